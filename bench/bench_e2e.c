@@ -0,0 +1,1429 @@
+/*
+ * End-to-end regression benchmark for the CPT server.
+ *
+ * Starts the real server binary on a free loopback port, logs in a fixed
+ * number of clients, puts them into channels and then drives a seeded mix
+ * of SEND, GET_USERS, JOIN_CHANNEL and CREATE_CHANNEL at a fixed rate.
+ * Throughput, ack and delivery latency percentiles, the server's peak RSS
+ * and its CPU time per SEND are compared against a baseline file; any
+ * metric that regresses beyond the threshold fails the run.
+ *
+ *   cpt_bench --server PATH [--baseline FILE] [--update-baseline] [--runs N]
+ *             [--clients N] [--fanout N] [--rate N] [--duration S]
+ *             [--msg-size N] [--payload random|log] [--seed N] [--protocol 1|2|3|4]
+ *             [--transport tcp|unix|shm] [--threshold PCT]
+ *
+ * With --protocol 2 every client negotiates batched framing at LOGIN, with
+ * --protocol 3 batched framing plus compression and with --protocol 4
+ * compression plus sequence numbers. --payload log fills
+ * messages with log-like lines instead of random letters, which is what
+ * compression is for; pair it with a large --msg-size.
+ *
+ * --transport unix connects over the server's AF_UNIX listener instead of
+ * TCP, --transport shm also moves every client onto shared-memory rings
+ * right after LOGIN.
+ *
+ * --runs N repeats the benchmark against a fresh server N times and
+ * reports the mean of each metric, so a comparison or a recorded baseline
+ * does not hang on one noisy run. --update-baseline writes what was
+ * measured.
+ *
+ * Exit status is 0 on success, 1 on a regression and 2 when the benchmark
+ * could not run or the baseline was recorded with a different workload.
+ */
+
+#include "common.h"
+#include "cpt_client.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NSEC_PER_SEC UINT64_C(1000000000)
+#define NSEC_PER_MSEC UINT64_C(1000000)
+#define READY_TIMEOUT_NS (5 * NSEC_PER_SEC)
+#define DRAIN_TIMEOUT_NS (5 * NSEC_PER_SEC)
+#define STAMP_DIGITS 20
+#define MAX_MSG_SIZE 16384
+#define METRIC_COUNT 12
+#define WORKLOAD_MAX 160
+#define TRANSPORT_TCP 0
+#define TRANSPORT_UNIX 1
+#define TRANSPORT_SHM 2
+
+/**
+ * Workload and comparison settings.
+ */
+struct bench_options
+{
+    const char *server;
+    const char *baseline;
+    int update_baseline;
+    int runs;
+    int clients;
+    int fanout;
+    int rate;
+    int duration;
+    int msg_size;
+    int log_payload;
+    int protocol;
+    int transport;
+    uint32_t seed;
+    double threshold;
+};
+
+/**
+ * Growable array of latency samples in nanoseconds.
+ */
+struct latency_set
+{
+    uint64_t *samples;
+    size_t count;
+    size_t capacity;
+};
+
+/**
+ * One request waiting for its response.
+ */
+struct outstanding
+{
+    uint64_t sent;
+    uint8_t command;
+};
+
+struct bench;
+
+/**
+ * A simulated user.
+ *
+ * Every request gets exactly one non-MESSAGE response and the server
+ * answers in order, so <fifo> pairs responses with their send times.
+ */
+struct bench_client
+{
+    struct bench *bench;
+    struct cpt_connection conn;
+    struct cpt_response_decoder dec;
+    uint16_t user_id;
+    uint16_t channel_id;
+    uint32_t rng;
+    uint64_t next_op;
+    int passed_fd;
+    struct outstanding *fifo;
+    size_t fifo_head;
+    size_t fifo_count;
+    size_t fifo_capacity;
+};
+
+struct bench
+{
+    struct bench_options opts;
+    char unix_path[64];
+    struct bench_client *clients;
+    struct pollfd *pollfds;
+    struct latency_set ack;
+    struct latency_set delivery;
+    int measuring;
+    uint64_t requests;
+    uint64_t acks;
+    uint64_t sends;
+    uint64_t deliveries;
+    uint64_t rx_bytes;
+    uint64_t errors;
+};
+
+/**
+ * A reported metric and the direction in which it regresses.
+ *
+ * <slack> is an absolute amount of change that is never reported, so
+ * microsecond-level noise on a fast path does not fail the run. The p99.9
+ * latencies get milliseconds of it: on one shared vCPU they move between
+ * 1.5 and 10 ms from run to run with the host's scheduling alone.
+ */
+struct metric
+{
+    const char *name;
+    int higher_is_better;
+    double slack;
+    double value;
+};
+
+static int parse_options(struct bench_options *opts, int argc, char *argv[]);
+static int run_bench(const struct bench_options *opts, struct metric *metrics, uint64_t *errors);
+static uint64_t now_ns(void);
+static void sleep_ns(uint64_t ns);
+static uint32_t next_random(uint32_t *state);
+static int latency_record(struct latency_set *set, uint64_t sample);
+static int compare_u64(const void *a, const void *b);
+static double latency_percentile(struct latency_set *set, double p);
+static int pick_port(uint16_t *port);
+static pid_t start_server(const struct bench *bench, uint16_t port);
+static int connect_server(const struct bench *bench, uint16_t port);
+static int connect_unix(const char *path);
+static int wait_for_server(const struct bench *bench, pid_t pid, uint16_t port);
+static char *read_server_stat(pid_t pid, char *stat, size_t size);
+static int read_server_cpu(pid_t pid, uint64_t *ns);
+static int read_server_hwm(pid_t pid, uint64_t *kb);
+static int read_server_faults(pid_t pid, uint64_t *faults);
+static int client_init(struct bench *bench, struct bench_client *client, int fd, int index);
+static void client_destroy(struct bench_client *client);
+static int client_expect(struct bench_client *client, uint8_t command);
+static void handle_response(void *arg, const struct CptResponse *res);
+static int issue_send(struct bench_client *client);
+static int issue_operation(struct bench_client *client);
+static int pump(struct bench *bench, uint64_t deadline, int load);
+static int receive(struct bench *bench, struct bench_client *client);
+static int all_answered(const struct bench *bench);
+static int setup_channels(struct bench *bench);
+static void workload_string(const struct bench_options *opts, char *buf, size_t size);
+static int write_baseline(const char *path, const char *workload, const struct metric *metrics, size_t count);
+static int compare_baseline(const char *path, const char *workload, const struct metric *metrics, size_t count,
+                            double threshold);
+
+int main(int argc, char *argv[])
+{
+    struct bench_options opts;
+    struct metric metrics[METRIC_COUNT];
+    struct metric sample[METRIC_COUNT];
+    char workload[WORKLOAD_MAX];
+    uint64_t errors;
+
+    if (parse_options(&opts, argc, argv) < 0)
+    {
+        return 2;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    errors = 0;
+
+    // every run starts its own server, the reported value of a metric is its mean over the runs
+    for (int run = 0; run < opts.runs; run++)
+    {
+        if (run_bench(&opts, sample, &errors) < 0)
+        {
+            return 2;
+        }
+
+        for (size_t i = 0; i < METRIC_COUNT; i++)
+        {
+            if (run == 0)
+            {
+                metrics[i] = sample[i];
+                metrics[i].value = 0.0;
+            }
+
+            metrics[i].value += sample[i].value / (double) opts.runs;
+        }
+    }
+
+    workload_string(&opts, workload, sizeof(workload));
+    printf("workload %s\n", workload);
+    printf("%-24s %14s\n", opts.runs == 1 ? "metric" : "metric (mean)", "value");
+    for (size_t i = 0; i < METRIC_COUNT; i++)
+    {
+        printf("%-24s %14.1f\n", metrics[i].name, metrics[i].value);
+    }
+    printf("%-24s %14" PRIu64 "\n", "errors", errors);
+
+    if (errors != 0)
+    {
+        fprintf(stderr, "cpt_bench: the server answered %" PRIu64 " requests with an error\n", errors);
+        return 1;
+    }
+
+    if (opts.update_baseline)
+    {
+        return write_baseline(opts.baseline, workload, metrics, METRIC_COUNT) < 0 ? 2 : 0;
+    }
+
+    return compare_baseline(opts.baseline, workload, metrics, METRIC_COUNT, opts.threshold);
+}
+
+/**
+ * Start the server, drive one run of the workload and stop the server.
+ *
+ * @param opts      Workload settings.
+ * @param metrics   Receives the METRIC_COUNT metrics of the run.
+ * @param errors    Incremented by the requests the server answered with an error.
+ * @return 0 on success, -1 when the run could not complete.
+ */
+static int run_bench(const struct bench_options *opts, struct metric *metrics, uint64_t *errors)
+{
+    struct bench bench;
+    uint64_t cpu_before, cpu_after, hwm_kb, faults, start, elapsed;
+    double seconds;
+    uint16_t port;
+    pid_t pid;
+    int status;
+    int fd;
+
+    memset(&bench, 0, sizeof(bench));
+    bench.opts = *opts;
+
+    if (pick_port(&port) < 0)
+    {
+        perror("cpt_bench: no free port");
+        return -1;
+    }
+
+    snprintf(bench.unix_path, sizeof(bench.unix_path), "/tmp/cpt_bench.%ld.sock", (long) getpid());
+    pid = start_server(&bench, port);
+
+    if (pid < 0 || wait_for_server(&bench, pid, port) < 0)
+    {
+        fprintf(stderr, "cpt_bench: server %s did not start on port %u\n", bench.opts.server, port);
+        if (pid > 0)
+        {
+            kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+        }
+        return -1;
+    }
+
+    bench.clients = calloc((size_t) bench.opts.clients, sizeof(struct bench_client));
+    bench.pollfds = calloc((size_t) bench.opts.clients, sizeof(struct pollfd));
+    status = bench.clients == NULL || bench.pollfds == NULL ? -1 : 0;
+
+    for (int i = 0; status == 0 && i < bench.opts.clients; i++)
+    {
+        fd = connect_server(&bench, port);
+        status = fd < 0 ? -1 : client_init(&bench, &bench.clients[i], fd, i);
+    }
+
+    if (status == 0)
+    {
+        status = setup_channels(&bench);
+    }
+
+    if (status == 0)
+    {
+        status = read_server_cpu(pid, &cpu_before);
+    }
+
+    if (status == 0)
+    {
+        bench.measuring = 1;
+        start = now_ns();
+
+        for (int i = 0; i < bench.opts.clients; i++)
+        {
+            // spread the first operations over one interval so clients do not fire in lockstep
+            bench.clients[i].next_op = start + next_random(&bench.clients[i].rng) % (NSEC_PER_SEC / (uint64_t) bench.opts.rate);
+        }
+
+        status = pump(&bench, start + (uint64_t) bench.opts.duration * NSEC_PER_SEC, 1);
+        elapsed = now_ns() - start;
+
+        if (status == 0)
+        {
+            status = pump(&bench, now_ns() + DRAIN_TIMEOUT_NS, 0);
+        }
+    }
+
+    if (status == 0)
+    {
+        status = read_server_cpu(pid, &cpu_after);
+    }
+
+    if (status == 0)
+    {
+        status = read_server_hwm(pid, &hwm_kb);
+    }
+
+    if (status == 0)
+    {
+        status = read_server_faults(pid, &faults);
+    }
+
+    for (int i = 0; bench.clients != NULL && i < bench.opts.clients; i++)
+    {
+        client_destroy(&bench.clients[i]);
+    }
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+
+    if (status < 0 || bench.sends == 0)
+    {
+        fprintf(stderr, "cpt_bench: benchmark failed (%" PRIu64 " errors)\n", bench.errors);
+        status = -1;
+    }
+    else
+    {
+        seconds = (double) elapsed / (double) NSEC_PER_SEC;
+        metrics[0] = (struct metric){"requests_per_sec", 1, 0.0, (double) bench.acks / seconds};
+        metrics[1] = (struct metric){"deliveries_per_sec", 1, 0.0, (double) bench.deliveries / seconds};
+        metrics[2] = (struct metric){"ack_p50_us", 0, 50.0, latency_percentile(&bench.ack, 0.50) / 1000.0};
+        metrics[3] = (struct metric){"ack_p99_us", 0, 200.0, latency_percentile(&bench.ack, 0.99) / 1000.0};
+        metrics[4] = (struct metric){"ack_p999_us", 0, 5000.0, latency_percentile(&bench.ack, 0.999) / 1000.0};
+        metrics[5] = (struct metric){"delivery_p50_us", 0, 50.0, latency_percentile(&bench.delivery, 0.50) / 1000.0};
+        metrics[6] = (struct metric){"delivery_p99_us", 0, 200.0, latency_percentile(&bench.delivery, 0.99) / 1000.0};
+        metrics[7] = (struct metric){"delivery_p999_us", 0, 5000.0, latency_percentile(&bench.delivery, 0.999) / 1000.0};
+        metrics[8] = (struct metric){"server_hwm_kb", 0, 1024.0, (double) hwm_kb};
+        metrics[9] = (struct metric){"server_cpu_ns_per_send", 0, 1000.0, (double) (cpu_after - cpu_before) / (double) bench.sends};
+        metrics[10] = (struct metric){"rx_bytes_per_delivery", 0, 8.0,
+                                      bench.deliveries == 0 ? 0.0 : (double) bench.rx_bytes / (double) bench.deliveries};
+        metrics[11] = (struct metric){"server_page_faults", 0, 256.0, (double) faults};
+        *errors += bench.errors;
+    }
+
+    free(bench.clients);
+    free(bench.pollfds);
+    free(bench.ack.samples);
+    free(bench.delivery.samples);
+
+    return status;
+}
+
+static int parse_options(struct bench_options *opts, int argc, char *argv[])
+{
+    opts->server = NULL;
+    opts->baseline = NULL;
+    opts->update_baseline = 0;
+    opts->runs = 1;
+    opts->clients = 32;
+    opts->fanout = 8;
+    opts->rate = 200;
+    opts->duration = 5;
+    opts->msg_size = 64;
+    opts->log_payload = 0;
+    opts->protocol = CPT_CLIENT_VERSION;
+    opts->transport = TRANSPORT_TCP;
+    opts->seed = 1;
+    opts->threshold = 25.0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (strcmp(argv[i], "--update-baseline") == 0)
+        {
+            opts->update_baseline = 1;
+            continue;
+        }
+
+        if (value == NULL)
+        {
+            fprintf(stderr, "cpt_bench: %s needs a value\n", argv[i]);
+            return -1;
+        }
+
+        if (strcmp(argv[i], "--server") == 0)
+        {
+            opts->server = value;
+        }
+        else if (strcmp(argv[i], "--baseline") == 0)
+        {
+            opts->baseline = value;
+        }
+        else if (strcmp(argv[i], "--runs") == 0)
+        {
+            opts->runs = atoi(value);
+        }
+        else if (strcmp(argv[i], "--clients") == 0)
+        {
+            opts->clients = atoi(value);
+        }
+        else if (strcmp(argv[i], "--fanout") == 0)
+        {
+            opts->fanout = atoi(value);
+        }
+        else if (strcmp(argv[i], "--rate") == 0)
+        {
+            opts->rate = atoi(value);
+        }
+        else if (strcmp(argv[i], "--duration") == 0)
+        {
+            opts->duration = atoi(value);
+        }
+        else if (strcmp(argv[i], "--msg-size") == 0)
+        {
+            opts->msg_size = atoi(value);
+        }
+        else if (strcmp(argv[i], "--payload") == 0)
+        {
+            if (strcmp(value, "log") != 0 && strcmp(value, "random") != 0)
+            {
+                fprintf(stderr, "cpt_bench: unknown payload %s\n", value);
+                return -1;
+            }
+
+            opts->log_payload = strcmp(value, "log") == 0;
+        }
+        else if (strcmp(argv[i], "--protocol") == 0)
+        {
+            opts->protocol = atoi(value);
+        }
+        else if (strcmp(argv[i], "--transport") == 0)
+        {
+            if (strcmp(value, "tcp") == 0)
+            {
+                opts->transport = TRANSPORT_TCP;
+            }
+            else if (strcmp(value, "unix") == 0)
+            {
+                opts->transport = TRANSPORT_UNIX;
+            }
+            else if (strcmp(value, "shm") == 0)
+            {
+                opts->transport = TRANSPORT_SHM;
+            }
+            else
+            {
+                fprintf(stderr, "cpt_bench: unknown transport %s\n", value);
+                return -1;
+            }
+        }
+        else if (strcmp(argv[i], "--seed") == 0)
+        {
+            opts->seed = (uint32_t) strtoul(value, NULL, 10);
+        }
+        else if (strcmp(argv[i], "--threshold") == 0)
+        {
+            opts->threshold = strtod(value, NULL);
+        }
+        else
+        {
+            fprintf(stderr, "cpt_bench: unknown option %s\n", argv[i]);
+            return -1;
+        }
+
+        i++;
+    }
+
+    if (opts->server == NULL || opts->runs < 1 || opts->clients < 1 || opts->fanout < 1 || opts->rate < 1 ||
+        opts->duration < 1 || opts->msg_size < STAMP_DIGITS || opts->msg_size > MAX_MSG_SIZE || opts->seed == 0 ||
+        opts->protocol < CPT_CLIENT_VERSION || opts->protocol > CPT_VERSION_SEQUENCED)
+    {
+        fprintf(stderr, "usage: cpt_bench --server PATH [--baseline FILE] [--update-baseline] [--runs N]\n"
+                        "                 [--clients N] [--fanout N] [--rate N] [--duration S] [--msg-size N]\n"
+                        "                 [--payload random|log] [--seed N] [--protocol 1|2|3|4]\n"
+                        "                 [--transport tcp|unix|shm] [--threshold PCT]\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * NSEC_PER_SEC + (uint64_t) ts.tv_nsec;
+}
+
+static void sleep_ns(uint64_t ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = (time_t) (ns / NSEC_PER_SEC);
+    ts.tv_nsec = (long) (ns % NSEC_PER_SEC);
+    nanosleep(&ts, NULL);
+}
+
+static uint32_t next_random(uint32_t *state)
+{
+    // xorshift32, the workload only depends on --seed
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+
+    return *state;
+}
+
+static int latency_record(struct latency_set *set, uint64_t sample)
+{
+    if (set->count == set->capacity)
+    {
+        uint64_t *samples;
+        size_t capacity;
+
+        capacity = set->capacity == 0 ? 4096 : set->capacity * 2;
+        samples = realloc(set->samples, capacity * sizeof(uint64_t));
+
+        if (samples == NULL)
+        {
+            return -1;
+        }
+
+        set->samples = samples;
+        set->capacity = capacity;
+    }
+
+    set->samples[set->count++] = sample;
+
+    return 0;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+static double latency_percentile(struct latency_set *set, double p)
+{
+    double rank;
+    size_t index;
+
+    if (set->count == 0)
+    {
+        return 0.0;
+    }
+
+    qsort(set->samples, set->count, sizeof(uint64_t), compare_u64);
+    rank = ceil(p * (double) set->count);
+    index = (size_t) rank;
+
+    return (double) set->samples[index == 0 ? 0 : index - 1];
+}
+
+static int pick_port(uint16_t *port)
+{
+    struct sockaddr_in6 addr;
+    socklen_t len;
+    int fd;
+
+    fd = socket(AF_INET6, SOCK_STREAM, 0);
+
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_loopback;
+    len = sizeof(addr);
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        getsockname(fd, (struct sockaddr *) &addr, &len) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+    *port = ntohs(addr.sin6_port);
+
+    return 0;
+}
+
+static pid_t start_server(const struct bench *bench, uint16_t port)
+{
+    char port_str[8];
+    pid_t pid;
+    int null_fd;
+
+    snprintf(port_str, sizeof(port_str), "%u", port);
+    pid = fork();
+
+    if (pid == 0)
+    {
+        null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0)
+        {
+            dup2(null_fd, STDOUT_FILENO);
+            close(null_fd);
+        }
+        if (bench->opts.transport == TRANSPORT_TCP)
+        {
+            execl(bench->opts.server, bench->opts.server, "--port", port_str, (char *) NULL);
+        }
+        else
+        {
+            execl(bench->opts.server, bench->opts.server, "--port", port_str, "--unix", bench->unix_path,
+                  (char *) NULL);
+        }
+        _exit(127);
+    }
+
+    return pid;
+}
+
+static int connect_server(const struct bench *bench, uint16_t port)
+{
+    struct sockaddr_in6 addr;
+    int on = 1;
+    int fd;
+
+    if (bench->opts.transport != TRANSPORT_TCP)
+    {
+        return connect_unix(bench->unix_path);
+    }
+
+    fd = socket(AF_INET6, SOCK_STREAM, 0);
+
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_loopback;
+    addr.sin6_port = htons(port);
+
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    // requests are batched per poll round already, Nagle would only add latency
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    return fd;
+}
+
+static int connect_unix(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int wait_for_server(const struct bench *bench, pid_t pid, uint16_t port)
+{
+    uint64_t deadline;
+    int fd;
+
+    deadline = now_ns() + READY_TIMEOUT_NS;
+
+    while (now_ns() < deadline)
+    {
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+        {
+            return -1;
+        }
+
+        fd = connect_server(bench, port);
+
+        if (fd >= 0)
+        {
+            close(fd);
+            return 0;
+        }
+
+        sleep_ns(20 * NSEC_PER_MSEC);
+    }
+
+    return -1;
+}
+
+/**
+ * The fields of /proc/<pid>/stat after the command name, from the state on.
+ */
+static char *read_server_stat(pid_t pid, char *stat, size_t size)
+{
+    char path[64];
+    char *fields;
+    size_t nread;
+    FILE *file;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+    file = fopen(path, "r");
+
+    if (file == NULL)
+    {
+        return NULL;
+    }
+
+    nread = fread(stat, 1, size - 1, file);
+    fclose(file);
+    stat[nread] = '\0';
+
+    // the command name may contain spaces, the fields start after its closing parenthesis
+    fields = strrchr(stat, ')');
+
+    return fields == NULL ? NULL : fields + 2;
+}
+
+static int read_server_cpu(pid_t pid, uint64_t *ns)
+{
+    char stat[1024];
+    unsigned long utime, stime;
+    char *fields;
+    long ticks;
+
+    fields = read_server_stat(pid, stat, sizeof(stat));
+    ticks = sysconf(_SC_CLK_TCK);
+
+    if (fields == NULL || ticks <= 0 ||
+        sscanf(fields, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+    {
+        return -1;
+    }
+
+    *ns = (uint64_t) (utime + stime) * (NSEC_PER_SEC / (uint64_t) ticks);
+
+    return 0;
+}
+
+static int read_server_hwm(pid_t pid, uint64_t *kb)
+{
+    char path[64];
+    char line[256];
+    unsigned long value;
+    FILE *file;
+    int found;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int) pid);
+    file = fopen(path, "r");
+
+    if (file == NULL)
+    {
+        return -1;
+    }
+
+    found = 0;
+
+    while (!found && fgets(line, sizeof(line), file) != NULL)
+    {
+        found = sscanf(line, "VmHWM: %lu kB", &value) == 1;
+    }
+
+    fclose(file);
+
+    if (!found)
+    {
+        return -1;
+    }
+
+    *kb = value;
+
+    return 0;
+}
+
+/**
+ * Minor and major page faults since the server started. With 4 KB pages
+ * every page of a connection's buffers is one fault when first touched.
+ */
+static int read_server_faults(pid_t pid, uint64_t *faults)
+{
+    char stat[1024];
+    unsigned long minflt, majflt;
+    char *fields;
+
+    fields = read_server_stat(pid, stat, sizeof(stat));
+
+    if (fields == NULL || sscanf(fields, "%*c %*d %*d %*d %*d %*d %*u %lu %*u %lu", &minflt, &majflt) != 2)
+    {
+        return -1;
+    }
+
+    *faults = (uint64_t) minflt + majflt;
+
+    return 0;
+}
+
+static int client_init(struct bench *bench, struct bench_client *client, int fd, int index)
+{
+    client->bench = bench;
+    client->rng = bench->opts.seed ^ ((uint32_t) index + 1) * 0x9E3779B9U;
+    client->passed_fd = -1;
+    client->fifo_capacity = 64;
+    client->fifo = malloc(client->fifo_capacity * sizeof(struct outstanding));
+    cpt_connection_init(&client->conn, fd, CPT_CONNECTION_OUTPUT_LIMIT);
+    bench->pollfds[index].fd = fd;
+
+    if (client->fifo == NULL || cpt_response_decoder_init(&client->dec, CPT_RESPONSE_DECODER_CAPACITY) < 0 ||
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0)
+    {
+        return -1;
+    }
+
+    if (next_random(&client->rng) == 0)
+    {
+        client->rng = 1;
+    }
+
+    return 0;
+}
+
+static void client_destroy(struct bench_client *client)
+{
+    if (client->bench == NULL)
+    {
+        return;
+    }
+
+    close(client->conn.fd);
+
+    if (client->passed_fd >= 0)
+    {
+        close(client->passed_fd);
+    }
+
+    cpt_connection_destroy(&client->conn);
+    cpt_response_decoder_destroy(&client->dec);
+    free(client->fifo);
+}
+
+static int client_expect(struct bench_client *client, uint8_t command)
+{
+    if (client->fifo_count == client->fifo_capacity)
+    {
+        struct outstanding *fifo;
+        size_t capacity;
+
+        capacity = client->fifo_capacity * 2;
+        fifo = malloc(capacity * sizeof(struct outstanding));
+
+        if (fifo == NULL)
+        {
+            return -1;
+        }
+
+        for (size_t i = 0; i < client->fifo_count; i++)
+        {
+            fifo[i] = client->fifo[(client->fifo_head + i) % client->fifo_capacity];
+        }
+
+        free(client->fifo);
+        client->fifo = fifo;
+        client->fifo_head = 0;
+        client->fifo_capacity = capacity;
+    }
+
+    client->fifo[(client->fifo_head + client->fifo_count) % client->fifo_capacity].sent = now_ns();
+    client->fifo[(client->fifo_head + client->fifo_count) % client->fifo_capacity].command = command;
+    client->fifo_count++;
+    client->bench->requests++;
+
+    return 0;
+}
+
+static void handle_response(void *arg, const struct CptResponse *res)
+{
+    struct bench_client *client;
+    struct outstanding request;
+    struct bench *bench;
+    uint64_t now, stamp;
+
+    client = arg;
+    bench = client->bench;
+    now = now_ns();
+
+    if (res->code == MESSAGE)
+    {
+        stamp = 0;
+
+        for (size_t i = 0; i < STAMP_DIGITS && i < res->msg_len; i++)
+        {
+            stamp = stamp * 10 + (uint64_t) (res->msg[i] - '0');
+        }
+
+        if (bench->measuring && stamp != 0 && now >= stamp)
+        {
+            bench->deliveries++;
+            latency_record(&bench->delivery, now - stamp);
+        }
+        return;
+    }
+
+    // presence events are unsolicited like MESSAGE but carry nothing to measure
+    if (res->code == USER_CONNECTED || res->code == USER_DISCONNECTED || res->code == USER_JOINED_CHANNEL ||
+        res->code == USER_LEFT_CHANNEL)
+    {
+        return;
+    }
+
+    if (client->fifo_count == 0)
+    {
+        bench->errors++;
+        return;
+    }
+
+    request = client->fifo[client->fifo_head];
+    client->fifo_head = (client->fifo_head + 1) % client->fifo_capacity;
+    client->fifo_count--;
+
+    if (res->code != SUCCESS && res->code != CHANNEL_CREATED && res->code != USER_LIST)
+    {
+        bench->errors++;
+        return;
+    }
+
+    if (bench->measuring)
+    {
+        bench->acks++;
+        latency_record(&bench->ack, now - request.sent);
+    }
+
+    if (request.command == LOGIN)
+    {
+        client->user_id = res->user_id;
+
+        if (bench->opts.protocol >= CPT_VERSION_BATCHED)
+        {
+            cpt_connection_set_version(&client->conn, (uint8_t) bench->opts.protocol);
+            cpt_response_decoder_set_version(&client->dec, (uint8_t) bench->opts.protocol);
+        }
+    }
+    else if (request.command == MAP_RINGS)
+    {
+        // the descriptor came with the first byte of this reply
+        if (client->passed_fd < 0 || cpt_connection_attach_rings(&client->conn, client->passed_fd) < 0)
+        {
+            bench->errors++;
+        }
+        client->passed_fd = -1;
+    }
+    else if (request.command == CREATE_CHANNEL && res->code == CHANNEL_CREATED)
+    {
+        if (client->channel_id == 0)
+        {
+            client->channel_id = res->channel_id;
+        }
+        else if (cpt_batch_leave_channel(&client->conn, res->channel_id) < 0 ||
+                 client_expect(client, LEAVE_CHANNEL) < 0)
+        {
+            // scratch channels are left again straight away
+            bench->errors++;
+        }
+    }
+}
+
+static int issue_send(struct bench_client *client)
+{
+    char msg[MAX_MSG_SIZE + 1];
+    int length;
+
+    // a decimal monotonic timestamp first, so any receiver can compute delivery latency
+    length = snprintf(msg, sizeof(msg), "%0*" PRIu64, STAMP_DIGITS, now_ns());
+
+    while (client->bench->opts.log_payload && length < client->bench->opts.msg_size)
+    {
+        length += snprintf(msg + length, sizeof(msg) - (size_t) length,
+                           " 12:%02u:%02u.%03u INFO worker-%u handled GET /api/v1/items/%u status=200 in %u ms\n",
+                           next_random(&client->rng) % 60, next_random(&client->rng) % 60,
+                           next_random(&client->rng) % 1000, next_random(&client->rng) % 8,
+                           next_random(&client->rng) % 100000, next_random(&client->rng) % 500);
+    }
+
+    while (length < client->bench->opts.msg_size)
+    {
+        msg[length] = (char) ('a' + next_random(&client->rng) % 26);
+        length++;
+    }
+
+    length = length > client->bench->opts.msg_size ? client->bench->opts.msg_size : length;
+
+    msg[length] = '\0';
+    client->bench->sends++;
+
+    if (cpt_batch_send(&client->conn, client->channel_id, msg) < 0)
+    {
+        return -1;
+    }
+
+    return client_expect(client, SEND);
+}
+
+static int issue_operation(struct bench_client *client)
+{
+    uint32_t roll;
+
+    roll = next_random(&client->rng) % 100;
+
+    if (roll < 85)
+    {
+        return issue_send(client);
+    }
+
+    if (roll < 90)
+    {
+        return cpt_batch_get_users(&client->conn, client->channel_id) < 0 ? -1 : client_expect(client, GET_USERS);
+    }
+
+    if (roll < 95)
+    {
+        // joining a channel the client is already in is a cheap idempotent request
+        return cpt_batch_join_channel(&client->conn, client->channel_id) < 0 ? -1 : client_expect(client, JOIN_CHANNEL);
+    }
+
+    return cpt_batch_create_channel(&client->conn, NULL) < 0 ? -1 : client_expect(client, CREATE_CHANNEL);
+}
+
+static int pump(struct bench *bench, uint64_t deadline, int load)
+{
+    struct bench_client *client;
+    uint64_t interval, now, wake;
+    int timeout;
+
+    interval = NSEC_PER_SEC / (uint64_t) bench->opts.rate;
+
+    for (;;)
+    {
+        now = now_ns();
+
+        if (now >= deadline)
+        {
+            return load ? 0 : -1;
+        }
+
+        if (!load && all_answered(bench))
+        {
+            return 0;
+        }
+
+        wake = deadline;
+
+        for (int i = 0; i < bench->opts.clients; i++)
+        {
+            client = &bench->clients[i];
+
+            while (load && client->next_op <= now)
+            {
+                if (issue_operation(client) < 0)
+                {
+                    return -1;
+                }
+                client->next_op += interval;
+            }
+
+            if (load && client->next_op < wake)
+            {
+                wake = client->next_op;
+            }
+
+            if (cpt_batch_pending(&client->conn) > 0 && cpt_batch_flush(&client->conn) < 0 && errno != EAGAIN &&
+                errno != EWOULDBLOCK && errno != EINTR)
+            {
+                return -1;
+            }
+
+            // a full ring is announced by a doorbell, not by the socket becoming writable
+            bench->pollfds[i].events =
+                (short) (cpt_batch_pending(&client->conn) > 0 && client->conn.shm == NULL ? POLLIN | POLLOUT : POLLIN);
+        }
+
+        timeout = (int) ((wake - now + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC);
+
+        if (poll(bench->pollfds, (nfds_t) bench->opts.clients, timeout) < 0 && errno != EINTR)
+        {
+            return -1;
+        }
+
+        for (int i = 0; i < bench->opts.clients; i++)
+        {
+            client = &bench->clients[i];
+
+            if ((bench->pollfds[i].revents & (POLLIN | POLLHUP | POLLERR)) == 0)
+            {
+                continue;
+            }
+
+            if (receive(bench, client) < 0)
+            {
+                fprintf(stderr, "cpt_bench: lost connection %d\n", i);
+                return -1;
+            }
+        }
+    }
+}
+
+/**
+ * Read and handle whatever a readable client has received.
+ *
+ * @return 0 on success, -1 if the connection was lost.
+ */
+static int receive(struct bench *bench, struct bench_client *client)
+{
+    ssize_t nread;
+
+    // rings are read until empty, only then will the server ring again
+    do
+    {
+        if (client->conn.shm != NULL)
+        {
+            nread = cpt_response_decoder_read_rings(&client->dec, &client->conn);
+        }
+        else if (bench->opts.transport == TRANSPORT_SHM)
+        {
+            nread = cpt_response_decoder_read_fd(&client->dec, client->conn.fd, &client->passed_fd);
+        }
+        else
+        {
+            nread = cpt_response_decoder_read(&client->dec, client->conn.fd);
+        }
+
+        if (nread > 0 && bench->measuring)
+        {
+            bench->rx_bytes += (uint64_t) nread;
+        }
+
+        if (nread == 0 || (nread < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        {
+            return -1;
+        }
+
+        cpt_response_decoder_drain(&client->dec, handle_response, client);
+    } while (nread > 0 && client->conn.shm != NULL);
+
+    return 0;
+}
+
+static int all_answered(const struct bench *bench)
+{
+    for (int i = 0; i < bench->opts.clients; i++)
+    {
+        if (bench->clients[i].fifo_count != 0 || cpt_batch_pending(&bench->clients[i].conn) != 0)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int setup_channels(struct bench *bench)
+{
+    char name[32];
+    char members[4096];
+    int leader, length, status;
+
+    for (int i = 0; i < bench->opts.clients; i++)
+    {
+        snprintf(name, sizeof(name), "bench%d", i);
+
+        if (bench->opts.protocol == CPT_VERSION_SEQUENCED)
+        {
+            status = cpt_batch_login_sequenced(&bench->clients[i].conn, name);
+        }
+        else if (bench->opts.protocol == CPT_VERSION_COMPRESSED)
+        {
+            status = cpt_batch_login_compressed(&bench->clients[i].conn, name);
+        }
+        else if (bench->opts.protocol == CPT_VERSION_BATCHED)
+        {
+            status = cpt_batch_login_batched(&bench->clients[i].conn, name);
+        }
+        else
+        {
+            status = cpt_batch_login(&bench->clients[i].conn, name);
+        }
+
+        if (status < 0 || client_expect(&bench->clients[i], LOGIN) < 0)
+        {
+            return -1;
+        }
+    }
+
+    if (pump(bench, now_ns() + DRAIN_TIMEOUT_NS, 0) < 0)
+    {
+        return -1;
+    }
+
+    for (int i = 0; bench->opts.transport == TRANSPORT_SHM && i < bench->opts.clients; i++)
+    {
+        if (cpt_batch_map_rings(&bench->clients[i].conn) < 0 || client_expect(&bench->clients[i], MAP_RINGS) < 0)
+        {
+            return -1;
+        }
+    }
+
+    if (bench->opts.transport == TRANSPORT_SHM && pump(bench, now_ns() + DRAIN_TIMEOUT_NS, 0) < 0)
+    {
+        return -1;
+    }
+
+    // every <fanout> consecutive clients share a channel created by the first of them
+    for (leader = 0; leader < bench->opts.clients; leader += bench->opts.fanout)
+    {
+        length = 0;
+
+        for (int i = leader + 1; i < leader + bench->opts.fanout && i < bench->opts.clients; i++)
+        {
+            length += snprintf(members + length, sizeof(members) - (size_t) length, "%u ", bench->clients[i].user_id);
+
+            if ((size_t) length >= sizeof(members))
+            {
+                return -1;
+            }
+        }
+
+        members[length] = '\0';
+
+        if (cpt_batch_create_channel(&bench->clients[leader].conn, members) < 0 ||
+            client_expect(&bench->clients[leader], CREATE_CHANNEL) < 0)
+        {
+            return -1;
+        }
+    }
+
+    if (pump(bench, now_ns() + DRAIN_TIMEOUT_NS, 0) < 0)
+    {
+        return -1;
+    }
+
+    for (leader = 0; leader < bench->opts.clients; leader += bench->opts.fanout)
+    {
+        for (int i = leader + 1; i < leader + bench->opts.fanout && i < bench->opts.clients; i++)
+        {
+            bench->clients[i].channel_id = bench->clients[leader].channel_id;
+        }
+    }
+
+    return bench->errors == 0 ? 0 : -1;
+}
+
+static void workload_string(const struct bench_options *opts, char *buf, size_t size)
+{
+    static const char *const transports[] = {"tcp", "unix", "shm"};
+
+    snprintf(buf, size,
+             "clients=%d fanout=%d rate=%d duration=%d msg_size=%d payload=%s seed=%u protocol=%d transport=%s",
+             opts->clients, opts->fanout, opts->rate, opts->duration, opts->msg_size,
+             opts->log_payload ? "log" : "random", opts->seed, opts->protocol, transports[opts->transport]);
+}
+
+static int write_baseline(const char *path, const char *workload, const struct metric *metrics, size_t count)
+{
+    FILE *file;
+
+    if (path == NULL)
+    {
+        fprintf(stderr, "cpt_bench: --update-baseline needs --baseline\n");
+        return -1;
+    }
+
+    file = fopen(path, "w");
+
+    if (file == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    fprintf(file, "# cpt_bench baseline, regenerate with --update-baseline\n");
+    fprintf(file, "workload %s\n", workload);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        fprintf(file, "%s %.1f\n", metrics[i].name, metrics[i].value);
+    }
+
+    fclose(file);
+    printf("baseline written to %s\n", path);
+
+    return 0;
+}
+
+static int compare_baseline(const char *path, const char *workload, const struct metric *metrics, size_t count,
+                            double threshold)
+{
+    char line[256];
+    char name[64];
+    double expected, limit;
+    FILE *file;
+    int regressions;
+
+    if (path == NULL)
+    {
+        return 0;
+    }
+
+    file = fopen(path, "r");
+
+    if (file == NULL)
+    {
+        fprintf(stderr, "cpt_bench: no baseline at %s, run with --update-baseline\n", path);
+        return 2;
+    }
+
+    regressions = 0;
+
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        if (line[0] == '#')
+        {
+            continue;
+        }
+
+        if (strncmp(line, "workload ", 9) == 0)
+        {
+            line[strcspn(line, "\n")] = '\0';
+
+            if (strcmp(line + 9, workload) != 0)
+            {
+                fprintf(stderr, "cpt_bench: baseline was recorded with \"%s\"\n", line + 9);
+                fclose(file);
+                return 2;
+            }
+            continue;
+        }
+
+        if (sscanf(line, "%63s %lf", name, &expected) != 2)
+        {
+            continue;
+        }
+
+        for (size_t i = 0; i < count; i++)
+        {
+            if (strcmp(name, metrics[i].name) != 0)
+            {
+                continue;
+            }
+
+            if (metrics[i].higher_is_better)
+            {
+                limit = expected * (1.0 - threshold / 100.0) - metrics[i].slack;
+            }
+            else
+            {
+                limit = expected * (1.0 + threshold / 100.0) + metrics[i].slack;
+            }
+
+            if (metrics[i].higher_is_better ? metrics[i].value < limit : metrics[i].value > limit)
+            {
+                fprintf(stderr, "REGRESSION %s: %.1f, baseline %.1f, limit %.1f\n", name, metrics[i].value, expected,
+                        limit);
+                regressions++;
+            }
+        }
+    }
+
+    fclose(file);
+
+    if (regressions == 0)
+    {
+        printf("no regressions against %s (threshold %.0f%%)\n", path, threshold);
+    }
+
+    return regressions == 0 ? 0 : 1;
+}
@@ -0,0 +1,780 @@
+/*
+ * Replays a session recorded with the server's --capture option.
+ *
+ * Every captured connection is opened again and sent the same frames in
+ * the same order, at the recorded pace scaled by --speed (2 replays
+ * twice as fast, 0 as fast as the server takes them). Responses are
+ * paired with requests in order, as the server answers each request
+ * once, which gives the ack latency; MESSAGE and presence events are
+ * only counted. Replay against a freshly started server so channel ids
+ * come out as they did when the capture was made.
+ *
+ *   cpt_replay --capture FILE [--port N] [--unix PATH] [--speed X]
+ *
+ * Exit status is 0 when the replay ran, 2 when the capture could not be
+ * read or the server could not be reached.
+ */
+
+#include "common.h"
+#include "cpt_capture.h"
+#include "cpt_client.h"
+#include "cpt_envelope.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NSEC_PER_SEC UINT64_C(1000000000)
+#define NSEC_PER_USEC UINT64_C(1000)
+#define DRAIN_TIMEOUT_NS (5 * NSEC_PER_SEC)
+// poll at least this often while waiting for the next frame, in milliseconds
+#define POLL_INTERVAL_MS 100
+// frames sent between two polls at full speed, so responses are read as they come
+#define BURST 256
+#define FIFO_INITIAL_CAPACITY 16
+
+struct replay_options
+{
+    const char *capture;
+    const char *unix_path;
+    uint16_t port;
+    double speed;
+};
+
+/**
+ * One captured record, <size> 0 when the connection closed.
+ */
+struct event
+{
+    uint32_t id;
+    uint64_t at_us;
+    uint8_t *data;
+    size_t size;
+};
+
+/**
+ * One request waiting for its response.
+ */
+struct outstanding
+{
+    uint64_t sent;
+    uint8_t command;
+    uint8_t version;
+};
+
+struct replay;
+
+/**
+ * A replayed connection. <version> is the framing its requests use,
+ * which changes once a LOGIN asking for batched framing was sent.
+ * <closing> is set when the capture closed it with requests still
+ * outstanding; it is closed once they are answered.
+ */
+struct connection
+{
+    struct replay *replay;
+    int fd;
+    int opened;
+    int closing;
+    uint8_t version;
+    struct cpt_response_decoder dec;
+    struct outstanding *fifo;
+    size_t fifo_head;
+    size_t fifo_count;
+    size_t fifo_capacity;
+};
+
+struct latency_set
+{
+    uint64_t *samples;
+    size_t count;
+    size_t capacity;
+};
+
+struct replay
+{
+    struct replay_options opts;
+    uint8_t *file;
+    struct event *events;
+    size_t event_count;
+    struct connection *connections;
+    size_t connection_count;
+    struct pollfd *pollfds;
+    struct connection **polled;
+    struct latency_set ack;
+    uint64_t requests;
+    uint64_t responses;
+    uint64_t error_responses;
+    uint64_t deliveries;
+    uint64_t unanswered;
+    uint64_t outstanding;
+};
+
+static int parse_options(struct replay_options *opts, int argc, char *argv[]);
+static int load_capture(struct replay *replay);
+static uint64_t now_ns(void);
+static int latency_record(struct latency_set *set, uint64_t sample);
+static int compare_u64(const void *a, const void *b);
+static double latency_percentile(struct latency_set *set, double p);
+static int connect_server(const struct replay_options *opts);
+static int send_event(struct replay *replay, const struct event *event);
+static int send_all(int fd, const uint8_t *buf, size_t size);
+static int expect(struct connection *conn, uint8_t command, uint8_t version);
+static void count_requests(struct connection *conn, uint8_t *data, size_t size);
+static void close_connection(struct connection *conn);
+static void receive(struct replay *replay, int timeout);
+static void handle_response(void *arg, const struct CptResponse *res);
+
+int main(int argc, char *argv[])
+{
+    struct replay replay;
+    uint64_t start, due, now, deadline, elapsed;
+    double seconds;
+    size_t next;
+    size_t burst;
+    int timeout;
+
+    memset(&replay, 0, sizeof(replay));
+
+    if (parse_options(&replay.opts, argc, argv) < 0 || load_capture(&replay) < 0)
+    {
+        return 2;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    start = now_ns();
+    deadline = 0;
+    due = start;
+    next = 0;
+
+    while (next < replay.event_count || (replay.outstanding > 0 && now_ns() < deadline))
+    {
+        now = now_ns();
+        burst = 0;
+
+        for (; next < replay.event_count && burst < BURST; next++, burst++)
+        {
+            due = replay.opts.speed <= 0.0
+                      ? start
+                      : start + (uint64_t) ((double) replay.events[next].at_us * NSEC_PER_USEC / replay.opts.speed);
+
+            if (due > now)
+            {
+                break;
+            }
+
+            if (send_event(&replay, &replay.events[next]) < 0)
+            {
+                fprintf(stderr, "cpt_replay: cannot reach the server\n");
+                return 2;
+            }
+        }
+
+        if (next == replay.event_count && deadline == 0)
+        {
+            deadline = now_ns() + DRAIN_TIMEOUT_NS;
+        }
+
+        timeout = POLL_INTERVAL_MS;
+
+        if (next < replay.event_count)
+        {
+            timeout = due > now ? (int) ((due - now) / (NSEC_PER_SEC / 1000)) : 0;
+            timeout = timeout > POLL_INTERVAL_MS ? POLL_INTERVAL_MS : timeout;
+        }
+
+        receive(&replay, timeout);
+    }
+
+    elapsed = now_ns() - start;
+
+    for (size_t i = 0; i < replay.connection_count; i++)
+    {
+        close_connection(&replay.connections[i]);
+        cpt_response_decoder_destroy(&replay.connections[i].dec);
+        free(replay.connections[i].fifo);
+    }
+
+    seconds = (double) elapsed / (double) NSEC_PER_SEC;
+    printf("%-24s %s\n", "capture", replay.opts.capture);
+    printf("%-24s %14zu\n", "connections", replay.connection_count);
+    printf("%-24s %14" PRIu64 "\n", "requests", replay.requests);
+    printf("%-24s %14" PRIu64 "\n", "responses", replay.responses);
+    printf("%-24s %14" PRIu64 "\n", "error_responses", replay.error_responses);
+    printf("%-24s %14" PRIu64 "\n", "unanswered", replay.unanswered);
+    printf("%-24s %14" PRIu64 "\n", "deliveries", replay.deliveries);
+    printf("%-24s %14.1f\n", "captured_s",
+           replay.event_count == 0 ? 0.0 : (double) replay.events[replay.event_count - 1].at_us / 1e6);
+    printf("%-24s %14.1f\n", "replayed_s", seconds);
+    printf("%-24s %14.1f\n", "requests_per_sec", (double) replay.requests / seconds);
+    printf("%-24s %14.1f\n", "deliveries_per_sec", (double) replay.deliveries / seconds);
+    printf("%-24s %14.1f\n", "ack_p50_us", latency_percentile(&replay.ack, 0.50) / 1000.0);
+    printf("%-24s %14.1f\n", "ack_p99_us", latency_percentile(&replay.ack, 0.99) / 1000.0);
+    printf("%-24s %14.1f\n", "ack_p999_us", latency_percentile(&replay.ack, 0.999) / 1000.0);
+    printf("%-24s %14.1f\n", "ack_max_us", latency_percentile(&replay.ack, 1.0) / 1000.0);
+
+    free(replay.ack.samples);
+    free(replay.connections);
+    free(replay.pollfds);
+    free(replay.polled);
+    free(replay.events);
+    free(replay.file);
+
+    return 0;
+}
+
+static int parse_options(struct replay_options *opts, int argc, char *argv[])
+{
+    opts->capture = NULL;
+    opts->unix_path = NULL;
+    opts->port = 8080;
+    opts->speed = 1.0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (value == NULL)
+        {
+            fprintf(stderr, "cpt_replay: %s needs a value\n", argv[i]);
+            return -1;
+        }
+
+        if (strcmp(argv[i], "--capture") == 0)
+        {
+            opts->capture = value;
+        }
+        else if (strcmp(argv[i], "--port") == 0)
+        {
+            opts->port = (uint16_t) atoi(value);
+        }
+        else if (strcmp(argv[i], "--unix") == 0)
+        {
+            opts->unix_path = value;
+        }
+        else if (strcmp(argv[i], "--speed") == 0)
+        {
+            opts->speed = atof(value);
+        }
+        else
+        {
+            fprintf(stderr, "cpt_replay: unknown option %s\n", argv[i]);
+            return -1;
+        }
+
+        i++;
+    }
+
+    if (opts->capture == NULL)
+    {
+        fprintf(stderr, "usage: cpt_replay --capture FILE [--port N] [--unix PATH] [--speed X]\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Read the whole capture and index its records.
+ */
+static int load_capture(struct replay *replay)
+{
+    FILE *file;
+    long size;
+    size_t pos;
+    size_t capacity;
+    uint32_t fields[3];
+    uint64_t at_us;
+    struct event *events;
+    int used;
+
+    file = fopen(replay->opts.capture, "rb");
+
+    if (file == NULL || fseek(file, 0, SEEK_END) < 0 || (size = ftell(file)) < CPT_CAPTURE_MAGIC_SIZE ||
+        fseek(file, 0, SEEK_SET) < 0)
+    {
+        fprintf(stderr, "cpt_replay: cannot read %s\n", replay->opts.capture);
+        if (file != NULL)
+        {
+            fclose(file);
+        }
+        return -1;
+    }
+
+    replay->file = malloc((size_t) size);
+
+    if (replay->file == NULL || fread(replay->file, 1, (size_t) size, file) != (size_t) size ||
+        memcmp(replay->file, CPT_CAPTURE_MAGIC, CPT_CAPTURE_MAGIC_SIZE) != 0)
+    {
+        fprintf(stderr, "cpt_replay: %s is not a capture\n", replay->opts.capture);
+        fclose(file);
+        return -1;
+    }
+
+    fclose(file);
+    pos = CPT_CAPTURE_MAGIC_SIZE;
+    capacity = 0;
+    at_us = 0;
+
+    while (pos < (size_t) size)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            used = cpt_varint_get(replay->file + pos, (size_t) size - pos, &fields[i]);
+
+            if (used <= 0)
+            {
+                break;
+            }
+
+            pos += (size_t) used;
+        }
+
+        // a capture cut short by a crash ends with a partial record
+        if (used <= 0 || fields[0] == 0 || fields[2] > (size_t) size - pos)
+        {
+            fprintf(stderr, "cpt_replay: ignoring a truncated record at byte %zu\n", pos);
+            break;
+        }
+
+        if (replay->event_count == capacity)
+        {
+            capacity = capacity == 0 ? 4096 : capacity * 2;
+            events = realloc(replay->events, capacity * sizeof(struct event));
+
+            if (events == NULL)
+            {
+                return -1;
+            }
+
+            replay->events = events;
+        }
+
+        at_us += fields[1];
+        replay->events[replay->event_count].id = fields[0];
+        replay->events[replay->event_count].at_us = at_us;
+        replay->events[replay->event_count].data = replay->file + pos;
+        replay->events[replay->event_count].size = fields[2];
+        replay->event_count++;
+        replay->connection_count = fields[0] > replay->connection_count ? fields[0] : replay->connection_count;
+        pos += fields[2];
+    }
+
+    // ids start at 1, connections[id - 1] belongs to id
+    replay->connections = calloc(replay->connection_count + 1, sizeof(struct connection));
+    replay->pollfds = calloc(replay->connection_count + 1, sizeof(struct pollfd));
+    replay->polled = calloc(replay->connection_count + 1, sizeof(struct connection *));
+
+    if (replay->connections == NULL || replay->pollfds == NULL || replay->polled == NULL)
+    {
+        return -1;
+    }
+
+    for (size_t i = 0; i < replay->connection_count; i++)
+    {
+        replay->connections[i].replay = replay;
+        replay->connections[i].fd = -1;
+        replay->connections[i].version = CPT_CLIENT_VERSION;
+
+        if (cpt_response_decoder_init(&replay->connections[i].dec, CPT_RESPONSE_DECODER_CAPACITY) < 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * NSEC_PER_SEC + (uint64_t) ts.tv_nsec;
+}
+
+static int latency_record(struct latency_set *set, uint64_t sample)
+{
+    if (set->count == set->capacity)
+    {
+        uint64_t *samples;
+        size_t capacity;
+
+        capacity = set->capacity == 0 ? 4096 : set->capacity * 2;
+        samples = realloc(set->samples, capacity * sizeof(uint64_t));
+
+        if (samples == NULL)
+        {
+            return -1;
+        }
+
+        set->samples = samples;
+        set->capacity = capacity;
+    }
+
+    set->samples[set->count++] = sample;
+
+    return 0;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+static double latency_percentile(struct latency_set *set, double p)
+{
+    double rank;
+    size_t index;
+
+    if (set->count == 0)
+    {
+        return 0.0;
+    }
+
+    qsort(set->samples, set->count, sizeof(uint64_t), compare_u64);
+    rank = ceil(p * (double) set->count);
+    index = (size_t) rank;
+
+    return (double) set->samples[index == 0 ? 0 : index - 1];
+}
+
+static int connect_server(const struct replay_options *opts)
+{
+    struct sockaddr_in6 addr;
+    struct sockaddr_un local;
+    int on = 1;
+    int fd;
+
+    if (opts->unix_path != NULL)
+    {
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        memset(&local, 0, sizeof(local));
+        local.sun_family = AF_UNIX;
+        snprintf(local.sun_path, sizeof(local.sun_path), "%s", opts->unix_path);
+
+        if (fd >= 0 && connect(fd, (struct sockaddr *) &local, sizeof(local)) < 0)
+        {
+            close(fd);
+            return -1;
+        }
+
+        return fd;
+    }
+
+    fd = socket(AF_INET6, SOCK_STREAM, 0);
+
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_loopback;
+    addr.sin6_port = htons(opts->port);
+
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    return fd;
+}
+
+/**
+ * Send one captured record on its connection, opening it the first time.
+ *
+ * @return 0 on success, -1 if the server could not be reached at all.
+ */
+static int send_event(struct replay *replay, const struct event *event)
+{
+    struct connection *conn;
+
+    conn = &replay->connections[event->id - 1];
+
+    // replayed faster than captured, the replies may not be in yet
+    if (event->size == 0)
+    {
+        conn->closing = 1;
+
+        if (conn->fifo_count == 0)
+        {
+            close_connection(conn);
+        }
+
+        return 0;
+    }
+
+    if (!conn->opened)
+    {
+        conn->opened = 1;
+        conn->fd = connect_server(&replay->opts);
+
+        if (conn->fd < 0)
+        {
+            return -1;
+        }
+    }
+
+    // the server dropped it, the rest of its frames have nowhere to go
+    if (conn->fd < 0)
+    {
+        return 0;
+    }
+
+    count_requests(conn, event->data, event->size);
+
+    if (send_all(conn->fd, event->data, event->size) < 0)
+    {
+        close_connection(conn);
+    }
+
+    return 0;
+}
+
+static int send_all(int fd, const uint8_t *buf, size_t size)
+{
+    ssize_t sent;
+
+    while (size > 0)
+    {
+        sent = send(fd, buf, size, 0);
+
+        if (sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (sent <= 0)
+        {
+            return -1;
+        }
+
+        buf += sent;
+        size -= (size_t) sent;
+    }
+
+    return 0;
+}
+
+/**
+ * Note the requests in a frame or envelope about to be sent.
+ */
+static void count_requests(struct connection *conn, uint8_t *data, size_t size)
+{
+    struct CptRequest req;
+    size_t header_size;
+    size_t body_size;
+    size_t offset;
+    int used;
+
+    if (conn->version < CPT_VERSION_BATCHED)
+    {
+        if (size < CPT_REQUEST_HEADER_SIZE)
+        {
+            return;
+        }
+
+        // the version byte of a LOGIN picks the framing of everything after it
+        expect(conn, data[1], data[0]);
+
+        if (data[1] == LOGIN && data[0] >= CPT_VERSION_BATCHED)
+        {
+            conn->version = data[0];
+        }
+
+        return;
+    }
+
+    if (cpt_envelope_parse_header(data, size, &header_size, &body_size) <= 0)
+    {
+        return;
+    }
+
+    for (offset = header_size; offset < header_size + body_size && offset < size; offset += (size_t) used)
+    {
+        used = cpt_parse_request_record(&req, data + offset, size - offset);
+
+        if (used <= 0)
+        {
+            return;
+        }
+
+        expect(conn, req.command, conn->version);
+    }
+}
+
+static int expect(struct connection *conn, uint8_t command, uint8_t version)
+{
+    struct outstanding *fifo;
+    size_t capacity;
+    size_t slot;
+
+    if (conn->fifo_count == conn->fifo_capacity)
+    {
+        capacity = conn->fifo_capacity == 0 ? FIFO_INITIAL_CAPACITY : conn->fifo_capacity * 2;
+        fifo = malloc(capacity * sizeof(struct outstanding));
+
+        if (fifo == NULL)
+        {
+            return -1;
+        }
+
+        for (size_t i = 0; i < conn->fifo_count; i++)
+        {
+            fifo[i] = conn->fifo[(conn->fifo_head + i) % conn->fifo_capacity];
+        }
+
+        free(conn->fifo);
+        conn->fifo = fifo;
+        conn->fifo_head = 0;
+        conn->fifo_capacity = capacity;
+    }
+
+    slot = (conn->fifo_head + conn->fifo_count) % conn->fifo_capacity;
+    conn->fifo[slot].sent = now_ns();
+    conn->fifo[slot].command = command;
+    conn->fifo[slot].version = version;
+    conn->fifo_count++;
+    conn->replay->requests++;
+    conn->replay->outstanding++;
+
+    return 0;
+}
+
+/**
+ * Close a connection, what it still waited for is counted as unanswered.
+ */
+static void close_connection(struct connection *conn)
+{
+    if (conn->fd < 0)
+    {
+        return;
+    }
+
+    close(conn->fd);
+    conn->fd = -1;
+    conn->replay->unanswered += conn->fifo_count;
+    conn->replay->outstanding -= conn->fifo_count;
+    conn->fifo_count = 0;
+}
+
+/**
+ * Wait up to <timeout> milliseconds and read what the open connections received.
+ */
+static void receive(struct replay *replay, int timeout)
+{
+    struct connection *conn;
+    nfds_t nfds;
+    ssize_t nread;
+
+    nfds = 0;
+
+    for (size_t i = 0; i < replay->connection_count; i++)
+    {
+        if (replay->connections[i].fd >= 0)
+        {
+            replay->pollfds[nfds].fd = replay->connections[i].fd;
+            replay->pollfds[nfds].events = POLLIN;
+            replay->polled[nfds] = &replay->connections[i];
+            nfds++;
+        }
+    }
+
+    if (nfds == 0)
+    {
+        if (timeout > 0)
+        {
+            poll(NULL, 0, timeout);
+        }
+        return;
+    }
+
+    if (poll(replay->pollfds, nfds, timeout) <= 0)
+    {
+        return;
+    }
+
+    for (nfds_t i = 0; i < nfds; i++)
+    {
+        if (replay->pollfds[i].revents == 0)
+        {
+            continue;
+        }
+
+        conn = replay->polled[i];
+        nread = cpt_response_decoder_read(&conn->dec, conn->fd);
+
+        if (nread == 0 || (nread < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        {
+            close_connection(conn);
+            continue;
+        }
+
+        cpt_response_decoder_drain(&conn->dec, handle_response, conn);
+
+        if (conn->closing && conn->fifo_count == 0)
+        {
+            close_connection(conn);
+        }
+    }
+}
+
+static void handle_response(void *arg, const struct CptResponse *res)
+{
+    struct connection *conn;
+    struct outstanding request;
+    struct replay *replay;
+
+    conn = arg;
+    replay = conn->replay;
+
+    if (res->code == MESSAGE || res->code == USER_CONNECTED || res->code == USER_DISCONNECTED ||
+        res->code == USER_JOINED_CHANNEL || res->code == USER_LEFT_CHANNEL)
+    {
+        replay->deliveries++;
+        return;
+    }
+
+    if (conn->fifo_count == 0)
+    {
+        // a response nothing asked for, the capture started mid-session
+        replay->error_responses++;
+        return;
+    }
+
+    request = conn->fifo[conn->fifo_head];
+    conn->fifo_head = (conn->fifo_head + 1) % conn->fifo_capacity;
+    conn->fifo_count--;
+    replay->outstanding--;
+    replay->responses++;
+    latency_record(&replay->ack, now_ns() - request.sent);
+
+    if (res->code != SUCCESS && res->code != CHANNEL_CREATED && res->code != USER_LIST)
+    {
+        replay->error_responses++;
+    }
+
+    // the reply to a batched LOGIN is the last one in the old framing
+    if (request.command == LOGIN && request.version >= CPT_VERSION_BATCHED && res->code == SUCCESS)
+    {
+        cpt_response_decoder_set_version(&conn->dec, request.version);
+    }
+}
@@ -0,0 +1,305 @@
+/*
+ * Fuzz target for the CPT codec, the version 2 records, the block
+ * compressor and the client response decoder in every framing.
+ *
+ * Built with clang it is a libFuzzer target (CPT_LIBFUZZER). Otherwise
+ * it gets a main() that runs every file named on the command line, or
+ * stdin when there are none (for AFL), or "--random N" generated inputs.
+ */
+
+#include "common.h"
+#include "cpt_client.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define FUZZ_MAX_INPUT (CPT_RESPONSE_DECODER_CAPACITY * 2)
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static void fuzz_request(uint8_t *buf, size_t size);
+static void fuzz_response(uint8_t *buf, size_t size);
+static void fuzz_records(uint8_t *buf, size_t size);
+static void fuzz_block(const uint8_t *buf, size_t size);
+static void fuzz_decoder(const uint8_t *data, size_t size, uint8_t version);
+static void touch_response(void *arg, const struct CptResponse *res);
+
+static void fuzz_request(uint8_t *buf, size_t size)
+{
+    struct CptRequest *req;
+    uint8_t *wire;
+    size_t wire_size;
+
+    req = cpt_parse_request(buf, size);
+
+    if (req == NULL)
+    {
+        return;
+    }
+
+    wire = malloc(cpt_request_size(req));
+    wire_size = cpt_serialize_request(req, wire, cpt_request_size(req));
+
+    if (wire_size != cpt_request_size(req) || memcmp(wire, buf, wire_size) != 0)
+    {
+        abort();
+    }
+
+    free(wire);
+    cpt_request_destroy(req);
+}
+
+static void fuzz_response(uint8_t *buf, size_t size)
+{
+    struct CptResponse res;
+    uint8_t *wire;
+    size_t wire_size;
+
+    if (cpt_parse_response_into(&res, buf, size) < 0)
+    {
+        return;
+    }
+
+    wire = malloc(cpt_response_size(&res));
+    wire_size = cpt_serialize_response(&res, wire, cpt_response_size(&res));
+
+    if (wire_size != cpt_response_size(&res) || memcmp(wire, buf, wire_size) != 0)
+    {
+        abort();
+    }
+
+    free(wire);
+}
+
+static void fuzz_records(uint8_t *buf, size_t size)
+{
+    struct CptRequest req;
+    uint8_t wire[CPT_REQUEST_RECORD_MAX];
+    int used;
+
+    used = cpt_parse_request_record(&req, buf, size);
+
+    if (used < 0)
+    {
+        return;
+    }
+
+    // padded varints are legal input, so only check the re-encoding parses back the same
+    if (cpt_serialize_request_record(&req, wire, sizeof(wire)) != cpt_request_record_size(&req) ||
+        cpt_parse_request_record(&req, wire, sizeof(wire)) != (int) cpt_request_record_size(&req) ||
+        (size_t) used < cpt_request_record_size(&req))
+    {
+        abort();
+    }
+}
+
+static void touch_response(void *arg, const struct CptResponse *res)
+{
+    unsigned *sum;
+
+    sum = arg;
+
+    // read every byte so ASan sees any MSG that points past the frame
+    for (size_t i = 0; i < res->msg_len; i++)
+    {
+        *sum += res->msg[i];
+    }
+}
+
+static void fuzz_block(const uint8_t *buf, size_t size)
+{
+    struct cpt_compressor codec;
+    uint8_t *packed;
+    const uint8_t *expanded;
+    size_t dict_size;
+    size_t packed_size;
+    size_t out_size;
+    unsigned sum;
+
+    if (size < 2 || cpt_compressor_init(&codec) < 0)
+    {
+        return;
+    }
+
+    // as a block: anything but an exact expansion must be rejected
+    out_size = (size_t) ((buf[0] << 8) | buf[1]);
+    dict_size = size - 2 < CPT_DICT_MAX ? size - 2 : CPT_DICT_MAX;
+    expanded = cpt_decompress(&codec, buf + 2, dict_size, buf + 2, size - 2, out_size);
+
+    sum = 0;
+
+    for (size_t i = 0; expanded != NULL && i < out_size; i++)
+    {
+        sum += expanded[i];
+    }
+
+    (void) sum;
+
+    // as data: compressing against its own prefix must round trip
+    size = size > UINT16_MAX ? UINT16_MAX : size;
+    packed = malloc(size + size / 255 + 16);
+
+    if (packed != NULL)
+    {
+        packed_size = cpt_compress(&codec, buf, dict_size, buf, size, packed, size + size / 255 + 16);
+        expanded = cpt_decompress(&codec, buf, dict_size, packed, packed_size, size);
+
+        if (packed_size == 0 || expanded == NULL || memcmp(expanded, buf, size) != 0)
+        {
+            abort();
+        }
+    }
+
+    free(packed);
+    cpt_compressor_destroy(&codec);
+}
+
+static void fuzz_decoder(const uint8_t *data, size_t size, uint8_t version)
+{
+    struct cpt_response_decoder dec;
+    unsigned sum;
+    size_t offset;
+    size_t chunk;
+
+    if (cpt_response_decoder_init(&dec, CPT_RESPONSE_DECODER_CAPACITY) < 0)
+    {
+        return;
+    }
+
+    cpt_response_decoder_set_version(&dec, version);
+
+    sum = 0;
+    offset = 0;
+
+    // the input doubles as its own segmentation schedule
+    while (offset < size)
+    {
+        chunk = 1 + (size_t) data[offset] * 7;
+
+        if (chunk > size - offset)
+        {
+            chunk = size - offset;
+        }
+
+        chunk = cpt_response_decoder_feed(&dec, data + offset, chunk);
+        offset += chunk;
+        cpt_response_decoder_drain(&dec, touch_response, &sum);
+
+        if (chunk == 0)
+        {
+            break;
+        }
+    }
+
+    cpt_response_decoder_destroy(&dec);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    uint8_t *copy;
+
+    // exact sized heap copy so any overread lands in a redzone
+    copy = malloc(size == 0 ? 1 : size);
+
+    if (copy == NULL)
+    {
+        return 0;
+    }
+
+    memcpy(copy, data, size);
+    fuzz_request(copy, size);
+    fuzz_response(copy, size);
+    fuzz_records(copy, size);
+    fuzz_block(copy, size);
+    free(copy);
+
+    fuzz_decoder(data, size, CPT_CLIENT_VERSION);
+    fuzz_decoder(data, size, CPT_VERSION_BATCHED);
+    fuzz_decoder(data, size, CPT_VERSION_COMPRESSED);
+    fuzz_decoder(data, size, CPT_VERSION_SEQUENCED);
+
+    return 0;
+}
+
+#ifndef CPT_LIBFUZZER
+
+static size_t read_input(FILE *file, uint8_t *buf, size_t size);
+static void run_random(unsigned long runs);
+
+static size_t read_input(FILE *file, uint8_t *buf, size_t size)
+{
+    return fread(buf, 1, size, file);
+}
+
+static void run_random(unsigned long runs)
+{
+    static uint8_t buf[FUZZ_MAX_INPUT];
+    uint32_t state;
+    size_t size;
+
+    state = 0xDEADBEEF;
+
+    for (unsigned long run = 0; run < runs; run++)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        size = state % 512;
+
+        for (size_t i = 0; i < size; i++)
+        {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            buf[i] = (uint8_t) state;
+        }
+
+        // mostly valid looking headers, so the parsers get past the first checks
+        if (size > 7 && (run & 1) == 0)
+        {
+            buf[0] = (uint8_t) (1 + buf[0] % SERVER_FULL);
+            buf[5] = 0;
+            buf[6] = (uint8_t) (size - 7);
+        }
+
+        LLVMFuzzerTestOneInput(buf, size);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    static uint8_t buf[FUZZ_MAX_INPUT];
+    FILE *file;
+    size_t size;
+
+    if (argc == 3 && strcmp(argv[1], "--random") == 0)
+    {
+        run_random(strtoul(argv[2], NULL, 10));
+        return EXIT_SUCCESS;
+    }
+
+    if (argc == 1)
+    {
+        size = read_input(stdin, buf, sizeof(buf));
+        LLVMFuzzerTestOneInput(buf, size);
+        return EXIT_SUCCESS;
+    }
+
+    for (int i = 1; i < argc; i++)
+    {
+        file = fopen(argv[i], "rb");
+
+        if (file == NULL)
+        {
+            perror(argv[i]);
+            return EXIT_FAILURE;
+        }
+
+        size = read_input(file, buf, sizeof(buf));
+        fclose(file);
+        LLVMFuzzerTestOneInput(buf, size);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+#endif
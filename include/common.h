@@ -44,8 +44,24 @@
 #define INVALID_ID 21
 #define UNAUTH_ACCESS 22
 #define SERVER_FULL 23
+#define MESSAGE_COMPRESSED 24
+#define CHANNEL_DICTIONARY 25
+#define MESSAGE_SEQUENCE 26
 #define RESERVED 255
 
+#define CPT_REQUEST_HEADER_SIZE 6
+#define CPT_RESPONSE_HEADER_SIZE 7
+
+// version 2 packs records into length-prefixed envelopes, see cpt_envelope.h
+#define CPT_VERSION_BATCHED 2
+// version 3 is version 2 plus compressed MESSAGE records, see cpt_compress.h
+#define CPT_VERSION_COMPRESSED 3
+// version 4 is version 3 plus per-channel sequence numbers on MESSAGEs and RESUME
+#define CPT_VERSION_SEQUENCED 4
+#define CPT_VARINT_MAX 5
+#define CPT_REQUEST_RECORD_MAX (1 + 3 + 3 + UINT16_MAX)
+#define CPT_RESPONSE_RECORD_MAX (1 + 3 + 3 + 3 + UINT16_MAX)
+
 enum commands{
     SEND = 1,
     LOGOUT = 2,
@@ -53,7 +69,11 @@ enum commands{
     CREATE_CHANNEL = 4,
     JOIN_CHANNEL = 5,
     LEAVE_CHANNEL = 6,
-    LOGIN = 7
+    LOGIN = 7,
+    // AF_UNIX clients only, see cpt_shm.h
+    MAP_RINGS = 8,
+    // version 4 clients only
+    RESUME = 9
 };
 
 struct CptRequest{
@@ -73,21 +93,44 @@ struct CptResponse{
     uint8_t *msg;
 };
 
+/**
+* Number of bytes cpt_serialize_request() writes for a request.
+*
+* @param req    A CptRequest struct.
+* @return       Size of the serialized packet.
+*/
+size_t cpt_request_size(const struct CptRequest * req);
+
 /**
 * Serialize a CptRequest struct for transmission.
 *
-* @param cpt    A CptRequest struct.
+* @param req        A CptRequest struct.
+* @param buffer     Destination buffer.
+* @param buf_size   Size of <buffer>.
+* @return           Size of the serialized packet, 0 if it does not fit in <buffer>.
+*/
+size_t cpt_serialize_request(struct CptRequest * req, uint8_t * buffer, size_t buf_size);
+
+/**
+* Number of bytes cpt_serialize_response() writes for a response.
+*
+* The header is CODE, CHANNEL_ID, USER_ID and MSG_LEN,
+* followed by MSG_LEN bytes of MSG.
+*
+* @param res    A CptResponse object.
 * @return       Size of the serialized packet.
 */
-size_t cpt_serialize_request(struct CptRequest * req, uint8_t * buffer);
+size_t cpt_response_size(const struct CptResponse * res);
 
 /**
 * Serialize a CptResponse object for transmission.
 *
-* @param cpt    A CptResponse object.
-* @return       Size of the serialized packet.
+* @param res        A CptResponse object.
+* @param buffer     Destination buffer.
+* @param buf_size   Size of <buffer>.
+* @return           Size of the serialized packet, 0 if it does not fit in <buffer>.
 */
-size_t cpt_serialize_response(struct CptResponse * res, uint8_t * buffer);
+size_t cpt_serialize_response(struct CptResponse * res, uint8_t * buffer, size_t buf_size);
 
 /**
  * Initialize CptRequest object.
@@ -95,12 +138,12 @@ size_t cpt_serialize_response(struct CptResponse * res, uint8_t * buffer);
  * Dynamically allocates a cpt struct and
  * initializes all fields.
  *
- * @return Pointer to cpt struct.
+ * @return Pointer to cpt struct, NULL if allocation failed.
 */
 struct CptRequest * cpt_request_init(void);
 
 /**
- * Free all memory and set fields to null.
+ * Free the struct and the MSG it owns.
  *
  * @param cpt   Pointer to a cpt structure.
 */
@@ -109,8 +152,7 @@ void cpt_request_destroy(struct CptRequest * cpt);
 /**
  * Reset packet parameters.
  *
- * Reset the packet parameters,
- * and free memory for certain params.
+ * Reset every field to zero and free the owned MSG.
  *
  * @param packet    A CptRequest struct.
 */
@@ -122,16 +164,15 @@ void cpt_request_reset(struct CptRequest * packet);
  * Initializes a CptResponse, returning a dynamically
  * allocated pointer to a CptResponse struct.
  *
- * @param res_code    Received client-side packet.
- * @return Pointer to a CptResponse object.
+ * @return Pointer to a CptResponse object, NULL if allocation failed.
  */
 struct CptResponse * cpt_response_init(void);
 
 /**
  * Destroy CptResponse object.
  *
- * Destroys CptResponse object, freeing any allocated memory
- * and setting all pointers to null.
+ * Destroys CptResponse object. MSG is never owned
+ * by a response and is not freed.
  *
  * @param response  Pointer to a CptResponse object.
  */
@@ -140,33 +181,162 @@ void cpt_response_destroy(struct CptResponse * response);
 /**
  * Reset packet parameters.
  *
- * Reset the response parameters, and free memory for certain params.
+ * Reset every field of the response to zero.
  *
  * @param response		Pointer to a CptResponse object.
 */
 void cpt_response_reset(struct CptResponse * response);
 
+/**
+ * Check whether a byte is one of the response codes of the protocol.
+ *
+ * @param code      Candidate response code.
+ * @return Non-zero if <code> is a known response code.
+ */
+int cpt_valid_response_code(uint8_t code);
+
+/**
+ * @brief Parse a serialized server response into an existing object.
+ *
+ * No memory is allocated: <msg> points into <res_buf>.
+ *
+ * @param res       CptResponse to fill.
+ * @param res_buf   Serialized response from server.
+ * @param data_size Number of bytes in <res_buf>.
+ * @return 0 on success, -1 if <res_buf> does not hold a complete response.
+ */
+int cpt_parse_response_into(struct CptResponse * res, uint8_t * res_buf, size_t data_size);
+
 /**
  * @brief Parse serialized server response.
  *
- * @param response  Address to a CptResponse object.
- * @param buffer    Serialized response from server.
- * @return Pointer to filled CptResponse.
+ * <msg> of the result points into <res_buf>.
+ *
+ * @param res_buf   Serialized response from server.
+ * @param data_size Number of bytes in <res_buf>.
+ * @return Pointer to a filled CptResponse, NULL if the response is incomplete.
  */
 struct CptResponse * cpt_parse_response(uint8_t * res_buf, size_t data_size);
 
+/**
+* Parse a cpt packet into an existing struct without copying.
+*
+* MSG points into <req_buf> and is not NUL terminated.
+*
+* @param req       CptRequest to fill.
+* @param req_buf   A serialized cpt protocol message.
+* @param req_size  Number of bytes in <req_buf>.
+* @return 0 on success, -1 if the packet is incomplete.
+*/
+int cpt_parse_request_into(struct CptRequest * req, uint8_t * req_buf, size_t req_size);
+
+/**
+* Number of bytes cpt_varint_put() writes for a value.
+*
+* @param value     Value to encode.
+* @return Encoded size, 1 to CPT_VARINT_MAX.
+*/
+size_t cpt_varint_size(uint32_t value);
+
+/**
+* Encode a value as an unsigned LEB128 varint.
+*
+* @param value     Value to encode.
+* @param buf       Destination, at least cpt_varint_size(<value>) bytes.
+* @return Number of bytes written.
+*/
+size_t cpt_varint_put(uint32_t value, uint8_t * buf);
+
+/**
+* Decode an unsigned LEB128 varint.
+*
+* Encodings padded with 0x80 continuation bytes are accepted.
+*
+* @param buf       Encoded bytes.
+* @param size      Number of bytes in <buf>.
+* @param value     Decoded value.
+* @return Bytes consumed, 0 if <buf> ends inside the varint, -1 if it is longer than CPT_VARINT_MAX
+*         or does not fit 32 bits.
+*/
+int cpt_varint_get(const uint8_t * buf, size_t size, uint32_t * value);
+
+/**
+* Number of bytes cpt_serialize_request_record() writes for a request.
+*
+* A record is COMMAND followed by varint CHANNEL_ID, varint MSG_LEN and MSG.
+*
+* @param req       A CptRequest struct.
+* @return Size of the record.
+*/
+size_t cpt_request_record_size(const struct CptRequest * req);
+
+/**
+* Serialize a request as a version 2 record.
+*
+* @param req       A CptRequest struct.
+* @param buffer    Destination buffer.
+* @param buf_size  Size of <buffer>.
+* @return Size of the record, 0 if it does not fit in <buffer>.
+*/
+size_t cpt_serialize_request_record(struct CptRequest * req, uint8_t * buffer, size_t buf_size);
+
+/**
+* Parse one version 2 request record without copying.
+*
+* VERSION is set to CPT_VERSION_BATCHED; MSG points into <buf> and is not NUL terminated.
+*
+* @param req       CptRequest to fill.
+* @param buf       Records from an envelope body.
+* @param size      Bytes left in the body.
+* @return Bytes consumed, -1 if the record is malformed or truncated.
+*/
+int cpt_parse_request_record(struct CptRequest * req, uint8_t * buf, size_t size);
+
+/**
+* Number of bytes cpt_serialize_response_record() writes for a response.
+*
+* A record is CODE followed by varint CHANNEL_ID, USER_ID, MSG_LEN and MSG.
+*
+* @param res       A CptResponse object.
+* @return Size of the record.
+*/
+size_t cpt_response_record_size(const struct CptResponse * res);
+
+/**
+* Serialize a response as a version 2 record.
+*
+* @param res       A CptResponse object.
+* @param buffer    Destination buffer.
+* @param buf_size  Size of <buffer>.
+* @return Size of the record, 0 if it does not fit in <buffer>.
+*/
+size_t cpt_serialize_response_record(struct CptResponse * res, uint8_t * buffer, size_t buf_size);
+
+/**
+* Parse one version 2 response record without copying.
+*
+* @param res       CptResponse to fill, MSG points into <buf>.
+* @param buf       Records from an envelope body.
+* @param size      Bytes left in the body.
+* @return Bytes consumed, -1 if the record is malformed or truncated.
+*/
+int cpt_parse_response_record(struct CptResponse * res, uint8_t * buf, size_t size);
+
 /**
 * Create a cpt struct from a cpt packet.
 *
-* @param packet    A serialized cpt protocol message.
-* @return A pointer to a cpt struct.
+* MSG is copied and NUL terminated; release the result with cpt_request_destroy().
+*
+* @param req_buf   A serialized cpt protocol message.
+* @param req_size  Number of bytes in <req_buf>.
+* @return A pointer to a cpt struct, NULL if the packet is incomplete.
 */
 struct CptRequest * cpt_parse_request(uint8_t * req_buf, size_t req_size);
 
 /**
- * Combines two pointers from the buff to the uint16_t.
+ * Combines two bytes from the buff to the uint16_t.
  * @param buf the serialized cpt protocol message.
- * @param count position of the bit.
+ * @param count offset of the first byte, advanced past the field.
  * @return uint16_t combined field made of the buf.
  */
 uint16_t unpack_u16(uint8_t * buf, int * count);
@@ -0,0 +1,146 @@
+//
+// Created by saga910 on 2022-03-26.
+//
+
+#ifndef CHAT_ASSIGNMNET_CPT_ADMIN_H
+#define CHAT_ASSIGNMNET_CPT_ADMIN_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// operators querying at the same time, more are turned away
+#define CPT_ADMIN_MAX_CONNECTIONS 4
+#define CPT_ADMIN_LINE_MAX 64
+// entries in the top talkers and deepest queues lists
+#define CPT_ADMIN_TOP 10
+// user ids and channel ids are both 16 bits
+#define CPT_ADMIN_IDS (UINT16_MAX + 1)
+
+// what a user id stands for in struct cpt_admin_user
+#define CPT_ADMIN_FREE 0
+#define CPT_ADMIN_LOGGED_IN 1
+#define CPT_ADMIN_PARKED 2
+
+struct serverInfo;
+struct cpt_fanout;
+struct cpt_latency;
+
+/**
+ * What the event loop publishes about one user id: its <state>, the
+ * protocol <version> and whether it is on shared-memory rings (<shm>),
+ * the messages and bytes it <sent>, and the bytes still <queued> and
+ * <urgent> after its last flush.
+ */
+struct cpt_admin_user
+{
+    _Atomic uint8_t state;
+    _Atomic uint8_t version;
+    _Atomic uint8_t shm;
+    _Atomic uint64_t sent;
+    _Atomic uint64_t sent_bytes;
+    _Atomic uint64_t queued;
+    _Atomic uint64_t urgent;
+};
+
+/**
+ * Counters the event loop publishes for the admin thread.
+ *
+ * The loop stores a value with a relaxed store where it changes it
+ * anyway; the memory and arena figures once per poll round. The admin
+ * thread only loads them, so a reply may mix two rounds but never
+ * waits for the loop. <members> is -1 for a channel id not in use.
+ */
+struct cpt_admin_stats
+{
+    struct cpt_admin_user users[CPT_ADMIN_IDS];
+    _Atomic int32_t members[CPT_ADMIN_IDS];
+    _Atomic uint32_t seq[CPT_ADMIN_IDS];
+    _Atomic uint64_t arena_regions;
+    _Atomic uint64_t arena_explicit;
+    _Atomic uint64_t arena_in_use;
+    _Atomic uint64_t memory_used;
+    _Atomic uint64_t memory_peak;
+    _Atomic uint64_t memory_budget;
+    _Atomic uint64_t shed_bytes;
+    _Atomic uint64_t shed_clients;
+};
+
+/**
+ * One operator connection: the query is read into <line> up to the
+ * first newline, then the whole <reply> is written from <sent> and the
+ * connection is closed. <fd> is -1 for a free slot.
+ */
+struct cpt_admin_conn
+{
+    int fd;
+    char line[CPT_ADMIN_LINE_MAX];
+    size_t line_len;
+    char *reply;
+    size_t reply_len;
+    size_t sent;
+};
+
+/**
+ * The admin socket, an AF_UNIX listener for operators.
+ *
+ * It is served by its own <thread>, which owns the listener and the
+ * connections and answers from <stats>, the per-command <latency> and
+ * the per-lane counters of <fanout>, so the event loop never formats a
+ * reply or waits for an operator. A byte on <wake> stops the thread.
+ * <queries> counts the queries answered.
+ */
+struct cpt_admin
+{
+    int listen_fd;
+    int wake[2];
+    pthread_t thread;
+    struct cpt_admin_conn conns[CPT_ADMIN_MAX_CONNECTIONS];
+    struct cpt_admin_stats *stats;
+    const struct cpt_latency *latency;
+    struct cpt_fanout *fanout;
+    _Atomic uint64_t queries;
+};
+
+/**
+ * Listen on <path>, replacing a file a previous run left behind, start
+ * publishing counters from <info> and start the admin thread.
+ *
+ * Called from the event loop, after the fan-out lanes are created.
+ *
+ * @param path      Socket path.
+ * @param info      The server registry to publish.
+ * @return The admin socket, NULL on failure.
+ */
+struct cpt_admin *cpt_admin_open(const char *path, struct serverInfo *info);
+
+/**
+ * Stop the admin thread, stop publishing and close the listener and
+ * every operator connection. The socket file is left for the caller to
+ * unlink, a live upgrade's new process already listens on it.
+ *
+ * @param admin     The admin socket, may be NULL.
+ * @param info      The server registry it was opened with.
+ */
+void cpt_admin_close(struct cpt_admin *admin, struct serverInfo *info);
+
+/**
+ * Answer one query.
+ *
+ * "connections" counts the logged-in and parked users, "channels" lists
+ * the member count of every channel, "queues" the clients with the most
+ * output waiting, "top" the clients that sent the most messages, "lanes"
+ * what each fan-out lane delivered and "report" what the server prints
+ * when it exits: per-command latency percentiles, the input arena and
+ * the memory budget. "stats" is all of them, "help" lists the queries.
+ *
+ * @param admin     The admin socket.
+ * @param query     The query, without the newline.
+ * @param out       Where to print the reply.
+ * @return 0 on success, -1 for an unknown query.
+ */
+int cpt_admin_query(const struct cpt_admin *admin, const char *query, FILE *out);
+
+#endif //CHAT_ASSIGNMNET_CPT_ADMIN_H
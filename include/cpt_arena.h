@@ -0,0 +1,92 @@
+//
+// Created by saga910 on 2022-03-26.
+//
+
+#ifndef CHAT_ASSIGNMNET_CPT_ARENA_H
+#define CHAT_ASSIGNMNET_CPT_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// size of a huge page on x86-64 and arm64, regions are aligned to it
+#define CPT_ARENA_HUGE_PAGE (2 * 1024 * 1024)
+#define CPT_ARENA_REGION (16 * 1024 * 1024)
+
+// 4 KB pages, the kernel's default
+#define CPT_ARENA_SMALL_PAGES 0
+// 2 MB pages when the kernel has transparent huge pages to spare
+#define CPT_ARENA_TRANSPARENT 1
+// pages from the hugetlbfs pool, transparent ones if it is empty
+#define CPT_ARENA_EXPLICIT 2
+
+/**
+ * Fixed-size slots carved out of a few large mappings.
+ *
+ * Each region is CPT_ARENA_REGION bytes aligned to a huge page, so a
+ * region is covered by a handful of TLB entries instead of one per 4 KB
+ * page and a freed slot is handed to the next connection with its pages
+ * still mapped. Slots are given out from <next> until the region is
+ * used up, freed ones are kept on <free_list> and reused first. With a
+ * <node> every region is bound to that NUMA node before it is touched,
+ * whichever thread takes the slot.
+ */
+struct cpt_arena
+{
+    size_t slot_size;
+    int pages;
+    int node;
+    uint8_t **regions;
+    size_t region_count;
+    size_t region_capacity;
+    size_t explicit_regions;
+    uint8_t *next;
+    uint8_t *end;
+    void *free_list;
+    size_t in_use;
+};
+
+/**
+ * Create an arena. Nothing is mapped until the first slot is taken.
+ *
+ * @param slot_size Bytes per slot, at most CPT_ARENA_REGION.
+ * @param pages     CPT_ARENA_SMALL_PAGES, CPT_ARENA_TRANSPARENT or
+ *                  CPT_ARENA_EXPLICIT.
+ * @return The arena, NULL if allocation failed or the slot is too big.
+ */
+struct cpt_arena *cpt_arena_create(size_t slot_size, int pages);
+
+/**
+ * Create an arena whose regions are placed on one NUMA node.
+ *
+ * @param slot_size Bytes per slot, at most CPT_ARENA_REGION.
+ * @param pages     CPT_ARENA_SMALL_PAGES, CPT_ARENA_TRANSPARENT or
+ *                  CPT_ARENA_EXPLICIT.
+ * @param node      NUMA node, -1 to place pages where they are first touched.
+ * @return The arena, NULL if allocation failed or the slot is too big.
+ */
+struct cpt_arena *cpt_arena_create_on(size_t slot_size, int pages, int node);
+
+/**
+ * Take a slot. Its contents are whatever the last user left there.
+ *
+ * @param arena     The arena.
+ * @return The slot, NULL if no region could be mapped.
+ */
+uint8_t *cpt_arena_alloc(struct cpt_arena *arena);
+
+/**
+ * Give a slot back.
+ *
+ * @param arena     The arena it came from.
+ * @param slot      The slot.
+ */
+void cpt_arena_free(struct cpt_arena *arena, uint8_t *slot);
+
+/**
+ * Unmap every region. Slots still in use become invalid.
+ *
+ * @param arena     The arena, may be NULL.
+ */
+void cpt_arena_destroy(struct cpt_arena *arena);
+
+#endif //CHAT_ASSIGNMNET_CPT_ARENA_H
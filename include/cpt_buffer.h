@@ -0,0 +1,107 @@
+//
+// Created by saga910 on 2022-03-26.
+//
+
+#ifndef CHAT_ASSIGNMNET_CPT_BUFFER_H
+#define CHAT_ASSIGNMNET_CPT_BUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Storage for buffers that must not come from malloc().
+ *
+ * <alloc> returns <size> bytes, NULL on failure; <free> takes back what
+ * <alloc> returned for the same <size>. Both get <arg>.
+ */
+struct cpt_buffer_pool
+{
+    uint8_t *(*alloc)(void *arg, size_t size);
+    void (*free)(void *arg, uint8_t *data, size_t size);
+    void *arg;
+};
+
+/**
+ * Growable byte buffer.
+ *
+ * Bytes are appended at <tail> and consumed from <head>. The storage
+ * grows by doubling but never past <limit>, so callers always get an
+ * explicit failure instead of an unbounded allocation. It comes from
+ * <pool>, or from malloc() while <pool> is NULL.
+ */
+struct cpt_buffer
+{
+    uint8_t *data;
+    size_t head;
+    size_t tail;
+    size_t capacity;
+    size_t limit;
+    struct cpt_buffer_pool *pool;
+};
+
+/**
+ * Initialize an empty buffer.
+ *
+ * No memory is allocated until the first reservation.
+ *
+ * @param buf       The buffer.
+ * @param limit     Largest capacity the buffer may grow to.
+ */
+void cpt_buffer_init(struct cpt_buffer * buf, size_t limit);
+
+/**
+ * Free the storage of a buffer.
+ *
+ * The buffer keeps its pool and takes storage from it again when it grows.
+ *
+ * @param buf       The buffer.
+ */
+void cpt_buffer_destroy(struct cpt_buffer * buf);
+
+/**
+ * Move the bytes of a buffer to storage from <pool> and grow from there.
+ *
+ * The unconsumed bytes are copied to the front of the new storage.
+ *
+ * @param buf       The buffer.
+ * @param pool      Where its storage comes from, NULL for malloc().
+ * @return 0 on success, -1 if allocation failed and the buffer stayed where it was.
+ */
+int cpt_buffer_move(struct cpt_buffer * buf, struct cpt_buffer_pool * pool);
+
+/**
+ * Make room for <size> more bytes at the tail.
+ *
+ * Consumed bytes are compacted away before the storage is grown.
+ *
+ * @param buf       The buffer.
+ * @param size      Number of bytes the caller is about to write.
+ * @return Pointer to the writable region, NULL if <limit> would be exceeded or allocation failed.
+ */
+uint8_t * cpt_buffer_reserve(struct cpt_buffer * buf, size_t size);
+
+/**
+ * Mark <size> bytes written after cpt_buffer_reserve() as part of the buffer.
+ *
+ * @param buf       The buffer.
+ * @param size      Number of bytes written.
+ */
+void cpt_buffer_commit(struct cpt_buffer * buf, size_t size);
+
+/**
+ * Drop <size> bytes from the head of the buffer.
+ *
+ * @param buf       The buffer.
+ * @param size      Number of bytes consumed.
+ */
+void cpt_buffer_consume(struct cpt_buffer * buf, size_t size);
+
+/**
+ * Number of bytes waiting between head and tail.
+ *
+ * @param buf       The buffer.
+ * @return Number of readable bytes.
+ */
+size_t cpt_buffer_length(const struct cpt_buffer * buf);
+
+#endif //CHAT_ASSIGNMNET_CPT_BUFFER_H
@@ -0,0 +1,89 @@
+//
+// Created by saga910 on 2022-03-26.
+//
+
+#ifndef CHAT_ASSIGNMNET_CPT_CAPTURE_H
+#define CHAT_ASSIGNMNET_CPT_CAPTURE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// first bytes of a capture file, the last one is the format version
+#define CPT_CAPTURE_MAGIC "CPTCAP\n\1"
+#define CPT_CAPTURE_MAGIC_SIZE 8
+#define CPT_CAPTURE_RING (8 * 1024 * 1024)
+
+/**
+ * A recording of the frames a server received.
+ *
+ * After the magic, each record is varint connection id, varint
+ * microseconds since the previous record, varint length and that many
+ * bytes: one version 1 frame or one envelope exactly as the client sent
+ * it. A record of length 0 means the connection closed. Connection ids
+ * start at 1 in the order connections first sent something.
+ *
+ * The event loop only copies records into <ring>, from <tail>; a
+ * writer thread moves them to <fd> from <head>. Records that do not fit
+ * in the ring are counted in <dropped> rather than waited for.
+ */
+struct cpt_capture
+{
+    int fd;
+    uint8_t *ring;
+    _Atomic uint64_t head;
+    _Atomic uint64_t tail;
+    _Atomic int stopping;
+    pthread_t thread;
+    uint64_t last_us;
+    uint32_t next_id;
+    uint64_t records;
+    uint64_t dropped;
+    int failed;
+};
+
+/**
+ * Create a capture file and start its writer thread.
+ *
+ * @param path      File to write, truncated if it exists.
+ * @return The capture, NULL on failure.
+ */
+struct cpt_capture *cpt_capture_open(const char *path);
+
+/**
+ * Hand out the id of a connection's first record.
+ *
+ * @param capture   The capture.
+ * @return Connection id, never 0.
+ */
+uint32_t cpt_capture_connection(struct cpt_capture *capture);
+
+/**
+ * Record one frame or envelope.
+ *
+ * @param capture   The capture.
+ * @param id        Connection id.
+ * @param now_us    Monotonic time in microseconds.
+ * @param frame     Bytes as received.
+ * @param size      Number of bytes, at least 1.
+ */
+void cpt_capture_frame(struct cpt_capture *capture, uint32_t id, uint64_t now_us, const uint8_t *frame, size_t size);
+
+/**
+ * Record that a connection closed.
+ *
+ * @param capture   The capture.
+ * @param id        Connection id.
+ * @param now_us    Monotonic time in microseconds.
+ */
+void cpt_capture_close(struct cpt_capture *capture, uint32_t id, uint64_t now_us);
+
+/**
+ * Write out what is left, stop the writer and close the file.
+ *
+ * @param capture   The capture, may be NULL.
+ */
+void cpt_capture_destroy(struct cpt_capture *capture);
+
+#endif //CHAT_ASSIGNMNET_CPT_CAPTURE_H
@@ -6,7 +6,17 @@
 #define CHAT_ASSIGNMNET_CPT_CLIENT_H
 
 #include "common.h"
+#include "cpt_buffer.h"
+#include "cpt_compress.h"
+#include "cpt_envelope.h"
+#include "cpt_ring.h"
+#include "cpt_shm.h"
 #include <arpa/inet.h>
+#include <sys/types.h>
+
+#define CPT_CLIENT_VERSION 1
+#define CPT_CONNECTION_OUTPUT_LIMIT (4 * 1024 * 1024)
+#define CPT_RESPONSE_DECODER_CAPACITY (128 * 1024)
 
 struct client_info
 {
@@ -14,6 +24,94 @@ struct client_info
     uint16_t channel_id;
 };
 
+/**
+ * A client connection to a CPT server.
+ *
+ * Requests are serialized back to back into <out> and leave
+ * in a single write when the batch is flushed. Once <version> is
+ * CPT_VERSION_BATCHED they are appended as records to <envelope>
+ * instead, and the envelope is sealed by the flush.
+ *
+ * Once <shm> is attached the batch goes into the shared-memory ring
+ * instead of the socket, which only carries doorbells from then on.
+ */
+struct cpt_connection
+{
+    int fd;
+    uint8_t version;
+    struct client_info info;
+    struct cpt_buffer out;
+    struct cpt_envelope envelope;
+    size_t batched;
+    struct cpt_shm *shm;
+};
+
+/**
+ * The dictionary a channel's compressed messages currently refer to.
+ */
+struct cpt_channel_dictionary
+{
+    uint16_t channel_id;
+    uint32_t id;
+    uint8_t *data;
+    size_t size;
+};
+
+/**
+ * How far a channel's sequence numbers have got.
+ *
+ * <last> is the highest sequence number seen. <gap_from> to <gap_to>
+ * are the messages skipped over that a RESUME may still fill in;
+ * <gap_from> is 0 while nothing is missing.
+ */
+struct cpt_channel_sequence
+{
+    uint16_t channel_id;
+    uint32_t last;
+    uint32_t gap_from;
+    uint32_t gap_to;
+};
+
+/**
+ * Incremental decoder for the server's response stream.
+ *
+ * Received bytes accumulate in <ring> regardless of how TCP segmented
+ * them. Complete responses are handed out in place; only a response
+ * that wraps around the end of the ring is copied into <scratch>.
+ * With <version> CPT_VERSION_BATCHED the stream is read as envelopes
+ * and each record inside them is handed out as one response.
+ * CPT_VERSION_COMPRESSED streams also carry CHANNEL_DICTIONARY records,
+ * kept in <dicts>, and MESSAGE_COMPRESSED records, which are expanded
+ * in <codec> and handed out as MESSAGE. CPT_VERSION_SEQUENCED streams
+ * put a MESSAGE_SEQUENCE record in front of every MESSAGE; these are
+ * tracked per channel in <seqs>, with <seq> holding the number of the
+ * MESSAGE being handed out. Missing numbers are counted in <gaps>, and
+ * a resent MESSAGE the client already has is dropped and counted in
+ * <duplicates>.
+ */
+struct cpt_response_decoder
+{
+    struct cpt_ring ring;
+    uint8_t version;
+    uint8_t *scratch;
+    struct cpt_compressor codec;
+    struct cpt_channel_dictionary *dicts;
+    size_t dict_count;
+    struct cpt_channel_sequence *seqs;
+    size_t seq_count;
+    uint32_t seq;
+    int skip;
+    size_t gaps;
+    size_t duplicates;
+    size_t decoded;
+    size_t resyncs;
+};
+
+/**
+ * Called for every complete response. <res->msg> is only valid during the call.
+ */
+typedef void (*cpt_response_handler)(void * arg, const struct CptResponse * res);
+
 /**
  * Prepare a LOGIN request packet for the server.
  *
@@ -22,13 +120,12 @@ struct client_info
  * with the necessary information to instruct the server to
  * persist the client's information until cpt_logout() is called.
  *
- * @param cpt            CPT packet information and any other necessary data.
  * @param serial_buf     A buffer intended for storing the result.
+ * @param buf_size       Size of <serial_buf>.
  * @param name           Client login name.
- * @return The size of the serialized packet in <serial_buf>.
+ * @return The size of the serialized packet in <serial_buf>, 0 if it does not fit.
 */
-
-size_t cpt_login(uint8_t * serial_buf, char * name);
+size_t cpt_login(uint8_t * serial_buf, size_t buf_size, char * name);
 
 /**
  * Prepare a LOGOUT request packet for the server.
@@ -38,11 +135,11 @@ size_t cpt_login(uint8_t * serial_buf, char * name);
  * with the necessary information to instruct the server to remove
  * any instance of the requesting client's information.
  *
- * @param cpt            CPT packet information and any other necessary data.
  * @param serial_buf     A buffer intended for storing the result.
- * @return Size of the resulting serialized packet in <serial_buf>
+ * @param buf_size       Size of <serial_buf>.
+ * @return Size of the resulting serialized packet in <serial_buf>, 0 if it does not fit.
 */
-size_t cpt_logout(uint8_t * serial_buf);
+size_t cpt_logout(uint8_t * serial_buf, size_t buf_size);
 
 /**
  * Prepare a GET_USERS request packet for the server.
@@ -52,12 +149,12 @@ size_t cpt_logout(uint8_t * serial_buf);
  * with the necessary information to instruct the server to
  * send back a list of users specified by the <channel_id>.
  *
- * @param client_info    CPT packet information and any other necessary data.
  * @param serial_buf     A buffer intended for storing the result.
+ * @param buf_size       Size of <serial_buf>.
  * @param channel_id     The ID of the CHANNEL to get users from.
- * @return Size of the resulting serialized packet in <serial_buf>
+ * @return Size of the resulting serialized packet in <serial_buf>, 0 if it does not fit.
 */
-size_t cpt_get_users(uint8_t * serial_buf, uint16_t channel_id);
+size_t cpt_get_users(uint8_t * serial_buf, size_t buf_size, uint16_t channel_id);
 
 /**
  * Prepare a CREATE_CHANNEL request packet for the server.
@@ -72,12 +169,12 @@ size_t cpt_get_users(uint8_t * serial_buf, uint16_t channel_id);
  *      > If <members> is not NULL, it will be assigned to the
  *        MSG field of the packet.
  *
- * @param cpt            CPT packet information and any other necessary data.
  * @param serial_buf     A buffer intended for storing the result.
+ * @param buf_size       Size of <serial_buf>.
  * @param user_list      Whitespace separated user IDs as a string.
- * @return Size of the resulting serialized packet in <serial_buf>
+ * @return Size of the resulting serialized packet in <serial_buf>, 0 if it does not fit.
 */
-size_t cpt_create_channel(uint8_t * serial_buf, char * user_list);
+size_t cpt_create_channel(uint8_t * serial_buf, size_t buf_size, char * user_list);
 
 /**
  * Prepare a JOIN_CHANNEL request packet for the server.
@@ -87,12 +184,12 @@ size_t cpt_create_channel(uint8_t * serial_buf, char * user_list);
  * with the necessary information to instruct the server to add
  * the client's information to an existing channel.
  *
- * @param client_info    CPT packet information and any other necessary data.
  * @param serial_buf     A buffer intended for storing the result.
+ * @param buf_size       Size of <serial_buf>.
  * @param channel_id     The target channel id.
- * @return Size of the resulting serialized packet in <serial_buf>
+ * @return Size of the resulting serialized packet in <serial_buf>, 0 if it does not fit.
 */
-size_t cpt_join_channel(uint8_t * serial_buf, uint16_t channel_id);
+size_t cpt_join_channel(uint8_t * serial_buf, size_t buf_size, uint16_t channel_id);
 
 /**
  * Prepare a LEAVE_CHANNEL request packet for the server.
@@ -102,12 +199,12 @@ size_t cpt_join_channel(uint8_t * serial_buf, uint16_t channel_id);
  * with the necessary information to remove the client's information
  * from the channel specified by <channel_id>.
  *
- * @param client_info    CPT packet information and any other necessary data.
  * @param serial_buf     A buffer intended for storing the result.
+ * @param buf_size       Size of <serial_buf>.
  * @param channel_id     The target channel id.
- * @return Size of the resulting serialized packet in <serial_buf>
+ * @return Size of the resulting serialized packet in <serial_buf>, 0 if it does not fit.
 */
-size_t cpt_leave_channel(uint8_t * serial_buf, uint16_t channel_id);
+size_t cpt_leave_channel(uint8_t * serial_buf, size_t buf_size, uint16_t channel_id);
 
 /**
  * Prepare a SEND request packet for the server.
@@ -118,12 +215,322 @@ size_t cpt_leave_channel(uint8_t * serial_buf, uint16_t channel_id);
  * the message specified by <msg> to ever user in the channel
  * specified within the packet CHAN_ID field.
  *
- * @param client_info    CPT packet information and any other necessary data.
  * @param serial_buf     A buffer intended for storing the result.
+ * @param buf_size       Size of <serial_buf>.
+ * @param channel_id     The target channel id.
  * @param msg            Intended chat message.
- * @return Size of the resulting serialized packet in <serial_buf>.
+ * @return Size of the resulting serialized packet in <serial_buf>, 0 if it does not fit.
 */
-size_t cpt_send(uint8_t * serial_buf, char * msg);
+size_t cpt_send(uint8_t * serial_buf, size_t buf_size, uint16_t channel_id, char * msg);
+
+/**
+ * Initialize a connection over an already connected socket.
+ *
+ * @param conn           The connection.
+ * @param fd             Connected socket.
+ * @param output_limit   Most bytes that may be batched before a flush.
+ */
+void cpt_connection_init(struct cpt_connection * conn, int fd, size_t output_limit);
+
+/**
+ * Release the connection buffers. The socket is left open.
+ *
+ * @param conn           The connection.
+ */
+void cpt_connection_destroy(struct cpt_connection * conn);
+
+/**
+ * Append a serialized request to the connection's batch.
+ *
+ * Nothing is written to the socket until cpt_batch_flush().
+ *
+ * @param conn           The connection.
+ * @param req            The request to serialize.
+ * @return 0 on success, -1 with errno set to ENOBUFS if the batch would exceed its limit.
+ */
+int cpt_batch_append(struct cpt_connection * conn, struct CptRequest * req);
+
+/**
+ * Append a LOGIN request to the batch.
+ *
+ * @param conn           The connection.
+ * @param name           Client login name.
+ * @return 0 on success, -1 if the batch is full.
+ */
+int cpt_batch_login(struct cpt_connection * conn, char * name);
+
+/**
+ * Append a LOGIN that asks for batched (version 2) framing.
+ *
+ * The reply is a version 1 frame. On SUCCESS, switch the connection
+ * and the decoder with cpt_connection_set_version() and
+ * cpt_response_decoder_set_version() before batching anything else;
+ * BAD_VERSION means the server only speaks version 1. Nothing may be
+ * batched behind this request until its reply has arrived.
+ *
+ * @param conn           The connection.
+ * @param name           Client login name.
+ * @return 0 on success, -1 if the batch is full.
+ */
+int cpt_batch_login_batched(struct cpt_connection * conn, char * name);
+
+/**
+ * Append a LOGIN that asks for batched framing with compression (version 3).
+ *
+ * Works like cpt_batch_login_batched(), switching the connection and
+ * the decoder to CPT_VERSION_COMPRESSED on SUCCESS. Requests are framed
+ * exactly as in version 2; only the responses differ.
+ *
+ * @param conn           The connection.
+ * @param name           Client login name.
+ * @return 0 on success, -1 if the batch is full.
+ */
+int cpt_batch_login_compressed(struct cpt_connection * conn, char * name);
+
+/**
+ * Append a LOGIN that asks for compression plus sequence numbers (version 4).
+ *
+ * Works like cpt_batch_login_compressed(), switching the connection and
+ * the decoder to CPT_VERSION_SEQUENCED on SUCCESS.
+ *
+ * @param conn           The connection.
+ * @param name           Client login name.
+ * @return 0 on success, -1 if the batch is full.
+ */
+int cpt_batch_login_sequenced(struct cpt_connection * conn, char * name);
+
+/**
+ * Append a RESUME request, asking for a channel's messages after <after> again.
+ *
+ * Only version 4 connections may send it. The server resends what it
+ * still has and replies SUCCESS with the number of messages it no
+ * longer has as a varint. Batch it right behind the JOIN_CHANNEL of a
+ * reconnect so nothing is sent in between.
+ *
+ * @param conn           The connection.
+ * @param channel_id     The channel.
+ * @param after          Last sequence number the client has, from cpt_response_decoder_resume_after().
+ * @return 0 on success, -1 if the batch is full.
+ */
+int cpt_batch_resume(struct cpt_connection * conn, uint16_t channel_id, uint32_t after);
+
+/**
+ * Append a MAP_RINGS request, only accepted on an AF_UNIX connection.
+ *
+ * The SUCCESS reply carries the rings' descriptor, receive it with
+ * cpt_response_decoder_read_fd() and pass it to
+ * cpt_connection_attach_rings(). Nothing may be batched behind this
+ * request until then.
+ *
+ * @param conn           The connection.
+ * @return 0 on success, -1 if the batch is full.
+ */
+int cpt_batch_map_rings(struct cpt_connection * conn);
+
+/**
+ * Map the rings received in reply to MAP_RINGS and switch the connection to them.
+ *
+ * Rings the first doorbell, which tells the server to switch as well.
+ * From then on read responses with cpt_response_decoder_read_rings().
+ *
+ * @param conn           The connection.
+ * @param fd             Descriptor from cpt_response_decoder_read_fd(), closed by this call.
+ * @return 0 on success, -1 if the rings could not be mapped.
+ */
+int cpt_connection_attach_rings(struct cpt_connection * conn, int fd);
 
+/**
+ * Change the framing used for requests batched from now on.
+ *
+ * @param conn           The connection.
+ * @param version        CPT_CLIENT_VERSION, CPT_VERSION_BATCHED or CPT_VERSION_COMPRESSED.
+ */
+void cpt_connection_set_version(struct cpt_connection * conn, uint8_t version);
+
+/**
+ * Append a LOGOUT request to the batch.
+ *
+ * @param conn           The connection.
+ * @return 0 on success, -1 if the batch is full.
+ */
+int cpt_batch_logout(struct cpt_connection * conn);
+
+/**
+ * Append a GET_USERS request to the batch.
+ *
+ * @param conn           The connection.
+ * @param channel_id     The ID of the CHANNEL to get users from.
+ * @return 0 on success, -1 if the batch is full.
+ */
+int cpt_batch_get_users(struct cpt_connection * conn, uint16_t channel_id);
+
+/**
+ * Append a CREATE_CHANNEL request to the batch.
+ *
+ * @param conn           The connection.
+ * @param user_list      Whitespace separated user IDs as a string, may be NULL.
+ * @return 0 on success, -1 if the batch is full.
+ */
+int cpt_batch_create_channel(struct cpt_connection * conn, char * user_list);
+
+/**
+ * Append a JOIN_CHANNEL request to the batch.
+ *
+ * @param conn           The connection.
+ * @param channel_id     The target channel id.
+ * @return 0 on success, -1 if the batch is full.
+ */
+int cpt_batch_join_channel(struct cpt_connection * conn, uint16_t channel_id);
+
+/**
+ * Append a LEAVE_CHANNEL request to the batch.
+ *
+ * @param conn           The connection.
+ * @param channel_id     The target channel id.
+ * @return 0 on success, -1 if the batch is full.
+ */
+int cpt_batch_leave_channel(struct cpt_connection * conn, uint16_t channel_id);
+
+/**
+ * Append a SEND request to the batch.
+ *
+ * @param conn           The connection.
+ * @param channel_id     The target channel id.
+ * @param msg            Intended chat message.
+ * @return 0 on success, -1 if the batch is full.
+ */
+int cpt_batch_send(struct cpt_connection * conn, uint16_t channel_id, char * msg);
+
+/**
+ * Write the batched requests to the socket with a single send().
+ *
+ * Whatever the kernel does not accept stays batched for the next flush.
+ * With rings attached the requests are copied into the ring instead; a
+ * full ring is EAGAIN and the server rings a doorbell once it has room.
+ *
+ * @param conn           The connection.
+ * @return Number of bytes written, -1 on error (errno is EAGAIN if the socket is full).
+ */
+ssize_t cpt_batch_flush(struct cpt_connection * conn);
+
+/**
+ * Number of serialized bytes waiting to be flushed.
+ *
+ * @param conn           The connection.
+ * @return Bytes in the batch.
+ */
+size_t cpt_batch_pending(const struct cpt_connection * conn);
+
+
+/**
+ * Initialize a response decoder.
+ *
+ * @param dec            The decoder.
+ * @param capacity       Ring size, a power of two larger than the biggest response or envelope.
+ * @return 0 on success, -1 if <capacity> is not a power of two or memory could not be allocated.
+ */
+int cpt_response_decoder_init(struct cpt_response_decoder * dec, size_t capacity);
+
+/**
+ * Change the framing of the bytes after the response being handled.
+ *
+ * May be called from the handler of cpt_response_decoder_drain(); the
+ * next response is decoded with the new framing.
+ *
+ * @param dec            The decoder.
+ * @param version        CPT_CLIENT_VERSION up to CPT_VERSION_SEQUENCED.
+ */
+void cpt_response_decoder_set_version(struct cpt_response_decoder * dec, uint8_t version);
+
+/**
+ * The sequence number to RESUME a channel after.
+ *
+ * That is the last message before the first gap, or the last one seen
+ * when nothing is missing.
+ *
+ * @param dec            The decoder.
+ * @param channel_id     The channel.
+ * @return The sequence number, 0 if the channel has not sent any.
+ */
+uint32_t cpt_response_decoder_resume_after(const struct cpt_response_decoder * dec, uint16_t channel_id);
+
+/**
+ * Drop what the decoder knows about a channel's sequence numbers.
+ *
+ * Call it after leaving a channel: a channel created later under the
+ * same id starts again from 1.
+ *
+ * @param dec            The decoder.
+ * @param channel_id     The channel.
+ */
+void cpt_response_decoder_forget_channel(struct cpt_response_decoder * dec, uint16_t channel_id);
+
+/**
+ * Free the decoder's ring, scratch space, dictionaries and sequence numbers.
+ *
+ * @param dec            The decoder.
+ */
+void cpt_response_decoder_destroy(struct cpt_response_decoder * dec);
+
+/**
+ * Read whatever the socket has into the decoder with a single readv().
+ *
+ * @param dec            The decoder.
+ * @param fd             Socket to read from.
+ * @return Bytes read, 0 on end of stream, -1 on error (errno is EAGAIN if nothing was ready).
+ */
+ssize_t cpt_response_decoder_read(struct cpt_response_decoder * dec, int fd);
+
+/**
+ * Like cpt_response_decoder_read(), also accepting a descriptor passed with SCM_RIGHTS.
+ *
+ * @param dec            The decoder.
+ * @param fd             AF_UNIX socket to read from.
+ * @param passed_fd      Set to the received descriptor, left alone if none came with the bytes.
+ * @return Bytes read, 0 on end of stream, -1 on error (errno is EAGAIN if nothing was ready).
+ */
+ssize_t cpt_response_decoder_read_fd(struct cpt_response_decoder * dec, int fd, int * passed_fd);
+
+/**
+ * Consume the doorbells on the socket and copy the server's ring into the decoder.
+ *
+ * Call cpt_response_decoder_drain() after each successful call and keep
+ * going until this fails with EAGAIN; only then is it safe to wait for
+ * the socket to become readable again. A doorbell may also mean the
+ * server made room for a batch that did not fit.
+ *
+ * @param dec            The decoder.
+ * @param conn           Connection with rings attached.
+ * @return Bytes copied, 0 when the server closed the connection, -1 on error
+ *         (errno is EAGAIN if the ring was empty, EPROTO if it was corrupt).
+ */
+ssize_t cpt_response_decoder_read_rings(struct cpt_response_decoder * dec, struct cpt_connection * conn);
+
+/**
+ * Copy already received bytes into the decoder.
+ *
+ * @param dec            The decoder.
+ * @param data           Received bytes.
+ * @param size           Number of bytes.
+ * @return Number of bytes accepted, less than <size> if the ring is full.
+ */
+size_t cpt_response_decoder_feed(struct cpt_response_decoder * dec, const uint8_t * data, size_t size);
+
+/**
+ * Emit every complete response currently buffered.
+ *
+ * A header with an unknown response code means the stream lost
+ * framing; the decoder skips a byte at a time until it finds a
+ * plausible header again and counts each skip in <resyncs>. In
+ * batched mode an envelope holding a malformed record is dropped
+ * from that record on, and also counted in <resyncs>. So is a
+ * compressed message that cannot be expanded; it is not emitted.
+ *
+ * @param dec            The decoder.
+ * @param handler        Called once per response.
+ * @param arg            Passed to <handler>.
+ * @return Number of responses emitted.
+ */
+size_t cpt_response_decoder_drain(struct cpt_response_decoder * dec, cpt_response_handler handler, void * arg);
 
 #endif //CHAT_ASSIGNMNET_CPT_CLIENT_H
@@ -0,0 +1,135 @@
+//
+// Created by saga910 on 2022-03-26.
+//
+
+#ifndef CHAT_ASSIGNMNET_CPT_COMPRESS_H
+#define CHAT_ASSIGNMNET_CPT_COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CPT_DICT_MAX (16 * 1024)
+#define CPT_DICT_RETRAIN (1024 * 1024)
+#define CPT_COMPRESS_MIN 512
+#define CPT_COMPRESS_HASH_BITS 12
+
+/**
+ * Working memory for the block codec.
+ *
+ * The format is LZ4's block format: sequences of literals followed by a
+ * 16 bit back reference. A dictionary is placed in front of the data in
+ * <window> so references may reach into it.
+ */
+struct cpt_compressor
+{
+    uint8_t *window;
+    uint32_t *table;
+};
+
+/**
+ * A channel's shared dictionary and the samples it is trained on.
+ *
+ * <samples> holds the most recent bytes of large messages sent to the
+ * channel. Once <pending> more bytes have arrived since the last training
+ * the dictionary is rebuilt from them and <id> changes. <table> is the
+ * dictionary's match index, built once per training rather than per block.
+ */
+struct cpt_dictionary
+{
+    uint32_t id;
+    uint8_t *data;
+    size_t size;
+    uint32_t *table;
+    uint8_t *samples;
+    size_t sample_head;
+    size_t sample_fill;
+    size_t pending;
+};
+
+/**
+ * Allocate the codec's working memory.
+ *
+ * @param codec     The codec.
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+int cpt_compressor_init(struct cpt_compressor * codec);
+
+/**
+ * Free the codec's working memory.
+ *
+ * @param codec     The codec.
+ */
+void cpt_compressor_destroy(struct cpt_compressor * codec);
+
+/**
+ * Compress a block.
+ *
+ * @param codec     The codec.
+ * @param dict      Dictionary, may be NULL.
+ * @param dict_size Dictionary size, at most CPT_DICT_MAX.
+ * @param src       Data, at most UINT16_MAX bytes.
+ * @param size      Size of <src>.
+ * @param dst       Destination.
+ * @param dst_size  Size of <dst>.
+ * @return Compressed size, 0 if it would not fit in <dst>.
+ */
+size_t cpt_compress(struct cpt_compressor * codec, const uint8_t * dict, size_t dict_size, const uint8_t * src,
+                    size_t size, uint8_t * dst, size_t dst_size);
+
+/**
+ * Compress a block against a trained dictionary.
+ *
+ * Same output as cpt_compress() with <dict->data>, without re-indexing
+ * the dictionary.
+ *
+ * @param codec     The codec.
+ * @param dict      Dictionary, uncompressed if it has not been trained yet.
+ * @param src       Data, at most UINT16_MAX bytes.
+ * @param size      Size of <src>.
+ * @param dst       Destination.
+ * @param dst_size  Size of <dst>.
+ * @return Compressed size, 0 if it would not fit in <dst>.
+ */
+size_t cpt_compress_dictionary(struct cpt_compressor * codec, const struct cpt_dictionary * dict, const uint8_t * src,
+                               size_t size, uint8_t * dst, size_t dst_size);
+
+/**
+ * Decompress a block produced by cpt_compress() with the same dictionary.
+ *
+ * @param codec     The codec.
+ * @param dict      Dictionary, may be NULL.
+ * @param dict_size Dictionary size, at most CPT_DICT_MAX.
+ * @param src       Compressed block.
+ * @param size      Size of <src>.
+ * @param out_size  Exact decompressed size, at most UINT16_MAX.
+ * @return The decompressed bytes inside the codec's window, valid until the
+ *         next call; NULL if the block is malformed.
+ */
+uint8_t * cpt_decompress(struct cpt_compressor * codec, const uint8_t * dict, size_t dict_size, const uint8_t * src,
+                         size_t size, size_t out_size);
+
+/**
+ * Create an empty dictionary.
+ *
+ * @return The dictionary, NULL if memory could not be allocated.
+ */
+struct cpt_dictionary * cpt_dictionary_create(void);
+
+/**
+ * Free a dictionary.
+ *
+ * @param dict      The dictionary, may be NULL.
+ */
+void cpt_dictionary_destroy(struct cpt_dictionary * dict);
+
+/**
+ * Add a message to the samples and retrain when enough new data arrived.
+ *
+ * @param dict      The dictionary.
+ * @param msg       Message.
+ * @param size      Size of <msg>.
+ * @return 1 if the dictionary was retrained, 0 otherwise.
+ */
+int cpt_dictionary_sample(struct cpt_dictionary * dict, const uint8_t * msg, size_t size);
+
+#endif //CHAT_ASSIGNMNET_CPT_COMPRESS_H
@@ -0,0 +1,72 @@
+//
+// Created by saga910 on 2022-03-26.
+//
+
+#ifndef CHAT_ASSIGNMNET_CPT_CPU_H
+#define CHAT_ASSIGNMNET_CPT_CPU_H
+
+#include <poll.h>
+#include <stddef.h>
+
+#define CPT_CPU_MAX 64
+// NUMA nodes cpt_cpu_bind() can name, as many as the kernel's largest default configuration
+#define CPT_CPU_MAX_NODES 1024
+
+/**
+ * Parse a CPU list such as "2,4-7".
+ *
+ * @param spec      The list.
+ * @param cpus      Filled with the CPU numbers in order.
+ * @param max       Room in <cpus>.
+ * @return Number of CPUs, -1 if the list is malformed or too long.
+ */
+int cpt_cpu_parse(const char *spec, int *cpus, int max);
+
+/**
+ * Pin the calling thread to one CPU.
+ *
+ * Memory the thread touches first from then on is placed on that
+ * CPU's NUMA node; memory another thread touched first stays where it
+ * is unless it was bound with cpt_cpu_bind().
+ *
+ * @param cpu       CPU number.
+ * @return 0 on success, -1 on failure.
+ */
+int cpt_cpu_pin(int cpu);
+
+/**
+ * NUMA node of the CPU the calling thread is running on.
+ *
+ * @return Node number, -1 if the kernel cannot tell.
+ */
+int cpt_cpu_node(void);
+
+/**
+ * Place the pages of a mapping on a NUMA node before they are touched.
+ *
+ * The node is preferred, not required: when it runs out of memory the
+ * pages come from another node instead of failing the fault.
+ *
+ * @param addr      Start of the mapping, page aligned.
+ * @param size      Length of the mapping.
+ * @param node      Node number, -1 leaves the placement to first touch.
+ * @return 0 on success, -1 on failure or without NUMA support.
+ */
+int cpt_cpu_bind(void *addr, size_t size, int node);
+
+/**
+ * poll(), but spin for up to <spin_us> microseconds before sleeping.
+ *
+ * While spinning the thread stays on its CPU, so an event that arrives
+ * within the spin is picked up without a scheduler wakeup. The spin
+ * counts against <timeout>.
+ *
+ * @param fds       Descriptors.
+ * @param nfds      Number of descriptors.
+ * @param timeout   Timeout in milliseconds, -1 for none.
+ * @param spin_us   How long to spin, 0 to sleep at once.
+ * @return As poll().
+ */
+int cpt_cpu_poll(struct pollfd *fds, nfds_t nfds, int timeout, unsigned spin_us);
+
+#endif //CHAT_ASSIGNMNET_CPT_CPU_H
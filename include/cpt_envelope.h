@@ -0,0 +1,81 @@
+//
+// Created by saga910 on 2022-03-26.
+//
+
+#ifndef CHAT_ASSIGNMNET_CPT_ENVELOPE_H
+#define CHAT_ASSIGNMNET_CPT_ENVELOPE_H
+
+#include "cpt_buffer.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// writers always use a 3 byte varint so the length can be filled in when the envelope is sealed
+#define CPT_ENVELOPE_HEADER_SIZE 3
+#define CPT_ENVELOPE_MAX (96 * 1024)
+
+/**
+ * A version 2 envelope being written into a cpt_buffer.
+ *
+ * An envelope is a varint body length followed by that many bytes of
+ * back to back records. <start> is relative to the buffer's head so it
+ * survives the buffer compacting while records are appended.
+ */
+struct cpt_envelope
+{
+    size_t start;
+    size_t body;
+    int open;
+};
+
+/**
+ * Initialize an envelope writer with no envelope open.
+ *
+ * @param env       The writer.
+ */
+void cpt_envelope_init(struct cpt_envelope * env);
+
+/**
+ * Reserve room for a record, opening a new envelope when needed.
+ *
+ * The current envelope is sealed first if the record would push its
+ * body past CPT_ENVELOPE_MAX.
+ *
+ * @param env       The writer.
+ * @param buf       Buffer the envelope lives in.
+ * @param size      Size of the record.
+ * @return Where to write the record, NULL if <buf> hit its limit.
+ */
+uint8_t * cpt_envelope_reserve(struct cpt_envelope * env, struct cpt_buffer * buf, size_t size);
+
+/**
+ * Add a record written after cpt_envelope_reserve() to the envelope.
+ *
+ * @param env       The writer.
+ * @param buf       Buffer the envelope lives in.
+ * @param size      Size of the record.
+ */
+void cpt_envelope_commit(struct cpt_envelope * env, struct cpt_buffer * buf, size_t size);
+
+/**
+ * Write the length of the open envelope, if any, and close it.
+ *
+ * Must be called before any byte of the envelope is sent.
+ *
+ * @param env       The writer.
+ * @param buf       Buffer the envelope lives in.
+ */
+void cpt_envelope_seal(struct cpt_envelope * env, struct cpt_buffer * buf);
+
+/**
+ * Decode the length prefix of an envelope.
+ *
+ * @param buf       Received bytes.
+ * @param size      Number of bytes in <buf>.
+ * @param header    Size of the length prefix.
+ * @param body      Length of the body that follows it.
+ * @return 1 on success, 0 if more bytes are needed, -1 if the prefix is
+ *         malformed or the body is larger than CPT_ENVELOPE_MAX.
+ */
+int cpt_envelope_parse_header(const uint8_t * buf, size_t size, size_t * header, size_t * body);
+
+#endif //CHAT_ASSIGNMNET_CPT_ENVELOPE_H
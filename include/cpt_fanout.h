@@ -0,0 +1,108 @@
+//
+// Created by saga910 on 2022-03-26.
+//
+
+#ifndef CHAT_ASSIGNMNET_CPT_FANOUT_H
+#define CHAT_ASSIGNMNET_CPT_FANOUT_H
+
+#include "cpt_pool.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CPT_FANOUT_MAX_LANES 64
+// channels with at least this many members are fanned out in parallel by default
+#define CPT_FANOUT_THRESHOLD 4096
+
+/**
+ * Work for one lane of a fan-out.
+ *
+ * @param arg       Argument given to cpt_fanout_run().
+ * @param lane      Lane to deliver, 0 .. lanes - 1.
+ */
+typedef void (*cpt_fanout_fn)(void *arg, int lane);
+
+/**
+ * Worker threads that deliver a broadcast to large channels in parallel.
+ *
+ * A fan-out has <lanes> lanes: lane 0 runs on the calling thread and
+ * each other lane on its own thread. Members are assigned to a lane by
+ * user id, so a member's output is only ever touched by one thread.
+ * <generation> counts the runs posted, <pending> the lanes of the
+ * current run still busy. <quiescent> holds the last generation each
+ * lane finished; memory retired at a generation every lane has passed
+ * can no longer be in use by a lane. <delivered> counts the members
+ * each lane queued a message for, written by that lane only. <pools>
+ * holds each pinned lane's output storage on the lane's NUMA node, NULL
+ * when the lanes are not pinned.
+ */
+struct cpt_fanout
+{
+    int lanes;
+    size_t threshold;
+    pthread_t threads[CPT_FANOUT_MAX_LANES];
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    uint64_t generation;
+    _Atomic uint64_t quiescent[CPT_FANOUT_MAX_LANES];
+    _Atomic uint64_t delivered[CPT_FANOUT_MAX_LANES];
+    struct cpt_pool *pools[CPT_FANOUT_MAX_LANES];
+    int pending;
+    int stopping;
+    cpt_fanout_fn fn;
+    void *arg;
+};
+
+/**
+ * Start the worker threads.
+ *
+ * With a CPU list, lane <n> is pinned to cpus[n % cpu_count]; lane 0 is
+ * the caller, which pins itself. Each pinned lane then creates its pool
+ * on the node it runs on; this returns once all of them have.
+ *
+ * @param lanes     Number of lanes, 2 .. CPT_FANOUT_MAX_LANES.
+ * @param threshold Member count from which a channel is fanned out in parallel.
+ * @param cpus      CPUs to pin the lanes to, may be NULL.
+ * @param cpu_count Number of CPUs in <cpus>, 0 leaves the threads unpinned.
+ * @return The fan-out, NULL on failure.
+ */
+struct cpt_fanout *cpt_fanout_create(int lanes, size_t threshold, const int *cpus, int cpu_count);
+
+/**
+ * Stop and join the worker threads and destroy the pools.
+ *
+ * No buffer may still hold storage from a pool.
+ *
+ * @param fanout    The fan-out, may be NULL.
+ */
+void cpt_fanout_destroy(struct cpt_fanout *fanout);
+
+/**
+ * Lane a user's output belongs to.
+ *
+ * @param fanout    The fan-out.
+ * @param user_id   User id.
+ * @return Lane index.
+ */
+int cpt_fanout_lane(const struct cpt_fanout *fanout, int user_id);
+
+/**
+ * Run <fn> once for every lane and wait until all of them are done.
+ *
+ * @param fanout    The fan-out.
+ * @param fn        Work for one lane.
+ * @param arg       Passed to <fn>.
+ */
+void cpt_fanout_run(struct cpt_fanout *fanout, cpt_fanout_fn fn, void *arg);
+
+/**
+ * The newest generation every lane has finished.
+ *
+ * @param fanout    The fan-out.
+ * @return Generation number, 0 before the first run.
+ */
+uint64_t cpt_fanout_quiescent(struct cpt_fanout *fanout);
+
+#endif //CHAT_ASSIGNMNET_CPT_FANOUT_H
@@ -0,0 +1,60 @@
+//
+// Created by saga910 on 2022-03-26.
+//
+
+#ifndef CHAT_ASSIGNMNET_CPT_HANDOFF_H
+#define CHAT_ASSIGNMNET_CPT_HANDOFF_H
+
+#include "cpt_server.h"
+
+#define CPT_HANDOFF_MAGIC 0x43505448U
+#define CPT_HANDOFF_VERSION 2
+#define CPT_HANDOFF_MAX_LISTENERS 8
+// descriptors travel in batches well below the kernel's per message limit
+#define CPT_HANDOFF_FD_BATCH 64
+
+/**
+ * Hand the listening sockets, every client and the registry to a new process.
+ *
+ * The stream is a descriptor count, the descriptors in batches of
+ * SCM_RIGHTS messages (listeners, then each client's socket, then the
+ * ring descriptor of each client on shared memory) and a snapshot:
+ * user ids, names, negotiated versions, buffered input, unsent output,
+ * ring state, channel membership and sequence numbers. Clients marked
+ * as closing are left out. Channel dictionaries are not carried over;
+ * version 3 members receive a new one when the channel retrains.
+ * Neither is channel history, a RESUME right after an upgrade finds
+ * nothing to replay.
+ *
+ * The caller keeps its descriptors open until the new process has
+ * confirmed, so a failed upgrade can carry on serving.
+ *
+ * @param sock          Blocking AF_UNIX socket to the new process.
+ * @param info          The server registry.
+ * @param listeners     Listening sockets, -1 for a disabled one.
+ * @param listener_count Number of <listeners>, at most CPT_HANDOFF_MAX_LISTENERS.
+ * @param clients       Connected clients.
+ * @param client_count  Number of <clients>.
+ * @return 0 once everything was sent, -1 on error.
+ */
+int cpt_handoff_send(int sock, struct serverInfo *info, const int *listeners, size_t listener_count, user **clients,
+                     size_t client_count);
+
+/**
+ * Rebuild the registry handed over by cpt_handoff_send().
+ *
+ * <info> must be freshly created. Restored clients are not resumed,
+ * call cpt_server_resume() for each of them once they are polled.
+ *
+ * @param sock          AF_UNIX socket to the previous process.
+ * @param info          Empty server registry.
+ * @param listeners     Set to the listening sockets, -1 for a disabled one.
+ * @param listener_count Number of <listeners>, as passed to cpt_handoff_send().
+ * @param clients       Set to an array of the restored clients, to be freed by the caller.
+ * @param client_count  Set to the number of restored clients.
+ * @return 0 on success, -1 if the handoff was incomplete or malformed.
+ */
+int cpt_handoff_receive(int sock, struct serverInfo *info, int *listeners, size_t listener_count, user ***clients,
+                        size_t *client_count);
+
+#endif //CHAT_ASSIGNMNET_CPT_HANDOFF_H
@@ -0,0 +1,73 @@
+//
+// Created by saga910 on 2022-03-26.
+//
+
+#ifndef CHAT_ASSIGNMNET_CPT_HISTORY_H
+#define CHAT_ASSIGNMNET_CPT_HISTORY_H
+
+#include "cpt_ring.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// bytes of recent messages each channel keeps for RESUME by default
+#define CPT_HISTORY_MEMORY (64 * 1024)
+
+/**
+ * A channel's most recent messages, oldest first.
+ *
+ * Each record is the sequence number, sender id and length in host
+ * order, followed by the message. The records live in <ring>, which is
+ * only allocated with the first message; when a new one does not fit
+ * the oldest are dropped until it does.
+ */
+struct cpt_history
+{
+    struct cpt_ring ring;
+};
+
+/**
+ * Called for every message replayed, oldest first.
+ *
+ * @param arg       Argument given to cpt_history_replay().
+ * @param seq       Sequence number.
+ * @param user_id   Sender.
+ * @param msg       Message.
+ * @param msg_len   Message length.
+ */
+typedef void (*cpt_history_fn)(void *arg, uint32_t seq, uint16_t user_id, uint8_t *msg, uint16_t msg_len);
+
+/**
+ * Keep a message, dropping the oldest ones to make room.
+ *
+ * @param history   The history.
+ * @param capacity  Bytes to allocate on first use, a power of two.
+ * @param seq       Sequence number, larger than any kept before.
+ * @param user_id   Sender.
+ * @param msg       Message.
+ * @param msg_len   Message length.
+ * @return 0 on success, -1 if it could not be kept; the history is then empty.
+ */
+int cpt_history_push(struct cpt_history *history, size_t capacity, uint32_t seq, uint16_t user_id,
+                     const uint8_t *msg, uint16_t msg_len);
+
+/**
+ * Hand every kept message after <after> to <fn>.
+ *
+ * @param history   The history.
+ * @param after     Last sequence number the caller already has.
+ * @param scratch   UINT16_MAX bytes for a message that wraps around the ring.
+ * @param fn        Called once per message.
+ * @param arg       Passed to <fn>.
+ * @return Number of messages replayed.
+ */
+uint32_t cpt_history_replay(struct cpt_history *history, uint32_t after, uint8_t *scratch, cpt_history_fn fn,
+                            void *arg);
+
+/**
+ * Free the kept messages.
+ *
+ * @param history   The history.
+ */
+void cpt_history_destroy(struct cpt_history *history);
+
+#endif //CHAT_ASSIGNMNET_CPT_HISTORY_H
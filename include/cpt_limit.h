@@ -0,0 +1,60 @@
+//
+// Created by saga910 on 2022-03-26.
+//
+
+#ifndef CHAT_ASSIGNMNET_CPT_LIMIT_H
+#define CHAT_ASSIGNMNET_CPT_LIMIT_H
+
+#include <stdint.h>
+
+/**
+ * A token bucket's rate: <interval> microseconds per token and room
+ * for <burst> tokens. An <interval> of 0 means unlimited.
+ */
+struct cpt_rate
+{
+    uint64_t interval;
+    uint64_t burst;
+};
+
+/**
+ * A token bucket, kept as the time at which it is full again.
+ *
+ * Spending a token pushes <refilled_at> one interval further; the
+ * bucket is empty once that lies a whole burst ahead of now. A zeroed
+ * bucket is full, so users and channels need no setup.
+ */
+struct cpt_bucket
+{
+    uint64_t refilled_at;
+};
+
+/**
+ * Set a rate.
+ *
+ * @param rate      The rate.
+ * @param per_second Tokens added per second, 0 for unlimited.
+ * @param burst     Tokens the bucket holds, 0 for <per_second>.
+ */
+void cpt_rate_init(struct cpt_rate *rate, uint32_t per_second, uint32_t burst);
+
+/**
+ * Whether a bucket has a token left.
+ *
+ * @param rate      The bucket's rate.
+ * @param bucket    The bucket.
+ * @param now       Monotonic time in microseconds.
+ * @return Non-zero if a token can be spent.
+ */
+int cpt_bucket_ready(const struct cpt_rate *rate, const struct cpt_bucket *bucket, uint64_t now);
+
+/**
+ * Spend a token, after cpt_bucket_ready() said there is one.
+ *
+ * @param rate      The bucket's rate.
+ * @param bucket    The bucket.
+ * @param now       Monotonic time in microseconds.
+ */
+void cpt_bucket_spend(const struct cpt_rate *rate, struct cpt_bucket *bucket, uint64_t now);
+
+#endif //CHAT_ASSIGNMNET_CPT_LIMIT_H
@@ -0,0 +1,177 @@
+//
+// Created by saga910 on 2022-03-26.
+//
+
+#ifndef CHAT_ASSIGNMNET_CPT_MESH_H
+#define CHAT_ASSIGNMNET_CPT_MESH_H
+
+#include "cpt_server.h"
+#include <poll.h>
+
+#define CPT_MESH_MAGIC 0x4350544DU
+#define CPT_MESH_MAX_NODES 16
+// points per node on the hash ring, enough to keep the channel split within a few percent
+#define CPT_MESH_VNODES 64
+#define CPT_MESH_RETRY_MS 1000
+#define CPT_MESH_INPUT_CAPACITY (256 * 1024)
+// a gossip record carries at most this many channel counts
+#define CPT_MESH_MEMBERS_BATCH 1024
+
+/**
+ * Records exchanged inside envelopes on a link between two nodes.
+ *
+ * MESH_MEMBERS: varint count, then count pairs of varint channel id and
+ * varint number of members the sending node has in that channel.
+ * MESH_FORWARD: varint channel id, varint sender user id, varint
+ * length and the message, to be delivered to the receiving node's
+ * members of the channel.
+ */
+enum cpt_mesh_record
+{
+    MESH_MEMBERS = 1,
+    MESH_FORWARD = 2
+};
+
+/**
+ * The link to one other node.
+ *
+ * Nodes dial every node with a lower index and accept the others; the
+ * dialing side opens with a fixed size hello. <members> holds the
+ * counts the peer last gossiped, indexed by channel id, and is cleared
+ * when the link drops.
+ */
+struct cpt_peer
+{
+    int fd;
+    const char *path;
+    struct cpt_ring in;
+    struct cpt_buffer out;
+    struct cpt_envelope envelope;
+    uint16_t *members;
+    uint64_t retry_at;
+};
+
+/**
+ * A node's view of the mesh.
+ *
+ * Channels are owned by consistent hashing over <points>, sorted by
+ * hash with the owning node of each in <owners>. A node only creates
+ * channels it owns, which keeps channel ids unique across the mesh,
+ * and hands out user ids from its own slice of the id space so a
+ * forwarded sender id is unambiguous. <dirty> lists the channels
+ * whose local member count changed since the last gossip.
+ */
+struct cpt_mesh
+{
+    struct serverInfo *info;
+    int node;
+    int count;
+    int listen_fd;
+    struct cpt_peer peers[CPT_MESH_MAX_NODES];
+    uint32_t points[CPT_MESH_MAX_NODES * CPT_MESH_VNODES];
+    uint8_t owners[CPT_MESH_MAX_NODES * CPT_MESH_VNODES];
+    uint16_t *dirty;
+    size_t dirty_count;
+    uint8_t *dirty_flags;
+    uint8_t *scratch;
+};
+
+/**
+ * Join a mesh: listen on this node's link socket and attach to <info>.
+ *
+ * Links to the other nodes are dialed by cpt_mesh_poll_set().
+ *
+ * @param info      The server registry, gets its user id slice.
+ * @param node      Index of this node in <paths>.
+ * @param paths     Link socket path of every node, the same list on all of them.
+ * @param count     Number of nodes, at most CPT_MESH_MAX_NODES.
+ * @return The mesh, NULL on failure.
+ */
+struct cpt_mesh *cpt_mesh_create(struct serverInfo *info, int node, const char **paths, int count);
+
+/**
+ * Close every link and detach from the registry. The link socket file
+ * is left in place.
+ *
+ * @param mesh      The mesh, may be NULL.
+ */
+void cpt_mesh_destroy(struct cpt_mesh *mesh);
+
+/**
+ * Node that owns a channel.
+ *
+ * @param mesh      The mesh.
+ * @param channel_id Channel id.
+ * @return Index of the owning node.
+ */
+int cpt_mesh_owner(const struct cpt_mesh *mesh, uint16_t channel_id);
+
+/**
+ * Whether a node may create a channel with this id: it owns it and no
+ * other node still has members in it.
+ *
+ * @param mesh      The mesh.
+ * @param channel_id Channel id.
+ * @return Non-zero if the id is free.
+ */
+int cpt_mesh_can_create(const struct cpt_mesh *mesh, uint16_t channel_id);
+
+/**
+ * Whether any other node reported members in a channel.
+ *
+ * @param mesh      The mesh.
+ * @param channel_id Channel id.
+ * @return Non-zero if the channel exists elsewhere.
+ */
+int cpt_mesh_has_remote(const struct cpt_mesh *mesh, uint16_t channel_id);
+
+/**
+ * Remember that the local member count of a channel changed, it is
+ * gossiped by the next cpt_mesh_flush().
+ *
+ * @param mesh      The mesh.
+ * @param channel_id Channel id.
+ */
+void cpt_mesh_note_members(struct cpt_mesh *mesh, uint16_t channel_id);
+
+/**
+ * Queue a message for every other node with members in the channel.
+ *
+ * Each such node gets one MESH_FORWARD record however many members it
+ * has, batched into the envelope of the current poll round.
+ *
+ * @param mesh      The mesh.
+ * @param channel_id Channel id.
+ * @param user_id   Sender.
+ * @param msg       Message.
+ * @param msg_len   Message length.
+ * @return Number of nodes the message was queued for.
+ */
+int cpt_mesh_forward(struct cpt_mesh *mesh, uint16_t channel_id, uint16_t user_id, const uint8_t *msg,
+                     uint16_t msg_len);
+
+/**
+ * Fill the poll entries of the mesh, dialing links that are down.
+ *
+ * @param mesh      The mesh.
+ * @param fds       CPT_MESH_MAX_NODES + 1 entries: the listener, then one per node.
+ * @return Poll timeout in milliseconds, -1 if no link is waiting to be dialed.
+ */
+int cpt_mesh_poll_set(struct cpt_mesh *mesh, struct pollfd *fds);
+
+/**
+ * Accept links, read from peers and deliver forwarded messages.
+ *
+ * @param mesh      The mesh.
+ * @param fds       The entries filled by cpt_mesh_poll_set(), after poll().
+ */
+void cpt_mesh_handle(struct cpt_mesh *mesh, const struct pollfd *fds);
+
+/**
+ * Gossip changed member counts and write queued records to every link.
+ *
+ * @param mesh      The mesh.
+ */
+void cpt_mesh_flush(struct cpt_mesh *mesh);
+
+#endif //CHAT_ASSIGNMNET_CPT_MESH_H
@@ -0,0 +1,93 @@
+//
+// Created by saga910 on 2022-03-26.
+//
+
+#ifndef CHAT_ASSIGNMNET_CPT_OFFLINE_H
+#define CHAT_ASSIGNMNET_CPT_OFFLINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// seconds a dropped user's place in their channels is kept by default
+#define CPT_OFFLINE_TTL 30
+#define CPT_OFFLINE_MEMORY (64 * 1024)
+#define CPT_OFFLINE_SEGMENT (4 * 1024 * 1024)
+#define CPT_OFFLINE_DIR "/tmp"
+
+/**
+ * Messages queued for a user whose connection dropped.
+ *
+ * Each record is the channel id, sender id, length and the message's
+ * sequence number in its channel in host order, followed by the
+ * message. The first CPT_OFFLINE_MEMORY bytes are kept in <memory>;
+ * after that records go to <segment>, a mapping of an unlinked file of
+ * CPT_OFFLINE_SEGMENT bytes in <dir>, so the kernel can write them out
+ * instead of holding them in RAM. Messages that fit in neither are
+ * counted in <dropped>.
+ */
+struct cpt_offline
+{
+    const char *dir;
+    uint8_t *memory;
+    size_t length;
+    size_t capacity;
+    int fd;
+    uint8_t *segment;
+    size_t spilled;
+    size_t dropped;
+    uint64_t expires_at;
+};
+
+/**
+ * Called for every queued message, in the order they were queued.
+ *
+ * @param arg       Argument given to cpt_offline_replay().
+ * @param channel_id Channel the message was sent to.
+ * @param user_id   Sender.
+ * @param seq       Sequence number in the channel.
+ * @param msg       Message.
+ * @param msg_len   Message length.
+ */
+typedef void (*cpt_offline_fn)(void *arg, uint16_t channel_id, uint16_t user_id, uint32_t seq, uint8_t *msg,
+                               uint16_t msg_len);
+
+/**
+ * Initialize an empty queue.
+ *
+ * @param queue     The queue.
+ * @param dir       Directory for the spill file, must outlive the queue.
+ * @param expires_at When the queue is given up, in the registry's clock.
+ */
+void cpt_offline_init(struct cpt_offline *queue, const char *dir, uint64_t expires_at);
+
+/**
+ * Queue a message.
+ *
+ * @param queue     The queue.
+ * @param channel_id Channel the message was sent to.
+ * @param user_id   Sender.
+ * @param seq       Sequence number in the channel.
+ * @param msg       Message.
+ * @param msg_len   Message length.
+ * @return 0 on success, -1 if the message was dropped.
+ */
+int cpt_offline_push(struct cpt_offline *queue, uint16_t channel_id, uint16_t user_id, uint32_t seq,
+                     const uint8_t *msg, uint16_t msg_len);
+
+/**
+ * Hand every queued message to <fn>.
+ *
+ * @param queue     The queue.
+ * @param fn        Called once per message.
+ * @param arg       Passed to <fn>.
+ */
+void cpt_offline_replay(struct cpt_offline *queue, cpt_offline_fn fn, void *arg);
+
+/**
+ * Free the memory and the spill file.
+ *
+ * @param queue     The queue.
+ */
+void cpt_offline_destroy(struct cpt_offline *queue);
+
+#endif //CHAT_ASSIGNMNET_CPT_OFFLINE_H
@@ -0,0 +1,66 @@
+//
+// Created by saga910 on 2022-03-26.
+//
+
+#ifndef CHAT_ASSIGNMNET_CPT_POOL_H
+#define CHAT_ASSIGNMNET_CPT_POOL_H
+
+#include "cpt_arena.h"
+#include "cpt_buffer.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// smallest block, the size an output buffer starts at
+#define CPT_POOL_MIN_BLOCK 1024
+// blocks of 1 KB .. 64 KB come from arenas, larger ones are mapped one at a time
+#define CPT_POOL_CLASSES 7
+
+/**
+ * Buffer storage on one NUMA node.
+ *
+ * Blocks are powers of two. Up to 64 KB each size has an arena bound to
+ * <node>; a larger block is a mapping of its own, bound before it is
+ * touched and unmapped when it is freed. <buffers> hands the pool to
+ * cpt_buffer_move(). A pool is not locked: one thread uses it at a time.
+ */
+struct cpt_pool
+{
+    int node;
+    struct cpt_arena *classes[CPT_POOL_CLASSES];
+    struct cpt_buffer_pool buffers;
+};
+
+/**
+ * Create a pool. Nothing is mapped until the first block is taken.
+ *
+ * @param node      NUMA node, -1 to place pages where they are first touched.
+ * @return The pool, NULL if allocation failed.
+ */
+struct cpt_pool *cpt_pool_create(int node);
+
+/**
+ * Take a block.
+ *
+ * @param pool      The pool.
+ * @param size      Bytes needed.
+ * @return The block, NULL if nothing could be mapped.
+ */
+uint8_t *cpt_pool_alloc(struct cpt_pool *pool, size_t size);
+
+/**
+ * Give a block back.
+ *
+ * @param pool      The pool it came from.
+ * @param block     The block.
+ * @param size      The size it was taken with.
+ */
+void cpt_pool_free(struct cpt_pool *pool, uint8_t *block, size_t size);
+
+/**
+ * Unmap the arenas. Every block must have been given back first.
+ *
+ * @param pool      The pool, may be NULL.
+ */
+void cpt_pool_destroy(struct cpt_pool *pool);
+
+#endif //CHAT_ASSIGNMNET_CPT_POOL_H
@@ -0,0 +1,88 @@
+//
+// Created by saga910 on 2022-03-26.
+//
+
+#ifndef CHAT_ASSIGNMNET_CPT_PRESENCE_H
+#define CHAT_ASSIGNMNET_CPT_PRESENCE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CPT_PRESENCE_WINDOW_MS 100
+// membership changes a channel buffers per window before its members are told to refetch instead
+#define CPT_PRESENCE_MAX 1024
+
+/**
+ * One membership change, <seq> orders the changes of a window.
+ */
+struct cpt_presence_delta
+{
+    uint32_t seq;
+    uint16_t user_id;
+    uint8_t joined;
+};
+
+/**
+ * Membership changes of one channel during the current window.
+ *
+ * Changes are only appended while the window is open and coalesced
+ * once when it closes, so recording one is O(1) however busy the
+ * channel is. <overflowed> is set once more than CPT_PRESENCE_MAX
+ * changes came in; the rest of the window is not recorded.
+ */
+struct cpt_presence
+{
+    struct cpt_presence_delta *deltas;
+    size_t count;
+    size_t capacity;
+    uint32_t seq;
+    int overflowed;
+};
+
+/**
+ * Record that a user joined or left.
+ *
+ * @param presence  The channel's changes.
+ * @param user_id   User.
+ * @param joined    Non-zero for a join, zero for a leave.
+ * @return 0 on success, -1 if the window overflowed.
+ */
+int cpt_presence_record(struct cpt_presence *presence, uint16_t user_id, int joined);
+
+/**
+ * Reduce the window's changes to one net change per user, joins first.
+ *
+ * A user who joined and left again (or the other way round) within
+ * the window cancels out.
+ *
+ * @param presence  The channel's changes.
+ * @return Number of joins, they are followed by the leaves in <deltas>.
+ */
+size_t cpt_presence_settle(struct cpt_presence *presence);
+
+/**
+ * Encode the user ids of settled changes as a presence MSG: a varint
+ * count, then the varint ids.
+ *
+ * @param deltas    First change.
+ * @param count     Number of changes.
+ * @param buf       Destination, at least 1 + count * CPT_VARINT_MAX bytes.
+ * @return Bytes written.
+ */
+size_t cpt_presence_encode(const struct cpt_presence_delta *deltas, size_t count, uint8_t *buf);
+
+/**
+ * Start a new window, keeping the storage.
+ *
+ * @param presence  The channel's changes.
+ */
+void cpt_presence_reset(struct cpt_presence *presence);
+
+/**
+ * Free the storage.
+ *
+ * @param presence  The channel's changes.
+ */
+void cpt_presence_destroy(struct cpt_presence *presence);
+
+#endif //CHAT_ASSIGNMNET_CPT_PRESENCE_H
@@ -0,0 +1,30 @@
+//
+// Created by saga910 on 2022-03-26.
+//
+
+#ifndef CHAT_ASSIGNMNET_CPT_PROBE_H
+#define CHAT_ASSIGNMNET_CPT_PROBE_H
+
+/**
+ * Static tracepoints of the "cpt" USDT provider.
+ *
+ * With CPT_USDT, which the build sets when <sys/sdt.h> is found, each
+ * probe is a single nop plus a .note.stapsdt entry that bpftrace, perf
+ * and systemtap attach to at run time; while nothing is attached the
+ * only cost is moving the arguments into registers. Without it probes
+ * compile to nothing and their arguments are not evaluated, so they
+ * must not have side effects.
+ */
+#ifdef CPT_USDT
+#include <sys/sdt.h>
+
+#define CPT_PROBE3(name, a, b, c) DTRACE_PROBE3(cpt, name, a, b, c)
+#define CPT_PROBE4(name, a, b, c, d) DTRACE_PROBE4(cpt, name, a, b, c, d)
+#define CPT_PROBE5(name, a, b, c, d, e) DTRACE_PROBE5(cpt, name, a, b, c, d, e)
+#else
+#define CPT_PROBE3(name, a, b, c) do { } while (0)
+#define CPT_PROBE4(name, a, b, c, d) do { } while (0)
+#define CPT_PROBE5(name, a, b, c, d, e) do { } while (0)
+#endif
+
+#endif //CHAT_ASSIGNMNET_CPT_PROBE_H
@@ -0,0 +1,115 @@
+//
+// Created by saga910 on 2022-03-26.
+//
+
+#ifndef CHAT_ASSIGNMNET_CPT_RING_H
+#define CHAT_ASSIGNMNET_CPT_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/**
+ * Byte ring buffer over caller supplied storage.
+ *
+ * <head> and <tail> only ever grow and are masked on access,
+ * so <capacity> must be a power of two.
+ */
+struct cpt_ring
+{
+    uint8_t *data;
+    size_t capacity;
+    size_t head;
+    size_t tail;
+};
+
+/**
+ * Initialize a ring over <storage>.
+ *
+ * @param ring      The ring.
+ * @param storage   Backing memory of <capacity> bytes.
+ * @param capacity  Size of <storage>, a power of two.
+ */
+void cpt_ring_init(struct cpt_ring * ring, uint8_t * storage, size_t capacity);
+
+/**
+ * Number of readable bytes in the ring.
+ *
+ * @param ring      The ring.
+ * @return Bytes between head and tail.
+ */
+size_t cpt_ring_length(const struct cpt_ring * ring);
+
+/**
+ * Number of bytes that can still be written.
+ *
+ * @param ring      The ring.
+ * @return Free space.
+ */
+size_t cpt_ring_space(const struct cpt_ring * ring);
+
+/**
+ * Describe the free space as at most two iovecs, suitable for readv().
+ *
+ * @param ring      The ring.
+ * @param iov       Two iovecs to fill.
+ * @return Number of iovecs used (0 when the ring is full).
+ */
+int cpt_ring_free_iov(struct cpt_ring * ring, struct iovec iov[2]);
+
+/**
+ * Describe the readable bytes as at most two iovecs, suitable for writev().
+ *
+ * @param ring      The ring.
+ * @param iov       Two iovecs to fill.
+ * @return Number of iovecs used (0 when the ring is empty).
+ */
+int cpt_ring_data_iov(struct cpt_ring * ring, struct iovec iov[2]);
+
+/**
+ * Mark <size> bytes written into the free space as readable.
+ *
+ * @param ring      The ring.
+ * @param size      Bytes written.
+ */
+void cpt_ring_produce(struct cpt_ring * ring, size_t size);
+
+/**
+ * Copy bytes into the ring.
+ *
+ * @param ring      The ring.
+ * @param src       Bytes to copy.
+ * @param size      Number of bytes.
+ * @return Number of bytes copied, less than <size> if the ring filled up.
+ */
+size_t cpt_ring_write(struct cpt_ring * ring, const uint8_t * src, size_t size);
+
+/**
+ * Copy readable bytes out without consuming them.
+ *
+ * @param ring      The ring.
+ * @param offset    Offset from the head.
+ * @param dst       Destination.
+ * @param size      Number of bytes, offset + size must not exceed the ring length.
+ */
+void cpt_ring_peek(const struct cpt_ring * ring, size_t offset, uint8_t * dst, size_t size);
+
+/**
+ * Pointer to readable bytes if they do not wrap around the end of the storage.
+ *
+ * @param ring      The ring.
+ * @param offset    Offset from the head.
+ * @param size      Number of bytes.
+ * @return Pointer into the ring, NULL if the range wraps.
+ */
+uint8_t * cpt_ring_contiguous(struct cpt_ring * ring, size_t offset, size_t size);
+
+/**
+ * Drop <size> bytes from the head of the ring.
+ *
+ * @param ring      The ring.
+ * @param size      Number of bytes consumed.
+ */
+void cpt_ring_consume(struct cpt_ring * ring, size_t size);
+
+#endif //CHAT_ASSIGNMNET_CPT_RING_H
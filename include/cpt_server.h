@@ -6,83 +6,592 @@
 #define CHAT_ASSIGNMNET_CPT_SERVER_H
 
 #include "common.h"
+#include "cpt_buffer.h"
+#include "cpt_compress.h"
+#include "cpt_envelope.h"
+#include "cpt_history.h"
+#include "cpt_limit.h"
+#include "cpt_offline.h"
+#include "cpt_presence.h"
+#include "cpt_ring.h"
+#include "cpt_shm.h"
+#include "cpt_stats.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <sys/types.h>
 
-typedef struct userList{
-    int userCount;
-    struct userList *next;
-}userList;
+#define CPT_SERVER_VERSION 1
+#define GLOBAL_CHANNEL 0
+#define CPT_MAX_CHANNELS (UINT16_MAX + 1)
+#define CPT_NAME_MAX 32
+#define CPT_INPUT_CAPACITY (128 * 1024)
+#define CPT_OUTPUT_LIMIT (8 * 1024 * 1024)
+// a client with less output than about one TCP segment may wait for more
+#define CPT_COALESCE_BYTES 1400
+// urgent turns a client's flush takes before one bulk envelope is let through
+#define CPT_URGENT_WEIGHT 4
+// memory the server may use before it sheds load, 0 for no limit
+#define CPT_MEMORY_BUDGET 0
+// one slot per command, slot 0 counts unknown commands
+#define CPT_COMMAND_COUNT (RESUME + 1)
+// CODE, CHANNEL_ID, USER_ID 0, MSG_LEN and a varint sequence number
+#define CPT_SEQUENCE_RECORD_MAX (1 + 3 + 1 + 1 + CPT_VARINT_MAX)
 
+struct cpt_admin_stats;
+struct cpt_arena;
+struct cpt_capture;
+struct cpt_fanout;
+struct cpt_mesh;
+struct cpt_snapshot;
+
+/**
+ * A connected client.
+ *
+ * <user_id> stays 0 until the client has logged in. <version> becomes
+ * CPT_VERSION_BATCHED once a version 2 LOGIN succeeds; from then on both
+ * directions are envelopes and <envelope> tracks the one being filled.
+ * A version 3 LOGIN gives CPT_VERSION_COMPRESSED, which is the same
+ * framing plus compressed MESSAGE records, and a version 4 LOGIN
+ * CPT_VERSION_SEQUENCED, which adds a MESSAGE_SEQUENCE record in front
+ * of every MESSAGE.
+ *
+ * <local> clients came in over the AF_UNIX listener and may ask for
+ * shared-memory rings. Once <shm> is set, the first <socket_left> bytes
+ * of <out> still go to the socket (while <pass_pending>, the rings'
+ * descriptor rides along after <pass_at> of them) and everything else
+ * moves through the rings as soon as the client's first doorbell sets
+ * <shm_active>. The server keeps the descriptor so a live upgrade can
+ * hand the rings on. <sends> limits how fast the client may SEND.
+ * <held_since> is when the client's output was first held back to
+ * coalesce with more, 0 while it is not, and <flushed_at> when it was
+ * last flushed.
+ *
+ * A client whose connection dropped is parked: it keeps its id and its
+ * channels, <offline> queues what is sent to them until the same name
+ * logs in again, and <offline_next> links the parked users.
+ *
+ * Replies and errors for a batched client on a socket go to <urgent>,
+ * with its own <urgent_envelope>, instead of behind the MESSAGEs in
+ * <out>. The two only take turns between envelopes: <unit_left> is
+ * what is still unsent of one cut short by a full socket, from <urgent>
+ * if <unit_urgent>. <urgent_run> counts the urgent turns taken while
+ * <out> waited. The first <legacy> bytes of <out> are version 1 frames
+ * queued before the client upgraded, which nothing may overtake.
+ *
+ * <charged> is what the client's buffers, input ring, offline queue and
+ * rings currently count against the server's memory budget. <sent> and
+ * <sent_bytes> count the messages the client got delivered by SEND.
+ */
 typedef struct user{
     int user_id;
     int user_fd;
+    int version;
+    char name[CPT_NAME_MAX + 1];
+    struct cpt_ring in;
+    struct cpt_buffer out;
+    struct cpt_envelope envelope;
+    struct cpt_buffer urgent;
+    struct cpt_envelope urgent_envelope;
+    size_t unit_left;
+    int unit_urgent;
+    int urgent_run;
+    size_t legacy;
+    uint16_t *channels;
+    int channel_count;
+    int channel_capacity;
+    int closing;
+    int dirty;
+    uint64_t held_since;
+    uint64_t flushed_at;
+    int local;
+    struct cpt_shm *shm;
+    int shm_active;
+    int pass_pending;
+    size_t pass_at;
+    size_t socket_left;
+    struct cpt_bucket sends;
+    struct cpt_offline *offline;
+    struct user *offline_next;
+    struct cpt_arena *arena;
+    uint32_t capture_id;
+    size_t charged;
+    uint64_t sent;
+    uint64_t sent_bytes;
     struct user *next;
 }user;
 
+/**
+ * Members of a channel.
+ */
+typedef struct userList{
+    int userCount;
+    int capacity;
+    user **members;
+}userList;
+
+/**
+ * A channel. <dict> is trained on the large messages sent to it and is
+ * NULL until the first one. Once a channel reaches the fan-out
+ * threshold, <snapshot> also publishes its members grouped by fan-out
+ * lane, replaced by a new version on every membership change; it is
+ * NULL for smaller channels. <sends>
+ * limits how fast its members together may SEND to it. <presence>
+ * collects joins and leaves until the presence window closes. <seq> is
+ * the sequence number of the last MESSAGE, starting from 1, and
+ * <history> keeps the most recent ones for RESUME. <charged> is what
+ * its member list, snapshot, dictionary and history count against the
+ * memory budget.
+ */
 typedef struct channel{
     uint16_t channel_id;
     struct userList *users;
+    _Atomic(struct cpt_snapshot *) snapshot;
+    struct cpt_bucket sends;
+    struct cpt_presence presence;
+    struct cpt_dictionary *dict;
+    uint32_t seq;
+    struct cpt_history history;
+    size_t charged;
     struct channel *next;
 }channel;
 
+/**
+ * Everything the server knows about its users and channels.
+ *
+ * <channels> is indexed by channel id and <users> by user id;
+ * <dirty> links the users that have output waiting to be flushed.
+ * <codec>, <packed> and <packed_record> hold a broadcast's compressed
+ * form while it is fanned out. User ids are handed out between
+ * <first_user_id> and <last_user_id>, the whole range unless the
+ * server is one node of a <mesh>. Broadcasts to large channels are
+ * delivered in parallel by <fanout> when it is set, member snapshots
+ * it may still be reading wait in <retired>. SENDs are limited
+ * by <user_rate> per user and <channel_rate> per channel, measured
+ * against <now>, the monotonic time of the current poll round.
+ * <presence_ids> lists the channels with membership changes waiting
+ * for the presence window, <presence_window> microseconds long (0
+ * turns presence events off), to close at <presence_due>. Users whose
+ * connection dropped stay parked from <offline> (oldest) to
+ * <offline_tail> for <offline_ttl> microseconds (0 turns parking off),
+ * spilling to files in <offline_dir>. <latency> times the requests of
+ * every command and <unknown_frame> and <unknown_record> are the
+ * UNKNOWN_CMD reply, serialized once. Small output is held for up to
+ * <coalesce_cap> microseconds (0 sends it every round), the first held
+ * client is due at <coalesce_due>. Every frame received is also
+ * recorded to <capture> when it is set. Each channel keeps up to
+ * <history_capacity> bytes of recent messages (0 keeps none), and
+ * <sequence_record> holds a broadcast's MESSAGE_SEQUENCE record.
+ * Flushes let <urgent_weight> urgent turns pass before a bulk one (0
+ * queues everything as bulk). <memory_used> is the sum of what every
+ * user and channel is charged, <memory_peak> the most it reached; past
+ * <memory_budget> bytes (0 for no limit) the server sheds load and
+ * counts the cached bytes it dropped in <shed_bytes> and the clients it
+ * disconnected in <shed_clients>. With an admin socket, users, channels
+ * and the memory figures are also published to <published>.
+ */
 struct serverInfo{
     channel global;
+    channel **channels;
+    user **users;
+    int user_count;
+    int first_user_id;
+    int last_user_id;
+    int next_user_id;
+    user *dirty;
+    uint8_t *frame;
+    uint8_t *record;
+    uint8_t *request;
+    char *text;
+    struct cpt_compressor codec;
+    uint8_t *packed;
+    uint8_t *packed_record;
+    struct cpt_mesh *mesh;
+    struct cpt_fanout *fanout;
+    struct cpt_snapshot *retired;
+    struct cpt_rate user_rate;
+    struct cpt_rate channel_rate;
+    uint64_t now;
+    uint64_t presence_window;
+    uint64_t presence_due;
+    uint16_t *presence_ids;
+    size_t presence_count;
+    uint8_t *presence_flags;
+    user *offline;
+    user *offline_tail;
+    uint64_t offline_ttl;
+    const char *offline_dir;
+    struct cpt_latency latency[CPT_COMMAND_COUNT];
+    uint8_t unknown_frame[CPT_RESPONSE_HEADER_SIZE];
+    uint8_t unknown_record[CPT_RESPONSE_HEADER_SIZE + 3];
+    size_t unknown_record_size;
+    uint64_t coalesce_cap;
+    uint64_t coalesce_due;
+    struct cpt_arena *arena;
+    struct cpt_capture *capture;
+    size_t history_capacity;
+    uint8_t sequence_record[CPT_SEQUENCE_RECORD_MAX];
+    int urgent_weight;
+    size_t memory_used;
+    size_t memory_peak;
+    size_t memory_budget;
+    uint64_t shed_bytes;
+    uint64_t shed_clients;
+    struct cpt_admin_stats *published;
 };
 
+/**
+ * Read the monotonic clock once for the whole poll round.
+ *
+ * @param info      The server registry.
+ */
+void cpt_server_tick(struct serverInfo *info);
+
+/**
+ * Create the server registry with an empty global channel.
+ *
+ * @return Pointer to a serverInfo, NULL if allocation failed.
+ */
+struct serverInfo *cpt_server_create(void);
+
+/**
+ * Destroy the registry and every channel in it.
+ *
+ * Users are owned by the event loop and are not freed, except for
+ * parked ones. The input arena goes last, after the parked users
+ * have given their slots back.
+ *
+ * @param info      The server registry.
+ */
+void cpt_server_destroy(struct serverInfo *info);
+
 /**
  * Initialize a channelList object
  *
+ * @return A channel with an empty member list.
  */
 channel *createChannelList(void);
 
 /**
+ * Link a channel into a channel list.
  *
- * @param list
- * @param input
+ * @param list      Head of the list.
+ * @param input     Channel to add after the head.
  */
 void add_Channel(channel *list,channel *input);
 
 /**
+ * Create a channel.
  *
- * @param list
- * @param id
- * @return
+ * @param list      Member list, NULL for an empty one.
+ * @param id        Channel id.
+ * @return The new channel, NULL if allocation failed.
  */
 channel * create_channel(userList *list, uint16_t id);
 
 /**
+ * Free a channel and its member list. Members are not freed.
  *
- * @param ch
+ * @param ch        The channel.
  */
 void destroy_channel(channel *ch);
 
 /**
+ * Free a user and its buffers. The socket is not closed.
  *
- * @param client
+ * @param client    The user.
  */
 void destroy_user(user *client);
 
 /**
+ * Create a user for a freshly accepted connection.
  *
- * @param fd
- * @param id
- * @return
+ * @param fd        Connected socket.
+ * @param id        User id, 0 until LOGIN.
+ * @return The new user, NULL if allocation failed.
  */
 user * create_user(int fd, int id);
 
+/**
+ * Create a user whose input ring is a slot of <arena>.
+ *
+ * @param arena     Arena of CPT_INPUT_CAPACITY slots, NULL to use malloc.
+ * @param fd        Connected socket.
+ * @param id        User id, 0 until LOGIN.
+ * @return The new user, NULL if allocation failed.
+ */
+user * create_user_in(struct cpt_arena *arena, int fd, int id);
+
+/**
+ * Read from a client and handle every complete request received.
+ *
+ * Version 2 clients send envelopes; a malformed one marks the client
+ * as closing since the stream cannot be resynchronized.
+ *
+ * @param info      The server registry.
+ * @param client    Readable client.
+ * @return Bytes read, 0 when the peer closed, -1 on error.
+ */
+ssize_t cpt_server_read(struct serverInfo *info, user *client);
+
+/**
+ * Pick up a client restored from a live upgrade.
+ *
+ * Handles the requests that were already buffered and queues a flush
+ * of the output that was.
+ *
+ * @param info      The server registry.
+ * @param client    The restored client.
+ */
+void cpt_server_resume(struct serverInfo *info, user *client);
+
+/**
+ * Write as much of a client's pending output as the socket accepts.
+ *
+ * Urgent output goes first, see struct user. Output for a client on
+ * shared-memory rings is copied into its ring instead, with a doorbell
+ * on the socket if the client may be asleep.
+ *
+ * @param info      The server registry.
+ * @param client    The client.
+ * @return 0 on success (even if output remains), -1 on error.
+ */
+int cpt_server_flush(struct serverInfo *info, user *client);
+
+/**
+ * Move a client's urgent output into <out>, in the order it would have been sent.
+ *
+ * Called before the output is handed to a new process, which treats
+ * it as one block already on its way.
+ *
+ * @param client    The client.
+ * @return 0 on success, -1 if memory ran out.
+ */
+int cpt_server_merge_output(user *client);
+
+/**
+ * Whether the event loop should wait for the client's socket to become writable.
+ *
+ * A client on shared-memory rings rings a doorbell when it frees space,
+ * so pending output alone does not need POLLOUT, and neither does
+ * output that is held back.
+ *
+ * @param client    The client.
+ * @return Non-zero if output is waiting for the socket.
+ */
+int cpt_server_wants_write(const user *client);
+
+/**
+ * Flush every client that had output queued since the last call.
+ *
+ * With a coalescing cap, a socket client that was flushed less than the
+ * cap ago and has less than CPT_COALESCE_BYTES of output is held back,
+ * so the output of later rounds goes out in the same write. It stays
+ * dirty and is flushed once it has enough or has waited for the cap.
+ * Clients whose socket failed are marked as closing.
+ *
+ * @param info      The server registry.
+ */
+void cpt_server_flush_dirty(struct serverInfo *info);
+
+/**
+ * Time until the first held client must be flushed.
+ *
+ * @param info      The server registry.
+ * @return Poll timeout in milliseconds, -1 if no output is held.
+ */
+int cpt_server_coalesce_timeout(const struct serverInfo *info);
+
+/**
+ * Send the presence events of a window that has closed.
+ *
+ * Each channel with changes gets one USER_JOINED_CHANNEL and one
+ * USER_LEFT_CHANNEL response at most (USER_CONNECTED and
+ * USER_DISCONNECTED for the global channel), with USER_ID 0 and a MSG
+ * of a varint count followed by the varint user ids. A user who came
+ * and went within the window is not mentioned. When a channel had more
+ * than CPT_PRESENCE_MAX changes, a single USER_JOINED_CHANNEL (or
+ * USER_CONNECTED) with an empty MSG tells members to GET_USERS again.
+ *
+ * @param info      The server registry.
+ */
+void cpt_server_flush_presence(struct serverInfo *info);
+
+/**
+ * Time until the presence window closes.
+ *
+ * @param info      The server registry.
+ * @return Poll timeout in milliseconds, -1 if no change is waiting.
+ */
+int cpt_server_presence_timeout(const struct serverInfo *info);
+
+/**
+ * Park a logged-in client whose connection dropped.
+ *
+ * The client stays in its channels under its id, and MESSAGEs sent to
+ * them are queued in its cpt_offline instead of its output. A LOGIN with
+ * the same name within the TTL takes its place and gets the queue
+ * replayed; output that was still unsent when the connection dropped is
+ * lost and its storage freed. The registry owns a parked client, the
+ * caller only closes the socket. Nothing is parked while the server is
+ * over its memory budget.
+ *
+ * @param info      The server registry.
+ * @param client    The client.
+ * @return 0 if the client was parked, -1 if it should be disconnected.
+ */
+int cpt_server_park(struct serverInfo *info, user *client);
+
+/**
+ * Disconnect and free the parked clients whose TTL ran out.
+ *
+ * @param info      The server registry.
+ */
+void cpt_server_expire_offline(struct serverInfo *info);
+
+/**
+ * Time until the oldest parked client expires.
+ *
+ * @param info      The server registry.
+ * @return Poll timeout in milliseconds, -1 if no client is parked.
+ */
+int cpt_server_offline_timeout(const struct serverInfo *info);
+
+/**
+ * Bring memory use back under the budget.
+ *
+ * Does nothing while the server is within its budget. Otherwise the
+ * channels' histories go first (RESUME then only counts the missing
+ * messages), then the spare output storage of clients with nothing
+ * queued, and if that is not enough the clients charged the most are
+ * marked as closing until what is left fits. Parked clients are not
+ * disconnected, they are charged no output. While over budget, no
+ * history is kept and no dropped client is parked.
+ *
+ * @param info      The server registry.
+ */
+void cpt_server_shed(struct serverInfo *info);
+
+/**
+ * Remove a client from every channel and release its user id and
+ * its share of the memory budget.
+ *
+ * @param info      The server registry.
+ * @param client    The client.
+ */
+void cpt_server_disconnect(struct serverInfo *info, user *client);
+
+/**
+ * Queue a response for a client.
+ *
+ * MESSAGE, MESSAGE_COMPRESSED, MESSAGE_SEQUENCE and CHANNEL_DICTIONARY
+ * go behind the client's other MESSAGEs, everything else is urgent.
+ *
+ * @param info      The server registry.
+ * @param client    Destination.
+ * @param code      Response code.
+ * @param channel_id Channel the response is about.
+ * @param user_id   User the response is about.
+ * @param msg       Message, may be NULL when <msg_len> is 0.
+ * @param msg_len   Message length.
+ * @return 0 on success, -1 if the client's output limit was hit.
+ */
+int cpt_queue_response(struct serverInfo *info, user *client, uint8_t code, uint16_t channel_id, uint16_t user_id,
+                       uint8_t *msg, uint16_t msg_len);
+
+/**
+ * Serialize a MESSAGE once and queue it for every member of a channel.
+ *
+ * Version 1 members get a copy of the frame, version 2 members a copy
+ * of the record appended to their open envelope. Messages of at least
+ * CPT_COMPRESS_MIN bytes are also compressed once against the channel's
+ * dictionary and version 3 members get that MESSAGE_COMPRESSED record
+ * instead, as long as it is smaller. When the message makes the
+ * dictionary retrain, the new one follows as a CHANNEL_DICTIONARY.
+ * The message gets the channel's next sequence number and is kept in
+ * its history; version 4 members get a MESSAGE_SEQUENCE record with
+ * that number right before it.
+ *
+ * With a fan-out, a channel of at least its threshold members is
+ * delivered by every lane in parallel, each to the members it owns.
+ *
+ * @param info      The server registry.
+ * @param ch        Target channel.
+ * @param user_id   Sender.
+ * @param msg       Message.
+ * @param msg_len   Message length.
+ * @return Number of members the message was queued for.
+ */
+int cpt_broadcast(struct serverInfo *info, channel *ch, uint16_t user_id, uint8_t *msg, uint16_t msg_len);
+
+/**
+ * Handle one request from a client.
+ *
+ * Commands are looked up in a table indexed by COMMAND, which also
+ * holds the shortest MSG each accepts. An unknown command is answered
+ * with UNKNOWN_CMD with CHANNEL_ID and USER_ID 0. How long the request
+ * took is counted in the command's latency histogram.
+ *
+ * @param info      The server registry.
+ * @param client    Requesting client.
+ * @param req       Parsed request, MSG is not NUL terminated.
+ * @return Status Code sent to the client.
+ */
+int cpt_handle_request(struct serverInfo *info, user *client, struct CptRequest *req);
+
+/**
+ * Start or stop publishing counters for the admin socket.
+ *
+ * Starting fills <stats> with every user and channel there is; from
+ * then on the server updates it where it changes them.
+ *
+ * @param info      The server registry.
+ * @param stats     Zeroed counters to publish to, NULL to stop.
+ */
+void cpt_server_publish(struct serverInfo *info, struct cpt_admin_stats *stats);
+
+/**
+ * Print the request count and latency of every command that was used.
+ *
+ * @param latency   CPT_COMMAND_COUNT histograms, indexed by command.
+ * @param out       Where to print.
+ */
+void cpt_server_latency_report(const struct cpt_latency *latency, FILE *out);
+
+/**
+ * Print the request count and latency of every command that was used,
+ * how the input arena is backed when there is one, and the memory in
+ * use against the budget with what was shed to stay under it.
+ *
+ * @param info      The server registry.
+ * @param out       Where to print.
+ */
+void cpt_server_report(const struct serverInfo *info, FILE *out);
+
 /**
  * Handle a received 'LOGIN' protocol message.
  *
  * Use information in the CptPacket to handle
  * a LOGIN protocol message from a connected client.
  *
+ * A LOGIN with VERSION 2 negotiates batched framing: the reply is still
+ * a version 1 frame and everything after it uses envelopes. VERSION 3
+ * also negotiates compression; the global channel's dictionary is sent
+ * right after the reply. VERSION 4 adds sequence numbers.
+ *
+ * A name that belongs to a parked user resumes that user: same id, same
+ * channels, and the MESSAGEs queued while it was away follow the reply
+ * in the negotiated framing.
+ *
  * If successful, the protocol request will be fulfilled,
  * updating any necessary information contained within
  * <server_info>.
  *
- * @param name          Name of user in received Packet MSG field.
+ * @param info          The server registry.
+ * @param client        Requesting client.
+ * @param req           Request, MSG holds the user name.
  * @return Status Code (SUCCESS if successful, other if failure).
  */
-int cpt_login_response(char * name);
+int cpt_login_response(struct serverInfo *info, user *client, struct CptRequest *req);
 
 /**
  * Handle a received 'LOGOUT' protocol message.
@@ -94,12 +603,15 @@ int cpt_login_response(char * name);
  * specified by the user <id> from the GlobalChannel
  * and any other relevant data structures.
  *
+ * @param info          The server registry.
+ * @param client        Requesting client.
+ * @param req           Request.
  * @return Status Code (SUCCESS if successful, other if failure).
  */
-int cpt_logout_response(void);
+int cpt_logout_response(struct serverInfo *info, user *client, struct CptRequest *req);
 
 /**
- * Handle a received 'LOGOUT' protocol message.
+ * Handle a received 'GET_USERS' protocol message.
  *
  * Uses information in a received CptRequest to handle
  * a GET_USERS protocol message from a connected client.
@@ -115,10 +627,12 @@ int cpt_logout_response(void);
  *      2 'Bruce Wayne'
  *      3 'Fakey McFakerson'
  *
- * @param channel_id    Target channel ID.
+ * @param info          The server registry.
+ * @param client        Requesting client.
+ * @param req           Request, CHAN_ID is the target channel.
  * @return Status Code (SUCCESS if successful, other if failure).
  */
-int cpt_get_users_response(uint16_t channel_id);
+int cpt_get_users_response(struct serverInfo *info, user *client, struct CptRequest *req);
 
 /**
  * Handle a received 'JOIN_CHANNEL' protocol message.
@@ -129,10 +643,15 @@ int cpt_get_users_response(uint16_t channel_id);
  * user into the channel specified by the CHANNEL_ID field
  * in the CptPacket <channel_id>.
  *
- * @param channel_id    Target channel ID.
+ * In a mesh, a channel that only has members on other nodes
+ * is joined by creating its local member list.
+ *
+ * @param info          The server registry.
+ * @param client        Requesting client.
+ * @param req           Request, CHAN_ID is the target channel.
  * @return Status Code (SUCCESS if successful, other if failure).
  */
-int cpt_join_channel_response(uint16_t channel_id);
+int cpt_join_channel_response(struct serverInfo *info, user *client, struct CptRequest *req);
 
 /**
  * Handle a received 'CREATE_CHANNEL' protocol message.
@@ -144,27 +663,33 @@ int cpt_join_channel_response(uint16_t channel_id);
  * function will also parse the <user_list> string and attempt
  * to add the requested user IDs to the channel.
  *
- * If <id_list> is NULL, function will create a new channel with
+ * If the MSG field is empty, function will create a new channel with
  * only the requesting user within it.
  *
- * @param id_list       ID list from MSG field of received CPT packet.
- * @return Status Code (SUCCESS if successful, other if failure).
+ * In a mesh, only ids the node owns are handed out and users
+ * on other nodes in the <user_list> are skipped.
+ *
+ * @param info          The server registry.
+ * @param client        Requesting client.
+ * @param req           Request, MSG is the optional ID list.
+ * @return Status Code (CHANNEL_CREATED if successful, other if failure).
  */
-int cpt_create_channel_response(char * id_list);
+int cpt_create_channel_response(struct serverInfo *info, user *client, struct CptRequest *req);
 
 /**
  * Handle a received 'LEAVE_CHANNEL' protocol message.
  *
  * Use information in the CptPacket to handle
  * a LEAVE_CHANNEL protocol message from a connected client.
- * If successful, will remove any instance of the user
- * specified by the user <id> from the GlobalChannel
- * and any other relevant data structures.
+ * If successful, will remove the requesting user from the
+ * channel, destroying the channel once it is empty.
  *
- * @param channel_id    Target channel ID.
+ * @param info          The server registry.
+ * @param client        Requesting client.
+ * @param req           Request, CHAN_ID is the target channel.
  * @return Status Code (SUCCESS if successful, other if failure).
  */
-int cpt_leave_channel_response(uint16_t channel_id);
+int cpt_leave_channel_response(struct serverInfo *info, user *client, struct CptRequest *req);
 
 /**
  * Handle a received 'SEND' protocol message.
@@ -174,12 +699,49 @@ int cpt_leave_channel_response(uint16_t channel_id);
  *
  * If successful, function will send the message in the
  * MSG field of the received packet to every user in the
- * CHAN_ID field of the received packet.
+ * CHAN_ID field of the received packet. In a mesh, one copy
+ * is also forwarded to each node with members in the channel.
  *
- * @param name          Name of user in received Packet MSG field.
- * @return Status Code (0 if successful, other if failure).
+ * A SEND that finds the user's or the channel's token bucket empty
+ * is answered with MSG_OVERFLOW and not delivered.
+ *
+ * @param info          The server registry.
+ * @param client        Requesting client.
+ * @param req           Request, MSG is the chat message.
+ * @return Status Code (SUCCESS if successful, other if failure).
+ */
+int cpt_send_response(struct serverInfo *info, user *client, struct CptRequest *req);
+
+/**
+ * Handle a received 'MAP_RINGS' protocol message.
+ *
+ * Creates a pair of shared-memory rings for a client connected over
+ * AF_UNIX. The SUCCESS reply carries the memfd as SCM_RIGHTS ancillary
+ * data and is the last response sent on the socket. The client must not
+ * send anything but doorbell bytes after the request; its first doorbell
+ * switches both directions to the rings, with the same framing as before.
+ *
+ * @param info          The server registry.
+ * @param client        Requesting client.
+ * @param req           Request.
+ * @return Status Code (SUCCESS if successful, other if failure).
+ */
+int cpt_map_rings_response(struct serverInfo *info, user *client, struct CptRequest *req);
+
+/**
+ * Handle a received 'RESUME' protocol message.
+ *
+ * Queues every MESSAGE the channel's history still holds after the
+ * sequence number in MSG, each behind its MESSAGE_SEQUENCE record, then
+ * a SUCCESS whose MSG is a varint count of the messages after it that
+ * are no longer held. Only version 4 members of the channel may resume.
+ *
+ * @param info          The server registry.
+ * @param client        Requesting client.
+ * @param req           Request, CHAN_ID is the channel and MSG a varint sequence number.
+ * @return Status Code (SUCCESS if successful, other if failure).
  */
-int cpt_send_response(char * name);
+int cpt_resume_response(struct serverInfo *info, user *client, struct CptRequest *req);
 
 
 #endif //CHAT_ASSIGNMNET_CPT_SERVER_H
@@ -0,0 +1,123 @@
+//
+// Created by saga910 on 2022-03-26.
+//
+
+#ifndef CHAT_ASSIGNMNET_CPT_SHM_H
+#define CHAT_ASSIGNMNET_CPT_SHM_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CPT_SHM_MAGIC 0x43505452U
+#define CPT_SHM_RING_CAPACITY (256 * 1024)
+#define CPT_SHM_TO_SERVER 0
+#define CPT_SHM_TO_CLIENT 1
+
+/**
+ * Shared indices of one single-producer single-consumer ring.
+ *
+ * <tail> is only written by the producer, <head> and <blocked> by the
+ * consumer (the producer sets <blocked> before it waits for space). They
+ * live on separate cache lines so the two sides do not false share.
+ */
+struct cpt_shm_ring
+{
+    _Alignas(64) _Atomic uint64_t tail;
+    _Alignas(64) _Atomic uint64_t head;
+    _Atomic uint32_t blocked;
+};
+
+/**
+ * Start of the shared mapping, followed by the two rings' data.
+ */
+struct cpt_shm_header
+{
+    uint32_t magic;
+    uint32_t capacity;
+    struct cpt_shm_ring rings[2];
+};
+
+/**
+ * One side's view of a shared ring pair.
+ *
+ * The peer can write anything into the mapping, so each side keeps its
+ * own copy of the capacity and of the indices it owns, and checks the
+ * peer's index against them on every access.
+ */
+struct cpt_shm
+{
+    int fd;
+    size_t size;
+    size_t capacity;
+    struct cpt_shm_header *header;
+    uint8_t *data[2];
+    uint64_t own[2];
+};
+
+/**
+ * Create a sealed memfd holding two empty rings and map it.
+ *
+ * @param shm       The rings.
+ * @param capacity  Bytes per ring, a power of two.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int cpt_shm_create(struct cpt_shm * shm, size_t capacity);
+
+/**
+ * Map rings created by the peer.
+ *
+ * <fd> is closed once mapped, also on failure.
+ *
+ * @param shm       The rings.
+ * @param fd        Descriptor received from the server.
+ * @return 0 on success, -1 if it could not be mapped or is not a ring pair.
+ */
+int cpt_shm_attach(struct cpt_shm * shm, int fd);
+
+/**
+ * Unmap the rings and close the descriptor if it is still open.
+ *
+ * @param shm       The rings.
+ */
+void cpt_shm_destroy(struct cpt_shm * shm);
+
+/**
+ * Copy as much of <data> into a ring as fits.
+ *
+ * @param shm       The rings.
+ * @param ring      CPT_SHM_TO_SERVER or CPT_SHM_TO_CLIENT, the one this side produces.
+ * @param data      Bytes to write.
+ * @param size      Size of <data>.
+ * @param written   Set to the number of bytes written.
+ * @return 1 if the consumer may be asleep and needs a doorbell, 0 if not,
+ *         -1 if the peer corrupted the ring.
+ */
+int cpt_shm_write(struct cpt_shm * shm, int ring, const uint8_t * data, size_t size, size_t * written);
+
+/**
+ * Copy up to <size> bytes out of a ring.
+ *
+ * Call until it reads nothing before waiting for a doorbell, that last
+ * empty read is what makes the wakeup race free.
+ *
+ * @param shm       The rings.
+ * @param ring      CPT_SHM_TO_SERVER or CPT_SHM_TO_CLIENT, the one this side consumes.
+ * @param dst       Destination.
+ * @param size      Size of <dst>.
+ * @param nread     Set to the number of bytes read.
+ * @return 1 if the producer was waiting for space and needs a doorbell,
+ *         0 if not, -1 if the peer corrupted the ring.
+ */
+int cpt_shm_read(struct cpt_shm * shm, int ring, uint8_t * dst, size_t size, size_t * nread);
+
+/**
+ * Wake the peer by sending one byte on the connection.
+ *
+ * A full socket buffer is ignored, the peer has doorbells pending anyway.
+ *
+ * @param fd        The AF_UNIX connection the rings were handed over on.
+ */
+void cpt_shm_doorbell(int fd);
+
+#endif //CHAT_ASSIGNMNET_CPT_SHM_H
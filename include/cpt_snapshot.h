@@ -0,0 +1,63 @@
+//
+// Created by saga910 on 2022-03-26.
+//
+
+#ifndef CHAT_ASSIGNMNET_CPT_SNAPSHOT_H
+#define CHAT_ASSIGNMNET_CPT_SNAPSHOT_H
+
+#include "cpt_fanout.h"
+#include <stddef.h>
+#include <stdint.h>
+
+struct user;
+
+/**
+ * An immutable copy of a large channel's members, grouped by fan-out
+ * lane: lane n delivers to members[starts[n]] .. members[starts[n + 1] - 1].
+ *
+ * A snapshot is never changed once published. A membership change
+ * builds the next <version> and swaps the channel's pointer, so lanes
+ * delivering a broadcast read it without locks. The old one is retired
+ * with the fan-out generation of the moment in <retired_at> and freed
+ * once every lane has finished that generation.
+ */
+struct cpt_snapshot
+{
+    uint64_t version;
+    uint64_t retired_at;
+    struct cpt_snapshot *retired_next;
+    int lanes;
+    size_t count;
+    size_t starts[CPT_FANOUT_MAX_LANES + 1];
+    struct user *members[];
+};
+
+/**
+ * Allocate a snapshot with room for <count> members.
+ *
+ * @param version   Version number.
+ * @param lanes     Number of lanes.
+ * @param count     Number of members.
+ * @return The snapshot, NULL if allocation failed.
+ */
+struct cpt_snapshot *cpt_snapshot_create(uint64_t version, int lanes, size_t count);
+
+/**
+ * Queue a snapshot that is no longer published to be freed.
+ *
+ * @param retired   Retired list.
+ * @param snapshot  The snapshot, may be NULL.
+ * @param epoch     Fan-out generation when it was unpublished.
+ */
+void cpt_snapshot_retire(struct cpt_snapshot **retired, struct cpt_snapshot *snapshot, uint64_t epoch);
+
+/**
+ * Free the retired snapshots no lane can still be reading.
+ *
+ * @param retired   Retired list.
+ * @param quiescent Generation every lane has finished, UINT64_MAX frees all.
+ * @return Number of snapshots freed.
+ */
+size_t cpt_snapshot_reclaim(struct cpt_snapshot **retired, uint64_t quiescent);
+
+#endif //CHAT_ASSIGNMNET_CPT_SNAPSHOT_H
@@ -0,0 +1,53 @@
+//
+// Created by saga910 on 2022-03-26.
+//
+
+#ifndef CHAT_ASSIGNMNET_CPT_STATS_H
+#define CHAT_ASSIGNMNET_CPT_STATS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// bucket i counts latencies of [2^i, 2^(i+1)) nanoseconds, the last one everything slower
+#define CPT_LATENCY_BUCKETS 32
+
+/**
+ * Calls of one kind and how long they took.
+ *
+ * Only one thread records, with relaxed loads and stores that cost what
+ * plain ones do; any other thread may read the fields while it does.
+ */
+struct cpt_latency
+{
+    _Atomic uint64_t count;
+    _Atomic uint64_t total_ns;
+    _Atomic uint64_t max_ns;
+    _Atomic uint64_t buckets[CPT_LATENCY_BUCKETS];
+};
+
+/**
+ * Read the monotonic clock.
+ *
+ * @return Monotonic time in nanoseconds.
+ */
+uint64_t cpt_stats_clock(void);
+
+/**
+ * Count one call.
+ *
+ * @param latency   The histogram.
+ * @param ns        How long the call took.
+ */
+void cpt_latency_record(struct cpt_latency *latency, uint64_t ns);
+
+/**
+ * Latency below which a share of the calls finished, to within a power of two.
+ *
+ * @param latency   The histogram.
+ * @param percent   Share of the calls, 0 to 100.
+ * @return Upper bound of the bucket holding that call in nanoseconds, at most the
+ *         slowest call, 0 if none was counted.
+ */
+uint64_t cpt_latency_percentile(const struct cpt_latency *latency, double percent);
+
+#endif //CHAT_ASSIGNMNET_CPT_STATS_H
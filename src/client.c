@@ -15,9 +15,14 @@
 #include <unistd.h>
 #include <dc_posix/dc_netdb.h>
 #include <dc_posix/sys/dc_socket.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 
 #define BUFFER 1024
 #define FALSE 0
+#define TRUE 1
+#define SEND_QUEUE_HIGH_WATER (1024 * 1024)
 
 struct application_settings
 {
@@ -27,6 +32,36 @@ struct application_settings
     struct dc_setting_string *ID;
 };
 
+/**
+ * A request that has been queued but not answered yet.
+ */
+struct pending_request
+{
+    uint8_t command;
+    uint16_t channel_id;
+};
+
+/**
+ * FIFO of unanswered requests, used to pair responses with what caused them.
+ */
+struct pending_queue
+{
+    struct pending_request *entries;
+    size_t head;
+    size_t count;
+    size_t capacity;
+};
+
+struct client_state
+{
+    int stdin_open;
+    struct cpt_connection conn;
+    struct cpt_response_decoder decoder;
+    struct pending_queue pending;
+    char line[BUFFER];
+    size_t line_len;
+};
+
 
 
 static struct dc_application_settings *create_settings(const struct dc_posix_env *env, struct dc_error *err);
@@ -39,6 +74,14 @@ static void trace_reporter(const struct dc_posix_env *env,
                            const char *file_name,
                            const char *function_name,
                            size_t line_number);
+static int queue_request(struct client_state *state, uint8_t command, uint16_t channel_id, char *msg);
+static int flush_requests(struct client_state *state);
+static int read_commands(struct client_state *state);
+static int handle_command(struct client_state *state, char *line);
+static ssize_t read_responses(struct client_state *state);
+static int response_matches(uint8_t code, const struct pending_request *req);
+static void handle_response(void *arg, const struct CptResponse *res);
+static void print_presence(const struct CptResponse *res);
 
 int main(int argc, char *argv[])
 {
@@ -160,10 +203,10 @@ static int destroy_settings(const struct dc_posix_env *env,
 static int run(const struct dc_posix_env *env, struct dc_error *err, struct dc_application_settings *settings)
 {
     struct application_settings *app_settings;
-    int sockfd = -1;
-    char   send_buf[BUFFER];
-    char   recv_buf[BUFFER];
+    struct client_state state;
+    struct pollfd fds[2];
     const char *server;
+    char name[BUFFER];
     uint16_t port;
     ssize_t rc;
     struct sockaddr_in6 *sockaddrIn;
@@ -178,8 +221,19 @@ static int run(const struct dc_posix_env *env, struct dc_error *err, struct dc_a
 
     server = dc_setting_string_get(env, app_settings->IP);
     port = dc_setting_uint16_get(env, app_settings->port);
+    snprintf(name, sizeof(name), "%s", dc_setting_string_get(env, app_settings->ID));
     converted_port = htons(port);
 
+    dc_memset(env, &state, 0, sizeof(state));
+    cpt_connection_init(&state.conn, -1, CPT_CONNECTION_OUTPUT_LIMIT);
+    state.stdin_open = TRUE;
+
+    if (cpt_response_decoder_init(&state.decoder, CPT_RESPONSE_DECODER_CAPACITY) < 0)
+    {
+        perror("malloc() failed");
+        return EXIT_FAILURE;
+    }
+
     do
     {
         dc_memset(env, &hints, 0, sizeof(hints));
@@ -190,15 +244,15 @@ static int run(const struct dc_posix_env *env, struct dc_error *err, struct dc_a
 
         if (rc != 0)
         {
-            printf("Host not found --> %s\n", gai_strerror(rc));
+            printf("Host not found --> %s\n", gai_strerror((int) rc));
             if (rc == EAI_SYSTEM)
                 perror("getaddrinfo() failed");
             break;
         }
 
 
-        sockfd = dc_socket(env, err, res->ai_family, res->ai_socktype, res->ai_protocol);
-        if (sockfd < 0)
+        state.conn.fd = dc_socket(env, err, res->ai_family, res->ai_socktype, res->ai_protocol);
+        if (state.conn.fd < 0)
         {
             perror("socket() failed");
             break;
@@ -208,7 +262,7 @@ static int run(const struct dc_posix_env *env, struct dc_error *err, struct dc_a
         sockaddrIn->sin6_port = converted_port;
         size = sizeof(struct sockaddr_in6);
 
-        rc = dc_connect(env, err, sockfd, res->ai_addr, size);
+        rc = dc_connect(env, err, state.conn.fd, res->ai_addr, size);
 
         if (rc < 0)
         {
@@ -216,179 +270,495 @@ static int run(const struct dc_posix_env *env, struct dc_error *err, struct dc_a
             break;
         }
 
-        while (1){
+        // the socket is only ever touched once poll() says it is ready
+        rc = fcntl(state.conn.fd, F_SETFL, fcntl(state.conn.fd, F_GETFL) | O_NONBLOCK);
+        if (rc < 0)
+        {
+            perror("fcntl() failed");
+            break;
+        }
 
-            rc = read(STDIN_FILENO, send_buf, sizeof(send_buf));
+        if (queue_request(&state, LOGIN, 0, name) < 0)
+        {
+            break;
+        }
+
+        while (state.stdin_open || cpt_batch_pending(&state.conn) != 0 || state.pending.count != 0)
+        {
+            // stop reading stdin while the socket is backed up so the queue stays bounded
+            fds[0].fd = (state.stdin_open && cpt_batch_pending(&state.conn) < SEND_QUEUE_HIGH_WATER) ? STDIN_FILENO : -1;
+            fds[0].events = POLLIN;
+            fds[0].revents = 0;
+            fds[1].fd = state.conn.fd;
+            fds[1].events = (short) (POLLIN | (cpt_batch_pending(&state.conn) != 0 ? POLLOUT : 0));
+            fds[1].revents = 0;
+
+            rc = poll(fds, 2, -1);
 
             if (rc < 0)
             {
-                perror("read() failed");
+                if (errno == EINTR)
+                    continue;
+                perror("poll() failed");
                 break;
             }
 
-            if(getchar() == '\n'){
+            if (fds[1].revents & (POLLIN | POLLHUP | POLLERR))
+            {
+                rc = read_responses(&state);
+
+                if (rc <= 0)
+                {
+                    break;
+                }
+            }
 
-                uint8_t *buff = malloc(sizeof(uint8_t *));
+            if (fds[0].revents & (POLLIN | POLLHUP))
+            {
+                if (read_commands(&state) < 0)
+                {
+                    break;
+                }
+            }
 
-                size_t reqsize= 0;
+            // pipeline: everything queued this iteration leaves in as few send() calls as the kernel allows
+            if (cpt_batch_pending(&state.conn) != 0 && flush_requests(&state) < 0)
+            {
+                break;
+            }
+        }
 
-                reqsize = cpt_send(buff, send_buf);
+    } while (FALSE);
 
-                rc = send(sockfd, buff, reqsize, 0);
 
+    if (state.conn.fd != -1){
+        close(state.conn.fd);
+    }
 
+    if (res != NULL){
+        freeaddrinfo(res);
+    }
 
-                if (rc < 0)
-                {
-                    perror("send() failed");
-                    break;
-                }
+    cpt_connection_destroy(&state.conn);
+    cpt_response_decoder_destroy(&state.decoder);
+    free(state.pending.entries);
 
-            }
+    return EXIT_SUCCESS;
+}
 
-            uint8_t * incoming = malloc(sizeof(uint8_t*));
+static int queue_request(struct client_state *state, uint8_t command, uint16_t channel_id, char *msg)
+{
+    struct CptRequest req;
+    struct pending_request *pending;
+    size_t msg_len;
 
-            rc = recv(sockfd, incoming, sizeof(recv_buf), 0);
+    msg_len = msg == NULL ? 0 : strlen(msg);
 
-            struct CptResponse *cptResponse;
-            cptResponse = cpt_parse_response(incoming, (size_t) rc);
-            printf("Response message: %s\n", cptResponse->msg);
-            printf("Response message length: %d\n", cptResponse->msg_len);
-            printf("Response channel id %d\n", cptResponse->channel_id);
-            printf("Response user id %d\n", cptResponse->user_id);
-            printf("Response code %d\n", cptResponse->code);
+    if (msg_len > UINT16_MAX)
+    {
+        fprintf(stderr, "message too long (%zu bytes)\n", msg_len);
+        return 0;
+    }
 
-            if (rc < 0)
+    if (state->pending.count == state->pending.capacity)
+    {
+        struct pending_request *entries;
+        size_t capacity;
+
+        capacity = state->pending.capacity == 0 ? 64 : state->pending.capacity * 2;
+        entries = malloc(capacity * sizeof(*entries));
+        if (entries == NULL)
+        {
+            perror("malloc() failed");
+            return -1;
+        }
+
+        // unwrap the ring into the new storage
+        for (size_t i = 0; i < state->pending.count; i++)
+        {
+            entries[i] = state->pending.entries[(state->pending.head + i) % state->pending.capacity];
+        }
+
+        free(state->pending.entries);
+        state->pending.entries = entries;
+        state->pending.capacity = capacity;
+        state->pending.head = 0;
+    }
+
+    req.version = CPT_CLIENT_VERSION;
+    req.command = command;
+    req.channel_id = channel_id;
+    req.msg_len = (uint16_t) msg_len;
+    req.msg = msg;
+
+    if (cpt_batch_append(&state->conn, &req) < 0)
+    {
+        fprintf(stderr, "send queue full, dropping command %d\n", command);
+        return 0;
+    }
+
+    pending = &state->pending.entries[(state->pending.head + state->pending.count) % state->pending.capacity];
+    pending->command = command;
+    pending->channel_id = channel_id;
+    state->pending.count++;
+
+    return 1;
+}
+
+static int flush_requests(struct client_state *state)
+{
+    ssize_t nwritten;
+
+    while (cpt_batch_pending(&state->conn) != 0)
+    {
+        nwritten = cpt_batch_flush(&state->conn);
+
+        if (nwritten < 0)
+        {
+            if (errno == EWOULDBLOCK || errno == EAGAIN)
             {
-                perror("recv() failed");
-                break;
+                return 0;
+            }
+
+            if (errno == EINTR)
+            {
+                continue;
             }
+
+            perror("send() failed");
+            return -1;
         }
+    }
 
+    return 0;
+}
 
+static int read_commands(struct client_state *state)
+{
+    ssize_t nread;
+    char *start;
+    char *newline;
+    size_t remaining;
 
-        if (rc < 0)
+    nread = read(STDIN_FILENO, state->line + state->line_len, sizeof(state->line) - state->line_len - 1);
+
+    if (nread < 0)
+    {
+        if (errno == EINTR || errno == EAGAIN)
         {
-            perror("recv() failed");
-            break;
+            return 0;
         }
 
-        printf("Rec: %s\n", recv_buf);
+        perror("read() failed");
+        return -1;
+    }
 
-    } while (FALSE);
+    if (nread == 0)
+    {
+        state->stdin_open = FALSE;
+        // a final line without a newline is still a command
+        if (state->line_len > 0)
+        {
+            state->line[state->line_len] = '\0';
+            state->line_len = 0;
+            return handle_command(state, state->line);
+        }
+        return 0;
+    }
 
+    state->line_len += (size_t) nread;
+    state->line[state->line_len] = '\0';
+    start = state->line;
 
-    if (sockfd != -1){
-        close(sockfd);
+    // one read() can carry many lines when stdin is a pipe; queue all of them
+    while ((newline = strchr(start, '\n')) != NULL)
+    {
+        *newline = '\0';
+        if (handle_command(state, start) < 0)
+        {
+            return -1;
+        }
+        start = newline + 1;
     }
 
-    if (res != NULL){
-        freeaddrinfo(res);
+    remaining = state->line_len - (size_t) (start - state->line);
+
+    if (remaining == sizeof(state->line) - 1)
+    {
+        fprintf(stderr, "line too long, sending as is\n");
+        remaining = 0;
+        if (handle_command(state, start) < 0)
+        {
+            return -1;
+        }
     }
 
-    return EXIT_SUCCESS;
-}
+    memmove(state->line, start, remaining);
+    state->line_len = remaining;
 
-static void error_reporter(const struct dc_error *err)
-{
-    fprintf(stderr, "ERROR: %s : %s : @ %zu : %d\n", err->file_name, err->function_name, err->line_number, 0);
-    fprintf(stderr, "ERROR: %s\n", err->message);
+    return 0;
 }
 
-static void trace_reporter(__attribute__((unused)) const struct dc_posix_env *env,
-                           const char *file_name,
-                           const char *function_name,
-                           size_t line_number)
+static int handle_command(struct client_state *state, char *line)
 {
-    fprintf(stdout, "TRACE: %s : %s : @ %zu\n", file_name, function_name, line_number);
+    unsigned long channel_id;
+    char *end;
+
+    if (line[0] != '/')
+    {
+        if (line[0] == '\0')
+        {
+            return 0;
+        }
+        return queue_request(state, SEND, state->conn.info.channel_id, line);
+    }
+
+    if (strncmp(line, "/create", 7) == 0)
+    {
+        return queue_request(state, CREATE_CHANNEL, 0, line[7] == ' ' ? line + 8 : NULL);
+    }
+
+    if (strcmp(line, "/logout") == 0)
+    {
+        return queue_request(state, LOGOUT, 0, NULL);
+    }
+
+    if (strcmp(line, "/quit") == 0)
+    {
+        state->stdin_open = FALSE;
+        return queue_request(state, LOGOUT, 0, NULL);
+    }
+
+    channel_id = state->conn.info.channel_id;
+
+    if (line[1] != '\0' && strchr(line, ' ') != NULL)
+    {
+        channel_id = strtoul(strchr(line, ' ') + 1, &end, 10);
+        if (*end != '\0' || channel_id > UINT16_MAX)
+        {
+            fprintf(stderr, "invalid channel id: %s\n", line);
+            return 0;
+        }
+    }
+
+    if (strncmp(line, "/join", 5) == 0)
+    {
+        return queue_request(state, JOIN_CHANNEL, (uint16_t) channel_id, NULL);
+    }
+
+    if (strncmp(line, "/leave", 6) == 0)
+    {
+        return queue_request(state, LEAVE_CHANNEL, (uint16_t) channel_id, NULL);
+    }
+
+    if (strncmp(line, "/users", 6) == 0)
+    {
+        return queue_request(state, GET_USERS, (uint16_t) channel_id, NULL);
+    }
+
+    fprintf(stderr, "unknown command: %s\n", line);
+
+    return 0;
 }
 
-size_t cpt_login(uint8_t * serial_buf, char * name)
+static ssize_t read_responses(struct client_state *state)
 {
-    struct CptRequest * new_req;
-    new_req = cpt_request_init();
-    new_req->command = LOGIN;
-    new_req->msg = name;
-    size_t req_size;
-    req_size = cpt_serialize_request(new_req, serial_buf);
-
-    return req_size;
+    ssize_t rc;
+
+    rc = cpt_response_decoder_read(&state->decoder, state->conn.fd);
+
+    if (rc < 0)
+    {
+        if (errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR)
+        {
+            return 1;
+        }
+
+        perror("recv() failed");
+        return rc;
+    }
+
+    if (rc == 0)
+    {
+        printf("Server closed the connection\n");
+        return rc;
+    }
+
+    // a single read can hold many coalesced broadcasts, handle all of them
+    cpt_response_decoder_drain(&state->decoder, handle_response, state);
+
+    return rc;
 }
 
-size_t cpt_logout(uint8_t * serial_buf)
+static int response_matches(uint8_t code, const struct pending_request *req)
 {
-    struct CptRequest * new_req;
-    new_req = cpt_request_init();
-    new_req->command = LOGOUT;
-    size_t req_size;
-    req_size = cpt_serialize_request(new_req, serial_buf);
-
-    return req_size;
+    switch (code)
+    {
+        case CHANNEL_CREATED:
+        case CHANNEL_CREATION_ERROR:
+            return req->command == CREATE_CHANNEL;
+        case USER_LIST:
+            return req->command == GET_USERS;
+        case LOGIN_FAIL:
+        case BAD_VERSION:
+            return req->command == LOGIN;
+        case SEND_FAILED:
+        case MESSAGE_FAILED:
+        case MSG_OVERFLOW:
+        case MSG_LEN_OVERFLOW:
+            return req->command == SEND;
+        default:
+            return TRUE;
+    }
 }
 
-size_t cpt_get_users(uint8_t * serial_buf, uint16_t channel_id)
+static void handle_response(void *arg, const struct CptResponse *res)
 {
+    struct client_state *state;
+    struct pending_queue *pending;
+    struct pending_request matched;
+    size_t i;
 
-    struct CptRequest * new_req;
-    new_req = cpt_request_init();
-    new_req->command = GET_USERS;
-    new_req->channel_id = channel_id;
-    size_t req_size;
-    req_size = cpt_serialize_request(new_req, serial_buf);
+    state = arg;
 
-    return req_size;
+    switch (res->code)
+    {
+        // unsolicited traffic, never an answer to one of our requests
+        case MESSAGE:
+        case CHANNEL_DESTROYED:
+            printf("[%u] <%u> %.*s\n", res->channel_id, res->user_id, (int) res->msg_len, (const char *) res->msg);
+            return;
+        case USER_CONNECTED:
+        case USER_DISCONNECTED:
+        case USER_JOINED_CHANNEL:
+        case USER_LEFT_CHANNEL:
+            print_presence(res);
+            return;
+        default:
+            break;
+    }
 
-}
+    pending = &state->pending;
 
-size_t cpt_create_channel(uint8_t * serial_buf, char * user_list){
+    // the server answers in order, so this almost always stops at the head
+    for (i = 0; i < pending->count; i++)
+    {
+        struct pending_request *req;
 
-    struct CptRequest * new_req;
-    new_req = cpt_request_init();
-    new_req->channel_id = 0;
-    new_req->command = CREATE_CHANNEL;
-    new_req->msg = user_list;
-    size_t req_size;
-    req_size = cpt_serialize_request(new_req, serial_buf);
+        req = &pending->entries[(pending->head + i) % pending->capacity];
 
-    return req_size;
-}
+        if (response_matches(res->code, req) &&
+            (req->channel_id == res->channel_id || req->command == CREATE_CHANNEL || req->command == LOGIN || req->command == LOGOUT))
+        {
+            break;
+        }
+    }
 
-size_t cpt_join_channel(uint8_t * serial_buf, uint16_t channel_id){
-    struct CptRequest * new_req;
-    new_req = cpt_request_init();
-    new_req->channel_id = channel_id;
-    new_req->command = JOIN_CHANNEL;
-    size_t req_size;
-    req_size = cpt_serialize_request(new_req, serial_buf);
+    if (i == pending->count)
+    {
+        printf("Unexpected response code %d on channel %u\n", res->code, res->channel_id);
+        return;
+    }
 
-    return req_size;
-}
+    matched = pending->entries[(pending->head + i) % pending->capacity];
 
-size_t cpt_leave_channel(uint8_t * serial_buf, uint16_t channel_id){
+    for (; i > 0; i--)
+    {
+        pending->entries[(pending->head + i) % pending->capacity] = pending->entries[(pending->head + i - 1) % pending->capacity];
+    }
 
-    struct CptRequest * new_req;
-    new_req = cpt_request_init();
-    new_req->channel_id = channel_id;
-    new_req->command = LEAVE_CHANNEL;
-    size_t req_size;
-    req_size = cpt_serialize_request(new_req, serial_buf);
+    pending->head = (pending->head + 1) % pending->capacity;
+    pending->count--;
 
-    return req_size;
+    if (res->code == SUCCESS || res->code == CHANNEL_CREATED)
+    {
+        switch (matched.command)
+        {
+            case LOGIN:
+                state->conn.info.user_id = res->user_id;
+                break;
+            case CREATE_CHANNEL:
+            case JOIN_CHANNEL:
+                state->conn.info.channel_id = res->channel_id;
+                break;
+            case LEAVE_CHANNEL:
+                if (state->conn.info.channel_id == matched.channel_id)
+                {
+                    state->conn.info.channel_id = 0;
+                }
+                break;
+            case SEND:
+                // acknowledgements are the common case for bots, keep them quiet
+                return;
+            case LOGOUT:
+            case GET_USERS:
+            default:
+                break;
+        }
+    }
 
+    printf("Response code %d to command %d on channel %u: %.*s\n",
+           res->code, matched.command, res->channel_id, (int) res->msg_len, (const char *) res->msg);
 }
 
-size_t cpt_send(uint8_t * serial_buf, char * msg)
+/**
+ * Print a batch of presence changes: a varint count, then varint user ids.
+ */
+static void print_presence(const struct CptResponse *res)
 {
-    struct CptRequest * new_req;
-    new_req = cpt_request_init();
-    new_req->version = 1;
-    new_req->msg = msg;
-    new_req->command = SEND;
-    new_req->msg_len = (uint16_t) strlen(msg);
-    size_t req_size;
-    req_size = cpt_serialize_request(new_req, serial_buf);
+    const char *what;
+    uint32_t count;
+    uint32_t id;
+    size_t pos;
+    int used;
+
+    what = res->code == USER_CONNECTED ? "connected" :
+           res->code == USER_DISCONNECTED ? "disconnected" :
+           res->code == USER_JOINED_CHANNEL ? "joined" : "left";
+
+    // too many changes to list, the member list has to be fetched again
+    if (res->msg_len == 0)
+    {
+        printf("[%u] membership changed, GET_USERS for the new list\n", res->channel_id);
+        return;
+    }
+
+    used = cpt_varint_get(res->msg, res->msg_len, &count);
+
+    if (used <= 0)
+    {
+        return;
+    }
+
+    printf("[%u] %s:", res->channel_id, what);
+    pos = (size_t) used;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        used = cpt_varint_get(res->msg + pos, res->msg_len - pos, &id);
+
+        if (used <= 0)
+        {
+            break;
+        }
+
+        pos += (size_t) used;
+        printf(" %u", id);
+    }
 
-    return req_size;
+    printf("\n");
+}
 
+static void error_reporter(const struct dc_error *err)
+{
+    fprintf(stderr, "ERROR: %s : %s : @ %zu : %d\n", err->file_name, err->function_name, err->line_number, 0);
+    fprintf(stderr, "ERROR: %s\n", err->message);
 }
 
+static void trace_reporter(__attribute__((unused)) const struct dc_posix_env *env,
+                           const char *file_name,
+                           const char *function_name,
+                           size_t line_number)
+{
+    fprintf(stdout, "TRACE: %s : %s : @ %zu\n", file_name, function_name, line_number);
+}
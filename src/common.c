@@ -16,52 +16,148 @@
  */
 
 #include <stdlib.h>
-#include <stdio.h>
 #include "common.h"
 
+static int get_u16_varint(const uint8_t * buf, size_t size, size_t * offset, uint16_t * value);
+
+int cpt_valid_response_code(uint8_t code)
+{
+    return (code >= SUCCESS && code <= MESSAGE_SEQUENCE) || code == RESERVED;
+}
+
+size_t cpt_response_size(const struct CptResponse * res)
+{
+    return CPT_RESPONSE_HEADER_SIZE + (size_t) res->msg_len;
+}
+
+int cpt_parse_response_into(struct CptResponse * res, uint8_t * res_buf, size_t data_size)
+{
+    int current;
+
+    if (data_size < CPT_RESPONSE_HEADER_SIZE)
+    {
+        return -1;
+    }
+
+    current = 1;
+    res->code = res_buf[0];
+    res->channel_id = unpack_u16(res_buf, &current);
+    res->user_id = unpack_u16(res_buf, &current);
+    res->msg_len = unpack_u16(res_buf, &current);
+
+    if (data_size - CPT_RESPONSE_HEADER_SIZE < res->msg_len)
+    {
+        return -1;
+    }
+
+    res->data_size = res->msg_len;
+    res->msg = res_buf + CPT_RESPONSE_HEADER_SIZE;
+
+    return 0;
+}
+
 struct CptResponse * cpt_parse_response(uint8_t * res_buf, size_t data_size){
     struct CptResponse *res;
-    res = malloc(data_size);
 
-    int * current = (int *) 1;
+    res = malloc(sizeof(struct CptResponse));
 
-    res->code = res_buf[0];
-    res->data_size = unpack_u16(res_buf, current);
-    res->channel_id = unpack_u16(res_buf, current);
-    res->user_id = unpack_u16(res_buf, current);
-    res->msg_len = unpack_u16(res_buf, current);
-    res->msg = &res_buf[8];
+    if (res == NULL)
+    {
+        return NULL;
+    }
+
+    if (cpt_parse_response_into(res, res_buf, data_size) < 0)
+    {
+        free(res);
+        return NULL;
+    }
 
     return res;
 }
 
+int cpt_parse_request_into(struct CptRequest * req, uint8_t * req_buf, size_t req_size)
+{
+    int current;
+
+    if (req_size < CPT_REQUEST_HEADER_SIZE)
+    {
+        return -1;
+    }
+
+    current = 2;
+    req->version = req_buf[0];
+    req->command = req_buf[1];
+    req->channel_id = unpack_u16(req_buf, &current);
+    req->msg_len = unpack_u16(req_buf, &current);
+
+    if (req_size - CPT_REQUEST_HEADER_SIZE < req->msg_len)
+    {
+        return -1;
+    }
+
+    req->msg = (char *) (req_buf + CPT_REQUEST_HEADER_SIZE);
+
+    return 0;
+}
+
 struct CptRequest * cpt_parse_request(uint8_t * req_buf, size_t req_size){
 
     struct CptRequest *req;
-    req = malloc(req_size);
+    int current;
 
-    int * current = (int *) 2;
+    if (req_size < CPT_REQUEST_HEADER_SIZE)
+    {
+        return NULL;
+    }
+
+    req = cpt_request_init();
+
+    if (req == NULL)
+    {
+        return NULL;
+    }
 
+    current = 2;
     req->version = req_buf[0];
-    printf("version = %d\n", req_buf[0]);
     req->command = req_buf[1];
-    printf("command = %d\n", req_buf[1]);
-    req->channel_id = unpack_u16(req_buf, current);
-    printf("channel id = %d\n", req_buf[2] + req_buf[3]);
-    req->msg_len = unpack_u16(req_buf, current);
-    printf("msg_len = %d\n", req_buf[4] + req_buf[5]);
-    // req->msg = req_buf[6];
+    req->channel_id = unpack_u16(req_buf, &current);
+    req->msg_len = unpack_u16(req_buf, &current);
+
+    if (req_size - CPT_REQUEST_HEADER_SIZE < req->msg_len)
+    {
+        cpt_request_destroy(req);
+        return NULL;
+    }
+
+    // owned, NUL terminated copy so handlers can treat MSG as a string
+    req->msg = malloc((size_t) req->msg_len + 1);
 
-    char* temp = strdup(req_buf + 6);
-    printf("res_msg = %s\n", temp);
+    if (req->msg == NULL)
+    {
+        cpt_request_destroy(req);
+        return NULL;
+    }
+
+    memcpy(req->msg, req_buf + CPT_REQUEST_HEADER_SIZE, req->msg_len);
+    req->msg[req->msg_len] = '\0';
 
     return req;
 }
 
-size_t cpt_serialize_request(struct CptRequest * req, uint8_t * buffer)
+size_t cpt_request_size(const struct CptRequest * req)
+{
+    return CPT_REQUEST_HEADER_SIZE + (size_t) req->msg_len;
+}
+
+size_t cpt_serialize_request(struct CptRequest * req, uint8_t * buffer, size_t buf_size)
 {
     uint8_t temp[2];
 
+    if (buf_size < cpt_request_size(req))
+    {
+        return 0;
+    }
+
     buffer[0] = req->version;
     buffer[1] = req-> command;
     pack_u16(req->channel_id, temp);
@@ -71,56 +167,58 @@ size_t cpt_serialize_request(struct CptRequest * req, uint8_t * buffer)
     buffer[4] = temp[0];
     buffer[5] = temp[1];
 
-    size_t req_size;
-
-    for (int i = 0; i < req->msg_len; i++) {
-        buffer[6 + i] = (uint8_t) req->msg[i];
-        printf("buffer[%d] = %c\n", 6 + i, req->msg[i]);
+    if (req->msg_len > 0)
+    {
+        memcpy(buffer + CPT_REQUEST_HEADER_SIZE, req->msg, req->msg_len);
     }
 
-    buffer[6 + req->msg_len] = '\0';
-
-    req_size = 6 + req->msg_len;
-
-    return req_size;
+    return cpt_request_size(req);
 }
 
-size_t cpt_serialize_response(struct CptResponse * res, uint8_t * buffer)
+size_t cpt_serialize_response(struct CptResponse * res, uint8_t * buffer, size_t buf_size)
 {
     uint8_t temp[2];
 
+    if (buf_size < cpt_response_size(res))
+    {
+        return 0;
+    }
+
     buffer[0] = res->code;
-    pack_u16(res->data_size, temp);
+    pack_u16(res->channel_id, temp);
     buffer[1] = temp[0];
     buffer[2] = temp[1];
-    pack_u16(res->channel_id, temp);
+    pack_u16(res->user_id, temp);
     buffer[3] = temp[0];
     buffer[4] = temp[1];
-    pack_u16(res->user_id, temp);
+    pack_u16(res->msg_len, temp);
     buffer[5] = temp[0];
     buffer[6] = temp[1];
-    pack_u16(res->msg_len, temp);
 
-    for (int i = 0; i < res->msg_len; i++) {
-        buffer[7 + i] = (uint8_t) res->msg[i];
+    if (res->msg_len > 0)
+    {
+        memcpy(buffer + CPT_RESPONSE_HEADER_SIZE, res->msg, res->msg_len);
     }
 
-    size_t res_size;
-    res_size = 7 + res->msg_len;
-
-    return res_size;
+    return cpt_response_size(res);
 }
 
-struct CptResponse * cpt_response_init(){
+struct CptResponse * cpt_response_init(void){
     struct CptResponse *res;
 
-    res = malloc(sizeof (struct CptResponse *));
+    res = malloc(sizeof (struct CptResponse));
+
+    if (res == NULL)
+    {
+        return NULL;
+    }
 
     res->code = 0;
     res->data_size = 0;
     res->channel_id = 0;
     res->user_id = 0;
     res->msg_len = 0;
+    res->msg = NULL;
 
     return res;
 }
@@ -130,27 +228,29 @@ void cpt_response_destroy(struct CptResponse * response)
     if (response != NULL)
     {
         free(response);
-        response = NULL;
     }
 }
 
 void cpt_response_reset(struct CptResponse * response)
 {
-    if (response->code != 0)
-    {
-        response->code = 0;
-    }
-    else if (response->data_size != 0)
-    {
-        response->data_size = 0;
-    }
+    response->code = 0;
+    response->data_size = 0;
+    response->channel_id = 0;
+    response->user_id = 0;
+    response->msg_len = 0;
+    response->msg = NULL;
 }
 
-struct CptRequest * cpt_request_init()
+struct CptRequest * cpt_request_init(void)
 {
     struct CptRequest *req;
 
-    req = malloc(sizeof (struct CptRequest *));
+    req = malloc(sizeof (struct CptRequest));
+
+    if (req == NULL)
+    {
+        return NULL;
+    }
 
     req->version = 0;
     req->command = 0;
@@ -165,77 +265,222 @@ void cpt_request_destroy(struct CptRequest * cpt)
 {
     if (cpt != NULL)
     {
-        cpt->version = 0;
-        cpt->command = 0;
-        cpt->channel_id = 0;
-        cpt->msg_len = 0;
-        cpt->msg = NULL;
-        free(cpt);
         free(cpt->msg);
-        cpt = NULL;
+        free(cpt);
     }
 }
 
 void cpt_request_reset(struct CptRequest * packet)
 {
-    if (packet->version != 0)
+    free(packet->msg);
+    packet->msg = NULL;
+    packet->version = 0;
+    packet->command = 0;
+    packet->channel_id = 0;
+    packet->msg_len = 0;
+}
+
+size_t cpt_varint_size(uint32_t value)
+{
+    size_t size;
+
+    size = 1;
+
+    while (value >= 0x80)
+    {
+        value >>= 7;
+        size++;
+    }
+
+    return size;
+}
+
+size_t cpt_varint_put(uint32_t value, uint8_t * buf)
+{
+    size_t size;
+
+    size = 0;
+
+    while (value >= 0x80)
     {
-        packet->version = 0;
+        buf[size++] = (uint8_t) (value | 0x80);
+        value >>= 7;
     }
-    else if (packet->msg != NULL)
+
+    buf[size++] = (uint8_t) value;
+
+    return size;
+}
+
+int cpt_varint_get(const uint8_t * buf, size_t size, uint32_t * value)
+{
+    uint32_t result;
+
+    result = 0;
+
+    for (size_t i = 0; i < CPT_VARINT_MAX; i++)
     {
-        packet->msg = NULL;
-        free(packet->msg);
+        if (i == size)
+        {
+            return 0;
+        }
+
+        // the fifth byte holds the top 4 bits, anything above them overflows 32 bits
+        if (i == CPT_VARINT_MAX - 1 && buf[i] > 0x0F)
+        {
+            return -1;
+        }
+
+        result |= (uint32_t) (buf[i] & 0x7F) << (7 * i);
+
+        if ((buf[i] & 0x80) == 0)
+        {
+            *value = result;
+            return (int) i + 1;
+        }
     }
-    else if (packet->channel_id != 0)
+
+    return -1;
+}
+
+static int get_u16_varint(const uint8_t * buf, size_t size, size_t * offset, uint16_t * value)
+{
+    uint32_t decoded;
+    int used;
+
+    used = cpt_varint_get(buf + *offset, size - *offset, &decoded);
+
+    if (used <= 0 || decoded > UINT16_MAX)
     {
-        packet->channel_id = 0;
+        return -1;
     }
-    else if (packet->command != 0)
+
+    *offset += (size_t) used;
+    *value = (uint16_t) decoded;
+
+    return 0;
+}
+
+size_t cpt_request_record_size(const struct CptRequest * req)
+{
+    return 1 + cpt_varint_size(req->channel_id) + cpt_varint_size(req->msg_len) + (size_t) req->msg_len;
+}
+
+size_t cpt_serialize_request_record(struct CptRequest * req, uint8_t * buffer, size_t buf_size)
+{
+    size_t offset;
+
+    if (buf_size < cpt_request_record_size(req))
     {
-        packet->command = 0;
+        return 0;
     }
-    else if (packet->msg_len != 0)
+
+    buffer[0] = req->command;
+    offset = 1;
+    offset += cpt_varint_put(req->channel_id, buffer + offset);
+    offset += cpt_varint_put(req->msg_len, buffer + offset);
+
+    if (req->msg_len > 0)
     {
-        packet->msg_len = 0;
+        memcpy(buffer + offset, req->msg, req->msg_len);
     }
+
+    return offset + req->msg_len;
 }
 
-void pack_u16(uint16_t value, uint8_t buf[2])
+int cpt_parse_request_record(struct CptRequest * req, uint8_t * buf, size_t size)
 {
-    uint16_t sig_byte_mask;
-    uint16_t lsig_byte_mask;
-    uint8_t sig_byte;
-    uint8_t lsig_byte;
+    size_t offset;
 
-    sig_byte_mask = 0b1111111100000000;
-    lsig_byte_mask = 0b0000000011111111;
+    if (size < 1)
+    {
+        return -1;
+    }
+
+    req->version = CPT_VERSION_BATCHED;
+    req->command = buf[0];
+    offset = 1;
+
+    if (get_u16_varint(buf, size, &offset, &req->channel_id) < 0 ||
+        get_u16_varint(buf, size, &offset, &req->msg_len) < 0 ||
+        size - offset < req->msg_len)
+    {
+        return -1;
+    }
 
+    req->msg = (char *) (buf + offset);
 
-    sig_byte = (uint8_t) ((value & sig_byte_mask) >> 8);
-    lsig_byte = (uint8_t) (value & lsig_byte_mask);
+    return (int) (offset + req->msg_len);
+}
 
-    buf[0] = sig_byte;
-    buf[1] = lsig_byte;
+size_t cpt_response_record_size(const struct CptResponse * res)
+{
+    return 1 + cpt_varint_size(res->channel_id) + cpt_varint_size(res->user_id) + cpt_varint_size(res->msg_len) +
+           (size_t) res->msg_len;
 }
 
-uint16_t unpack_u16(uint8_t * buf, int * count)
+size_t cpt_serialize_response_record(struct CptResponse * res, uint8_t * buffer, size_t buf_size)
 {
-    uint16_t byte;
+    size_t offset;
 
-    byte = 0;
-    byte = (uint16_t) (( * buf + byte) << 8);
-    (count)++;
-    buf++;
+    if (buf_size < cpt_response_record_size(res))
+    {
+        return 0;
+    }
 
-    byte += ( * buf);
-    buf++;
+    buffer[0] = res->code;
+    offset = 1;
+    offset += cpt_varint_put(res->channel_id, buffer + offset);
+    offset += cpt_varint_put(res->user_id, buffer + offset);
+    offset += cpt_varint_put(res->msg_len, buffer + offset);
 
-    return byte;
+    if (res->msg_len > 0)
+    {
+        memcpy(buffer + offset, res->msg, res->msg_len);
+    }
+
+    return offset + res->msg_len;
 }
 
+int cpt_parse_response_record(struct CptResponse * res, uint8_t * buf, size_t size)
+{
+    size_t offset;
+
+    if (size < 1 || !cpt_valid_response_code(buf[0]))
+    {
+        return -1;
+    }
+
+    res->code = buf[0];
+    offset = 1;
+
+    if (get_u16_varint(buf, size, &offset, &res->channel_id) < 0 ||
+        get_u16_varint(buf, size, &offset, &res->user_id) < 0 ||
+        get_u16_varint(buf, size, &offset, &res->msg_len) < 0 ||
+        size - offset < res->msg_len)
+    {
+        return -1;
+    }
+
+    res->data_size = res->msg_len;
+    res->msg = buf + offset;
 
+    return (int) (offset + res->msg_len);
+}
 
+void pack_u16(uint16_t value, uint8_t buf[2])
+{
+    buf[0] = (uint8_t) (value >> 8);
+    buf[1] = (uint8_t) (value & 0xFF);
+}
 
+uint16_t unpack_u16(uint8_t * buf, int * count)
+{
+    uint16_t byte;
 
+    byte = (uint16_t) (buf[*count] << 8);
+    byte = (uint16_t) (byte | buf[*count + 1]);
+    *count += 2;
 
+    return byte;
+}
@@ -0,0 +1,619 @@
+#include "cpt_admin.h"
+#include "cpt_arena.h"
+#include "cpt_fanout.h"
+#include "cpt_server.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/**
+ * A query the admin socket answers and what prints its reply.
+ */
+struct query
+{
+    const char *name;
+    void (*print)(const struct cpt_admin *admin, FILE *out);
+};
+
+/**
+ * A user id in a top list and the value it is ranked by, loaded once.
+ */
+struct ranked
+{
+    int id;
+    uint64_t key;
+};
+
+static void *serve(void *arg);
+static void print_connections(const struct cpt_admin *admin, FILE *out);
+static void print_channels(const struct cpt_admin *admin, FILE *out);
+static void print_queues(const struct cpt_admin *admin, FILE *out);
+static void print_top(const struct cpt_admin *admin, FILE *out);
+static void print_lanes(const struct cpt_admin *admin, FILE *out);
+static void print_report(const struct cpt_admin *admin, FILE *out);
+static void print_stats(const struct cpt_admin *admin, FILE *out);
+static void print_help(const struct cpt_admin *admin, FILE *out);
+static size_t rank(struct ranked *top, size_t count, int id, uint64_t key);
+static uint64_t load(const _Atomic uint64_t *value);
+static void accept_operators(struct cpt_admin *admin);
+static void read_query(struct cpt_admin *admin, struct cpt_admin_conn *conn);
+static void write_reply(struct cpt_admin_conn *conn);
+static void drop_conn(struct cpt_admin_conn *conn);
+static void close_fds(struct cpt_admin *admin);
+
+static const struct query queries[] = {
+        {"connections", print_connections},
+        {"channels", print_channels},
+        {"queues", print_queues},
+        {"top", print_top},
+        {"lanes", print_lanes},
+        {"report", print_report},
+        {"stats", print_stats},
+        {"help", print_help},
+};
+
+struct cpt_admin *cpt_admin_open(const char *path, struct serverInfo *info)
+{
+    struct sockaddr_un addr;
+    struct cpt_admin *admin;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        return NULL;
+    }
+
+    strcpy(addr.sun_path, path);
+    admin = calloc(1, sizeof(struct cpt_admin));
+
+    if (admin == NULL)
+    {
+        return NULL;
+    }
+
+    admin->wake[0] = -1;
+    admin->wake[1] = -1;
+    admin->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    admin->stats = calloc(1, sizeof(struct cpt_admin_stats));
+
+    for (int i = 0; i < CPT_ADMIN_MAX_CONNECTIONS; i++)
+    {
+        admin->conns[i].fd = -1;
+    }
+
+    if (admin->listen_fd < 0 || admin->stats == NULL || pipe(admin->wake) < 0)
+    {
+        close_fds(admin);
+        free(admin->stats);
+        free(admin);
+        return NULL;
+    }
+
+    // a previous run that was killed, or the process this one upgrades, leaves the file behind
+    unlink(path);
+
+    if (fcntl(admin->listen_fd, F_SETFL, O_NONBLOCK) < 0 || fcntl(admin->listen_fd, F_SETFD, FD_CLOEXEC) < 0 ||
+        fcntl(admin->wake[0], F_SETFD, FD_CLOEXEC) < 0 || fcntl(admin->wake[1], F_SETFD, FD_CLOEXEC) < 0 ||
+        bind(admin->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(admin->listen_fd, CPT_ADMIN_MAX_CONNECTIONS) < 0)
+    {
+        close_fds(admin);
+        free(admin->stats);
+        free(admin);
+        return NULL;
+    }
+
+    // filled before the thread starts, which from then on only loads what the loop stores
+    cpt_server_publish(info, admin->stats);
+    admin->latency = info->latency;
+    admin->fanout = info->fanout;
+    atomic_init(&admin->queries, 0);
+
+    if (pthread_create(&admin->thread, NULL, serve, admin) != 0)
+    {
+        cpt_server_publish(info, NULL);
+        close_fds(admin);
+        free(admin->stats);
+        free(admin);
+        return NULL;
+    }
+
+    return admin;
+}
+
+void cpt_admin_close(struct cpt_admin *admin, struct serverInfo *info)
+{
+    if (admin == NULL)
+    {
+        return;
+    }
+
+    // closing the write end wakes the thread with end of file
+    close(admin->wake[1]);
+    admin->wake[1] = -1;
+    pthread_join(admin->thread, NULL);
+    cpt_server_publish(info, NULL);
+
+    for (int i = 0; i < CPT_ADMIN_MAX_CONNECTIONS; i++)
+    {
+        drop_conn(&admin->conns[i]);
+    }
+
+    close_fds(admin);
+    free(admin->stats);
+    free(admin);
+}
+
+int cpt_admin_query(const struct cpt_admin *admin, const char *query, FILE *out)
+{
+    for (size_t i = 0; i < sizeof(queries) / sizeof(queries[0]); i++)
+    {
+        if (strcmp(query, queries[i].name) == 0)
+        {
+            queries[i].print(admin, out);
+            return 0;
+        }
+    }
+
+    fprintf(out, "unknown query '%s', try help\n", query);
+
+    return -1;
+}
+
+/**
+ * The admin thread: accept operators, read their queries and write the
+ * replies until the wake pipe is closed.
+ */
+static void *serve(void *arg)
+{
+    struct pollfd fds[CPT_ADMIN_MAX_CONNECTIONS + 2];
+    struct cpt_admin_conn *conn;
+    struct cpt_admin *admin;
+
+    admin = arg;
+
+    for (;;)
+    {
+        fds[0].fd = admin->wake[0];
+        fds[0].events = POLLIN;
+        fds[1].fd = admin->listen_fd;
+        fds[1].events = POLLIN;
+
+        for (int i = 0; i < CPT_ADMIN_MAX_CONNECTIONS; i++)
+        {
+            conn = &admin->conns[i];
+            fds[i + 2].fd = conn->fd;
+            fds[i + 2].events = (short) (conn->reply != NULL ? POLLOUT : POLLIN);
+        }
+
+        if (poll(fds, CPT_ADMIN_MAX_CONNECTIONS + 2, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return NULL;
+        }
+
+        if (fds[0].revents != 0)
+        {
+            return NULL;
+        }
+
+        for (int i = 0; i < CPT_ADMIN_MAX_CONNECTIONS; i++)
+        {
+            conn = &admin->conns[i];
+
+            if (conn->fd < 0 || fds[i + 2].revents == 0)
+            {
+                continue;
+            }
+
+            if (conn->reply == NULL)
+            {
+                read_query(admin, conn);
+            }
+            else
+            {
+                write_reply(conn);
+            }
+        }
+
+        // after the connections, so a new one is not matched with a stale entry
+        if (fds[1].revents & POLLIN)
+        {
+            accept_operators(admin);
+        }
+    }
+}
+
+static void print_connections(const struct cpt_admin *admin, FILE *out)
+{
+    const struct cpt_admin_user *slot;
+    int versions[CPT_VERSION_SEQUENCED + 1];
+    uint8_t version;
+    int logged_in;
+    int parked;
+    int shm;
+
+    memset(versions, 0, sizeof(versions));
+    logged_in = 0;
+    parked = 0;
+    shm = 0;
+
+    for (int id = 0; id < CPT_ADMIN_IDS; id++)
+    {
+        slot = &admin->stats->users[id];
+
+        switch (atomic_load_explicit(&slot->state, memory_order_relaxed))
+        {
+            case CPT_ADMIN_LOGGED_IN:
+                logged_in++;
+                version = atomic_load_explicit(&slot->version, memory_order_relaxed);
+                versions[version >= 1 && version <= CPT_VERSION_SEQUENCED ? version : 0]++;
+                shm += atomic_load_explicit(&slot->shm, memory_order_relaxed) != 0;
+                break;
+            case CPT_ADMIN_PARKED:
+                parked++;
+                break;
+            default:
+                break;
+        }
+    }
+
+    fprintf(out, "connections: %d logged in, %d parked, %d on shared memory\n", logged_in, parked, shm);
+    fprintf(out, "versions: 1 %d, 2 %d, 3 %d, 4 %d\n", versions[1], versions[CPT_VERSION_BATCHED],
+            versions[CPT_VERSION_COMPRESSED], versions[CPT_VERSION_SEQUENCED]);
+}
+
+static void print_channels(const struct cpt_admin *admin, FILE *out)
+{
+    int32_t members;
+    int count;
+
+    count = 0;
+
+    for (int i = 0; i < CPT_ADMIN_IDS; i++)
+    {
+        count += atomic_load_explicit(&admin->stats->members[i], memory_order_relaxed) >= 0;
+    }
+
+    fprintf(out, "channels: %d\n", count);
+
+    for (int i = 0; i < CPT_ADMIN_IDS; i++)
+    {
+        members = atomic_load_explicit(&admin->stats->members[i], memory_order_relaxed);
+
+        if (members >= 0)
+        {
+            fprintf(out, "channel %d: %" PRId32 " members, seq %" PRIu32 "\n", i, members,
+                    atomic_load_explicit(&admin->stats->seq[i], memory_order_relaxed));
+        }
+    }
+}
+
+static void print_queues(const struct cpt_admin *admin, FILE *out)
+{
+    struct ranked top[CPT_ADMIN_TOP];
+    const struct cpt_admin_user *slot;
+    uint64_t queued;
+    uint64_t total;
+    size_t count;
+    int waiting;
+
+    count = 0;
+    total = 0;
+    waiting = 0;
+
+    for (int id = 0; id < CPT_ADMIN_IDS; id++)
+    {
+        slot = &admin->stats->users[id];
+
+        if (atomic_load_explicit(&slot->state, memory_order_relaxed) != CPT_ADMIN_LOGGED_IN)
+        {
+            continue;
+        }
+
+        queued = load(&slot->queued) + load(&slot->urgent);
+
+        if (queued > 0)
+        {
+            total += queued;
+            waiting++;
+            count = rank(top, count, id, queued);
+        }
+    }
+
+    fprintf(out, "queues: %" PRIu64 " bytes waiting for %d clients\n", total, waiting);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        slot = &admin->stats->users[top[i].id];
+        fprintf(out, "user %d: %" PRIu64 " bytes queued, %" PRIu64 " urgent\n", top[i].id, load(&slot->queued),
+                load(&slot->urgent));
+    }
+}
+
+static void print_top(const struct cpt_admin *admin, FILE *out)
+{
+    struct ranked top[CPT_ADMIN_TOP];
+    const struct cpt_admin_user *slot;
+    size_t count;
+
+    count = 0;
+
+    for (int id = 0; id < CPT_ADMIN_IDS; id++)
+    {
+        slot = &admin->stats->users[id];
+
+        if (atomic_load_explicit(&slot->state, memory_order_relaxed) == CPT_ADMIN_LOGGED_IN)
+        {
+            count = rank(top, count, id, load(&slot->sent));
+        }
+    }
+
+    fprintf(out, "top talkers: %zu\n", count);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        fprintf(out, "user %d: %" PRIu64 " messages, %" PRIu64 " bytes\n", top[i].id, top[i].key,
+                load(&admin->stats->users[top[i].id].sent_bytes));
+    }
+}
+
+static void print_lanes(const struct cpt_admin *admin, FILE *out)
+{
+    struct cpt_fanout *fanout;
+
+    fanout = admin->fanout;
+
+    if (fanout == NULL)
+    {
+        fprintf(out, "lanes: 1, no fan-out\n");
+        return;
+    }
+
+    // the lane count and threshold never change, each lane only ever adds to its own counters
+    fprintf(out, "lanes: %d, from %zu members\n", fanout->lanes, fanout->threshold);
+
+    for (int lane = 0; lane < fanout->lanes; lane++)
+    {
+        fprintf(out, "lane %d: %" PRIu64 " delivered, finished generation %" PRIu64 "\n", lane,
+                load(&fanout->delivered[lane]), load(&fanout->quiescent[lane]));
+    }
+}
+
+static void print_report(const struct cpt_admin *admin, FILE *out)
+{
+    const struct cpt_admin_stats *stats;
+
+    stats = admin->stats;
+    cpt_server_latency_report(admin->latency, out);
+
+    if (load(&stats->arena_regions) > 0)
+    {
+        fprintf(out,
+                "input arena: %" PRIu64 " regions of %d MB, %" PRIu64 " on explicit huge pages, %" PRIu64
+                " slots in use\n",
+                load(&stats->arena_regions), CPT_ARENA_REGION / (1024 * 1024), load(&stats->arena_explicit),
+                load(&stats->arena_in_use));
+    }
+
+    fprintf(out, "memory: %" PRIu64 " KB in use, %" PRIu64 " KB peak, budget %" PRIu64 " KB\n",
+            load(&stats->memory_used) / 1024, load(&stats->memory_peak) / 1024, load(&stats->memory_budget) / 1024);
+
+    if (load(&stats->shed_bytes) > 0 || load(&stats->shed_clients) > 0)
+    {
+        fprintf(out, "shed: %" PRIu64 " KB of cached frames and spare output, %" PRIu64 " clients disconnected\n",
+                load(&stats->shed_bytes) / 1024, load(&stats->shed_clients));
+    }
+}
+
+static void print_stats(const struct cpt_admin *admin, FILE *out)
+{
+    print_connections(admin, out);
+    print_queues(admin, out);
+    print_top(admin, out);
+    print_lanes(admin, out);
+    print_report(admin, out);
+    print_channels(admin, out);
+}
+
+static void print_help(const struct cpt_admin *admin, FILE *out)
+{
+    (void) admin;
+
+    for (size_t i = 0; i < sizeof(queries) / sizeof(queries[0]); i++)
+    {
+        fprintf(out, "%s\n", queries[i].name);
+    }
+}
+
+/**
+ * Put a user id into the list of the <count> with the largest <key> so
+ * far, which is kept sorted and at most CPT_ADMIN_TOP long.
+ *
+ * @return The new length of the list.
+ */
+static size_t rank(struct ranked *top, size_t count, int id, uint64_t key)
+{
+    size_t at;
+
+    if (key == 0 || (count == CPT_ADMIN_TOP && top[count - 1].key >= key))
+    {
+        return count;
+    }
+
+    if (count < CPT_ADMIN_TOP)
+    {
+        count++;
+    }
+
+    for (at = count - 1; at > 0 && top[at - 1].key < key; at--)
+    {
+        top[at] = top[at - 1];
+    }
+
+    top[at].id = id;
+    top[at].key = key;
+
+    return count;
+}
+
+static uint64_t load(const _Atomic uint64_t *value)
+{
+    return atomic_load_explicit(value, memory_order_relaxed);
+}
+
+static void accept_operators(struct cpt_admin *admin)
+{
+    struct cpt_admin_conn *conn;
+    int fd;
+
+    for (;;)
+    {
+        fd = accept(admin->listen_fd, NULL, NULL);
+
+        if (fd < 0)
+        {
+            return;
+        }
+
+        conn = NULL;
+
+        for (int i = 0; i < CPT_ADMIN_MAX_CONNECTIONS && conn == NULL; i++)
+        {
+            if (admin->conns[i].fd < 0)
+            {
+                conn = &admin->conns[i];
+            }
+        }
+
+        if (conn == NULL || fcntl(fd, F_SETFL, O_NONBLOCK) < 0 || fcntl(fd, F_SETFD, FD_CLOEXEC) < 0)
+        {
+            close(fd);
+            continue;
+        }
+
+        conn->fd = fd;
+        conn->line_len = 0;
+    }
+}
+
+static void read_query(struct cpt_admin *admin, struct cpt_admin_conn *conn)
+{
+    FILE *stream;
+    char *end;
+    ssize_t nread;
+
+    nread = read(conn->fd, conn->line + conn->line_len, sizeof(conn->line) - 1 - conn->line_len);
+
+    if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+        return;
+    }
+
+    if (nread <= 0)
+    {
+        drop_conn(conn);
+        return;
+    }
+
+    conn->line_len += (size_t) nread;
+    conn->line[conn->line_len] = '\0';
+    end = strchr(conn->line, '\n');
+
+    // a line that fills the buffer is answered as it is, and will not be a known query
+    if (end == NULL && conn->line_len < sizeof(conn->line) - 1)
+    {
+        return;
+    }
+
+    if (end != NULL)
+    {
+        *end = '\0';
+    }
+
+    end = conn->line + strlen(conn->line);
+
+    while (end > conn->line && (end[-1] == '\r' || end[-1] == ' '))
+    {
+        *--end = '\0';
+    }
+
+    stream = open_memstream(&conn->reply, &conn->reply_len);
+
+    if (stream == NULL)
+    {
+        drop_conn(conn);
+        return;
+    }
+
+    cpt_admin_query(admin, conn->line, stream);
+    fclose(stream);
+    atomic_fetch_add_explicit(&admin->queries, 1, memory_order_relaxed);
+    conn->sent = 0;
+    write_reply(conn);
+}
+
+static void write_reply(struct cpt_admin_conn *conn)
+{
+    ssize_t nwritten;
+
+    nwritten = send(conn->fd, conn->reply + conn->sent, conn->reply_len - conn->sent, MSG_NOSIGNAL);
+
+    if (nwritten < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+        return;
+    }
+
+    if (nwritten > 0)
+    {
+        conn->sent += (size_t) nwritten;
+    }
+
+    if (nwritten <= 0 || conn->sent == conn->reply_len)
+    {
+        drop_conn(conn);
+    }
+}
+
+static void drop_conn(struct cpt_admin_conn *conn)
+{
+    if (conn->fd >= 0)
+    {
+        close(conn->fd);
+    }
+
+    free(conn->reply);
+    conn->fd = -1;
+    conn->line_len = 0;
+    conn->reply = NULL;
+    conn->reply_len = 0;
+    conn->sent = 0;
+}
+
+static void close_fds(struct cpt_admin *admin)
+{
+    if (admin->listen_fd >= 0)
+    {
+        close(admin->listen_fd);
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+        if (admin->wake[i] >= 0)
+        {
+            close(admin->wake[i]);
+        }
+    }
+}
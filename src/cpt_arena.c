@@ -0,0 +1,201 @@
+// MAP_HUGETLB and MADV_HUGEPAGE are Linux extensions
+#define _GNU_SOURCE
+
+#include "cpt_arena.h"
+#include "cpt_cpu.h"
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#define REGIONS_INITIAL_CAPACITY 4
+
+static uint8_t *map_region(struct cpt_arena *arena);
+static uint8_t *map_aligned(void);
+
+struct cpt_arena *cpt_arena_create(size_t slot_size, int pages)
+{
+    return cpt_arena_create_on(slot_size, pages, -1);
+}
+
+struct cpt_arena *cpt_arena_create_on(size_t slot_size, int pages, int node)
+{
+    struct cpt_arena *arena;
+
+    if (slot_size < sizeof(void *) || slot_size > CPT_ARENA_REGION)
+    {
+        return NULL;
+    }
+
+    arena = calloc(1, sizeof(struct cpt_arena));
+
+    if (arena == NULL)
+    {
+        return NULL;
+    }
+
+    // keep every slot pointer-aligned for the free list
+    arena->slot_size = (slot_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    arena->pages = pages;
+    arena->node = node;
+
+    return arena;
+}
+
+uint8_t *cpt_arena_alloc(struct cpt_arena *arena)
+{
+    uint8_t *slot;
+
+    if (arena->free_list != NULL)
+    {
+        slot = arena->free_list;
+        arena->free_list = *(void **) arena->free_list;
+        arena->in_use++;
+        return slot;
+    }
+
+    if (arena->next == NULL || (size_t) (arena->end - arena->next) < arena->slot_size)
+    {
+        slot = map_region(arena);
+
+        if (slot == NULL)
+        {
+            return NULL;
+        }
+
+        arena->next = slot;
+        arena->end = slot + CPT_ARENA_REGION;
+    }
+
+    slot = arena->next;
+    arena->next += arena->slot_size;
+    arena->in_use++;
+
+    return slot;
+}
+
+void cpt_arena_free(struct cpt_arena *arena, uint8_t *slot)
+{
+    // the most recently freed slot is reused first, its pages are the likeliest to be warm
+    *(void **) slot = arena->free_list;
+    arena->free_list = slot;
+    arena->in_use--;
+}
+
+/**
+ * Map one more region and remember it for cpt_arena_destroy().
+ */
+static uint8_t *map_region(struct cpt_arena *arena)
+{
+    uint8_t **regions;
+    uint8_t *base;
+    size_t capacity;
+
+    if (arena->region_count == arena->region_capacity)
+    {
+        capacity = arena->region_capacity == 0 ? REGIONS_INITIAL_CAPACITY : arena->region_capacity * 2;
+        regions = realloc(arena->regions, capacity * sizeof(uint8_t *));
+
+        if (regions == NULL)
+        {
+            return NULL;
+        }
+
+        arena->regions = regions;
+        arena->region_capacity = capacity;
+    }
+
+    base = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if (arena->pages == CPT_ARENA_EXPLICIT)
+    {
+        // fails unless vm.nr_hugepages has reserved enough pages
+        base = mmap(NULL, CPT_ARENA_REGION, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1,
+                    0);
+    }
+#endif
+
+    if (base != MAP_FAILED)
+    {
+        arena->explicit_regions++;
+    }
+    else
+    {
+        base = map_aligned();
+
+        if (base == MAP_FAILED)
+        {
+            return NULL;
+        }
+
+#ifdef MADV_HUGEPAGE
+        if (arena->pages != CPT_ARENA_SMALL_PAGES)
+        {
+            // only a hint, in "never" mode or without free huge pages the region stays on 4 KB pages
+            madvise(base, CPT_ARENA_REGION, MADV_HUGEPAGE);
+        }
+#endif
+    }
+
+    // nothing in the region is touched yet, so every page faults in on the node
+    if (arena->node >= 0)
+    {
+        cpt_cpu_bind(base, CPT_ARENA_REGION, arena->node);
+    }
+
+    arena->regions[arena->region_count++] = base;
+
+    return base;
+}
+
+/**
+ * Map a region aligned to a huge page, which the kernel only backs with
+ * transparent huge pages where a whole aligned 2 MB range is mapped.
+ * One huge page more is mapped and the slack on either side trimmed.
+ */
+static uint8_t *map_aligned(void)
+{
+    uint8_t *raw;
+    uint8_t *base;
+    size_t head;
+    size_t tail;
+
+    raw = mmap(NULL, CPT_ARENA_REGION + CPT_ARENA_HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+               -1, 0);
+
+    if (raw == MAP_FAILED)
+    {
+        return MAP_FAILED;
+    }
+
+    head = (CPT_ARENA_HUGE_PAGE - (size_t) ((uintptr_t) raw % CPT_ARENA_HUGE_PAGE)) % CPT_ARENA_HUGE_PAGE;
+    tail = CPT_ARENA_HUGE_PAGE - head;
+    base = raw + head;
+
+    if (head > 0)
+    {
+        munmap(raw, head);
+    }
+
+    if (tail > 0)
+    {
+        munmap(base + CPT_ARENA_REGION, tail);
+    }
+
+    return base;
+}
+
+void cpt_arena_destroy(struct cpt_arena *arena)
+{
+    if (arena == NULL)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < arena->region_count; i++)
+    {
+        munmap(arena->regions[i], CPT_ARENA_REGION);
+    }
+
+    free(arena->regions);
+    free(arena);
+}
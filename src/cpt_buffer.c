@@ -0,0 +1,171 @@
+#include "cpt_buffer.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define CPT_BUFFER_MIN_CAPACITY 1024
+
+static uint8_t *take_storage(struct cpt_buffer_pool *pool, size_t size);
+static void give_storage(struct cpt_buffer_pool *pool, uint8_t *data, size_t size);
+
+void cpt_buffer_init(struct cpt_buffer * buf, size_t limit)
+{
+    buf->data = NULL;
+    buf->head = 0;
+    buf->tail = 0;
+    buf->capacity = 0;
+    buf->limit = limit;
+    buf->pool = NULL;
+}
+
+void cpt_buffer_destroy(struct cpt_buffer * buf)
+{
+    give_storage(buf->pool, buf->data, buf->capacity);
+    buf->data = NULL;
+    buf->head = 0;
+    buf->tail = 0;
+    buf->capacity = 0;
+}
+
+int cpt_buffer_move(struct cpt_buffer * buf, struct cpt_buffer_pool * pool)
+{
+    size_t used;
+    uint8_t *data;
+
+    if (buf->capacity == 0)
+    {
+        buf->pool = pool;
+        return 0;
+    }
+
+    data = take_storage(pool, buf->capacity);
+
+    if (data == NULL)
+    {
+        return -1;
+    }
+
+    used = buf->tail - buf->head;
+    memcpy(data, buf->data + buf->head, used);
+    give_storage(buf->pool, buf->data, buf->capacity);
+    buf->data = data;
+    buf->head = 0;
+    buf->tail = used;
+    buf->pool = pool;
+
+    return 0;
+}
+
+uint8_t * cpt_buffer_reserve(struct cpt_buffer * buf, size_t size)
+{
+    size_t used;
+    size_t capacity;
+    uint8_t *data;
+
+    if (buf->capacity - buf->tail >= size)
+    {
+        return buf->data + buf->tail;
+    }
+
+    used = buf->tail - buf->head;
+
+    if (size > buf->limit || used > buf->limit - size)
+    {
+        return NULL;
+    }
+
+    if (buf->capacity - used >= size)
+    {
+        memmove(buf->data, buf->data + buf->head, used);
+        buf->head = 0;
+        buf->tail = used;
+        return buf->data + buf->tail;
+    }
+
+    capacity = buf->capacity == 0 ? CPT_BUFFER_MIN_CAPACITY : buf->capacity;
+
+    while (capacity - used < size)
+    {
+        capacity *= 2;
+    }
+
+    if (capacity > buf->limit)
+    {
+        capacity = buf->limit;
+    }
+
+    if (buf->head != 0)
+    {
+        memmove(buf->data, buf->data + buf->head, used);
+        buf->head = 0;
+        buf->tail = used;
+    }
+
+    if (buf->pool == NULL)
+    {
+        data = realloc(buf->data, capacity);
+    }
+    else
+    {
+        data = take_storage(buf->pool, capacity);
+
+        if (data != NULL && buf->data != NULL)
+        {
+            memcpy(data, buf->data, used);
+            give_storage(buf->pool, buf->data, buf->capacity);
+        }
+    }
+
+    if (data == NULL)
+    {
+        return NULL;
+    }
+
+    buf->data = data;
+    buf->capacity = capacity;
+
+    return buf->data + buf->tail;
+}
+
+void cpt_buffer_commit(struct cpt_buffer * buf, size_t size)
+{
+    buf->tail += size;
+}
+
+void cpt_buffer_consume(struct cpt_buffer * buf, size_t size)
+{
+    buf->head += size;
+
+    if (buf->head == buf->tail)
+    {
+        buf->head = 0;
+        buf->tail = 0;
+    }
+}
+
+size_t cpt_buffer_length(const struct cpt_buffer * buf)
+{
+    return buf->tail - buf->head;
+}
+
+/**
+ * <size> bytes from <pool>, or from malloc() without one.
+ */
+static uint8_t *take_storage(struct cpt_buffer_pool *pool, size_t size)
+{
+    return pool == NULL ? malloc(size) : pool->alloc(pool->arg, size);
+}
+
+/**
+ * Hand storage back to where take_storage() got it.
+ */
+static void give_storage(struct cpt_buffer_pool *pool, uint8_t *data, size_t size)
+{
+    if (pool == NULL)
+    {
+        free(data);
+    }
+    else if (data != NULL)
+    {
+        pool->free(pool->arg, data, size);
+    }
+}
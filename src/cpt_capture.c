@@ -0,0 +1,225 @@
+#include "cpt_capture.h"
+#include "common.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RING_MASK (CPT_CAPTURE_RING - 1)
+// connection id, time delta and length
+#define RECORD_HEADER_MAX (3 * CPT_VARINT_MAX)
+// how long the writer sleeps when the ring is empty
+#define IDLE_NS 1000000
+
+static void push(struct cpt_capture *capture, uint32_t id, uint64_t now_us, const uint8_t *frame, size_t size);
+static void copy_in(struct cpt_capture *capture, uint64_t pos, const uint8_t *src, size_t size);
+static void *write_records(void *arg);
+static size_t write_out(struct cpt_capture *capture, uint64_t head, uint64_t tail);
+static int write_all(int fd, const uint8_t *buf, size_t size);
+
+struct cpt_capture *cpt_capture_open(const char *path)
+{
+    struct cpt_capture *capture;
+
+    capture = calloc(1, sizeof(struct cpt_capture));
+
+    if (capture == NULL)
+    {
+        return NULL;
+    }
+
+    capture->ring = malloc(CPT_CAPTURE_RING);
+    capture->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (capture->ring == NULL || capture->fd < 0 ||
+        write_all(capture->fd, (const uint8_t *) CPT_CAPTURE_MAGIC, CPT_CAPTURE_MAGIC_SIZE) < 0)
+    {
+        if (capture->fd >= 0)
+        {
+            close(capture->fd);
+        }
+        free(capture->ring);
+        free(capture);
+        return NULL;
+    }
+
+    atomic_init(&capture->head, 0);
+    atomic_init(&capture->tail, 0);
+    atomic_init(&capture->stopping, 0);
+
+    if (pthread_create(&capture->thread, NULL, write_records, capture) != 0)
+    {
+        close(capture->fd);
+        free(capture->ring);
+        free(capture);
+        return NULL;
+    }
+
+    return capture;
+}
+
+uint32_t cpt_capture_connection(struct cpt_capture *capture)
+{
+    return ++capture->next_id;
+}
+
+void cpt_capture_frame(struct cpt_capture *capture, uint32_t id, uint64_t now_us, const uint8_t *frame, size_t size)
+{
+    push(capture, id, now_us, frame, size);
+}
+
+void cpt_capture_close(struct cpt_capture *capture, uint32_t id, uint64_t now_us)
+{
+    push(capture, id, now_us, NULL, 0);
+}
+
+/**
+ * Append one record to the ring, or count it as dropped if the writer
+ * has fallen that far behind.
+ */
+static void push(struct cpt_capture *capture, uint32_t id, uint64_t now_us, const uint8_t *frame, size_t size)
+{
+    uint8_t header[RECORD_HEADER_MAX];
+    uint64_t head;
+    uint64_t tail;
+    size_t header_size;
+    uint64_t delta;
+
+    // the clock is per poll round, it never goes back
+    delta = capture->last_us == 0 || now_us < capture->last_us ? 0 : now_us - capture->last_us;
+    header_size = cpt_varint_put(id, header);
+    header_size += cpt_varint_put(delta > UINT32_MAX ? UINT32_MAX : (uint32_t) delta, header + header_size);
+    header_size += cpt_varint_put((uint32_t) size, header + header_size);
+
+    head = atomic_load_explicit(&capture->head, memory_order_acquire);
+    tail = atomic_load_explicit(&capture->tail, memory_order_relaxed);
+
+    if (CPT_CAPTURE_RING - (tail - head) < header_size + size)
+    {
+        capture->dropped++;
+        return;
+    }
+
+    copy_in(capture, tail, header, header_size);
+    copy_in(capture, tail + header_size, frame, size);
+    capture->last_us = now_us;
+    capture->records++;
+
+    // the bytes are in place before the writer can see them
+    atomic_store_explicit(&capture->tail, tail + header_size + size, memory_order_release);
+}
+
+static void copy_in(struct cpt_capture *capture, uint64_t pos, const uint8_t *src, size_t size)
+{
+    size_t offset;
+    size_t first;
+
+    if (size == 0)
+    {
+        return;
+    }
+
+    offset = (size_t) (pos & RING_MASK);
+    first = CPT_CAPTURE_RING - offset < size ? CPT_CAPTURE_RING - offset : size;
+    memcpy(capture->ring + offset, src, first);
+    memcpy(capture->ring, src + first, size - first);
+}
+
+static void *write_records(void *arg)
+{
+    struct cpt_capture *capture;
+    struct timespec idle;
+    uint64_t head;
+    uint64_t tail;
+    int stopping;
+
+    capture = arg;
+    idle.tv_sec = 0;
+    idle.tv_nsec = IDLE_NS;
+
+    for (;;)
+    {
+        // read before the tail, so nothing pushed before the stop is left behind
+        stopping = atomic_load_explicit(&capture->stopping, memory_order_acquire);
+        head = atomic_load_explicit(&capture->head, memory_order_relaxed);
+        tail = atomic_load_explicit(&capture->tail, memory_order_acquire);
+
+        if (head == tail)
+        {
+            if (stopping)
+            {
+                return NULL;
+            }
+
+            nanosleep(&idle, NULL);
+            continue;
+        }
+
+        head += write_out(capture, head, tail);
+        atomic_store_explicit(&capture->head, head, memory_order_release);
+    }
+}
+
+/**
+ * Write the records between <head> and <tail>, up to the end of the ring.
+ *
+ * @return Bytes consumed from the ring.
+ */
+static size_t write_out(struct cpt_capture *capture, uint64_t head, uint64_t tail)
+{
+    size_t offset;
+    size_t size;
+
+    offset = (size_t) (head & RING_MASK);
+    size = (size_t) (tail - head);
+    size = CPT_CAPTURE_RING - offset < size ? CPT_CAPTURE_RING - offset : size;
+
+    // after a write error the rest is consumed and thrown away, the server goes on
+    if (!capture->failed && write_all(capture->fd, capture->ring + offset, size) < 0)
+    {
+        capture->failed = 1;
+    }
+
+    return size;
+}
+
+static int write_all(int fd, const uint8_t *buf, size_t size)
+{
+    ssize_t written;
+
+    while (size > 0)
+    {
+        written = write(fd, buf, size);
+
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (written <= 0)
+        {
+            return -1;
+        }
+
+        buf += written;
+        size -= (size_t) written;
+    }
+
+    return 0;
+}
+
+void cpt_capture_destroy(struct cpt_capture *capture)
+{
+    if (capture == NULL)
+    {
+        return;
+    }
+
+    atomic_store_explicit(&capture->stopping, 1, memory_order_release);
+    pthread_join(capture->thread, NULL);
+    close(capture->fd);
+    free(capture->ring);
+    free(capture);
+}
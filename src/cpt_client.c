@@ -0,0 +1,929 @@
+#include "cpt_client.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+static size_t build_request(uint8_t * serial_buf, size_t buf_size, uint8_t command, uint16_t channel_id, char * msg);
+static int batch_request(struct cpt_connection * conn, uint8_t version, uint8_t command, uint16_t channel_id,
+                         char * msg);
+static size_t drain_envelopes(struct cpt_response_decoder * dec, cpt_response_handler handler, void * arg);
+static struct cpt_channel_dictionary *find_dictionary(struct cpt_response_decoder * dec, uint16_t channel_id);
+static struct cpt_channel_sequence *find_sequence(const struct cpt_response_decoder * dec, uint16_t channel_id);
+static int track_sequence(struct cpt_response_decoder * dec, const struct CptResponse * res);
+static int store_dictionary(struct cpt_response_decoder * dec, const struct CptResponse * res);
+static int inflate_message(struct cpt_response_decoder * dec, struct CptResponse * res);
+static ssize_t flush_rings(struct cpt_connection * conn, size_t length);
+
+static size_t build_request(uint8_t * serial_buf, size_t buf_size, uint8_t command, uint16_t channel_id, char * msg)
+{
+    struct CptRequest req;
+    size_t msg_len;
+
+    msg_len = msg == NULL ? 0 : strlen(msg);
+
+    if (msg_len > UINT16_MAX)
+    {
+        return 0;
+    }
+
+    req.version = CPT_CLIENT_VERSION;
+    req.command = command;
+    req.channel_id = channel_id;
+    req.msg_len = (uint16_t) msg_len;
+    req.msg = msg;
+
+    return cpt_serialize_request(&req, serial_buf, buf_size);
+}
+
+size_t cpt_login(uint8_t * serial_buf, size_t buf_size, char * name)
+{
+    return build_request(serial_buf, buf_size, LOGIN, 0, name);
+}
+
+size_t cpt_logout(uint8_t * serial_buf, size_t buf_size)
+{
+    return build_request(serial_buf, buf_size, LOGOUT, 0, NULL);
+}
+
+size_t cpt_get_users(uint8_t * serial_buf, size_t buf_size, uint16_t channel_id)
+{
+    return build_request(serial_buf, buf_size, GET_USERS, channel_id, NULL);
+}
+
+size_t cpt_create_channel(uint8_t * serial_buf, size_t buf_size, char * user_list)
+{
+    return build_request(serial_buf, buf_size, CREATE_CHANNEL, 0, user_list);
+}
+
+size_t cpt_join_channel(uint8_t * serial_buf, size_t buf_size, uint16_t channel_id)
+{
+    return build_request(serial_buf, buf_size, JOIN_CHANNEL, channel_id, NULL);
+}
+
+size_t cpt_leave_channel(uint8_t * serial_buf, size_t buf_size, uint16_t channel_id)
+{
+    return build_request(serial_buf, buf_size, LEAVE_CHANNEL, channel_id, NULL);
+}
+
+size_t cpt_send(uint8_t * serial_buf, size_t buf_size, uint16_t channel_id, char * msg)
+{
+    return build_request(serial_buf, buf_size, SEND, channel_id, msg);
+}
+
+void cpt_connection_init(struct cpt_connection * conn, int fd, size_t output_limit)
+{
+    conn->fd = fd;
+    conn->version = CPT_CLIENT_VERSION;
+    conn->info.user_id = 0;
+    conn->info.channel_id = 0;
+    conn->batched = 0;
+    conn->shm = NULL;
+    cpt_buffer_init(&conn->out, output_limit);
+    cpt_envelope_init(&conn->envelope);
+}
+
+void cpt_connection_set_version(struct cpt_connection * conn, uint8_t version)
+{
+    cpt_envelope_seal(&conn->envelope, &conn->out);
+    conn->version = version;
+}
+
+void cpt_connection_destroy(struct cpt_connection * conn)
+{
+    cpt_buffer_destroy(&conn->out);
+    conn->batched = 0;
+
+    if (conn->shm != NULL)
+    {
+        cpt_shm_destroy(conn->shm);
+        free(conn->shm);
+        conn->shm = NULL;
+    }
+}
+
+int cpt_connection_attach_rings(struct cpt_connection * conn, int fd)
+{
+    struct cpt_shm *shm;
+
+    shm = malloc(sizeof(struct cpt_shm));
+
+    if (shm == NULL)
+    {
+        close(fd);
+        return -1;
+    }
+
+    if (cpt_shm_attach(shm, fd) < 0)
+    {
+        free(shm);
+        return -1;
+    }
+
+    conn->shm = shm;
+    cpt_shm_doorbell(conn->fd);
+
+    return 0;
+}
+
+int cpt_batch_append(struct cpt_connection * conn, struct CptRequest * req)
+{
+    uint8_t *dst;
+    size_t size;
+
+    if (conn->version >= CPT_VERSION_BATCHED)
+    {
+        size = cpt_request_record_size(req);
+        dst = cpt_envelope_reserve(&conn->envelope, &conn->out, size);
+    }
+    else
+    {
+        size = cpt_request_size(req);
+        dst = cpt_buffer_reserve(&conn->out, size);
+    }
+
+    if (dst == NULL)
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    if (conn->version >= CPT_VERSION_BATCHED)
+    {
+        cpt_envelope_commit(&conn->envelope, &conn->out, cpt_serialize_request_record(req, dst, size));
+    }
+    else
+    {
+        cpt_buffer_commit(&conn->out, cpt_serialize_request(req, dst, size));
+    }
+
+    conn->batched++;
+
+    return 0;
+}
+
+static int batch_request(struct cpt_connection * conn, uint8_t version, uint8_t command, uint16_t channel_id,
+                         char * msg)
+{
+    struct CptRequest req;
+    size_t msg_len;
+
+    msg_len = msg == NULL ? 0 : strlen(msg);
+
+    if (msg_len > UINT16_MAX)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    req.version = version;
+    req.command = command;
+    req.channel_id = channel_id;
+    req.msg_len = (uint16_t) msg_len;
+    req.msg = msg;
+
+    return cpt_batch_append(conn, &req);
+}
+
+int cpt_batch_login(struct cpt_connection * conn, char * name)
+{
+    return batch_request(conn, conn->version, LOGIN, 0, name);
+}
+
+int cpt_batch_login_batched(struct cpt_connection * conn, char * name)
+{
+    // the negotiating LOGIN itself is always a version 1 frame
+    return batch_request(conn, CPT_VERSION_BATCHED, LOGIN, 0, name);
+}
+
+int cpt_batch_login_compressed(struct cpt_connection * conn, char * name)
+{
+    return batch_request(conn, CPT_VERSION_COMPRESSED, LOGIN, 0, name);
+}
+
+int cpt_batch_login_sequenced(struct cpt_connection * conn, char * name)
+{
+    return batch_request(conn, CPT_VERSION_SEQUENCED, LOGIN, 0, name);
+}
+
+int cpt_batch_resume(struct cpt_connection * conn, uint16_t channel_id, uint32_t after)
+{
+    uint8_t number[CPT_VARINT_MAX];
+    struct CptRequest req;
+
+    req.version = conn->version;
+    req.command = RESUME;
+    req.channel_id = channel_id;
+    req.msg_len = (uint16_t) cpt_varint_put(after, number);
+    req.msg = (char *) number;
+
+    return cpt_batch_append(conn, &req);
+}
+
+int cpt_batch_map_rings(struct cpt_connection * conn)
+{
+    return batch_request(conn, conn->version, MAP_RINGS, 0, NULL);
+}
+
+int cpt_batch_logout(struct cpt_connection * conn)
+{
+    return batch_request(conn, conn->version, LOGOUT, 0, NULL);
+}
+
+int cpt_batch_get_users(struct cpt_connection * conn, uint16_t channel_id)
+{
+    return batch_request(conn, conn->version, GET_USERS, channel_id, NULL);
+}
+
+int cpt_batch_create_channel(struct cpt_connection * conn, char * user_list)
+{
+    return batch_request(conn, conn->version, CREATE_CHANNEL, 0, user_list);
+}
+
+int cpt_batch_join_channel(struct cpt_connection * conn, uint16_t channel_id)
+{
+    return batch_request(conn, conn->version, JOIN_CHANNEL, channel_id, NULL);
+}
+
+int cpt_batch_leave_channel(struct cpt_connection * conn, uint16_t channel_id)
+{
+    return batch_request(conn, conn->version, LEAVE_CHANNEL, channel_id, NULL);
+}
+
+int cpt_batch_send(struct cpt_connection * conn, uint16_t channel_id, char * msg)
+{
+    return batch_request(conn, conn->version, SEND, channel_id, msg);
+}
+
+ssize_t cpt_batch_flush(struct cpt_connection * conn)
+{
+    ssize_t nwritten;
+    size_t length;
+
+    cpt_envelope_seal(&conn->envelope, &conn->out);
+    length = cpt_buffer_length(&conn->out);
+
+    if (length == 0)
+    {
+        return 0;
+    }
+
+    if (conn->shm != NULL)
+    {
+        nwritten = flush_rings(conn, length);
+    }
+    else
+    {
+        nwritten = send(conn->fd, conn->out.data + conn->out.head, length, MSG_NOSIGNAL);
+    }
+
+    if (nwritten < 0)
+    {
+        return nwritten;
+    }
+
+    cpt_buffer_consume(&conn->out, (size_t) nwritten);
+
+    if (cpt_buffer_length(&conn->out) == 0)
+    {
+        conn->batched = 0;
+    }
+
+    return nwritten;
+}
+
+/**
+ * Copy the batch into the server's ring, ringing the doorbell if the server may be asleep.
+ */
+static ssize_t flush_rings(struct cpt_connection * conn, size_t length)
+{
+    size_t written;
+    int rc;
+
+    rc = cpt_shm_write(conn->shm, CPT_SHM_TO_SERVER, conn->out.data + conn->out.head, length, &written);
+
+    if (rc < 0)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+
+    if (rc > 0)
+    {
+        cpt_shm_doorbell(conn->fd);
+    }
+
+    if (written == 0)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    return (ssize_t) written;
+}
+
+size_t cpt_batch_pending(const struct cpt_connection * conn)
+{
+    return cpt_buffer_length(&conn->out);
+}
+
+int cpt_response_decoder_init(struct cpt_response_decoder * dec, size_t capacity)
+{
+    uint8_t *storage;
+
+    // the ring masks offsets with capacity - 1
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0)
+    {
+        return -1;
+    }
+
+    storage = malloc(capacity);
+    dec->scratch = malloc(CPT_VARINT_MAX + CPT_ENVELOPE_MAX);
+
+    if (storage == NULL || dec->scratch == NULL)
+    {
+        free(storage);
+        free(dec->scratch);
+        dec->scratch = NULL;
+        return -1;
+    }
+
+    cpt_ring_init(&dec->ring, storage, capacity);
+    dec->version = CPT_CLIENT_VERSION;
+    // the codec is only allocated once a compressed message arrives
+    dec->codec.window = NULL;
+    dec->codec.table = NULL;
+    dec->dicts = NULL;
+    dec->dict_count = 0;
+    dec->seqs = NULL;
+    dec->seq_count = 0;
+    dec->seq = 0;
+    dec->skip = 0;
+    dec->gaps = 0;
+    dec->duplicates = 0;
+    dec->decoded = 0;
+    dec->resyncs = 0;
+
+    return 0;
+}
+
+void cpt_response_decoder_destroy(struct cpt_response_decoder * dec)
+{
+    free(dec->ring.data);
+    free(dec->scratch);
+    dec->ring.data = NULL;
+    dec->scratch = NULL;
+    cpt_compressor_destroy(&dec->codec);
+
+    for (size_t i = 0; i < dec->dict_count; i++)
+    {
+        free(dec->dicts[i].data);
+    }
+
+    free(dec->dicts);
+    dec->dicts = NULL;
+    dec->dict_count = 0;
+    free(dec->seqs);
+    dec->seqs = NULL;
+    dec->seq_count = 0;
+}
+
+void cpt_response_decoder_set_version(struct cpt_response_decoder * dec, uint8_t version)
+{
+    dec->version = version;
+}
+
+uint32_t cpt_response_decoder_resume_after(const struct cpt_response_decoder * dec, uint16_t channel_id)
+{
+    const struct cpt_channel_sequence *entry;
+
+    entry = find_sequence(dec, channel_id);
+
+    if (entry == NULL)
+    {
+        return 0;
+    }
+
+    return entry->gap_from == 0 ? entry->last : entry->gap_from - 1;
+}
+
+void cpt_response_decoder_forget_channel(struct cpt_response_decoder * dec, uint16_t channel_id)
+{
+    struct cpt_channel_sequence *entry;
+
+    entry = find_sequence(dec, channel_id);
+
+    if (entry != NULL)
+    {
+        *entry = dec->seqs[--dec->seq_count];
+    }
+}
+
+ssize_t cpt_response_decoder_read(struct cpt_response_decoder * dec, int fd)
+{
+    struct iovec iov[2];
+    ssize_t nread;
+    int iovcnt;
+
+    iovcnt = cpt_ring_free_iov(&dec->ring, iov);
+
+    if (iovcnt == 0)
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    nread = readv(fd, iov, iovcnt);
+
+    if (nread > 0)
+    {
+        cpt_ring_produce(&dec->ring, (size_t) nread);
+    }
+
+    return nread;
+}
+
+ssize_t cpt_response_decoder_read_fd(struct cpt_response_decoder * dec, int fd, int * passed_fd)
+{
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov[2];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    ssize_t nread;
+    int iovcnt;
+
+    iovcnt = cpt_ring_free_iov(&dec->ring, iov);
+
+    if (iovcnt == 0)
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (size_t) iovcnt;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    nread = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+
+    if (nread <= 0)
+    {
+        return nread;
+    }
+
+    cpt_ring_produce(&dec->ring, (size_t) nread);
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len >= CMSG_LEN(sizeof(int)))
+        {
+            memcpy(passed_fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+
+    return nread;
+}
+
+ssize_t cpt_response_decoder_read_rings(struct cpt_response_decoder * dec, struct cpt_connection * conn)
+{
+    uint8_t bells[64];
+    struct iovec iov[2];
+    ssize_t nbells;
+    size_t moved;
+    size_t n;
+    int iovcnt;
+    int rc;
+    int wake;
+
+    // doorbells are consumed before the ring is read, so one rung after this read still wakes the caller
+    do
+    {
+        nbells = recv(conn->fd, bells, sizeof(bells), MSG_DONTWAIT);
+    } while (nbells == (ssize_t) sizeof(bells));
+
+    if (nbells == 0)
+    {
+        return 0;
+    }
+
+    if (nbells < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    {
+        return -1;
+    }
+
+    iovcnt = cpt_ring_free_iov(&dec->ring, iov);
+
+    if (iovcnt == 0)
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    moved = 0;
+    wake = 0;
+
+    for (int i = 0; i < iovcnt; i++)
+    {
+        rc = cpt_shm_read(conn->shm, CPT_SHM_TO_CLIENT, iov[i].iov_base, iov[i].iov_len, &n);
+
+        if (rc < 0)
+        {
+            errno = EPROTO;
+            return -1;
+        }
+
+        wake |= rc;
+        moved += n;
+
+        if (n < iov[i].iov_len)
+        {
+            break;
+        }
+    }
+
+    if (wake)
+    {
+        cpt_shm_doorbell(conn->fd);
+    }
+
+    if (moved == 0)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    cpt_ring_produce(&dec->ring, moved);
+
+    return (ssize_t) moved;
+}
+
+size_t cpt_response_decoder_feed(struct cpt_response_decoder * dec, const uint8_t * data, size_t size)
+{
+    return cpt_ring_write(&dec->ring, data, size);
+}
+
+size_t cpt_response_decoder_drain(struct cpt_response_decoder * dec, cpt_response_handler handler, void * arg)
+{
+    uint8_t header[CPT_RESPONSE_HEADER_SIZE];
+    struct CptResponse res;
+    uint8_t *frame;
+    size_t available;
+    size_t frame_size;
+    size_t emitted;
+
+    emitted = 0;
+
+    while ((available = cpt_ring_length(&dec->ring)) >= CPT_RESPONSE_HEADER_SIZE)
+    {
+        // a handler may have switched the framing after the previous response
+        if (dec->version >= CPT_VERSION_BATCHED)
+        {
+            break;
+        }
+
+        cpt_ring_peek(&dec->ring, 0, header, sizeof(header));
+
+        if (!cpt_valid_response_code(header[0]))
+        {
+            cpt_ring_consume(&dec->ring, 1);
+            dec->resyncs++;
+            continue;
+        }
+
+        frame_size = CPT_RESPONSE_HEADER_SIZE + (size_t) ((header[5] << 8) | header[6]);
+
+        if (available < frame_size)
+        {
+            break;
+        }
+
+        frame = cpt_ring_contiguous(&dec->ring, 0, frame_size);
+
+        if (frame == NULL)
+        {
+            cpt_ring_peek(&dec->ring, 0, dec->scratch, frame_size);
+            frame = dec->scratch;
+        }
+
+        cpt_parse_response_into(&res, frame, frame_size);
+        handler(arg, &res);
+        cpt_ring_consume(&dec->ring, frame_size);
+        dec->decoded++;
+        emitted++;
+    }
+
+    if (dec->version >= CPT_VERSION_BATCHED)
+    {
+        emitted += drain_envelopes(dec, handler, arg);
+    }
+
+    return emitted;
+}
+
+static size_t drain_envelopes(struct cpt_response_decoder * dec, cpt_response_handler handler, void * arg)
+{
+    uint8_t header[CPT_VARINT_MAX];
+    struct CptResponse res;
+    uint8_t *envelope;
+    size_t available;
+    size_t peeked;
+    size_t header_size;
+    size_t body_size;
+    size_t offset;
+    size_t emitted;
+    int used;
+
+    emitted = 0;
+
+    for (;;)
+    {
+        available = cpt_ring_length(&dec->ring);
+        peeked = available < sizeof(header) ? available : sizeof(header);
+        cpt_ring_peek(&dec->ring, 0, header, peeked);
+        used = cpt_envelope_parse_header(header, peeked, &header_size, &body_size);
+
+        if (used < 0)
+        {
+            cpt_ring_consume(&dec->ring, 1);
+            dec->resyncs++;
+            continue;
+        }
+
+        if (used == 0 || available < header_size + body_size)
+        {
+            break;
+        }
+
+        envelope = cpt_ring_contiguous(&dec->ring, 0, header_size + body_size);
+
+        if (envelope == NULL)
+        {
+            cpt_ring_peek(&dec->ring, 0, dec->scratch, header_size + body_size);
+            envelope = dec->scratch;
+        }
+
+        for (offset = header_size; offset < header_size + body_size; offset += (size_t) used)
+        {
+            used = cpt_parse_response_record(&res, envelope + offset, header_size + body_size - offset);
+
+            if (used < 0)
+            {
+                dec->resyncs++;
+                break;
+            }
+
+            if (res.code == CHANNEL_DICTIONARY)
+            {
+                dec->resyncs += store_dictionary(dec, &res) < 0;
+                continue;
+            }
+
+            if (res.code == MESSAGE_SEQUENCE)
+            {
+                dec->resyncs += track_sequence(dec, &res) < 0;
+                continue;
+            }
+
+            // the message behind a sequence number the client already has
+            if (dec->skip && (res.code == MESSAGE || res.code == MESSAGE_COMPRESSED))
+            {
+                dec->skip = 0;
+                dec->duplicates++;
+                continue;
+            }
+
+            if (res.code == MESSAGE_COMPRESSED && inflate_message(dec, &res) < 0)
+            {
+                dec->resyncs++;
+                continue;
+            }
+
+            handler(arg, &res);
+            dec->decoded++;
+            emitted++;
+        }
+
+        cpt_ring_consume(&dec->ring, header_size + body_size);
+    }
+
+    return emitted;
+}
+
+static struct cpt_channel_dictionary *find_dictionary(struct cpt_response_decoder * dec, uint16_t channel_id)
+{
+    for (size_t i = 0; i < dec->dict_count; i++)
+    {
+        if (dec->dicts[i].channel_id == channel_id)
+        {
+            return &dec->dicts[i];
+        }
+    }
+
+    return NULL;
+}
+
+static struct cpt_channel_sequence *find_sequence(const struct cpt_response_decoder * dec, uint16_t channel_id)
+{
+    for (size_t i = 0; i < dec->seq_count; i++)
+    {
+        if (dec->seqs[i].channel_id == channel_id)
+        {
+            return &dec->seqs[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Account for a MESSAGE_SEQUENCE record and decide whether the MESSAGE behind it is new.
+ *
+ * A number past <last> opens a gap over whatever was skipped. A lower
+ * one is a resend: it is new if it falls into the gap, which then
+ * shrinks to the numbers after it since resends come oldest first;
+ * otherwise the MESSAGE behind it is skipped.
+ *
+ * @return 0 on success, -1 if the record is malformed or memory ran out.
+ */
+static int track_sequence(struct cpt_response_decoder * dec, const struct CptResponse * res)
+{
+    struct cpt_channel_sequence *entry;
+    struct cpt_channel_sequence *seqs;
+    uint32_t seq;
+    int used;
+
+    used = cpt_varint_get(res->msg, res->msg_len, &seq);
+
+    if (used <= 0 || seq == 0)
+    {
+        return -1;
+    }
+
+    dec->seq = seq;
+    dec->skip = 0;
+    entry = find_sequence(dec, res->channel_id);
+
+    if (entry == NULL)
+    {
+        seqs = realloc(dec->seqs, (dec->seq_count + 1) * sizeof(struct cpt_channel_sequence));
+
+        if (seqs == NULL)
+        {
+            return -1;
+        }
+
+        dec->seqs = seqs;
+        entry = &dec->seqs[dec->seq_count++];
+        entry->channel_id = res->channel_id;
+        entry->last = seq;
+        entry->gap_from = 0;
+        entry->gap_to = 0;
+        return 0;
+    }
+
+    if (seq > entry->last)
+    {
+        if (seq > entry->last + 1)
+        {
+            dec->gaps += seq - entry->last - 1;
+            entry->gap_from = entry->gap_from == 0 ? entry->last + 1 : entry->gap_from;
+            entry->gap_to = seq - 1;
+        }
+
+        entry->last = seq;
+        return 0;
+    }
+
+    if (entry->gap_from != 0 && seq >= entry->gap_from && seq <= entry->gap_to)
+    {
+        entry->gap_from = seq == entry->gap_to ? 0 : seq + 1;
+        return 0;
+    }
+
+    dec->skip = 1;
+
+    return 0;
+}
+
+/**
+ * Replace a channel's dictionary with the one in a CHANNEL_DICTIONARY record.
+ *
+ * @return 0 on success, -1 if the record is malformed or memory ran out.
+ */
+static int store_dictionary(struct cpt_response_decoder * dec, const struct CptResponse * res)
+{
+    struct cpt_channel_dictionary *entry;
+    struct cpt_channel_dictionary *dicts;
+    uint8_t *data;
+    uint32_t id;
+    int used;
+
+    used = cpt_varint_get(res->msg, res->msg_len, &id);
+
+    if (used <= 0 || res->msg_len - (size_t) used > CPT_DICT_MAX)
+    {
+        return -1;
+    }
+
+    // one spare byte so an empty dictionary is not mistaken for a failed malloc
+    data = malloc(res->msg_len - (size_t) used + 1);
+
+    if (data == NULL)
+    {
+        return -1;
+    }
+
+    memcpy(data, res->msg + used, res->msg_len - (size_t) used);
+    entry = find_dictionary(dec, res->channel_id);
+
+    if (entry == NULL)
+    {
+        dicts = realloc(dec->dicts, (dec->dict_count + 1) * sizeof(struct cpt_channel_dictionary));
+
+        if (dicts == NULL)
+        {
+            free(data);
+            return -1;
+        }
+
+        dec->dicts = dicts;
+        entry = &dec->dicts[dec->dict_count++];
+        entry->channel_id = res->channel_id;
+        entry->data = NULL;
+    }
+
+    free(entry->data);
+    entry->id = id;
+    entry->data = data;
+    entry->size = res->msg_len - (size_t) used;
+
+    return 0;
+}
+
+/**
+ * Turn a MESSAGE_COMPRESSED record into the MESSAGE it was made from.
+ *
+ * The expanded MSG lives in the decoder's codec until the next call.
+ *
+ * @return 0 on success, -1 if the dictionary is unknown or the block is malformed.
+ */
+static int inflate_message(struct cpt_response_decoder * dec, struct CptResponse * res)
+{
+    const struct cpt_channel_dictionary *dict;
+    uint8_t *msg;
+    uint32_t dict_id;
+    uint32_t msg_len;
+    int used;
+    int header_size;
+
+    used = cpt_varint_get(res->msg, res->msg_len, &dict_id);
+
+    if (used <= 0)
+    {
+        return -1;
+    }
+
+    header_size = used;
+    used = cpt_varint_get(res->msg + header_size, res->msg_len - (size_t) header_size, &msg_len);
+
+    if (used <= 0 || msg_len > UINT16_MAX)
+    {
+        return -1;
+    }
+
+    header_size += used;
+    dict = dict_id == 0 ? NULL : find_dictionary(dec, res->channel_id);
+
+    // a dictionary that was replaced in the meantime cannot expand the block
+    if (dict_id != 0 && (dict == NULL || dict->id != dict_id))
+    {
+        return -1;
+    }
+
+    if (dec->codec.window == NULL && cpt_compressor_init(&dec->codec) < 0)
+    {
+        return -1;
+    }
+
+    msg = cpt_decompress(&dec->codec, dict == NULL ? NULL : dict->data, dict == NULL ? 0 : dict->size,
+                         res->msg + header_size, res->msg_len - (size_t) header_size, msg_len);
+
+    if (msg == NULL)
+    {
+        return -1;
+    }
+
+    res->code = MESSAGE;
+    res->data_size = (uint16_t) msg_len;
+    res->msg_len = (uint16_t) msg_len;
+    res->msg = msg;
+
+    return 0;
+}
@@ -0,0 +1,453 @@
+#include "cpt_compress.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define WINDOW_SIZE (CPT_DICT_MAX + UINT16_MAX)
+#define TABLE_SIZE (1U << CPT_COMPRESS_HASH_BITS)
+#define EMPTY_SLOT UINT32_MAX
+#define MIN_MATCH 4
+#define MAX_OFFSET UINT16_MAX
+// after every 64 misses in a row the search steps one byte further, incompressible stretches go by quickly
+#define SKIP_STRENGTH 6
+// the format ends every block with literals: no match may start in the last 12 or run into the last 5 bytes
+#define MATCH_LIMIT 12
+#define LAST_LITERALS 5
+
+static uint32_t read_u32(const uint8_t *p);
+static uint32_t hash_u32(uint32_t value);
+static uint8_t *put_length(uint8_t *op, const uint8_t *oend, size_t length);
+static uint8_t *put_sequence(uint8_t *op, const uint8_t *oend, const uint8_t *literals, size_t literal_len,
+                             size_t offset, size_t match_len);
+static void index_dictionary(uint32_t *table, const uint8_t *dict, size_t dict_size);
+static size_t compress_window(struct cpt_compressor *codec, size_t dict_size, size_t size, uint8_t *dst,
+                              size_t dst_size);
+
+int cpt_compressor_init(struct cpt_compressor * codec)
+{
+    codec->window = malloc(WINDOW_SIZE);
+    codec->table = malloc(TABLE_SIZE * sizeof(uint32_t));
+
+    if (codec->window == NULL || codec->table == NULL)
+    {
+        cpt_compressor_destroy(codec);
+        return -1;
+    }
+
+    return 0;
+}
+
+void cpt_compressor_destroy(struct cpt_compressor * codec)
+{
+    free(codec->window);
+    free(codec->table);
+    codec->window = NULL;
+    codec->table = NULL;
+}
+
+static uint32_t read_u32(const uint8_t *p)
+{
+    uint32_t value;
+
+    memcpy(&value, p, sizeof(value));
+
+    return value;
+}
+
+static uint32_t hash_u32(uint32_t value)
+{
+    return (value * 2654435761U) >> (32 - CPT_COMPRESS_HASH_BITS);
+}
+
+static uint8_t *put_length(uint8_t *op, const uint8_t *oend, size_t length)
+{
+    while (length >= 255)
+    {
+        if (op == oend)
+        {
+            return NULL;
+        }
+        *op++ = 255;
+        length -= 255;
+    }
+
+    if (op == oend)
+    {
+        return NULL;
+    }
+
+    *op++ = (uint8_t) length;
+
+    return op;
+}
+
+static uint8_t *put_sequence(uint8_t *op, const uint8_t *oend, const uint8_t *literals, size_t literal_len,
+                             size_t offset, size_t match_len)
+{
+    uint8_t *token;
+
+    if (op == oend)
+    {
+        return NULL;
+    }
+
+    token = op++;
+    *token = (uint8_t) ((literal_len >= 15 ? 15 : literal_len) << 4);
+
+    if (literal_len >= 15 && (op = put_length(op, oend, literal_len - 15)) == NULL)
+    {
+        return NULL;
+    }
+
+    if ((size_t) (oend - op) < literal_len)
+    {
+        return NULL;
+    }
+
+    memcpy(op, literals, literal_len);
+    op += literal_len;
+
+    // the last sequence carries literals only
+    if (match_len == 0)
+    {
+        return op;
+    }
+
+    if (oend - op < 2)
+    {
+        return NULL;
+    }
+
+    *op++ = (uint8_t) (offset & 0xFF);
+    *op++ = (uint8_t) (offset >> 8);
+    match_len -= MIN_MATCH;
+    *token = (uint8_t) (*token | (match_len >= 15 ? 15 : match_len));
+
+    if (match_len >= 15)
+    {
+        op = put_length(op, oend, match_len - 15);
+    }
+
+    return op;
+}
+
+static void index_dictionary(uint32_t *table, const uint8_t *dict, size_t dict_size)
+{
+    memset(table, 0xFF, TABLE_SIZE * sizeof(uint32_t));
+
+    for (size_t i = 0; i + MIN_MATCH <= dict_size; i++)
+    {
+        table[hash_u32(read_u32(dict + i))] = (uint32_t) i;
+    }
+}
+
+size_t cpt_compress(struct cpt_compressor * codec, const uint8_t * dict, size_t dict_size, const uint8_t * src,
+                    size_t size, uint8_t * dst, size_t dst_size)
+{
+    if (size > UINT16_MAX)
+    {
+        return 0;
+    }
+
+    if (dict == NULL || dict_size > CPT_DICT_MAX)
+    {
+        dict_size = 0;
+    }
+
+    // dictionary and data are laid out back to back so one index space covers both
+    if (dict_size > 0)
+    {
+        memcpy(codec->window, dict, dict_size);
+    }
+    memcpy(codec->window + dict_size, src, size);
+    index_dictionary(codec->table, codec->window, dict_size);
+
+    return compress_window(codec, dict_size, size, dst, dst_size);
+}
+
+size_t cpt_compress_dictionary(struct cpt_compressor * codec, const struct cpt_dictionary * dict, const uint8_t * src,
+                               size_t size, uint8_t * dst, size_t dst_size)
+{
+    if (dict->data == NULL || dict->table == NULL)
+    {
+        return cpt_compress(codec, NULL, 0, src, size, dst, dst_size);
+    }
+
+    if (size > UINT16_MAX)
+    {
+        return 0;
+    }
+
+    memcpy(codec->window, dict->data, dict->size);
+    memcpy(codec->window + dict->size, src, size);
+    memcpy(codec->table, dict->table, TABLE_SIZE * sizeof(uint32_t));
+
+    return compress_window(codec, dict->size, size, dst, dst_size);
+}
+
+/**
+ * Greedy match search over the data that follows the dictionary in the window.
+ *
+ * The table must already index the dictionary.
+ */
+static size_t compress_window(struct cpt_compressor *codec, size_t dict_size, size_t size, uint8_t *dst,
+                              size_t dst_size)
+{
+    const uint8_t *base;
+    const uint8_t *oend;
+    uint8_t *op;
+    size_t anchor, pos, end, limit, candidate, match_len, misses;
+    uint32_t h;
+
+    base = codec->window;
+    op = dst;
+    oend = dst + dst_size;
+    anchor = dict_size;
+    pos = dict_size;
+    end = dict_size + size;
+    limit = size > MATCH_LIMIT ? end - MATCH_LIMIT : dict_size;
+    misses = 0;
+
+    while (pos < limit)
+    {
+        h = hash_u32(read_u32(base + pos));
+        candidate = codec->table[h];
+        codec->table[h] = (uint32_t) pos;
+
+        if (candidate == EMPTY_SLOT || pos - candidate > MAX_OFFSET || read_u32(base + candidate) != read_u32(base + pos))
+        {
+            pos += 1 + (misses++ >> SKIP_STRENGTH);
+            continue;
+        }
+
+        match_len = MIN_MATCH;
+
+        while (pos + match_len < end - LAST_LITERALS && base[candidate + match_len] == base[pos + match_len])
+        {
+            match_len++;
+        }
+
+        op = put_sequence(op, oend, base + anchor, pos - anchor, pos - candidate, match_len);
+
+        if (op == NULL)
+        {
+            return 0;
+        }
+
+        pos += match_len;
+        anchor = pos;
+        misses = 0;
+    }
+
+    op = put_sequence(op, oend, base + anchor, end - anchor, 0, 0);
+
+    return op == NULL ? 0 : (size_t) (op - dst);
+}
+
+uint8_t * cpt_decompress(struct cpt_compressor * codec, const uint8_t * dict, size_t dict_size, const uint8_t * src,
+                         size_t size, size_t out_size)
+{
+    const uint8_t *ip;
+    const uint8_t *iend;
+    const uint8_t *match;
+    uint8_t *out;
+    uint8_t *op;
+    uint8_t *oend;
+    size_t literal_len, match_len, offset;
+    uint8_t token, extra;
+
+    if (dict == NULL || dict_size > CPT_DICT_MAX)
+    {
+        dict_size = 0;
+    }
+
+    if (out_size > UINT16_MAX)
+    {
+        return NULL;
+    }
+
+    if (dict_size > 0)
+    {
+        memcpy(codec->window, dict, dict_size);
+    }
+    out = codec->window + dict_size;
+    op = out;
+    oend = out + out_size;
+    ip = src;
+    iend = src + size;
+
+    while (ip < iend)
+    {
+        token = *ip++;
+        literal_len = token >> 4;
+
+        if (literal_len == 15)
+        {
+            do
+            {
+                if (ip == iend)
+                {
+                    return NULL;
+                }
+                extra = *ip++;
+                literal_len += extra;
+            } while (extra == 255);
+        }
+
+        if ((size_t) (iend - ip) < literal_len || (size_t) (oend - op) < literal_len)
+        {
+            return NULL;
+        }
+
+        memcpy(op, ip, literal_len);
+        ip += literal_len;
+        op += literal_len;
+
+        if (ip == iend)
+        {
+            break;
+        }
+
+        if (iend - ip < 2)
+        {
+            return NULL;
+        }
+
+        offset = (size_t) ip[0] | ((size_t) ip[1] << 8);
+        ip += 2;
+        match_len = token & 15;
+
+        if (match_len == 15)
+        {
+            do
+            {
+                if (ip == iend)
+                {
+                    return NULL;
+                }
+                extra = *ip++;
+                match_len += extra;
+            } while (extra == 255);
+        }
+
+        match_len += MIN_MATCH;
+
+        if (offset == 0 || offset > (size_t) (op - codec->window) || (size_t) (oend - op) < match_len)
+        {
+            return NULL;
+        }
+
+        match = op - offset;
+
+        // an overlapping match repeats the last <offset> bytes and has to be copied byte by byte
+        if (offset >= match_len)
+        {
+            memcpy(op, match, match_len);
+        }
+        else
+        {
+            for (size_t i = 0; i < match_len; i++)
+            {
+                op[i] = match[i];
+            }
+        }
+
+        op += match_len;
+    }
+
+    return op == oend ? out : NULL;
+}
+
+struct cpt_dictionary * cpt_dictionary_create(void)
+{
+    struct cpt_dictionary *dict;
+
+    dict = calloc(1, sizeof(struct cpt_dictionary));
+
+    if (dict == NULL)
+    {
+        return NULL;
+    }
+
+    dict->samples = malloc(CPT_DICT_MAX);
+
+    if (dict->samples == NULL)
+    {
+        free(dict);
+        return NULL;
+    }
+
+    return dict;
+}
+
+void cpt_dictionary_destroy(struct cpt_dictionary * dict)
+{
+    if (dict == NULL)
+    {
+        return;
+    }
+
+    free(dict->data);
+    free(dict->table);
+    free(dict->samples);
+    free(dict);
+}
+
+int cpt_dictionary_sample(struct cpt_dictionary * dict, const uint8_t * msg, size_t size)
+{
+    uint32_t *table;
+    uint8_t *data;
+    size_t chunk;
+    size_t tail;
+
+    // only the most recent CPT_DICT_MAX bytes can end up in the dictionary
+    if (size > CPT_DICT_MAX)
+    {
+        msg += size - CPT_DICT_MAX;
+        dict->pending += size - CPT_DICT_MAX;
+        size = CPT_DICT_MAX;
+    }
+
+    while (size > 0)
+    {
+        chunk = CPT_DICT_MAX - dict->sample_head;
+        chunk = chunk < size ? chunk : size;
+        memcpy(dict->samples + dict->sample_head, msg, chunk);
+        dict->sample_head = (dict->sample_head + chunk) % CPT_DICT_MAX;
+        dict->sample_fill = dict->sample_fill + chunk > CPT_DICT_MAX ? CPT_DICT_MAX : dict->sample_fill + chunk;
+        dict->pending += chunk;
+        msg += chunk;
+        size -= chunk;
+    }
+
+    // the first dictionary is built as soon as there is enough to fill it
+    if (dict->pending < (dict->data == NULL ? CPT_DICT_MAX : CPT_DICT_RETRAIN))
+    {
+        return 0;
+    }
+
+    data = malloc(dict->sample_fill);
+    table = malloc(TABLE_SIZE * sizeof(uint32_t));
+
+    if (data == NULL || table == NULL)
+    {
+        free(data);
+        free(table);
+        return 0;
+    }
+
+    // oldest first, so the most recent content sits closest to the data and gets the shortest offsets
+    tail = dict->sample_fill < CPT_DICT_MAX ? 0 : dict->sample_head;
+    memcpy(data, dict->samples + tail, dict->sample_fill - tail);
+    memcpy(data + dict->sample_fill - tail, dict->samples, tail);
+
+    index_dictionary(table, data, dict->sample_fill);
+    free(dict->data);
+    free(dict->table);
+    dict->data = data;
+    dict->table = table;
+    dict->size = dict->sample_fill;
+    dict->id++;
+    dict->pending = 0;
+
+    return 1;
+}
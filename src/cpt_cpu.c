@@ -0,0 +1,176 @@
+// sched_setaffinity(), getcpu() and the CPU_* macros are Linux extensions
+#define _GNU_SOURCE
+
+#include "cpt_cpu.h"
+#include <limits.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef SYS_mbind
+#include <linux/mempolicy.h>
+#endif
+
+// nodes per word of an mbind() node mask
+#define NODE_BITS (sizeof(unsigned long) * CHAR_BIT)
+
+static uint64_t elapsed_us(const struct timespec *since);
+
+int cpt_cpu_parse(const char *spec, int *cpus, int max)
+{
+    const char *cursor;
+    char *end;
+    long first;
+    long last;
+    int count;
+
+    cursor = spec;
+    count = 0;
+
+    while (*cursor != '\0')
+    {
+        first = strtol(cursor, &end, 10);
+
+        if (end == cursor || first < 0 || first >= CPU_SETSIZE)
+        {
+            return -1;
+        }
+
+        last = first;
+        cursor = end;
+
+        if (*cursor == '-')
+        {
+            last = strtol(cursor + 1, &end, 10);
+
+            if (end == cursor + 1 || last < first || last >= CPU_SETSIZE)
+            {
+                return -1;
+            }
+
+            cursor = end;
+        }
+
+        for (long cpu = first; cpu <= last; cpu++)
+        {
+            if (count == max)
+            {
+                return -1;
+            }
+
+            cpus[count++] = (int) cpu;
+        }
+
+        if (*cursor == ',')
+        {
+            cursor++;
+        }
+        else if (*cursor != '\0')
+        {
+            return -1;
+        }
+    }
+
+    return count;
+}
+
+int cpt_cpu_pin(int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET((size_t) cpu, &set);
+
+    // 0 is the calling thread
+    return sched_setaffinity(0, sizeof(set), &set);
+}
+
+int cpt_cpu_node(void)
+{
+    unsigned cpu;
+    unsigned node;
+
+    if (getcpu(&cpu, &node) != 0)
+    {
+        return -1;
+    }
+
+    return (int) node;
+}
+
+int cpt_cpu_bind(void *addr, size_t size, int node)
+{
+#ifdef SYS_mbind
+    unsigned long mask[CPT_CPU_MAX_NODES / NODE_BITS];
+
+    if (node < 0 || node >= CPT_CPU_MAX_NODES)
+    {
+        return -1;
+    }
+
+    memset(mask, 0, sizeof(mask));
+    mask[(size_t) node / NODE_BITS] = 1UL << ((size_t) node % NODE_BITS);
+
+    // glibc has no wrapper, which saves linking libnuma for one call; the kernel ignores the last bit of <maxnode>
+    if (syscall(SYS_mbind, addr, size, MPOL_PREFERRED, mask, (unsigned long) CPT_CPU_MAX_NODES + 1, 0) != 0)
+    {
+        return -1;
+    }
+
+    return 0;
+#else
+    (void) addr;
+    (void) size;
+    (void) node;
+
+    return -1;
+#endif
+}
+
+int cpt_cpu_poll(struct pollfd *fds, nfds_t nfds, int timeout, unsigned spin_us)
+{
+    struct timespec start;
+    uint64_t spun;
+    int rc;
+
+    if (spin_us == 0 || timeout == 0)
+    {
+        return poll(fds, nfds, timeout);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    do
+    {
+        rc = poll(fds, nfds, 0);
+
+        if (rc != 0)
+        {
+            return rc;
+        }
+
+        spun = elapsed_us(&start);
+    }
+    while (spun < spin_us && (timeout < 0 || spun < (uint64_t) timeout * 1000));
+
+    if (timeout > 0)
+    {
+        timeout = spun >= (uint64_t) timeout * 1000 ? 0 : timeout - (int) (spun / 1000);
+    }
+
+    return poll(fds, nfds, timeout);
+}
+
+static uint64_t elapsed_us(const struct timespec *since)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) (now.tv_sec - since->tv_sec) * 1000000U + (uint64_t) (now.tv_nsec / 1000) -
+           (uint64_t) (since->tv_nsec / 1000);
+}
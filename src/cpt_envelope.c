@@ -0,0 +1,84 @@
+#include "cpt_envelope.h"
+#include "common.h"
+
+void cpt_envelope_init(struct cpt_envelope * env)
+{
+    env->start = 0;
+    env->body = 0;
+    env->open = 0;
+}
+
+uint8_t * cpt_envelope_reserve(struct cpt_envelope * env, struct cpt_buffer * buf, size_t size)
+{
+    uint8_t *dst;
+
+    if (env->open && env->body + size > CPT_ENVELOPE_MAX)
+    {
+        cpt_envelope_seal(env, buf);
+    }
+
+    if (env->open)
+    {
+        return cpt_buffer_reserve(buf, size);
+    }
+
+    // reserve the header and the record together so the second reservation cannot fail
+    dst = cpt_buffer_reserve(buf, CPT_ENVELOPE_HEADER_SIZE + size);
+
+    if (dst == NULL)
+    {
+        return NULL;
+    }
+
+    env->start = buf->tail - buf->head;
+    env->body = 0;
+    env->open = 1;
+    cpt_buffer_commit(buf, CPT_ENVELOPE_HEADER_SIZE);
+
+    return dst + CPT_ENVELOPE_HEADER_SIZE;
+}
+
+void cpt_envelope_commit(struct cpt_envelope * env, struct cpt_buffer * buf, size_t size)
+{
+    cpt_buffer_commit(buf, size);
+    env->body += size;
+}
+
+void cpt_envelope_seal(struct cpt_envelope * env, struct cpt_buffer * buf)
+{
+    uint8_t *header;
+
+    if (!env->open)
+    {
+        return;
+    }
+
+    header = buf->data + buf->head + env->start;
+    header[0] = (uint8_t) (0x80 | (env->body & 0x7F));
+    header[1] = (uint8_t) (0x80 | ((env->body >> 7) & 0x7F));
+    header[2] = (uint8_t) ((env->body >> 14) & 0x7F);
+    env->open = 0;
+}
+
+int cpt_envelope_parse_header(const uint8_t * buf, size_t size, size_t * header, size_t * body)
+{
+    uint32_t length;
+    int used;
+
+    used = cpt_varint_get(buf, size, &length);
+
+    if (used <= 0)
+    {
+        return used;
+    }
+
+    if (length > CPT_ENVELOPE_MAX)
+    {
+        return -1;
+    }
+
+    *header = (size_t) used;
+    *body = length;
+
+    return 1;
+}
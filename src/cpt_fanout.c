@@ -0,0 +1,252 @@
+#include "cpt_fanout.h"
+#include "cpt_cpu.h"
+#include <stdlib.h>
+
+struct worker
+{
+    struct cpt_fanout *fanout;
+    int lane;
+    int cpu;
+};
+
+static void *work(void *arg);
+static void stop_workers(struct cpt_fanout *fanout, int started);
+
+struct cpt_fanout *cpt_fanout_create(int lanes, size_t threshold, const int *cpus, int cpu_count)
+{
+    struct cpt_fanout *fanout;
+    struct worker *worker;
+    int started;
+
+    if (lanes < 2 || lanes > CPT_FANOUT_MAX_LANES)
+    {
+        return NULL;
+    }
+
+    fanout = calloc(1, sizeof(struct cpt_fanout));
+
+    if (fanout == NULL)
+    {
+        return NULL;
+    }
+
+    fanout->lanes = lanes;
+    fanout->threshold = threshold;
+
+    for (int lane = 0; lane < CPT_FANOUT_MAX_LANES; lane++)
+    {
+        atomic_init(&fanout->quiescent[lane], 0);
+        atomic_init(&fanout->delivered[lane], 0);
+    }
+
+    if (pthread_mutex_init(&fanout->lock, NULL) != 0)
+    {
+        free(fanout);
+        return NULL;
+    }
+
+    if (pthread_cond_init(&fanout->start, NULL) != 0)
+    {
+        pthread_mutex_destroy(&fanout->lock);
+        free(fanout);
+        return NULL;
+    }
+
+    if (pthread_cond_init(&fanout->done, NULL) != 0)
+    {
+        pthread_cond_destroy(&fanout->start);
+        pthread_mutex_destroy(&fanout->lock);
+        free(fanout);
+        return NULL;
+    }
+
+    // lane 0 is the event loop itself, which pinned itself before it got here
+    if (cpu_count > 0)
+    {
+        fanout->pools[0] = cpt_pool_create(cpt_cpu_node());
+    }
+
+    fanout->pending = lanes - 1;
+
+    for (started = 1; started < lanes; started++)
+    {
+        worker = malloc(sizeof(struct worker));
+
+        if (worker == NULL)
+        {
+            break;
+        }
+
+        worker->fanout = fanout;
+        worker->lane = started;
+        worker->cpu = cpu_count > 0 ? cpus[started % cpu_count] : -1;
+
+        if (pthread_create(&fanout->threads[started], NULL, work, worker) != 0)
+        {
+            free(worker);
+            break;
+        }
+    }
+
+    if (started < lanes)
+    {
+        stop_workers(fanout, started);
+        return NULL;
+    }
+
+    // every lane has its pool before the first snapshot hands it members
+    pthread_mutex_lock(&fanout->lock);
+
+    while (fanout->pending > 0)
+    {
+        pthread_cond_wait(&fanout->done, &fanout->lock);
+    }
+
+    pthread_mutex_unlock(&fanout->lock);
+
+    return fanout;
+}
+
+void cpt_fanout_destroy(struct cpt_fanout *fanout)
+{
+    if (fanout == NULL)
+    {
+        return;
+    }
+
+    stop_workers(fanout, fanout->lanes);
+}
+
+/**
+ * Join the threads of lanes 1 .. started - 1 and free the fan-out and its pools.
+ */
+static void stop_workers(struct cpt_fanout *fanout, int started)
+{
+    pthread_mutex_lock(&fanout->lock);
+    fanout->stopping = 1;
+    pthread_cond_broadcast(&fanout->start);
+    pthread_mutex_unlock(&fanout->lock);
+
+    for (int lane = 1; lane < started; lane++)
+    {
+        pthread_join(fanout->threads[lane], NULL);
+    }
+
+    for (int lane = 0; lane < fanout->lanes; lane++)
+    {
+        cpt_pool_destroy(fanout->pools[lane]);
+    }
+
+    pthread_cond_destroy(&fanout->done);
+    pthread_cond_destroy(&fanout->start);
+    pthread_mutex_destroy(&fanout->lock);
+    free(fanout);
+}
+
+int cpt_fanout_lane(const struct cpt_fanout *fanout, int user_id)
+{
+    return (int) ((unsigned) user_id % (unsigned) fanout->lanes);
+}
+
+void cpt_fanout_run(struct cpt_fanout *fanout, cpt_fanout_fn fn, void *arg)
+{
+    pthread_mutex_lock(&fanout->lock);
+    fanout->fn = fn;
+    fanout->arg = arg;
+    fanout->pending = fanout->lanes - 1;
+    fanout->generation++;
+    pthread_cond_broadcast(&fanout->start);
+    pthread_mutex_unlock(&fanout->lock);
+
+    fn(arg, 0);
+    atomic_store_explicit(&fanout->quiescent[0], fanout->generation, memory_order_release);
+
+    pthread_mutex_lock(&fanout->lock);
+
+    while (fanout->pending > 0)
+    {
+        pthread_cond_wait(&fanout->done, &fanout->lock);
+    }
+
+    pthread_mutex_unlock(&fanout->lock);
+}
+
+uint64_t cpt_fanout_quiescent(struct cpt_fanout *fanout)
+{
+    uint64_t oldest;
+    uint64_t seen;
+
+    oldest = UINT64_MAX;
+
+    for (int lane = 0; lane < fanout->lanes; lane++)
+    {
+        seen = atomic_load_explicit(&fanout->quiescent[lane], memory_order_acquire);
+        oldest = seen < oldest ? seen : oldest;
+    }
+
+    return oldest;
+}
+
+static void *work(void *arg)
+{
+    struct cpt_fanout *fanout;
+    uint64_t seen;
+    cpt_fanout_fn fn;
+    void *fn_arg;
+    int lane;
+
+    fanout = ((struct worker *) arg)->fanout;
+    lane = ((struct worker *) arg)->lane;
+
+    // once pinned the lane stays on its node, and its pool binds the output it writes there; the
+    // member lists it only reads stay where the event loop put them
+    if (((struct worker *) arg)->cpu >= 0 && cpt_cpu_pin(((struct worker *) arg)->cpu) == 0)
+    {
+        fanout->pools[lane] = cpt_pool_create(cpt_cpu_node());
+    }
+
+    free(arg);
+    seen = 0;
+    pthread_mutex_lock(&fanout->lock);
+
+    if (--fanout->pending == 0)
+    {
+        pthread_cond_signal(&fanout->done);
+    }
+
+    pthread_mutex_unlock(&fanout->lock);
+
+    for (;;)
+    {
+        pthread_mutex_lock(&fanout->lock);
+
+        while (!fanout->stopping && fanout->generation == seen)
+        {
+            pthread_cond_wait(&fanout->start, &fanout->lock);
+        }
+
+        if (fanout->stopping)
+        {
+            pthread_mutex_unlock(&fanout->lock);
+            return NULL;
+        }
+
+        seen = fanout->generation;
+        fn = fanout->fn;
+        fn_arg = fanout->arg;
+        pthread_mutex_unlock(&fanout->lock);
+
+        fn(fn_arg, lane);
+        // everything the lane read during this run is released before the event loop can reclaim it
+        atomic_store_explicit(&fanout->quiescent[lane], seen, memory_order_release);
+
+        pthread_mutex_lock(&fanout->lock);
+
+        if (--fanout->pending == 0)
+        {
+            pthread_cond_signal(&fanout->done);
+        }
+
+        pthread_mutex_unlock(&fanout->lock);
+    }
+}
@@ -0,0 +1,852 @@
+#include "cpt_handoff.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define FLAG_LOCAL 1U
+#define FLAG_SHM 2U
+#define FLAG_SHM_ACTIVE 4U
+#define FLAG_PASS_PENDING 8U
+
+/**
+ * Cursor over a received snapshot. Any read past the end sets <failed>
+ * and returns zeroes, so the parser checks once per record.
+ */
+struct reader
+{
+    const uint8_t *data;
+    size_t size;
+    size_t pos;
+    int failed;
+};
+
+static int put_bytes(struct cpt_buffer *buf, const void *data, size_t size);
+static int put_varint(struct cpt_buffer *buf, uint32_t value);
+static int put_client(struct cpt_buffer *buf, user *client);
+static int put_channels(struct cpt_buffer *buf, struct serverInfo *info);
+static const uint8_t *get_bytes(struct reader *r, size_t size);
+static uint32_t get_varint(struct reader *r);
+static user *get_client(struct reader *r, struct serverInfo *info, int fd);
+static int get_channels(struct reader *r, struct serverInfo *info);
+static int send_all(int sock, const void *data, size_t size);
+static int recv_all(int sock, void *data, size_t size);
+static int send_descriptors(int sock, const int *fds, size_t count);
+static int recv_descriptors(int sock, int *fds, size_t count);
+static int handed_off(const user *client);
+
+static int handed_off(const user *client)
+{
+    // parked clients have no socket to hand on, their queues die with this process
+    return !client->closing && client->offline == NULL;
+}
+
+static int put_bytes(struct cpt_buffer *buf, const void *data, size_t size)
+{
+    uint8_t *dst;
+
+    dst = cpt_buffer_reserve(buf, size);
+
+    if (dst == NULL)
+    {
+        return -1;
+    }
+
+    memcpy(dst, data, size);
+    cpt_buffer_commit(buf, size);
+
+    return 0;
+}
+
+static int put_varint(struct cpt_buffer *buf, uint32_t value)
+{
+    uint8_t bytes[CPT_VARINT_MAX];
+
+    return put_bytes(buf, bytes, cpt_varint_put(value, bytes));
+}
+
+static int put_client(struct cpt_buffer *buf, user *client)
+{
+    uint8_t *dst;
+    size_t name_len;
+    size_t in_len;
+    size_t out_len;
+    uint32_t flags;
+    int status;
+
+    flags = (client->local ? FLAG_LOCAL : 0U) | (client->shm != NULL ? FLAG_SHM : 0U) |
+            (client->shm_active ? FLAG_SHM_ACTIVE : 0U) | (client->pass_pending ? FLAG_PASS_PENDING : 0U);
+
+    // the new process starts with one queue and no open envelope, so both are sealed and merged in wire order
+    if (cpt_server_merge_output(client) < 0)
+    {
+        return -1;
+    }
+
+    name_len = strlen(client->name);
+    in_len = cpt_ring_length(&client->in);
+    out_len = cpt_buffer_length(&client->out);
+
+    status = put_varint(buf, (uint32_t) client->user_id);
+    status |= put_varint(buf, (uint32_t) client->version);
+    status |= put_varint(buf, flags);
+    status |= put_varint(buf, (uint32_t) name_len);
+    status |= put_bytes(buf, client->name, name_len);
+    status |= put_varint(buf, (uint32_t) in_len);
+
+    if (status != 0 || (dst = cpt_buffer_reserve(buf, in_len)) == NULL)
+    {
+        return -1;
+    }
+
+    cpt_ring_peek(&client->in, 0, dst, in_len);
+    cpt_buffer_commit(buf, in_len);
+
+    status = put_varint(buf, (uint32_t) out_len);
+    status |= put_bytes(buf, client->out.data + client->out.head, out_len);
+    status |= put_varint(buf, (uint32_t) client->socket_left);
+    status |= put_varint(buf, (uint32_t) client->pass_at);
+
+    if (client->shm != NULL)
+    {
+        status |= put_bytes(buf, client->shm->own, sizeof(client->shm->own));
+    }
+
+    status |= put_varint(buf, (uint32_t) client->channel_count);
+
+    for (int i = 0; i < client->channel_count; i++)
+    {
+        status |= put_varint(buf, client->channels[i]);
+    }
+
+    return status;
+}
+
+/**
+ * Channel ids and sequence numbers followed by the user ids of their members.
+ *
+ * A channel whose members are all closing is dropped, as it would be
+ * once they are gone.
+ */
+static int put_channels(struct cpt_buffer *buf, struct serverInfo *info)
+{
+    channel *ch;
+    uint32_t count;
+    uint32_t members;
+    int status;
+
+    count = 0;
+
+    for (int id = 0; id < CPT_MAX_CHANNELS; id++)
+    {
+        ch = info->channels[id];
+        members = 0;
+
+        for (int i = 0; ch != NULL && i < ch->users->userCount; i++)
+        {
+            members += handed_off(ch->users->members[i]) ? 1U : 0U;
+        }
+
+        count += ch != NULL && (members > 0 || id == GLOBAL_CHANNEL) ? 1U : 0U;
+    }
+
+    status = put_varint(buf, count);
+
+    for (int id = 0; id < CPT_MAX_CHANNELS; id++)
+    {
+        ch = info->channels[id];
+        members = 0;
+
+        for (int i = 0; ch != NULL && i < ch->users->userCount; i++)
+        {
+            members += handed_off(ch->users->members[i]) ? 1U : 0U;
+        }
+
+        if (ch == NULL || (members == 0 && id != GLOBAL_CHANNEL))
+        {
+            continue;
+        }
+
+        status |= put_varint(buf, (uint32_t) id);
+        status |= put_varint(buf, ch->seq);
+        status |= put_varint(buf, members);
+
+        for (int i = 0; i < ch->users->userCount; i++)
+        {
+            if (handed_off(ch->users->members[i]))
+            {
+                status |= put_varint(buf, (uint32_t) ch->users->members[i]->user_id);
+            }
+        }
+    }
+
+    return status;
+}
+
+int cpt_handoff_send(int sock, struct serverInfo *info, const int *listeners, size_t listener_count, user **clients,
+                     size_t client_count)
+{
+    struct cpt_buffer snapshot;
+    uint64_t length;
+    uint32_t fd_count;
+    uint32_t mask;
+    uint32_t kept;
+    int *fds;
+    int status;
+
+    if (listener_count > CPT_HANDOFF_MAX_LISTENERS)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    fds = malloc((listener_count + 2 * client_count) * sizeof(int));
+
+    if (fds == NULL)
+    {
+        return -1;
+    }
+
+    fd_count = 0;
+    mask = 0;
+    kept = 0;
+
+    for (size_t i = 0; i < listener_count; i++)
+    {
+        if (listeners[i] >= 0)
+        {
+            mask |= 1U << i;
+            fds[fd_count++] = listeners[i];
+        }
+    }
+
+    for (size_t i = 0; i < client_count; i++)
+    {
+        if (handed_off(clients[i]))
+        {
+            fds[fd_count++] = clients[i]->user_fd;
+            kept++;
+        }
+    }
+
+    for (size_t i = 0; i < client_count; i++)
+    {
+        if (handed_off(clients[i]) && clients[i]->shm != NULL)
+        {
+            fds[fd_count++] = clients[i]->shm->fd;
+        }
+    }
+
+    cpt_buffer_init(&snapshot, SIZE_MAX);
+    status = put_varint(&snapshot, CPT_HANDOFF_MAGIC);
+    status |= put_varint(&snapshot, CPT_HANDOFF_VERSION);
+    status |= put_varint(&snapshot, mask);
+    status |= put_varint(&snapshot, kept);
+    status |= put_varint(&snapshot, (uint32_t) info->next_user_id);
+
+    for (size_t i = 0; status == 0 && i < client_count; i++)
+    {
+        if (handed_off(clients[i]))
+        {
+            status = put_client(&snapshot, clients[i]);
+        }
+    }
+
+    if (status == 0)
+    {
+        status = put_channels(&snapshot, info);
+    }
+
+    length = cpt_buffer_length(&snapshot);
+
+    if (status == 0)
+    {
+        status = send_all(sock, &fd_count, sizeof(fd_count));
+    }
+
+    if (status == 0)
+    {
+        status = send_descriptors(sock, fds, fd_count);
+    }
+
+    if (status == 0)
+    {
+        status = send_all(sock, &length, sizeof(length));
+    }
+
+    if (status == 0)
+    {
+        status = send_all(sock, snapshot.data + snapshot.head, (size_t) length);
+    }
+
+    cpt_buffer_destroy(&snapshot);
+    free(fds);
+
+    return status == 0 ? 0 : -1;
+}
+
+static const uint8_t *get_bytes(struct reader *r, size_t size)
+{
+    const uint8_t *bytes;
+
+    if (r->failed || r->size - r->pos < size)
+    {
+        r->failed = 1;
+        return NULL;
+    }
+
+    bytes = r->data + r->pos;
+    r->pos += size;
+
+    return bytes;
+}
+
+static uint32_t get_varint(struct reader *r)
+{
+    uint32_t value;
+    int used;
+
+    if (r->failed)
+    {
+        return 0;
+    }
+
+    used = cpt_varint_get(r->data + r->pos, r->size - r->pos, &value);
+
+    if (used <= 0)
+    {
+        r->failed = 1;
+        return 0;
+    }
+
+    r->pos += (size_t) used;
+
+    return value;
+}
+
+/**
+ * Restore one client around its socket. Its ring descriptor is
+ * assigned by the caller once the whole snapshot parsed.
+ *
+ * @return The client, NULL if the record is malformed.
+ */
+static user *get_client(struct reader *r, struct serverInfo *info, int fd)
+{
+    struct iovec iov[2];
+    const uint8_t *bytes;
+    user *client;
+    uint32_t user_id, version, flags, name_len, in_len, out_len, channel_count;
+    uint8_t *dst;
+    int iovcnt;
+
+    user_id = get_varint(r);
+    version = get_varint(r);
+    flags = get_varint(r);
+    name_len = get_varint(r);
+    bytes = get_bytes(r, name_len);
+
+    if (r->failed || user_id > UINT16_MAX || (user_id != 0 && info->users[user_id] != NULL) ||
+        version < CPT_SERVER_VERSION || version > CPT_VERSION_SEQUENCED || name_len > CPT_NAME_MAX)
+    {
+        return NULL;
+    }
+
+    client = create_user_in(info->arena, fd, (int) user_id);
+
+    if (client == NULL)
+    {
+        return NULL;
+    }
+
+    client->version = (int) version;
+    client->local = (flags & FLAG_LOCAL) != 0;
+    memcpy(client->name, bytes, name_len);
+    client->name[name_len] = '\0';
+
+    in_len = get_varint(r);
+    bytes = get_bytes(r, in_len);
+
+    if (r->failed || in_len > CPT_INPUT_CAPACITY)
+    {
+        destroy_user(client);
+        return NULL;
+    }
+
+    iovcnt = cpt_ring_free_iov(&client->in, iov);
+    memcpy(iov[0].iov_base, bytes, in_len < iov[0].iov_len ? in_len : iov[0].iov_len);
+
+    if (iovcnt > 1 && in_len > iov[0].iov_len)
+    {
+        memcpy(iov[1].iov_base, bytes + iov[0].iov_len, in_len - iov[0].iov_len);
+    }
+
+    cpt_ring_produce(&client->in, in_len);
+
+    out_len = get_varint(r);
+    bytes = get_bytes(r, out_len);
+
+    if (r->failed || (out_len > 0 && (dst = cpt_buffer_reserve(&client->out, out_len)) == NULL))
+    {
+        destroy_user(client);
+        return NULL;
+    }
+
+    if (out_len > 0)
+    {
+        memcpy(dst, bytes, out_len);
+        cpt_buffer_commit(&client->out, out_len);
+    }
+
+    client->socket_left = get_varint(r);
+    client->pass_at = get_varint(r);
+
+    if (flags & FLAG_SHM)
+    {
+        client->shm = calloc(1, sizeof(struct cpt_shm));
+        bytes = get_bytes(r, sizeof(client->shm->own));
+
+        if (client->shm == NULL || bytes == NULL)
+        {
+            destroy_user(client);
+            return NULL;
+        }
+
+        client->shm->fd = -1;
+        memcpy(client->shm->own, bytes, sizeof(client->shm->own));
+        client->shm_active = (flags & FLAG_SHM_ACTIVE) != 0;
+        client->pass_pending = (flags & FLAG_PASS_PENDING) != 0;
+    }
+
+    // whatever the socket was still owed goes out whole before anything urgent
+    client->unit_left = client->shm != NULL ? client->socket_left : out_len;
+
+    channel_count = get_varint(r);
+
+    if (r->failed || channel_count > CPT_MAX_CHANNELS ||
+        (channel_count > 0 && (client->channels = malloc(channel_count * sizeof(uint16_t))) == NULL))
+    {
+        destroy_user(client);
+        return NULL;
+    }
+
+    client->channel_capacity = (int) channel_count;
+
+    for (uint32_t i = 0; i < channel_count; i++)
+    {
+        client->channels[client->channel_count++] = (uint16_t) get_varint(r);
+    }
+
+    if (r->failed || client->socket_left > out_len || client->pass_at > client->socket_left)
+    {
+        destroy_user(client);
+        return NULL;
+    }
+
+    if (user_id != 0)
+    {
+        info->users[user_id] = client;
+        info->user_count++;
+    }
+
+    return client;
+}
+
+static int get_channels(struct reader *r, struct serverInfo *info)
+{
+    channel *ch;
+    user *member;
+    uint32_t count;
+    uint32_t id;
+    uint32_t seq;
+    uint32_t members;
+
+    count = get_varint(r);
+
+    for (uint32_t c = 0; !r->failed && c < count; c++)
+    {
+        id = get_varint(r);
+        seq = get_varint(r);
+        members = get_varint(r);
+
+        if (r->failed || id >= CPT_MAX_CHANNELS || members > CPT_MAX_CHANNELS ||
+            (id != GLOBAL_CHANNEL && info->channels[id] != NULL))
+        {
+            return -1;
+        }
+
+        ch = id == GLOBAL_CHANNEL ? &info->global : create_channel(NULL, (uint16_t) id);
+
+        if (ch == NULL)
+        {
+            return -1;
+        }
+
+        info->channels[id] = ch;
+        ch->seq = seq;
+
+        if (members > 0 && (ch->users->members = malloc(members * sizeof(user *))) == NULL)
+        {
+            return -1;
+        }
+
+        ch->users->capacity = (int) members;
+
+        for (uint32_t i = 0; i < members; i++)
+        {
+            id = get_varint(r);
+            member = r->failed || id > UINT16_MAX ? NULL : info->users[id];
+
+            if (member == NULL)
+            {
+                return -1;
+            }
+
+            ch->users->members[ch->users->userCount++] = member;
+        }
+    }
+
+    return r->failed ? -1 : 0;
+}
+
+int cpt_handoff_receive(int sock, struct serverInfo *info, int *listeners, size_t listener_count, user ***clients,
+                        size_t *client_count)
+{
+    struct reader r;
+    uint8_t *snapshot;
+    uint64_t length;
+    uint64_t own[2];
+    uint32_t fd_count, mask, kept, next;
+    size_t used, shm_next;
+    user **restored;
+    int *fds;
+    int status;
+
+    *clients = NULL;
+    *client_count = 0;
+    fds = NULL;
+    snapshot = NULL;
+    restored = NULL;
+    kept = 0;
+    fd_count = 0;
+
+    if (recv_all(sock, &fd_count, sizeof(fd_count)) < 0 || (fds = malloc((fd_count + 1) * sizeof(int))) == NULL ||
+        recv_descriptors(sock, fds, fd_count) < 0)
+    {
+        free(fds);
+        return -1;
+    }
+
+    status = recv_all(sock, &length, sizeof(length));
+
+    if (status == 0 && (length > SIZE_MAX || (snapshot = malloc((size_t) length + 1)) == NULL))
+    {
+        status = -1;
+    }
+
+    if (status == 0)
+    {
+        status = recv_all(sock, snapshot, (size_t) length);
+    }
+
+    r.data = snapshot;
+    r.size = (size_t) length;
+    r.pos = 0;
+    r.failed = status != 0;
+
+    if (get_varint(&r) != CPT_HANDOFF_MAGIC || get_varint(&r) != CPT_HANDOFF_VERSION)
+    {
+        r.failed = 1;
+    }
+
+    mask = get_varint(&r);
+    kept = get_varint(&r);
+    next = get_varint(&r);
+    used = 0;
+
+    for (size_t i = 0; i < listener_count; i++)
+    {
+        listeners[i] = -1;
+
+        if (!r.failed && (mask & (1U << i)) && used < fd_count)
+        {
+            listeners[i] = fds[used++];
+        }
+    }
+
+    // every client's socket follows the listeners, ring descriptors come last
+    if (r.failed || (mask >> listener_count) != 0 || kept > fd_count - used || next == 0 || next > UINT16_MAX ||
+        (restored = calloc(kept + 1, sizeof(user *))) == NULL)
+    {
+        r.failed = 1;
+    }
+
+    for (uint32_t i = 0; !r.failed && i < kept; i++)
+    {
+        restored[i] = get_client(&r, info, fds[used + i]);
+        r.failed = restored[i] == NULL;
+    }
+
+    if (!r.failed && get_channels(&r, info) < 0)
+    {
+        r.failed = 1;
+    }
+
+    for (uint32_t i = 0; !r.failed && i < kept; i++)
+    {
+        for (int c = 0; c < restored[i]->channel_count; c++)
+        {
+            r.failed |= info->channels[restored[i]->channels[c]] == NULL;
+        }
+    }
+
+    shm_next = used + kept;
+
+    for (uint32_t i = 0; !r.failed && i < kept; i++)
+    {
+        if (restored[i]->shm == NULL)
+        {
+            continue;
+        }
+
+        // the mapping gets its own descriptor, the received one stays with the client for the next upgrade
+        memcpy(own, restored[i]->shm->own, sizeof(own));
+
+        if (shm_next == fd_count || cpt_shm_attach(restored[i]->shm, dup(fds[shm_next])) < 0)
+        {
+            r.failed = 1;
+            break;
+        }
+
+        restored[i]->shm->fd = fds[shm_next++];
+        memcpy(restored[i]->shm->own, own, sizeof(own));
+    }
+
+    if (!r.failed && shm_next != fd_count)
+    {
+        r.failed = 1;
+    }
+
+    if (r.failed)
+    {
+        for (uint32_t i = 0; restored != NULL && i < kept && restored[i] != NULL; i++)
+        {
+            if (restored[i]->shm != NULL)
+            {
+                restored[i]->shm->fd = -1;
+            }
+            cpt_server_disconnect(info, restored[i]);
+            destroy_user(restored[i]);
+        }
+
+        for (uint32_t i = 0; i < fd_count; i++)
+        {
+            close(fds[i]);
+        }
+
+        for (size_t i = 0; i < listener_count; i++)
+        {
+            listeners[i] = -1;
+        }
+
+        free(restored);
+        free(snapshot);
+        free(fds);
+        return -1;
+    }
+
+    info->next_user_id = (int) next;
+    *clients = restored;
+    *client_count = kept;
+    free(snapshot);
+    free(fds);
+
+    return 0;
+}
+
+static int send_all(int sock, const void *data, size_t size)
+{
+    const uint8_t *p;
+    ssize_t n;
+
+    p = data;
+
+    while (size > 0)
+    {
+        n = send(sock, p, size, MSG_NOSIGNAL);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return -1;
+        }
+
+        p += n;
+        size -= (size_t) n;
+    }
+
+    return 0;
+}
+
+static int recv_all(int sock, void *data, size_t size)
+{
+    uint8_t *p;
+    ssize_t n;
+
+    p = data;
+
+    while (size > 0)
+    {
+        n = recv(sock, p, size, MSG_WAITALL);
+
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+
+            return -1;
+        }
+
+        p += n;
+        size -= (size_t) n;
+    }
+
+    return 0;
+}
+
+/**
+ * Send descriptors in batches, each one a 4 byte count with the
+ * descriptors attached.
+ */
+static int send_descriptors(int sock, const int *fds, size_t count)
+{
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(CPT_HANDOFF_FD_BATCH * sizeof(int))];
+    } control;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    uint32_t batch;
+    ssize_t n;
+
+    for (size_t sent = 0; sent < count; sent += batch)
+    {
+        batch = (uint32_t) (count - sent < CPT_HANDOFF_FD_BATCH ? count - sent : CPT_HANDOFF_FD_BATCH);
+        memset(&msg, 0, sizeof(msg));
+        memset(&control, 0, sizeof(control));
+        iov.iov_base = &batch;
+        iov.iov_len = sizeof(batch);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(batch * sizeof(int));
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(batch * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds + sent, batch * sizeof(int));
+
+        do
+        {
+            n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        } while (n < 0 && errno == EINTR);
+
+        if (n != (ssize_t) sizeof(batch))
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int recv_descriptors(int sock, int *fds, size_t count)
+{
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(CPT_HANDOFF_FD_BATCH * sizeof(int))];
+    } control;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    uint32_t batch;
+    size_t got;
+    size_t n;
+    ssize_t nread;
+    int status;
+
+    got = 0;
+    status = 0;
+
+    while (status == 0 && got < count)
+    {
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = &batch;
+        iov.iov_len = sizeof(batch);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        do
+        {
+            nread = recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+        } while (nread < 0 && errno == EINTR);
+
+        if (nread != (ssize_t) sizeof(batch) || (msg.msg_flags & MSG_CTRUNC))
+        {
+            status = -1;
+        }
+
+        n = 0;
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); nread > 0 && cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            {
+                continue;
+            }
+
+            for (size_t i = 0; i < (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int); i++)
+            {
+                // whatever arrives is ours to close, even beyond what was announced
+                if (got < count)
+                {
+                    memcpy(&fds[got++], CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                }
+                else
+                {
+                    int extra;
+
+                    memcpy(&extra, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                    close(extra);
+                    status = -1;
+                }
+                n++;
+            }
+        }
+
+        if (n != batch)
+        {
+            status = -1;
+        }
+    }
+
+    if (status != 0)
+    {
+        for (size_t i = 0; i < got; i++)
+        {
+            close(fds[i]);
+        }
+    }
+
+    return status;
+}
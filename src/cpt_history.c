@@ -0,0 +1,112 @@
+#include "cpt_history.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define RECORD_HEADER 8
+
+static void read_header(const struct cpt_history *history, size_t offset, uint32_t *seq, uint16_t *user_id,
+                        uint16_t *msg_len);
+
+int cpt_history_push(struct cpt_history *history, size_t capacity, uint32_t seq, uint16_t user_id,
+                     const uint8_t *msg, uint16_t msg_len)
+{
+    uint8_t header[RECORD_HEADER];
+    uint8_t *storage;
+    uint32_t oldest;
+    uint16_t oldest_user;
+    uint16_t oldest_len;
+    size_t size;
+
+    size = RECORD_HEADER + (size_t) msg_len;
+
+    if (history->ring.data == NULL)
+    {
+        storage = malloc(capacity);
+
+        if (storage == NULL)
+        {
+            return -1;
+        }
+
+        cpt_ring_init(&history->ring, storage, capacity);
+    }
+
+    // a message larger than the whole history would leave a gap anyway
+    if (size > history->ring.capacity)
+    {
+        cpt_ring_consume(&history->ring, cpt_ring_length(&history->ring));
+        return -1;
+    }
+
+    while (cpt_ring_space(&history->ring) < size)
+    {
+        read_header(history, 0, &oldest, &oldest_user, &oldest_len);
+        cpt_ring_consume(&history->ring, RECORD_HEADER + (size_t) oldest_len);
+    }
+
+    memcpy(header, &seq, sizeof(seq));
+    memcpy(header + 4, &user_id, sizeof(user_id));
+    memcpy(header + 6, &msg_len, sizeof(msg_len));
+    cpt_ring_write(&history->ring, header, RECORD_HEADER);
+    cpt_ring_write(&history->ring, msg, msg_len);
+
+    return 0;
+}
+
+uint32_t cpt_history_replay(struct cpt_history *history, uint32_t after, uint8_t *scratch, cpt_history_fn fn,
+                            void *arg)
+{
+    uint32_t seq;
+    uint16_t user_id;
+    uint16_t msg_len;
+    uint32_t replayed;
+    uint8_t *msg;
+    size_t offset;
+
+    replayed = 0;
+    offset = 0;
+
+    while (history->ring.data != NULL && offset < cpt_ring_length(&history->ring))
+    {
+        read_header(history, offset, &seq, &user_id, &msg_len);
+        offset += RECORD_HEADER;
+
+        if (seq > after)
+        {
+            msg = cpt_ring_contiguous(&history->ring, offset, msg_len);
+
+            if (msg == NULL)
+            {
+                cpt_ring_peek(&history->ring, offset, scratch, msg_len);
+                msg = scratch;
+            }
+
+            fn(arg, seq, user_id, msg, msg_len);
+            replayed++;
+        }
+
+        offset += msg_len;
+    }
+
+    return replayed;
+}
+
+static void read_header(const struct cpt_history *history, size_t offset, uint32_t *seq, uint16_t *user_id,
+                        uint16_t *msg_len)
+{
+    uint8_t header[RECORD_HEADER];
+
+    cpt_ring_peek(&history->ring, offset, header, RECORD_HEADER);
+    memcpy(seq, header, sizeof(*seq));
+    memcpy(user_id, header + 4, sizeof(*user_id));
+    memcpy(msg_len, header + 6, sizeof(*msg_len));
+}
+
+void cpt_history_destroy(struct cpt_history *history)
+{
+    free(history->ring.data);
+    history->ring.data = NULL;
+    history->ring.capacity = 0;
+    history->ring.head = 0;
+    history->ring.tail = 0;
+}
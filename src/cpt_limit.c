@@ -0,0 +1,40 @@
+#include "cpt_limit.h"
+
+#define MICROSECONDS 1000000U
+
+void cpt_rate_init(struct cpt_rate *rate, uint32_t per_second, uint32_t burst)
+{
+    if (per_second == 0)
+    {
+        rate->interval = 0;
+        rate->burst = 0;
+        return;
+    }
+
+    rate->interval = (MICROSECONDS + per_second - 1) / per_second;
+    rate->burst = burst == 0 ? per_second : burst;
+}
+
+int cpt_bucket_ready(const struct cpt_rate *rate, const struct cpt_bucket *bucket, uint64_t now)
+{
+    uint64_t start;
+
+    if (rate->interval == 0)
+    {
+        return 1;
+    }
+
+    start = bucket->refilled_at > now ? bucket->refilled_at : now;
+
+    return start + rate->interval - now <= rate->burst * rate->interval;
+}
+
+void cpt_bucket_spend(const struct cpt_rate *rate, struct cpt_bucket *bucket, uint64_t now)
+{
+    if (rate->interval == 0)
+    {
+        return;
+    }
+
+    bucket->refilled_at = (bucket->refilled_at > now ? bucket->refilled_at : now) + rate->interval;
+}
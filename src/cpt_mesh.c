@@ -0,0 +1,809 @@
+#include "cpt_mesh.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// magic, node index and node count, sent once by the dialing side
+#define HELLO_SIZE 8
+#define HELLO_TIMEOUT_MS 1000
+
+struct point
+{
+    uint32_t hash;
+    uint8_t owner;
+};
+
+static uint32_t mix32(uint32_t value);
+static int compare_points(const void *a, const void *b);
+static uint64_t now_ms(void);
+static int bind_link(const char *path);
+static void dial(struct cpt_mesh *mesh, int node, uint64_t now);
+static void accept_links(struct cpt_mesh *mesh);
+static void open_link(struct cpt_mesh *mesh, int node, int fd);
+static void drop_link(struct cpt_mesh *mesh, int node);
+static int read_link(struct cpt_mesh *mesh, struct cpt_peer *peer);
+static int read_records(struct cpt_mesh *mesh, struct cpt_peer *peer, uint8_t *body, size_t size);
+static int get_varint(const uint8_t *buf, size_t size, size_t *pos, uint32_t *value);
+static int write_link(struct cpt_peer *peer);
+static int queue_members(struct cpt_mesh *mesh, struct cpt_peer *peer, const uint16_t *ids, size_t count);
+static uint32_t local_members(const struct cpt_mesh *mesh, uint16_t channel_id);
+
+// murmur3's finalizer, spreads neighbouring channel ids over the ring
+static uint32_t mix32(uint32_t value)
+{
+    value ^= value >> 16;
+    value *= 0x85EBCA6BU;
+    value ^= value >> 13;
+    value *= 0xC2B2AE35U;
+    value ^= value >> 16;
+
+    return value;
+}
+
+static int compare_points(const void *a, const void *b)
+{
+    const struct point *pa = a;
+    const struct point *pb = b;
+
+    if (pa->hash != pb->hash)
+    {
+        return pa->hash < pb->hash ? -1 : 1;
+    }
+
+    return (int) pa->owner - (int) pb->owner;
+}
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000U + (uint64_t) ts.tv_nsec / 1000000U;
+}
+
+struct cpt_mesh *cpt_mesh_create(struct serverInfo *info, int node, const char **paths, int count)
+{
+    struct point points[CPT_MESH_MAX_NODES * CPT_MESH_VNODES];
+    struct cpt_mesh *mesh;
+    uint8_t *storage;
+    int span;
+    int n;
+
+    if (count < 1 || count > CPT_MESH_MAX_NODES || node < 0 || node >= count)
+    {
+        return NULL;
+    }
+
+    mesh = calloc(1, sizeof(struct cpt_mesh));
+
+    if (mesh == NULL)
+    {
+        return NULL;
+    }
+
+    mesh->info = info;
+    mesh->node = node;
+    mesh->count = count;
+    mesh->listen_fd = -1;
+    mesh->dirty = malloc(CPT_MAX_CHANNELS * sizeof(uint16_t));
+    mesh->dirty_flags = calloc(CPT_MAX_CHANNELS, 1);
+    mesh->scratch = malloc(CPT_VARINT_MAX + CPT_ENVELOPE_MAX);
+
+    for (int i = 0; i < CPT_MESH_MAX_NODES; i++)
+    {
+        mesh->peers[i].fd = -1;
+        cpt_buffer_init(&mesh->peers[i].out, CPT_OUTPUT_LIMIT);
+        cpt_envelope_init(&mesh->peers[i].envelope);
+    }
+
+    if (mesh->dirty == NULL || mesh->dirty_flags == NULL || mesh->scratch == NULL)
+    {
+        cpt_mesh_destroy(mesh);
+        return NULL;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        mesh->peers[i].path = paths[i];
+
+        if (i == node)
+        {
+            continue;
+        }
+
+        storage = malloc(CPT_MESH_INPUT_CAPACITY);
+        mesh->peers[i].members = calloc(CPT_MAX_CHANNELS, sizeof(uint16_t));
+
+        if (storage == NULL || mesh->peers[i].members == NULL)
+        {
+            free(storage);
+            cpt_mesh_destroy(mesh);
+            return NULL;
+        }
+
+        cpt_ring_init(&mesh->peers[i].in, storage, CPT_MESH_INPUT_CAPACITY);
+    }
+
+    // every node computes the same ring from the node count alone
+    n = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        for (uint32_t v = 0; v < CPT_MESH_VNODES; v++)
+        {
+            points[n].hash = mix32(((uint32_t) i << 16 | v) + 1U);
+            points[n].owner = (uint8_t) i;
+            n++;
+        }
+    }
+
+    qsort(points, (size_t) n, sizeof(struct point), compare_points);
+
+    for (int i = 0; i < n; i++)
+    {
+        mesh->points[i] = points[i].hash;
+        mesh->owners[i] = points[i].owner;
+    }
+
+    mesh->listen_fd = bind_link(paths[node]);
+
+    if (mesh->listen_fd < 0)
+    {
+        cpt_mesh_destroy(mesh);
+        return NULL;
+    }
+
+    // each node hands out user ids from its own slice
+    span = UINT16_MAX / count;
+    info->first_user_id = node * span + 1;
+    info->last_user_id = (node + 1) * span;
+
+    if (info->next_user_id < info->first_user_id || info->next_user_id > info->last_user_id)
+    {
+        info->next_user_id = info->first_user_id;
+    }
+
+    info->mesh = mesh;
+
+    return mesh;
+}
+
+void cpt_mesh_destroy(struct cpt_mesh *mesh)
+{
+    if (mesh == NULL)
+    {
+        return;
+    }
+
+    if (mesh->info != NULL && mesh->info->mesh == mesh)
+    {
+        mesh->info->mesh = NULL;
+    }
+
+    if (mesh->listen_fd >= 0)
+    {
+        close(mesh->listen_fd);
+    }
+
+    for (int i = 0; i < CPT_MESH_MAX_NODES; i++)
+    {
+        if (mesh->peers[i].fd >= 0)
+        {
+            close(mesh->peers[i].fd);
+        }
+
+        free(mesh->peers[i].in.data);
+        cpt_buffer_destroy(&mesh->peers[i].out);
+        free(mesh->peers[i].members);
+    }
+
+    free(mesh->dirty);
+    free(mesh->dirty_flags);
+    free(mesh->scratch);
+    free(mesh);
+}
+
+/**
+ * Bind the non-blocking listener other nodes dial, replacing a stale
+ * socket file.
+ */
+static int bind_link(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        return -1;
+    }
+
+    strcpy(addr.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    unlink(path);
+
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0 || fcntl(fd, F_SETFD, FD_CLOEXEC) < 0 ||
+        bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, CPT_MESH_MAX_NODES) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int cpt_mesh_owner(const struct cpt_mesh *mesh, uint16_t channel_id)
+{
+    uint32_t hash;
+    size_t low;
+    size_t high;
+    size_t mid;
+
+    hash = mix32((uint32_t) channel_id);
+    low = 0;
+    high = (size_t) mesh->count * CPT_MESH_VNODES;
+
+    // the first point at or after the channel's hash, wrapping to the start
+    while (low < high)
+    {
+        mid = low + (high - low) / 2;
+
+        if (mesh->points[mid] < hash)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    return mesh->owners[low == (size_t) mesh->count * CPT_MESH_VNODES ? 0 : low];
+}
+
+int cpt_mesh_can_create(const struct cpt_mesh *mesh, uint16_t channel_id)
+{
+    return cpt_mesh_owner(mesh, channel_id) == mesh->node && !cpt_mesh_has_remote(mesh, channel_id);
+}
+
+int cpt_mesh_has_remote(const struct cpt_mesh *mesh, uint16_t channel_id)
+{
+    for (int i = 0; i < mesh->count; i++)
+    {
+        if (mesh->peers[i].fd >= 0 && mesh->peers[i].members[channel_id] > 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void cpt_mesh_note_members(struct cpt_mesh *mesh, uint16_t channel_id)
+{
+    if (!mesh->dirty_flags[channel_id])
+    {
+        mesh->dirty_flags[channel_id] = 1;
+        mesh->dirty[mesh->dirty_count++] = channel_id;
+    }
+}
+
+int cpt_mesh_forward(struct cpt_mesh *mesh, uint16_t channel_id, uint16_t user_id, const uint8_t *msg,
+                     uint16_t msg_len)
+{
+    struct cpt_peer *peer;
+    uint8_t *dst;
+    size_t size;
+    size_t pos;
+    int forwarded;
+
+    size = 1 + cpt_varint_size(channel_id) + cpt_varint_size(user_id) + cpt_varint_size(msg_len) + msg_len;
+    forwarded = 0;
+
+    for (int i = 0; i < mesh->count; i++)
+    {
+        peer = &mesh->peers[i];
+
+        if (peer->fd < 0 || peer->members[channel_id] == 0)
+        {
+            continue;
+        }
+
+        dst = cpt_envelope_reserve(&peer->envelope, &peer->out, size);
+
+        // a node that stopped reading is cut off like a slow client
+        if (dst == NULL)
+        {
+            drop_link(mesh, i);
+            continue;
+        }
+
+        dst[0] = MESH_FORWARD;
+        pos = 1;
+        pos += cpt_varint_put(channel_id, dst + pos);
+        pos += cpt_varint_put(user_id, dst + pos);
+        pos += cpt_varint_put(msg_len, dst + pos);
+        memcpy(dst + pos, msg, msg_len);
+        cpt_envelope_commit(&peer->envelope, &peer->out, size);
+        forwarded++;
+    }
+
+    return forwarded;
+}
+
+int cpt_mesh_poll_set(struct cpt_mesh *mesh, struct pollfd *fds)
+{
+    struct cpt_peer *peer;
+    uint64_t now;
+    int timeout;
+
+    now = now_ms();
+    timeout = -1;
+    fds[0].fd = mesh->listen_fd;
+    fds[0].events = POLLIN;
+
+    for (int i = 0; i < CPT_MESH_MAX_NODES; i++)
+    {
+        peer = &mesh->peers[i];
+
+        // lower nodes are dialed, higher ones dial this node
+        if (i < mesh->node && peer->fd < 0)
+        {
+            if (now >= peer->retry_at)
+            {
+                dial(mesh, i, now);
+            }
+
+            if (peer->fd < 0 && (timeout < 0 || peer->retry_at - now < (uint64_t) timeout))
+            {
+                timeout = (int) (peer->retry_at - now);
+            }
+        }
+
+        fds[1 + i].fd = peer->fd;
+        fds[1 + i].events = (short) (cpt_buffer_length(&peer->out) > 0 ? POLLIN | POLLOUT : POLLIN);
+        fds[1 + i].revents = 0;
+    }
+
+    return timeout;
+}
+
+static void dial(struct cpt_mesh *mesh, int node, uint64_t now)
+{
+    struct sockaddr_un addr;
+    uint8_t hello[HELLO_SIZE];
+    uint32_t magic;
+    uint16_t value;
+    int fd;
+
+    mesh->peers[node].retry_at = now + CPT_MESH_RETRY_MS;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, mesh->peers[node].path, sizeof(addr.sun_path) - 1);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0)
+    {
+        return;
+    }
+
+    magic = CPT_MESH_MAGIC;
+    memcpy(hello, &magic, sizeof(magic));
+    value = (uint16_t) mesh->node;
+    memcpy(hello + 4, &value, sizeof(value));
+    value = (uint16_t) mesh->count;
+    memcpy(hello + 6, &value, sizeof(value));
+
+    // an AF_UNIX connect completes at once and the fresh socket has room for the hello
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        send(fd, hello, sizeof(hello), MSG_NOSIGNAL) != (ssize_t) sizeof(hello) ||
+        fcntl(fd, F_SETFL, O_NONBLOCK) < 0 || fcntl(fd, F_SETFD, FD_CLOEXEC) < 0)
+    {
+        close(fd);
+        return;
+    }
+
+    open_link(mesh, node, fd);
+}
+
+static void accept_links(struct cpt_mesh *mesh)
+{
+    struct pollfd wait;
+    uint8_t hello[HELLO_SIZE];
+    uint32_t magic;
+    uint16_t node;
+    uint16_t count;
+    int fd;
+
+    for (;;)
+    {
+        fd = accept(mesh->listen_fd, NULL, NULL);
+
+        if (fd < 0)
+        {
+            break;
+        }
+
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        wait.fd = fd;
+        wait.events = POLLIN;
+
+        // the dialing side sends the hello right after connecting
+        if (poll(&wait, 1, HELLO_TIMEOUT_MS) != 1 || recv(fd, hello, sizeof(hello), MSG_WAITALL) != HELLO_SIZE)
+        {
+            close(fd);
+            continue;
+        }
+
+        memcpy(&magic, hello, sizeof(magic));
+        memcpy(&node, hello + 4, sizeof(node));
+        memcpy(&count, hello + 6, sizeof(count));
+
+        if (magic != CPT_MESH_MAGIC || count != mesh->count || node <= mesh->node || node >= mesh->count ||
+            fcntl(fd, F_SETFL, O_NONBLOCK) < 0)
+        {
+            close(fd);
+            continue;
+        }
+
+        // a node that restarted dials again, its old link is dead
+        if (mesh->peers[node].fd >= 0)
+        {
+            drop_link(mesh, node);
+        }
+
+        open_link(mesh, node, fd);
+    }
+}
+
+/**
+ * Start using a link and tell the peer every channel this node has
+ * members in.
+ */
+static void open_link(struct cpt_mesh *mesh, int node, int fd)
+{
+    struct cpt_peer *peer;
+    uint16_t ids[CPT_MESH_MEMBERS_BATCH];
+    size_t count;
+
+    peer = &mesh->peers[node];
+    peer->fd = fd;
+    count = 0;
+
+    for (int id = 0; id < CPT_MAX_CHANNELS; id++)
+    {
+        if (mesh->info->channels[id] == NULL || mesh->info->channels[id]->users->userCount == 0)
+        {
+            continue;
+        }
+
+        ids[count++] = (uint16_t) id;
+
+        if (count == CPT_MESH_MEMBERS_BATCH)
+        {
+            queue_members(mesh, peer, ids, count);
+            count = 0;
+        }
+    }
+
+    if (count > 0)
+    {
+        queue_members(mesh, peer, ids, count);
+    }
+}
+
+static void drop_link(struct cpt_mesh *mesh, int node)
+{
+    struct cpt_peer *peer;
+
+    peer = &mesh->peers[node];
+    close(peer->fd);
+    peer->fd = -1;
+    peer->retry_at = now_ms() + CPT_MESH_RETRY_MS;
+    cpt_ring_consume(&peer->in, cpt_ring_length(&peer->in));
+    cpt_buffer_consume(&peer->out, cpt_buffer_length(&peer->out));
+    cpt_envelope_init(&peer->envelope);
+
+    // its members are gone from this node's point of view until it is back
+    memset(peer->members, 0, CPT_MAX_CHANNELS * sizeof(uint16_t));
+}
+
+void cpt_mesh_handle(struct cpt_mesh *mesh, const struct pollfd *fds)
+{
+    struct cpt_peer *peer;
+
+    if (fds[0].revents & POLLIN)
+    {
+        accept_links(mesh);
+    }
+
+    for (int i = 0; i < mesh->count; i++)
+    {
+        peer = &mesh->peers[i];
+
+        // the entry may describe a link that was replaced while accepting
+        if (peer->fd < 0 || fds[1 + i].fd != peer->fd || fds[1 + i].revents == 0)
+        {
+            continue;
+        }
+
+        if ((fds[1 + i].revents & (POLLIN | POLLHUP | POLLERR)) && read_link(mesh, peer) < 0)
+        {
+            drop_link(mesh, i);
+            continue;
+        }
+
+        if ((fds[1 + i].revents & POLLOUT) && write_link(peer) < 0)
+        {
+            drop_link(mesh, i);
+        }
+    }
+}
+
+/**
+ * Read what a peer sent and handle every complete envelope.
+ *
+ * @return 0 on success, -1 if the link closed or sent garbage.
+ */
+static int read_link(struct cpt_mesh *mesh, struct cpt_peer *peer)
+{
+    struct iovec iov[2];
+    uint8_t header[CPT_VARINT_MAX];
+    uint8_t *envelope;
+    size_t available;
+    size_t header_size;
+    size_t body_size;
+    ssize_t nread;
+    int iovcnt;
+    int used;
+
+    iovcnt = cpt_ring_free_iov(&peer->in, iov);
+    nread = readv(peer->fd, iov, iovcnt);
+
+    if (nread < 0)
+    {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+    }
+
+    if (nread == 0)
+    {
+        return -1;
+    }
+
+    cpt_ring_produce(&peer->in, (size_t) nread);
+
+    for (;;)
+    {
+        available = cpt_ring_length(&peer->in);
+        cpt_ring_peek(&peer->in, 0, header, available < sizeof(header) ? available : sizeof(header));
+        used = cpt_envelope_parse_header(header, available < sizeof(header) ? available : sizeof(header),
+                                         &header_size, &body_size);
+
+        if (used < 0)
+        {
+            return -1;
+        }
+
+        if (used == 0 || available < header_size + body_size)
+        {
+            return 0;
+        }
+
+        envelope = cpt_ring_contiguous(&peer->in, 0, header_size + body_size);
+
+        if (envelope == NULL)
+        {
+            cpt_ring_peek(&peer->in, 0, mesh->scratch, header_size + body_size);
+            envelope = mesh->scratch;
+        }
+
+        if (read_records(mesh, peer, envelope + header_size, body_size) < 0)
+        {
+            return -1;
+        }
+
+        cpt_ring_consume(&peer->in, header_size + body_size);
+    }
+}
+
+static int read_records(struct cpt_mesh *mesh, struct cpt_peer *peer, uint8_t *body, size_t size)
+{
+    uint32_t count, channel_id, members, user_id, msg_len;
+    channel *ch;
+    size_t pos;
+    uint8_t type;
+
+    pos = 0;
+
+    while (pos < size)
+    {
+        type = body[pos++];
+
+        switch (type)
+        {
+            case MESH_MEMBERS:
+                if (get_varint(body, size, &pos, &count) < 0)
+                {
+                    return -1;
+                }
+
+                for (uint32_t i = 0; i < count; i++)
+                {
+                    if (get_varint(body, size, &pos, &channel_id) < 0 || get_varint(body, size, &pos, &members) < 0 ||
+                        channel_id > UINT16_MAX || members > UINT16_MAX)
+                    {
+                        return -1;
+                    }
+
+                    peer->members[channel_id] = (uint16_t) members;
+                }
+                break;
+            case MESH_FORWARD:
+                if (get_varint(body, size, &pos, &channel_id) < 0 || get_varint(body, size, &pos, &user_id) < 0 ||
+                    get_varint(body, size, &pos, &msg_len) < 0 || channel_id > UINT16_MAX || user_id > UINT16_MAX ||
+                    msg_len > UINT16_MAX || size - pos < msg_len)
+                {
+                    return -1;
+                }
+
+                // forwarded messages only reach local members and never travel on
+                ch = mesh->info->channels[channel_id];
+
+                if (ch != NULL)
+                {
+                    cpt_broadcast(mesh->info, ch, (uint16_t) user_id, body + pos, (uint16_t) msg_len);
+                }
+
+                pos += msg_len;
+                break;
+            default:
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int get_varint(const uint8_t *buf, size_t size, size_t *pos, uint32_t *value)
+{
+    int used;
+
+    used = cpt_varint_get(buf + *pos, size - *pos, value);
+
+    if (used <= 0)
+    {
+        return -1;
+    }
+
+    *pos += (size_t) used;
+
+    return 0;
+}
+
+static int write_link(struct cpt_peer *peer)
+{
+    ssize_t nwritten;
+
+    // records queued since the last write go out as one envelope, its header is only valid once sealed
+    cpt_envelope_seal(&peer->envelope, &peer->out);
+
+    while (cpt_buffer_length(&peer->out) > 0)
+    {
+        nwritten = send(peer->fd, peer->out.data + peer->out.head, cpt_buffer_length(&peer->out), MSG_NOSIGNAL);
+
+        if (nwritten < 0)
+        {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        }
+
+        cpt_buffer_consume(&peer->out, (size_t) nwritten);
+    }
+
+    return 0;
+}
+
+static uint32_t local_members(const struct cpt_mesh *mesh, uint16_t channel_id)
+{
+    const channel *ch;
+
+    ch = mesh->info->channels[channel_id];
+
+    if (ch == NULL)
+    {
+        return 0;
+    }
+
+    return ch->users->userCount > UINT16_MAX ? UINT16_MAX : (uint32_t) ch->users->userCount;
+}
+
+/**
+ * Queue MESH_MEMBERS records with the local member count of each channel.
+ *
+ * @return 0 on success, -1 if the link was dropped.
+ */
+static int queue_members(struct cpt_mesh *mesh, struct cpt_peer *peer, const uint16_t *ids, size_t count)
+{
+    uint8_t *dst;
+    size_t batch;
+    size_t size;
+    size_t pos;
+
+    for (size_t first = 0; first < count; first += batch)
+    {
+        batch = count - first < CPT_MESH_MEMBERS_BATCH ? count - first : CPT_MESH_MEMBERS_BATCH;
+        size = 1 + cpt_varint_size((uint32_t) batch);
+
+        for (size_t i = first; i < first + batch; i++)
+        {
+            size += cpt_varint_size(ids[i]) + cpt_varint_size(local_members(mesh, ids[i]));
+        }
+
+        dst = cpt_envelope_reserve(&peer->envelope, &peer->out, size);
+
+        if (dst == NULL)
+        {
+            drop_link(mesh, (int) (peer - mesh->peers));
+            return -1;
+        }
+
+        dst[0] = MESH_MEMBERS;
+        pos = 1;
+        pos += cpt_varint_put((uint32_t) batch, dst + pos);
+
+        for (size_t i = first; i < first + batch; i++)
+        {
+            pos += cpt_varint_put(ids[i], dst + pos);
+            pos += cpt_varint_put(local_members(mesh, ids[i]), dst + pos);
+        }
+
+        cpt_envelope_commit(&peer->envelope, &peer->out, size);
+    }
+
+    return 0;
+}
+
+void cpt_mesh_flush(struct cpt_mesh *mesh)
+{
+    struct cpt_peer *peer;
+
+    for (int i = 0; i < mesh->count; i++)
+    {
+        peer = &mesh->peers[i];
+
+        if (peer->fd >= 0 && mesh->dirty_count > 0)
+        {
+            queue_members(mesh, peer, mesh->dirty, mesh->dirty_count);
+        }
+
+        if (peer->fd < 0)
+        {
+            continue;
+        }
+
+        if (write_link(peer) < 0)
+        {
+            drop_link(mesh, i);
+        }
+    }
+
+    for (size_t i = 0; i < mesh->dirty_count; i++)
+    {
+        mesh->dirty_flags[mesh->dirty[i]] = 0;
+    }
+
+    mesh->dirty_count = 0;
+}
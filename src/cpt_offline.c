@@ -0,0 +1,188 @@
+#include "cpt_offline.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define RECORD_HEADER 10
+#define MEMORY_INITIAL_CAPACITY 1024
+
+static uint8_t *reserve(struct cpt_offline *queue, size_t size);
+static int open_segment(struct cpt_offline *queue);
+static void replay_records(uint8_t *data, size_t length, cpt_offline_fn fn, void *arg);
+
+void cpt_offline_init(struct cpt_offline *queue, const char *dir, uint64_t expires_at)
+{
+    memset(queue, 0, sizeof(*queue));
+    queue->dir = dir;
+    queue->fd = -1;
+    queue->expires_at = expires_at;
+}
+
+int cpt_offline_push(struct cpt_offline *queue, uint16_t channel_id, uint16_t user_id, uint32_t seq,
+                     const uint8_t *msg, uint16_t msg_len)
+{
+    uint8_t *dst;
+
+    dst = reserve(queue, RECORD_HEADER + (size_t) msg_len);
+
+    if (dst == NULL)
+    {
+        queue->dropped++;
+        return -1;
+    }
+
+    memcpy(dst, &channel_id, sizeof(channel_id));
+    memcpy(dst + 2, &user_id, sizeof(user_id));
+    memcpy(dst + 4, &msg_len, sizeof(msg_len));
+    memcpy(dst + 6, &seq, sizeof(seq));
+    memcpy(dst + RECORD_HEADER, msg, msg_len);
+
+    return 0;
+}
+
+/**
+ * Room for one record, in memory while the budget lasts and in the
+ * spill file after that. Once spilling has started every later record
+ * goes to the file, which keeps them in order.
+ */
+static uint8_t *reserve(struct cpt_offline *queue, size_t size)
+{
+    uint8_t *memory;
+    size_t capacity;
+
+    if (queue->segment == NULL && queue->length + size <= CPT_OFFLINE_MEMORY)
+    {
+        if (queue->length + size > queue->capacity)
+        {
+            capacity = queue->capacity == 0 ? MEMORY_INITIAL_CAPACITY : queue->capacity;
+
+            while (capacity < queue->length + size)
+            {
+                capacity *= 2;
+            }
+
+            capacity = capacity > CPT_OFFLINE_MEMORY ? CPT_OFFLINE_MEMORY : capacity;
+            memory = realloc(queue->memory, capacity);
+
+            if (memory == NULL)
+            {
+                return NULL;
+            }
+
+            queue->memory = memory;
+            queue->capacity = capacity;
+        }
+
+        queue->length += size;
+
+        return queue->memory + queue->length - size;
+    }
+
+    if ((queue->segment == NULL && open_segment(queue) < 0) || queue->spilled + size > CPT_OFFLINE_SEGMENT)
+    {
+        return NULL;
+    }
+
+    queue->spilled += size;
+
+    return queue->segment + queue->spilled - size;
+}
+
+/**
+ * Create the spill file. It is unlinked straight away, so nothing is
+ * left behind however the server exits.
+ */
+static int open_segment(struct cpt_offline *queue)
+{
+    char path[PATH_MAX];
+    void *base;
+
+    if (queue->fd >= 0)
+    {
+        // an earlier attempt already failed to map it
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/cpt-offline-XXXXXX", queue->dir);
+    queue->fd = mkstemp(path);
+
+    if (queue->fd < 0)
+    {
+        return -1;
+    }
+
+    unlink(path);
+    fcntl(queue->fd, F_SETFD, FD_CLOEXEC);
+
+    if (ftruncate(queue->fd, CPT_OFFLINE_SEGMENT) < 0)
+    {
+        return -1;
+    }
+
+    base = mmap(NULL, CPT_OFFLINE_SEGMENT, PROT_READ | PROT_WRITE, MAP_SHARED, queue->fd, 0);
+
+    if (base == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    queue->segment = base;
+
+    return 0;
+}
+
+void cpt_offline_replay(struct cpt_offline *queue, cpt_offline_fn fn, void *arg)
+{
+    replay_records(queue->memory, queue->length, fn, arg);
+
+    if (queue->segment != NULL)
+    {
+        replay_records(queue->segment, queue->spilled, fn, arg);
+    }
+}
+
+static void replay_records(uint8_t *data, size_t length, cpt_offline_fn fn, void *arg)
+{
+    uint16_t channel_id;
+    uint16_t user_id;
+    uint16_t msg_len;
+    uint32_t seq;
+    size_t pos;
+
+    pos = 0;
+
+    while (pos < length)
+    {
+        memcpy(&channel_id, data + pos, sizeof(channel_id));
+        memcpy(&user_id, data + pos + 2, sizeof(user_id));
+        memcpy(&msg_len, data + pos + 4, sizeof(msg_len));
+        memcpy(&seq, data + pos + 6, sizeof(seq));
+        fn(arg, channel_id, user_id, seq, data + pos + RECORD_HEADER, msg_len);
+        pos += RECORD_HEADER + (size_t) msg_len;
+    }
+}
+
+void cpt_offline_destroy(struct cpt_offline *queue)
+{
+    if (queue->segment != NULL)
+    {
+        munmap(queue->segment, CPT_OFFLINE_SEGMENT);
+    }
+
+    if (queue->fd >= 0)
+    {
+        close(queue->fd);
+    }
+
+    free(queue->memory);
+    queue->memory = NULL;
+    queue->segment = NULL;
+    queue->fd = -1;
+    queue->length = 0;
+    queue->capacity = 0;
+    queue->spilled = 0;
+}
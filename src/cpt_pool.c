@@ -0,0 +1,141 @@
+// MAP_ANONYMOUS is a Linux extension
+#define _GNU_SOURCE
+
+#include "cpt_pool.h"
+#include "cpt_cpu.h"
+#include <stdlib.h>
+#include <sys/mman.h>
+
+static int block_class(size_t size);
+/**
+ * cpt_pool_alloc() for the buffers that were moved to the pool.
+ */
+static uint8_t *take_block(void *arg, size_t size);
+/**
+ * cpt_pool_free() for the buffers that were moved to the pool.
+ */
+static void give_block(void *arg, uint8_t *data, size_t size);
+
+struct cpt_pool *cpt_pool_create(int node)
+{
+    struct cpt_pool *pool;
+
+    pool = calloc(1, sizeof(struct cpt_pool));
+
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+
+    pool->node = node;
+
+    for (int i = 0; i < CPT_POOL_CLASSES; i++)
+    {
+        // small pages: a huge page would pin 2 MB for the first few kilobytes of output
+        pool->classes[i] = cpt_arena_create_on((size_t) CPT_POOL_MIN_BLOCK << i, CPT_ARENA_SMALL_PAGES, node);
+
+        if (pool->classes[i] == NULL)
+        {
+            cpt_pool_destroy(pool);
+            return NULL;
+        }
+    }
+
+    pool->buffers.alloc = take_block;
+    pool->buffers.free = give_block;
+    pool->buffers.arg = pool;
+
+    return pool;
+}
+
+uint8_t *cpt_pool_alloc(struct cpt_pool *pool, size_t size)
+{
+    uint8_t *block;
+    int class;
+
+    class = block_class(size);
+
+    if (class >= 0)
+    {
+        return cpt_arena_alloc(pool->classes[class]);
+    }
+
+    block = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (block == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    if (pool->node >= 0)
+    {
+        cpt_cpu_bind(block, size, pool->node);
+    }
+
+    return block;
+}
+
+void cpt_pool_free(struct cpt_pool *pool, uint8_t *block, size_t size)
+{
+    int class;
+
+    class = block_class(size);
+
+    if (class >= 0)
+    {
+        cpt_arena_free(pool->classes[class], block);
+    }
+    else
+    {
+        munmap(block, size);
+    }
+}
+
+void cpt_pool_destroy(struct cpt_pool *pool)
+{
+    if (pool == NULL)
+    {
+        return;
+    }
+
+    for (int i = 0; i < CPT_POOL_CLASSES; i++)
+    {
+        cpt_arena_destroy(pool->classes[i]);
+    }
+
+    free(pool);
+}
+
+/**
+ * Arena a block of <size> bytes comes from, -1 if it is mapped on its own.
+ */
+static int block_class(size_t size)
+{
+    int class;
+
+    for (class = 0; class < CPT_POOL_CLASSES; class++)
+    {
+        if (size <= (size_t) CPT_POOL_MIN_BLOCK << class)
+        {
+            return class;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * cpt_pool_alloc() for the buffers that were moved to the pool.
+ */
+static uint8_t *take_block(void *arg, size_t size)
+{
+    return cpt_pool_alloc(arg, size);
+}
+
+/**
+ * cpt_pool_free() for the buffers that were moved to the pool.
+ */
+static void give_block(void *arg, uint8_t *data, size_t size)
+{
+    cpt_pool_free(arg, data, size);
+}
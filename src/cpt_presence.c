@@ -0,0 +1,143 @@
+#include "cpt_presence.h"
+#include "common.h"
+#include <stdlib.h>
+
+#define PRESENCE_INITIAL_CAPACITY 16
+
+static int compare_deltas(const void *a, const void *b);
+
+int cpt_presence_record(struct cpt_presence *presence, uint16_t user_id, int joined)
+{
+    struct cpt_presence_delta *deltas;
+    size_t capacity;
+
+    if (presence->overflowed)
+    {
+        return -1;
+    }
+
+    if (presence->count == CPT_PRESENCE_MAX)
+    {
+        presence->overflowed = 1;
+        return -1;
+    }
+
+    if (presence->count == presence->capacity)
+    {
+        capacity = presence->capacity == 0 ? PRESENCE_INITIAL_CAPACITY : presence->capacity * 2;
+        deltas = realloc(presence->deltas, capacity * sizeof(struct cpt_presence_delta));
+
+        if (deltas == NULL)
+        {
+            // members learn about it the same way as about a storm
+            presence->overflowed = 1;
+            return -1;
+        }
+
+        presence->deltas = deltas;
+        presence->capacity = capacity;
+    }
+
+    presence->deltas[presence->count].seq = presence->seq++;
+    presence->deltas[presence->count].user_id = user_id;
+    presence->deltas[presence->count].joined = (uint8_t) (joined != 0);
+    presence->count++;
+
+    return 0;
+}
+
+size_t cpt_presence_settle(struct cpt_presence *presence)
+{
+    struct cpt_presence_delta *deltas;
+    struct cpt_presence_delta swap;
+    size_t count;
+    size_t end;
+    size_t joins;
+
+    if (presence->count == 0)
+    {
+        return 0;
+    }
+
+    deltas = presence->deltas;
+    qsort(deltas, presence->count, sizeof(struct cpt_presence_delta), compare_deltas);
+    count = 0;
+
+    // a user's changes alternate, so only an odd number of them leaves a net change
+    for (size_t i = 0; i < presence->count; i = end)
+    {
+        end = i + 1;
+
+        while (end < presence->count && deltas[end].user_id == deltas[i].user_id)
+        {
+            end++;
+        }
+
+        if ((end - i) % 2 == 1)
+        {
+            deltas[count++] = deltas[end - 1];
+        }
+    }
+
+    presence->count = count;
+    joins = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (deltas[i].joined)
+        {
+            swap = deltas[joins];
+            deltas[joins++] = deltas[i];
+            deltas[i] = swap;
+        }
+    }
+
+    return joins;
+}
+
+size_t cpt_presence_encode(const struct cpt_presence_delta *deltas, size_t count, uint8_t *buf)
+{
+    size_t size;
+
+    size = cpt_varint_put((uint32_t) count, buf);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        size += cpt_varint_put(deltas[i].user_id, buf + size);
+    }
+
+    return size;
+}
+
+void cpt_presence_reset(struct cpt_presence *presence)
+{
+    presence->count = 0;
+    presence->seq = 0;
+    presence->overflowed = 0;
+}
+
+void cpt_presence_destroy(struct cpt_presence *presence)
+{
+    free(presence->deltas);
+    presence->deltas = NULL;
+    presence->count = 0;
+    presence->capacity = 0;
+    presence->seq = 0;
+    presence->overflowed = 0;
+}
+
+static int compare_deltas(const void *a, const void *b)
+{
+    const struct cpt_presence_delta *x;
+    const struct cpt_presence_delta *y;
+
+    x = a;
+    y = b;
+
+    if (x->user_id != y->user_id)
+    {
+        return x->user_id < y->user_id ? -1 : 1;
+    }
+
+    return x->seq < y->seq ? -1 : (x->seq > y->seq ? 1 : 0);
+}
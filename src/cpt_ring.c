@@ -0,0 +1,160 @@
+#include "cpt_ring.h"
+#include <string.h>
+
+void cpt_ring_init(struct cpt_ring * ring, uint8_t * storage, size_t capacity)
+{
+    ring->data = storage;
+    ring->capacity = capacity;
+    ring->head = 0;
+    ring->tail = 0;
+}
+
+size_t cpt_ring_length(const struct cpt_ring * ring)
+{
+    return ring->tail - ring->head;
+}
+
+size_t cpt_ring_space(const struct cpt_ring * ring)
+{
+    return ring->capacity - (ring->tail - ring->head);
+}
+
+int cpt_ring_free_iov(struct cpt_ring * ring, struct iovec iov[2])
+{
+    size_t space;
+    size_t start;
+    size_t first;
+
+    space = cpt_ring_space(ring);
+
+    if (space == 0)
+    {
+        return 0;
+    }
+
+    start = ring->tail & (ring->capacity - 1);
+    first = ring->capacity - start;
+
+    iov[0].iov_base = ring->data + start;
+
+    if (first >= space)
+    {
+        iov[0].iov_len = space;
+        return 1;
+    }
+
+    iov[0].iov_len = first;
+    iov[1].iov_base = ring->data;
+    iov[1].iov_len = space - first;
+
+    return 2;
+}
+
+int cpt_ring_data_iov(struct cpt_ring * ring, struct iovec iov[2])
+{
+    size_t length;
+    size_t start;
+    size_t first;
+
+    length = cpt_ring_length(ring);
+
+    if (length == 0)
+    {
+        return 0;
+    }
+
+    start = ring->head & (ring->capacity - 1);
+    first = ring->capacity - start;
+
+    iov[0].iov_base = ring->data + start;
+
+    if (first >= length)
+    {
+        iov[0].iov_len = length;
+        return 1;
+    }
+
+    iov[0].iov_len = first;
+    iov[1].iov_base = ring->data;
+    iov[1].iov_len = length - first;
+
+    return 2;
+}
+
+void cpt_ring_produce(struct cpt_ring * ring, size_t size)
+{
+    ring->tail += size;
+}
+
+size_t cpt_ring_write(struct cpt_ring * ring, const uint8_t * src, size_t size)
+{
+    size_t start;
+    size_t first;
+
+    if (size > cpt_ring_space(ring))
+    {
+        size = cpt_ring_space(ring);
+    }
+
+    start = ring->tail & (ring->capacity - 1);
+    first = ring->capacity - start;
+
+    if (first >= size)
+    {
+        memcpy(ring->data + start, src, size);
+    }
+    else
+    {
+        memcpy(ring->data + start, src, first);
+        memcpy(ring->data, src + first, size - first);
+    }
+
+    ring->tail += size;
+
+    return size;
+}
+
+void cpt_ring_peek(const struct cpt_ring * ring, size_t offset, uint8_t * dst, size_t size)
+{
+    size_t start;
+    size_t first;
+
+    start = (ring->head + offset) & (ring->capacity - 1);
+    first = ring->capacity - start;
+
+    if (first >= size)
+    {
+        memcpy(dst, ring->data + start, size);
+    }
+    else
+    {
+        memcpy(dst, ring->data + start, first);
+        memcpy(dst + first, ring->data, size - first);
+    }
+}
+
+uint8_t * cpt_ring_contiguous(struct cpt_ring * ring, size_t offset, size_t size)
+{
+    size_t start;
+
+    start = (ring->head + offset) & (ring->capacity - 1);
+
+    if (ring->capacity - start < size)
+    {
+        return NULL;
+    }
+
+    return ring->data + start;
+}
+
+void cpt_ring_consume(struct cpt_ring * ring, size_t size)
+{
+    ring->head += size;
+
+    // rewinding an empty ring keeps the next frame from straddling the end
+    if (ring->head == ring->tail)
+    {
+        ring->head = 0;
+        ring->tail = 0;
+    }
+}
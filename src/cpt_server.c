@@ -0,0 +1,3111 @@
+#include "cpt_server.h"
+#include "cpt_admin.h"
+#include "cpt_arena.h"
+#include "cpt_capture.h"
+#include "cpt_fanout.h"
+#include "cpt_mesh.h"
+#include "cpt_probe.h"
+#include "cpt_snapshot.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MEMBERS_INITIAL_CAPACITY 8
+#define CHANNELS_INITIAL_CAPACITY 4
+#define REQUEST_SCRATCH_SIZE (CPT_VARINT_MAX + CPT_ENVELOPE_MAX)
+
+static int channel_add_user(struct serverInfo *info, channel *ch, user *client);
+static int channel_remove_user(struct serverInfo *info, channel *ch, user *client);
+static int channel_has_user(const channel *ch, const user *client);
+static int grow_members(userList *list);
+static int publish_members(struct serverInfo *info, channel *ch);
+static void unpublish_members(struct serverInfo *info, channel *ch);
+static void retire_snapshot(struct serverInfo *info, struct cpt_snapshot *snapshot);
+static void note_presence(struct serverInfo *info, channel *ch, const user *client, int joined);
+static void send_presence(struct serverInfo *info, channel *ch);
+static void broadcast_response(struct serverInfo *info, channel *ch, uint8_t code, uint8_t *msg, uint16_t msg_len);
+static void mark_dirty(struct serverInfo *info, user *client);
+static int queue_bytes(struct serverInfo *info, user *client, const uint8_t *bytes, size_t size);
+static int append_bytes(user *client, const uint8_t *bytes, size_t size);
+static int queue_urgent_bytes(struct serverInfo *info, user *client, const uint8_t *bytes, size_t size);
+static int queue_response(struct serverInfo *info, user *client, uint8_t code, uint16_t channel_id, uint16_t user_id,
+                          uint8_t *msg, uint16_t msg_len, int urgent);
+static int urgent_allowed(const struct serverInfo *info, const user *client);
+static void upgrade_version(user *client, int version);
+static int accepting_input(const user *client);
+static void handle_input(struct serverInfo *info, user *client);
+static ssize_t read_rings(struct serverInfo *info, user *client);
+static void drain_rings(struct serverInfo *info, user *client);
+static int read_frames(struct serverInfo *info, user *client);
+static int read_envelopes(struct serverInfo *info, user *client);
+static void capture_frame(struct serverInfo *info, user *client, const uint8_t *frame, size_t size);
+static ssize_t send_descriptor(int fd, uint8_t *data, size_t size, int pass_fd);
+static int send_queues(const struct serverInfo *info, user *client, size_t bulk_size);
+static int send_output(user *client, size_t size);
+static int send_urgent(user *client, size_t size);
+static size_t envelope_size(const uint8_t *data, size_t size);
+static size_t unit_rest(const user *client, int urgent, size_t sent);
+static int flush_rings(user *client);
+static uint16_t bounded_length(size_t length);
+static size_t pack_message(struct serverInfo *info, const channel *ch, const struct CptResponse *res);
+static void train_dictionary(struct serverInfo *info, channel *ch, uint8_t *msg, uint16_t msg_len);
+static void send_dictionary(struct serverInfo *info, user *client, const channel *ch);
+static int broadcast_lanes(struct serverInfo *info, channel *ch, const struct CptResponse *res, size_t frame_size,
+                           size_t record_size, uint32_t seq, size_t sequence_size);
+static void deliver_lane(void *arg, int lane);
+static int park_message(user *member, const struct CptResponse *res, uint32_t seq);
+static user *find_parked(const struct serverInfo *info, const char *name);
+static void unlink_parked(struct serverInfo *info, user *parked);
+static void free_parked(user *parked);
+static void adopt_parked(struct serverInfo *info, user *client, user *parked);
+static void replace_member(userList *list, const user *from, user *to);
+static int dispatch(struct serverInfo *info, user *client, struct CptRequest *req);
+static int hold_output(const struct serverInfo *info, user *client);
+static void replay_message(void *arg, uint16_t channel_id, uint16_t user_id, uint32_t seq, uint8_t *msg,
+                           uint16_t msg_len);
+static void resend_message(void *arg, uint32_t seq, uint16_t user_id, uint8_t *msg, uint16_t msg_len);
+static int queue_message(struct serverInfo *info, user *client, uint16_t channel_id, uint16_t user_id, uint32_t seq,
+                         uint8_t *msg, uint16_t msg_len);
+static size_t sequence_record(struct serverInfo *info, const channel *ch, uint32_t seq);
+static int flush_output(struct serverInfo *info, user *client);
+static size_t user_memory(const user *client);
+static size_t channel_memory(channel *ch);
+static void charge(struct serverInfo *info, size_t *charged, size_t size);
+static void charge_user(struct serverInfo *info, user *client);
+static void charge_channel(struct serverInfo *info, channel *ch);
+static int over_budget(const struct serverInfo *info);
+static void drop_spare_output(struct serverInfo *info, user *client);
+static void publish_user(const struct serverInfo *info, const user *client, uint8_t state);
+static void publish_channel(const struct serverInfo *info, int id, int32_t members);
+
+/**
+ * How a command is handled: requests with fewer than <min_len> bytes
+ * of MSG are answered with <too_short> without calling <handler>. Slot
+ * 0 stands for every unknown command and has no handler.
+ */
+struct command
+{
+    int (*handler)(struct serverInfo *info, user *client, struct CptRequest *req);
+    uint16_t min_len;
+    uint8_t too_short;
+    const char *name;
+};
+
+static const struct command commands[CPT_COMMAND_COUNT] = {
+        [0] = {NULL, 0, 0, "unknown"},
+        [SEND] = {cpt_send_response, 0, 0, "SEND"},
+        [LOGOUT] = {cpt_logout_response, 0, 0, "LOGOUT"},
+        [GET_USERS] = {cpt_get_users_response, 0, 0, "GET_USERS"},
+        [CREATE_CHANNEL] = {cpt_create_channel_response, 0, 0, "CREATE_CHANNEL"},
+        [JOIN_CHANNEL] = {cpt_join_channel_response, 0, 0, "JOIN_CHANNEL"},
+        [LEAVE_CHANNEL] = {cpt_leave_channel_response, 0, 0, "LEAVE_CHANNEL"},
+        [LOGIN] = {cpt_login_response, 1, LOGIN_FAIL, "LOGIN"},
+        [MAP_RINGS] = {cpt_map_rings_response, 0, 0, "MAP_RINGS"},
+        [RESUME] = {cpt_resume_response, 1, INVALID_ID, "RESUME"},
+};
+
+/**
+ * Where a resumed client's queued MESSAGEs are replayed to, or a
+ * channel's history for a RESUME.
+ */
+struct replay_job
+{
+    struct serverInfo *info;
+    user *client;
+    uint16_t channel_id;
+};
+
+/**
+ * A broadcast to a channel split by fan-out lane.
+ *
+ * Each lane fills its own slots, and links the members it made dirty
+ * into its own list so the lanes never write the same memory.
+ */
+struct lane_job
+{
+    struct cpt_fanout *fanout;
+    const struct cpt_snapshot *snapshot;
+    const struct CptResponse *res;
+    const uint8_t *frame;
+    size_t frame_size;
+    const uint8_t *record;
+    size_t record_size;
+    const uint8_t *packed;
+    size_t packed_size;
+    uint32_t seq;
+    const uint8_t *sequence;
+    size_t sequence_size;
+    user *dirty[CPT_FANOUT_MAX_LANES];
+    user *dirty_tail[CPT_FANOUT_MAX_LANES];
+    int delivered[CPT_FANOUT_MAX_LANES];
+};
+
+struct serverInfo *cpt_server_create(void)
+{
+    struct serverInfo *info;
+    struct CptResponse unknown;
+
+    info = calloc(1, sizeof(struct serverInfo));
+
+    if (info == NULL)
+    {
+        return NULL;
+    }
+
+    info->global.channel_id = GLOBAL_CHANNEL;
+    info->global.users = calloc(1, sizeof(userList));
+    atomic_init(&info->global.snapshot, NULL);
+    info->global.next = NULL;
+    info->channels = calloc(CPT_MAX_CHANNELS, sizeof(channel *));
+    info->users = calloc(CPT_MAX_CHANNELS, sizeof(user *));
+    info->frame = malloc(CPT_RESPONSE_HEADER_SIZE + UINT16_MAX);
+    info->record = malloc(CPT_RESPONSE_RECORD_MAX);
+    info->request = malloc(REQUEST_SCRATCH_SIZE);
+    info->text = malloc((size_t) UINT16_MAX + 1);
+    info->packed = malloc(UINT16_MAX);
+    info->packed_record = malloc(CPT_RESPONSE_RECORD_MAX);
+    info->presence_ids = malloc(CPT_MAX_CHANNELS * sizeof(uint16_t));
+    info->presence_flags = calloc(CPT_MAX_CHANNELS, 1);
+    info->presence_window = (uint64_t) CPT_PRESENCE_WINDOW_MS * 1000;
+    info->offline_dir = CPT_OFFLINE_DIR;
+    info->history_capacity = CPT_HISTORY_MEMORY;
+    info->urgent_weight = CPT_URGENT_WEIGHT;
+    info->memory_budget = CPT_MEMORY_BUDGET;
+    unknown.code = UNKNOWN_CMD;
+    unknown.data_size = 0;
+    unknown.channel_id = 0;
+    unknown.user_id = 0;
+    unknown.msg_len = 0;
+    unknown.msg = NULL;
+    cpt_serialize_response(&unknown, info->unknown_frame, sizeof(info->unknown_frame));
+    info->unknown_record_size = cpt_serialize_response_record(&unknown, info->unknown_record,
+                                                              sizeof(info->unknown_record));
+    info->first_user_id = 1;
+    info->last_user_id = UINT16_MAX;
+    info->next_user_id = 1;
+
+    if (info->global.users == NULL || info->channels == NULL || info->users == NULL || info->frame == NULL ||
+        info->record == NULL || info->request == NULL || info->text == NULL || info->packed == NULL ||
+        info->packed_record == NULL || info->presence_ids == NULL || info->presence_flags == NULL ||
+        cpt_compressor_init(&info->codec) < 0)
+    {
+        cpt_server_destroy(info);
+        return NULL;
+    }
+
+    info->channels[GLOBAL_CHANNEL] = &info->global;
+    cpt_server_tick(info);
+
+    return info;
+}
+
+void cpt_server_tick(struct serverInfo *info)
+{
+    struct cpt_admin_stats *stats;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    info->now = (uint64_t) ts.tv_sec * 1000000U + (uint64_t) ts.tv_nsec / 1000U;
+    stats = info->published;
+
+    if (stats == NULL)
+    {
+        return;
+    }
+
+    // what the previous round left behind, once per round rather than at every change
+    if (info->arena != NULL)
+    {
+        atomic_store_explicit(&stats->arena_regions, info->arena->region_count, memory_order_relaxed);
+        atomic_store_explicit(&stats->arena_explicit, info->arena->explicit_regions, memory_order_relaxed);
+        atomic_store_explicit(&stats->arena_in_use, info->arena->in_use, memory_order_relaxed);
+    }
+
+    atomic_store_explicit(&stats->memory_used, info->memory_used, memory_order_relaxed);
+    atomic_store_explicit(&stats->memory_peak, info->memory_peak, memory_order_relaxed);
+    atomic_store_explicit(&stats->memory_budget, info->memory_budget, memory_order_relaxed);
+    atomic_store_explicit(&stats->shed_bytes, info->shed_bytes, memory_order_relaxed);
+    atomic_store_explicit(&stats->shed_clients, info->shed_clients, memory_order_relaxed);
+}
+
+void cpt_server_publish(struct serverInfo *info, struct cpt_admin_stats *stats)
+{
+    const channel *ch;
+    const user *client;
+
+    info->published = stats;
+
+    if (stats == NULL)
+    {
+        return;
+    }
+
+    for (int id = 0; id < CPT_MAX_CHANNELS; id++)
+    {
+        ch = info->channels[id];
+        publish_channel(info, id, ch == NULL ? -1 : ch->users->userCount);
+
+        if (ch != NULL)
+        {
+            atomic_store_explicit(&stats->seq[id], ch->seq, memory_order_relaxed);
+        }
+    }
+
+    for (int id = info->first_user_id; id <= info->last_user_id; id++)
+    {
+        client = info->users[id];
+
+        if (client != NULL)
+        {
+            publish_user(info, client, client->offline != NULL ? CPT_ADMIN_PARKED : CPT_ADMIN_LOGGED_IN);
+        }
+    }
+
+    cpt_server_tick(info);
+}
+
+void cpt_server_destroy(struct serverInfo *info)
+{
+    user *parked;
+
+    if (info == NULL)
+    {
+        return;
+    }
+
+    if (info->channels != NULL)
+    {
+        for (int i = 1; i < CPT_MAX_CHANNELS; i++)
+        {
+            if (info->channels[i] != NULL)
+            {
+                destroy_channel(info->channels[i]);
+            }
+        }
+    }
+
+    if (info->global.users != NULL)
+    {
+        free(info->global.users->members);
+        free(info->global.users);
+    }
+
+    free(atomic_load_explicit(&info->global.snapshot, memory_order_relaxed));
+    cpt_snapshot_reclaim(&info->retired, UINT64_MAX);
+    cpt_presence_destroy(&info->global.presence);
+    cpt_history_destroy(&info->global.history);
+    cpt_dictionary_destroy(info->global.dict);
+    cpt_compressor_destroy(&info->codec);
+    free(info->channels);
+    free(info->users);
+    free(info->frame);
+    free(info->record);
+    free(info->request);
+    free(info->text);
+    free(info->packed);
+    free(info->packed_record);
+    free(info->presence_ids);
+    free(info->presence_flags);
+
+    while (info->offline != NULL)
+    {
+        parked = info->offline;
+        info->offline = parked->offline_next;
+        free_parked(parked);
+    }
+
+    cpt_arena_destroy(info->arena);
+    free(info);
+}
+
+channel *createChannelList(void){
+    channel *global = malloc(sizeof(channel));
+    struct userList *list;
+    if (global == NULL) {
+        printf("ERROR (malloc) : createChannelList()\n");
+        return NULL;
+    }
+    list = calloc(1, sizeof(userList));
+    if (list == NULL) {
+        printf("ERROR (malloc) : createChannelList()\n");
+        free(global);
+        return NULL;
+    }
+
+    global->channel_id = GLOBAL_CHANNEL;
+    global->users = list;
+    atomic_init(&global->snapshot, NULL);
+    global->sends.refilled_at = 0;
+    memset(&global->presence, 0, sizeof(global->presence));
+    global->dict = NULL;
+    global->next = NULL;
+
+    return global;
+}
+
+void add_Channel(channel *list, channel *input){
+    input->next = list->next;
+    list->next = input;
+}
+
+channel * create_channel(userList *list, uint16_t id){
+    channel *temp = malloc(sizeof(channel));
+
+    if (temp == NULL)
+    {
+        return NULL;
+    }
+
+    if (list == NULL)
+    {
+        list = calloc(1, sizeof(userList));
+
+        if (list == NULL)
+        {
+            free(temp);
+            return NULL;
+        }
+    }
+
+    temp->channel_id = id;
+    temp->next = NULL;
+    temp->users = list;
+    atomic_init(&temp->snapshot, NULL);
+    temp->sends.refilled_at = 0;
+    memset(&temp->presence, 0, sizeof(temp->presence));
+    temp->dict = NULL;
+    temp->seq = 0;
+    memset(&temp->history, 0, sizeof(temp->history));
+    temp->charged = 0;
+
+    return temp;
+}
+
+void destroy_channel(channel *ch){
+    if (ch->users != NULL)
+    {
+        free(ch->users->members);
+        free(ch->users);
+    }
+    // lanes are idle while the event loop changes channels
+    free(atomic_load_explicit(&ch->snapshot, memory_order_relaxed));
+    cpt_presence_destroy(&ch->presence);
+    cpt_dictionary_destroy(ch->dict);
+    cpt_history_destroy(&ch->history);
+    ch->channel_id = 0;
+    ch->next = NULL;
+    ch->users = NULL;
+    ch->dict = NULL;
+    free(ch);
+}
+
+void destroy_user(user *client){
+    if (client->shm != NULL)
+    {
+        cpt_shm_destroy(client->shm);
+        free(client->shm);
+    }
+    if (client->arena != NULL)
+    {
+        cpt_arena_free(client->arena, client->in.data);
+    }
+    else
+    {
+        free(client->in.data);
+    }
+    cpt_buffer_destroy(&client->out);
+    cpt_buffer_destroy(&client->urgent);
+    free(client->channels);
+    client->user_fd = 0;
+    client->user_id = 0;
+    free(client);
+}
+
+user * create_user(int fd, int id){
+    return create_user_in(NULL, fd, id);
+}
+
+user * create_user_in(struct cpt_arena *arena, int fd, int id){
+    user *i  = calloc(1, sizeof(user));
+    uint8_t *storage;
+
+    if (i == NULL)
+    {
+        return NULL;
+    }
+
+    storage = arena != NULL ? cpt_arena_alloc(arena) : malloc(CPT_INPUT_CAPACITY);
+
+    if (storage == NULL)
+    {
+        free(i);
+        return NULL;
+    }
+
+    i->user_id = id;
+    i->user_fd = fd;
+    i->version = CPT_SERVER_VERSION;
+    i->arena = arena;
+    i->next = NULL;
+    cpt_ring_init(&i->in, storage, CPT_INPUT_CAPACITY);
+    cpt_buffer_init(&i->out, CPT_OUTPUT_LIMIT);
+    cpt_envelope_init(&i->envelope);
+    cpt_buffer_init(&i->urgent, CPT_OUTPUT_LIMIT);
+    cpt_envelope_init(&i->urgent_envelope);
+
+    return i;
+}
+
+static int channel_has_user(const channel *ch, const user *client)
+{
+    for (int i = 0; i < ch->users->userCount; i++)
+    {
+        if (ch->users->members[i] == client)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int channel_add_user(struct serverInfo *info, channel *ch, user *client)
+{
+    userList *list;
+
+    if (channel_has_user(ch, client))
+    {
+        return 0;
+    }
+
+    list = ch->users;
+
+    if (grow_members(list) < 0)
+    {
+        return -1;
+    }
+
+    if (client->channel_count == client->channel_capacity)
+    {
+        uint16_t *channels;
+        int capacity;
+
+        capacity = client->channel_capacity == 0 ? CHANNELS_INITIAL_CAPACITY : client->channel_capacity * 2;
+        channels = realloc(client->channels, (size_t) capacity * sizeof(uint16_t));
+
+        if (channels == NULL)
+        {
+            return -1;
+        }
+
+        client->channels = channels;
+        client->channel_capacity = capacity;
+    }
+
+    list->members[list->userCount++] = client;
+    client->channels[client->channel_count++] = ch->channel_id;
+    publish_channel(info, ch->channel_id, list->userCount);
+
+    // if the copy fails the channel is delivered from the flat list until its next broadcast
+    if (atomic_load_explicit(&ch->snapshot, memory_order_relaxed) != NULL)
+    {
+        publish_members(info, ch);
+    }
+
+    note_presence(info, ch, client, 1);
+
+    if (info->mesh != NULL)
+    {
+        cpt_mesh_note_members(info->mesh, ch->channel_id);
+    }
+
+    charge_channel(info, ch);
+    charge_user(info, client);
+
+    return 0;
+}
+
+static int channel_remove_user(struct serverInfo *info, channel *ch, user *client)
+{
+    userList *list;
+    int found;
+
+    list = ch->users;
+    found = 0;
+
+    for (int i = 0; i < list->userCount; i++)
+    {
+        if (list->members[i] == client)
+        {
+            list->members[i] = list->members[--list->userCount];
+            found = 1;
+            break;
+        }
+    }
+
+    for (int i = 0; i < client->channel_count; i++)
+    {
+        if (client->channels[i] == ch->channel_id)
+        {
+            client->channels[i] = client->channels[--client->channel_count];
+            break;
+        }
+    }
+
+    if (found && atomic_load_explicit(&ch->snapshot, memory_order_relaxed) != NULL)
+    {
+        // a channel that shrank well below the threshold goes back to the flat list
+        if ((size_t) list->userCount < info->fanout->threshold / 2 || list->userCount == 0)
+        {
+            unpublish_members(info, ch);
+        }
+        else
+        {
+            publish_members(info, ch);
+        }
+    }
+
+    if (found)
+    {
+        note_presence(info, ch, client, 0);
+    }
+
+    if (found && info->mesh != NULL)
+    {
+        cpt_mesh_note_members(info->mesh, ch->channel_id);
+    }
+
+    if (found && list->userCount == 0 && ch->channel_id != GLOBAL_CHANNEL)
+    {
+        charge(info, &ch->charged, 0);
+        publish_channel(info, ch->channel_id, -1);
+        info->channels[ch->channel_id] = NULL;
+        destroy_channel(ch);
+    }
+    else if (found)
+    {
+        publish_channel(info, ch->channel_id, list->userCount);
+        charge_channel(info, ch);
+    }
+
+    return found;
+}
+
+static int grow_members(userList *list)
+{
+    user **members;
+    int capacity;
+
+    if (list->userCount < list->capacity)
+    {
+        return 0;
+    }
+
+    capacity = list->capacity == 0 ? MEMBERS_INITIAL_CAPACITY : list->capacity * 2;
+    members = realloc(list->members, (size_t) capacity * sizeof(user *));
+
+    if (members == NULL)
+    {
+        return -1;
+    }
+
+    list->members = members;
+    list->capacity = capacity;
+
+    return 0;
+}
+
+/**
+ * Publish a new snapshot of a channel's members grouped by fan-out lane
+ * and retire the one it replaces.
+ *
+ * @return 0 on success, -1 if allocation failed and the channel went back to the flat list.
+ */
+static int publish_members(struct serverInfo *info, channel *ch)
+{
+    struct cpt_snapshot *current;
+    struct cpt_snapshot *next;
+    size_t fill[CPT_FANOUT_MAX_LANES];
+    struct cpt_pool *pool;
+    user *member;
+    int lanes;
+    int lane;
+
+    current = atomic_load_explicit(&ch->snapshot, memory_order_relaxed);
+    lanes = info->fanout->lanes;
+    next = cpt_snapshot_create(current == NULL ? 1 : current->version + 1, lanes, (size_t) ch->users->userCount);
+
+    if (next == NULL)
+    {
+        unpublish_members(info, ch);
+        return -1;
+    }
+
+    memset(fill, 0, sizeof(fill));
+
+    for (int i = 0; i < ch->users->userCount; i++)
+    {
+        fill[cpt_fanout_lane(info->fanout, ch->users->members[i]->user_id)]++;
+    }
+
+    next->starts[0] = 0;
+
+    for (lane = 0; lane < lanes; lane++)
+    {
+        next->starts[lane + 1] = next->starts[lane] + fill[lane];
+        fill[lane] = next->starts[lane];
+    }
+
+    for (int i = 0; i < ch->users->userCount; i++)
+    {
+        member = ch->users->members[i];
+        lane = cpt_fanout_lane(info->fanout, member->user_id);
+        next->members[fill[lane]++] = member;
+        pool = info->fanout->pools[lane];
+
+        // the lane writes the member's output from now on, so it moves to the lane's node; where the
+        // pool cannot take it the output stays in place and is only slower to reach
+        if (pool != NULL && member->out.pool != &pool->buffers)
+        {
+            cpt_buffer_move(&member->out, &pool->buffers);
+        }
+    }
+
+    // the members are written before the pointer that leads to them
+    atomic_store_explicit(&ch->snapshot, next, memory_order_release);
+    retire_snapshot(info, current);
+
+    return 0;
+}
+
+static void unpublish_members(struct serverInfo *info, channel *ch)
+{
+    struct cpt_snapshot *current;
+
+    current = atomic_load_explicit(&ch->snapshot, memory_order_relaxed);
+
+    if (current == NULL)
+    {
+        return;
+    }
+
+    atomic_store_explicit(&ch->snapshot, NULL, memory_order_release);
+    retire_snapshot(info, current);
+}
+
+/**
+ * Retire an unpublished snapshot and free the ones no lane can still hold.
+ */
+static void retire_snapshot(struct serverInfo *info, struct cpt_snapshot *snapshot)
+{
+    cpt_snapshot_retire(&info->retired, snapshot, info->fanout->generation);
+    cpt_snapshot_reclaim(&info->retired, cpt_fanout_quiescent(info->fanout));
+}
+
+/**
+ * Record a join or leave for the channel's next presence events.
+ */
+static void note_presence(struct serverInfo *info, channel *ch, const user *client, int joined)
+{
+    if (info->presence_window == 0)
+    {
+        return;
+    }
+
+    cpt_presence_record(&ch->presence, (uint16_t) client->user_id, joined);
+
+    if (!info->presence_flags[ch->channel_id])
+    {
+        // the window opens with the first change anywhere
+        if (info->presence_count == 0)
+        {
+            info->presence_due = info->now + info->presence_window;
+        }
+
+        info->presence_flags[ch->channel_id] = 1;
+        info->presence_ids[info->presence_count++] = ch->channel_id;
+    }
+}
+
+void cpt_server_flush_presence(struct serverInfo *info)
+{
+    channel *ch;
+
+    if (info->presence_count == 0 || info->now < info->presence_due)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < info->presence_count; i++)
+    {
+        info->presence_flags[info->presence_ids[i]] = 0;
+        ch = info->channels[info->presence_ids[i]];
+
+        // a channel that emptied is gone, and so is everyone who would care
+        if (ch != NULL)
+        {
+            send_presence(info, ch);
+            cpt_presence_reset(&ch->presence);
+        }
+    }
+
+    info->presence_count = 0;
+}
+
+int cpt_server_presence_timeout(const struct serverInfo *info)
+{
+    if (info->presence_count == 0)
+    {
+        return -1;
+    }
+
+    if (info->now >= info->presence_due)
+    {
+        return 0;
+    }
+
+    return (int) ((info->presence_due - info->now + 999) / 1000);
+}
+
+static void send_presence(struct serverInfo *info, channel *ch)
+{
+    uint8_t joined_code;
+    uint8_t left_code;
+    size_t joins;
+    size_t size;
+
+    joined_code = ch->channel_id == GLOBAL_CHANNEL ? USER_CONNECTED : USER_JOINED_CHANNEL;
+    left_code = ch->channel_id == GLOBAL_CHANNEL ? USER_DISCONNECTED : USER_LEFT_CHANNEL;
+
+    if (ch->presence.overflowed)
+    {
+        broadcast_response(info, ch, joined_code, NULL, 0);
+        return;
+    }
+
+    joins = cpt_presence_settle(&ch->presence);
+
+    if (joins > 0)
+    {
+        size = cpt_presence_encode(ch->presence.deltas, joins, info->packed);
+        broadcast_response(info, ch, joined_code, info->packed, (uint16_t) size);
+    }
+
+    if (ch->presence.count > joins)
+    {
+        size = cpt_presence_encode(ch->presence.deltas + joins, ch->presence.count - joins, info->packed);
+        broadcast_response(info, ch, left_code, info->packed, (uint16_t) size);
+    }
+}
+
+/**
+ * Serialize a response once per framing and queue it for every member.
+ */
+static void broadcast_response(struct serverInfo *info, channel *ch, uint8_t code, uint8_t *msg, uint16_t msg_len)
+{
+    struct CptResponse res;
+    const uint8_t *bytes;
+    size_t frame_size;
+    size_t record_size;
+    size_t size;
+    user *member;
+
+    res.code = code;
+    res.data_size = msg_len;
+    res.channel_id = ch->channel_id;
+    res.user_id = 0;
+    res.msg_len = msg_len;
+    res.msg = msg;
+    frame_size = cpt_serialize_response(&res, info->frame, CPT_RESPONSE_HEADER_SIZE + UINT16_MAX);
+    record_size = cpt_serialize_response_record(&res, info->record, CPT_RESPONSE_RECORD_MAX);
+
+    for (int i = 0; i < ch->users->userCount; i++)
+    {
+        member = ch->users->members[i];
+
+        if (member->version >= CPT_VERSION_BATCHED)
+        {
+            bytes = info->record;
+            size = record_size;
+        }
+        else
+        {
+            bytes = info->frame;
+            size = frame_size;
+        }
+
+        if (queue_bytes(info, member, bytes, size) == 0)
+        {
+            CPT_PROBE4(enqueue, member->user_fd, code, ch->channel_id, size);
+        }
+    }
+}
+
+void cpt_server_disconnect(struct serverInfo *info, user *client)
+{
+    channel *ch;
+
+    while (client->channel_count > 0)
+    {
+        ch = info->channels[client->channels[client->channel_count - 1]];
+
+        if (ch == NULL || !channel_remove_user(info, ch, client))
+        {
+            client->channel_count--;
+        }
+    }
+
+    if (client->user_id != 0)
+    {
+        publish_user(info, client, CPT_ADMIN_FREE);
+        info->users[client->user_id] = NULL;
+        info->user_count--;
+        client->user_id = 0;
+    }
+
+    charge(info, &client->charged, 0);
+}
+
+int cpt_server_park(struct serverInfo *info, user *client)
+{
+    user **link;
+
+    // parking would only move the memory of a client shed to stay under the budget
+    if (info->offline_ttl == 0 || client->user_id == 0 || over_budget(info))
+    {
+        return -1;
+    }
+
+    client->offline = malloc(sizeof(struct cpt_offline));
+
+    if (client->offline == NULL)
+    {
+        return -1;
+    }
+
+    cpt_offline_init(client->offline, info->offline_dir, info->now + info->offline_ttl);
+
+    // nothing is flushed to a parked client any more
+    for (link = &info->dirty; *link != NULL; link = &(*link)->next)
+    {
+        if (*link == client)
+        {
+            *link = client->next;
+            break;
+        }
+    }
+
+    client->dirty = 0;
+    client->next = NULL;
+    client->user_fd = -1;
+    client->offline_next = NULL;
+    cpt_buffer_destroy(&client->out);
+    cpt_buffer_destroy(&client->urgent);
+    cpt_envelope_init(&client->envelope);
+    cpt_envelope_init(&client->urgent_envelope);
+    charge_user(info, client);
+
+    if (info->offline_tail == NULL)
+    {
+        info->offline = client;
+    }
+    else
+    {
+        info->offline_tail->offline_next = client;
+    }
+
+    info->offline_tail = client;
+    publish_user(info, client, CPT_ADMIN_PARKED);
+
+    return 0;
+}
+
+void cpt_server_expire_offline(struct serverInfo *info)
+{
+    user *parked;
+
+    // every client is parked for the same TTL, so the oldest expires first
+    while (info->offline != NULL && info->offline->offline->expires_at <= info->now)
+    {
+        parked = info->offline;
+        unlink_parked(info, parked);
+        cpt_server_disconnect(info, parked);
+        free_parked(parked);
+    }
+}
+
+int cpt_server_offline_timeout(const struct serverInfo *info)
+{
+    uint64_t expires_at;
+
+    if (info->offline == NULL)
+    {
+        return -1;
+    }
+
+    expires_at = info->offline->offline->expires_at;
+
+    if (info->now >= expires_at)
+    {
+        return 0;
+    }
+
+    return (int) ((expires_at - info->now + 999) / 1000);
+}
+
+void cpt_server_shed(struct serverInfo *info)
+{
+    channel *ch;
+    user *client;
+    user *largest;
+    size_t closing;
+
+    if (!over_budget(info))
+    {
+        return;
+    }
+
+    // cached frames first, a RESUME then only learns how many messages are gone
+    for (int i = 0; i < CPT_MAX_CHANNELS && over_budget(info); i++)
+    {
+        ch = info->channels[i];
+
+        if (ch != NULL && ch->history.ring.data != NULL)
+        {
+            info->shed_bytes += ch->history.ring.capacity;
+            cpt_history_destroy(&ch->history);
+            charge_channel(info, ch);
+        }
+    }
+
+    for (int id = info->first_user_id; id <= info->last_user_id && over_budget(info); id++)
+    {
+        if (info->users[id] != NULL)
+        {
+            drop_spare_output(info, info->users[id]);
+        }
+    }
+
+    // what the clients marked here still hold is freed when the event loop closes them
+    closing = 0;
+
+    while (info->memory_used - closing > info->memory_budget)
+    {
+        largest = NULL;
+
+        for (int id = info->first_user_id; id <= info->last_user_id; id++)
+        {
+            client = info->users[id];
+
+            if (client != NULL && !client->closing && client->offline == NULL &&
+                (largest == NULL || client->charged > largest->charged))
+            {
+                largest = client;
+            }
+        }
+
+        if (largest == NULL)
+        {
+            break;
+        }
+
+        largest->closing = 1;
+        closing += largest->charged;
+        info->shed_clients++;
+    }
+}
+
+/**
+ * Free the output storage of a client that has nothing queued.
+ */
+static void drop_spare_output(struct serverInfo *info, user *client)
+{
+    // a client that is not dirty has no envelope open
+    if (client->dirty || client->offline != NULL)
+    {
+        return;
+    }
+
+    if (cpt_buffer_length(&client->out) == 0 && client->out.capacity > 0)
+    {
+        info->shed_bytes += client->out.capacity;
+        cpt_buffer_destroy(&client->out);
+    }
+
+    if (cpt_buffer_length(&client->urgent) == 0 && client->urgent.capacity > 0)
+    {
+        info->shed_bytes += client->urgent.capacity;
+        cpt_buffer_destroy(&client->urgent);
+    }
+
+    charge_user(info, client);
+}
+
+/**
+ * Publish what the admin socket shows of a user, or clear its id when
+ * <state> is CPT_ADMIN_FREE.
+ */
+static void publish_user(const struct serverInfo *info, const user *client, uint8_t state)
+{
+    struct cpt_admin_user *slot;
+    int live;
+
+    if (info->published == NULL || client->user_id == 0)
+    {
+        return;
+    }
+
+    slot = &info->published->users[client->user_id];
+    live = state != CPT_ADMIN_FREE;
+    atomic_store_explicit(&slot->state, state, memory_order_relaxed);
+    atomic_store_explicit(&slot->version, (uint8_t) (live ? client->version : 0), memory_order_relaxed);
+    atomic_store_explicit(&slot->shm, (uint8_t) (live && client->shm != NULL), memory_order_relaxed);
+    atomic_store_explicit(&slot->sent, live ? client->sent : 0, memory_order_relaxed);
+    atomic_store_explicit(&slot->sent_bytes, live ? client->sent_bytes : 0, memory_order_relaxed);
+    atomic_store_explicit(&slot->queued, live ? cpt_buffer_length(&client->out) : 0, memory_order_relaxed);
+    atomic_store_explicit(&slot->urgent, live ? cpt_buffer_length(&client->urgent) : 0, memory_order_relaxed);
+}
+
+/**
+ * Publish the member count of a channel id, -1 once it is gone.
+ */
+static void publish_channel(const struct serverInfo *info, int id, int32_t members)
+{
+    if (info->published != NULL)
+    {
+        atomic_store_explicit(&info->published->members[id], members, memory_order_relaxed);
+    }
+}
+
+/**
+ * What a client's storage takes. A parked client's offline queue is
+ * counted at its in-memory maximum since lanes fill it without the
+ * event loop looking.
+ */
+static size_t user_memory(const user *client)
+{
+    size_t size;
+
+    size = sizeof(user) + client->in.capacity + client->out.capacity + client->urgent.capacity +
+           (size_t) client->channel_capacity * sizeof(uint16_t);
+
+    if (client->offline != NULL)
+    {
+        size += sizeof(struct cpt_offline) + CPT_OFFLINE_MEMORY;
+    }
+
+    if (client->shm != NULL)
+    {
+        size += sizeof(struct cpt_shm) + client->shm->size;
+    }
+
+    return size;
+}
+
+/**
+ * What a channel's member list, snapshot, dictionary and history take.
+ */
+static size_t channel_memory(channel *ch)
+{
+    struct cpt_snapshot *snapshot;
+    size_t size;
+
+    size = sizeof(channel) + sizeof(userList) + (size_t) ch->users->capacity * sizeof(user *) +
+           ch->history.ring.capacity;
+    snapshot = atomic_load_explicit(&ch->snapshot, memory_order_relaxed);
+
+    if (snapshot != NULL)
+    {
+        size += sizeof(struct cpt_snapshot) + snapshot->count * sizeof(user *);
+    }
+
+    if (ch->dict != NULL)
+    {
+        size += sizeof(struct cpt_dictionary) + CPT_DICT_MAX + ch->dict->size;
+
+        if (ch->dict->table != NULL)
+        {
+            size += ((size_t) 1 << CPT_COMPRESS_HASH_BITS) * sizeof(uint32_t);
+        }
+    }
+
+    return size;
+}
+
+/**
+ * Replace what was <charged> to the budget with <size>.
+ */
+static void charge(struct serverInfo *info, size_t *charged, size_t size)
+{
+    info->memory_used = info->memory_used - *charged + size;
+    *charged = size;
+
+    if (info->memory_used > info->memory_peak)
+    {
+        info->memory_peak = info->memory_used;
+    }
+}
+
+static void charge_user(struct serverInfo *info, user *client)
+{
+    charge(info, &client->charged, user_memory(client));
+}
+
+static void charge_channel(struct serverInfo *info, channel *ch)
+{
+    charge(info, &ch->charged, channel_memory(ch));
+}
+
+static int over_budget(const struct serverInfo *info)
+{
+    return info->memory_budget != 0 && info->memory_used > info->memory_budget;
+}
+
+static int park_message(user *member, const struct CptResponse *res, uint32_t seq)
+{
+    return cpt_offline_push(member->offline, res->channel_id, res->user_id, seq, res->msg, res->msg_len);
+}
+
+static user *find_parked(const struct serverInfo *info, const char *name)
+{
+    for (user *parked = info->offline; parked != NULL; parked = parked->offline_next)
+    {
+        if (strcmp(parked->name, name) == 0)
+        {
+            return parked;
+        }
+    }
+
+    return NULL;
+}
+
+static void unlink_parked(struct serverInfo *info, user *parked)
+{
+    user **link;
+    user *prev;
+
+    prev = NULL;
+
+    for (link = &info->offline; *link != parked; link = &(*link)->offline_next)
+    {
+        prev = *link;
+    }
+
+    *link = parked->offline_next;
+
+    if (info->offline_tail == parked)
+    {
+        info->offline_tail = prev;
+    }
+
+    parked->offline_next = NULL;
+}
+
+static void free_parked(user *parked)
+{
+    cpt_offline_destroy(parked->offline);
+    free(parked->offline);
+    parked->offline = NULL;
+    destroy_user(parked);
+}
+
+/**
+ * Give a parked user's id, channels and send budget to the client that
+ * logged in under its name. The client takes the parked user's place
+ * in every member list, which keeps it in the same fan-out lane.
+ */
+static void adopt_parked(struct serverInfo *info, user *client, user *parked)
+{
+    channel *ch;
+
+    client->user_id = parked->user_id;
+    client->channels = parked->channels;
+    client->channel_count = parked->channel_count;
+    client->channel_capacity = parked->channel_capacity;
+    client->sends = parked->sends;
+    parked->channels = NULL;
+    parked->channel_count = 0;
+    parked->channel_capacity = 0;
+    info->users[client->user_id] = client;
+
+    for (int i = 0; i < client->channel_count; i++)
+    {
+        ch = info->channels[client->channels[i]];
+        replace_member(ch->users, parked, client);
+
+        if (atomic_load_explicit(&ch->snapshot, memory_order_relaxed) != NULL)
+        {
+            publish_members(info, ch);
+        }
+    }
+}
+
+static void replace_member(userList *list, const user *from, user *to)
+{
+    for (int i = 0; i < list->userCount; i++)
+    {
+        if (list->members[i] == from)
+        {
+            list->members[i] = to;
+            return;
+        }
+    }
+}
+
+static void replay_message(void *arg, uint16_t channel_id, uint16_t user_id, uint32_t seq, uint8_t *msg,
+                           uint16_t msg_len)
+{
+    struct replay_job *job;
+
+    job = arg;
+    queue_message(job->info, job->client, channel_id, user_id, seq, msg, msg_len);
+}
+
+static void resend_message(void *arg, uint32_t seq, uint16_t user_id, uint8_t *msg, uint16_t msg_len)
+{
+    struct replay_job *job;
+
+    job = arg;
+    queue_message(job->info, job->client, job->channel_id, user_id, seq, msg, msg_len);
+}
+
+/**
+ * Queue one MESSAGE for a client, behind its MESSAGE_SEQUENCE record for
+ * a version 4 client.
+ */
+static int queue_message(struct serverInfo *info, user *client, uint16_t channel_id, uint16_t user_id, uint32_t seq,
+                         uint8_t *msg, uint16_t msg_len)
+{
+    uint8_t number[CPT_VARINT_MAX];
+
+    if (client->version >= CPT_VERSION_SEQUENCED &&
+        cpt_queue_response(info, client, MESSAGE_SEQUENCE, channel_id, 0, number,
+                           (uint16_t) cpt_varint_put(seq, number)) < 0)
+    {
+        return -1;
+    }
+
+    return cpt_queue_response(info, client, MESSAGE, channel_id, user_id, msg, msg_len);
+}
+
+static void mark_dirty(struct serverInfo *info, user *client)
+{
+    if (!client->dirty)
+    {
+        client->dirty = 1;
+        client->next = info->dirty;
+        info->dirty = client;
+    }
+}
+
+static int queue_bytes(struct serverInfo *info, user *client, const uint8_t *bytes, size_t size)
+{
+    if (append_bytes(client, bytes, size) < 0)
+    {
+        return -1;
+    }
+
+    mark_dirty(info, client);
+
+    return 0;
+}
+
+/**
+ * Copy serialized output to a client without touching the registry,
+ * which makes it safe to call from a fan-out lane.
+ */
+static int append_bytes(user *client, const uint8_t *bytes, size_t size)
+{
+    uint8_t *dst;
+
+    if (client->closing || client->offline != NULL)
+    {
+        return -1;
+    }
+
+    if (client->version >= CPT_VERSION_BATCHED)
+    {
+        dst = cpt_envelope_reserve(&client->envelope, &client->out, size);
+    }
+    else
+    {
+        dst = cpt_buffer_reserve(&client->out, size);
+    }
+
+    if (dst == NULL)
+    {
+        // a peer that stops reading must not grow without bound
+        client->closing = 1;
+        return -1;
+    }
+
+    memcpy(dst, bytes, size);
+
+    if (client->version >= CPT_VERSION_BATCHED)
+    {
+        cpt_envelope_commit(&client->envelope, &client->out, size);
+    }
+    else
+    {
+        cpt_buffer_commit(&client->out, size);
+    }
+
+    return 0;
+}
+
+/**
+ * Copy a serialized reply to a client's urgent queue.
+ */
+static int queue_urgent_bytes(struct serverInfo *info, user *client, const uint8_t *bytes, size_t size)
+{
+    uint8_t *dst;
+
+    if (client->closing)
+    {
+        return -1;
+    }
+
+    dst = cpt_envelope_reserve(&client->urgent_envelope, &client->urgent, size);
+
+    if (dst == NULL)
+    {
+        client->closing = 1;
+        return -1;
+    }
+
+    memcpy(dst, bytes, size);
+    cpt_envelope_commit(&client->urgent_envelope, &client->urgent, size);
+    mark_dirty(info, client);
+
+    return 0;
+}
+
+/**
+ * Whether a reply may go ahead of a client's MESSAGEs.
+ *
+ * Version 1 clients have nothing to frame it apart with, and a client
+ * on rings keeps one queue so the socket and the rings stay in order.
+ */
+static int urgent_allowed(const struct serverInfo *info, const user *client)
+{
+    return info->urgent_weight > 0 && client->version >= CPT_VERSION_BATCHED && client->shm == NULL;
+}
+
+/**
+ * Switch a client to a negotiated version. Whatever is queued by then
+ * stays version 1 frames, which nothing urgent may overtake.
+ */
+static void upgrade_version(user *client, int version)
+{
+    client->version = version;
+    client->legacy = cpt_buffer_length(&client->out);
+}
+
+static uint16_t bounded_length(size_t length)
+{
+    return (uint16_t) (length > UINT16_MAX ? UINT16_MAX : length);
+}
+
+int cpt_queue_response(struct serverInfo *info, user *client, uint8_t code, uint16_t channel_id, uint16_t user_id,
+                       uint8_t *msg, uint16_t msg_len)
+{
+    int urgent;
+
+    urgent = code != MESSAGE && code != MESSAGE_COMPRESSED && code != MESSAGE_SEQUENCE && code != CHANNEL_DICTIONARY;
+
+    return queue_response(info, client, code, channel_id, user_id, msg, msg_len,
+                          urgent && urgent_allowed(info, client));
+}
+
+/**
+ * Queue a response in a client's urgent queue or behind its MESSAGEs.
+ */
+static int queue_response(struct serverInfo *info, user *client, uint8_t code, uint16_t channel_id, uint16_t user_id,
+                          uint8_t *msg, uint16_t msg_len, int urgent)
+{
+    struct CptResponse res;
+    struct cpt_envelope *envelope;
+    struct cpt_buffer *out;
+    uint8_t *dst;
+    size_t size;
+
+    // only MESSAGEs are queued for a parked client, by the broadcast
+    if (client->closing || client->offline != NULL)
+    {
+        return -1;
+    }
+
+    res.code = code;
+    res.data_size = msg_len;
+    res.channel_id = channel_id;
+    res.user_id = user_id;
+    res.msg_len = msg_len;
+    res.msg = msg;
+    out = urgent ? &client->urgent : &client->out;
+    envelope = urgent ? &client->urgent_envelope : &client->envelope;
+
+    if (client->version >= CPT_VERSION_BATCHED)
+    {
+        size = cpt_response_record_size(&res);
+        dst = cpt_envelope_reserve(envelope, out, size);
+    }
+    else
+    {
+        size = cpt_response_size(&res);
+        dst = cpt_buffer_reserve(out, size);
+    }
+
+    if (dst == NULL)
+    {
+        client->closing = 1;
+        return -1;
+    }
+
+    if (client->version >= CPT_VERSION_BATCHED)
+    {
+        cpt_envelope_commit(envelope, out, cpt_serialize_response_record(&res, dst, size));
+    }
+    else
+    {
+        cpt_buffer_commit(out, cpt_serialize_response(&res, dst, size));
+    }
+
+    CPT_PROBE4(enqueue, client->user_fd, code, channel_id, size);
+    mark_dirty(info, client);
+
+    return 0;
+}
+
+int cpt_broadcast(struct serverInfo *info, channel *ch, uint16_t user_id, uint8_t *msg, uint16_t msg_len)
+{
+    struct CptResponse res;
+    const uint8_t *bytes;
+    size_t size;
+    size_t frame_size;
+    size_t record_size;
+    size_t packed_size;
+    size_t sequence_size;
+    uint32_t seq;
+    int packed;
+    int delivered;
+    int fanned;
+    user *member;
+
+    res.code = MESSAGE;
+    res.data_size = msg_len;
+    res.channel_id = ch->channel_id;
+    res.user_id = user_id;
+    res.msg_len = msg_len;
+    res.msg = msg;
+
+    // serialize once per framing, every member gets a copy of the same bytes
+    frame_size = cpt_serialize_response(&res, info->frame, CPT_RESPONSE_HEADER_SIZE + UINT16_MAX);
+    record_size = cpt_serialize_response_record(&res, info->record, CPT_RESPONSE_RECORD_MAX);
+    seq = ++ch->seq;
+
+    if (info->published != NULL)
+    {
+        atomic_store_explicit(&info->published->seq[ch->channel_id], seq, memory_order_relaxed);
+    }
+
+    sequence_size = sequence_record(info, ch, seq);
+    packed_size = 0;
+    packed = msg_len < CPT_COMPRESS_MIN;
+    delivered = 0;
+    // a published channel stays on the lanes until it shrinks well below the threshold
+    fanned = info->fanout != NULL && (atomic_load_explicit(&ch->snapshot, memory_order_relaxed) != NULL ||
+                                      ((size_t) ch->users->userCount >= info->fanout->threshold &&
+                                       publish_members(info, ch) == 0));
+
+    CPT_PROBE5(broadcast_start, ch->channel_id, user_id, msg_len, ch->users->userCount, fanned);
+
+    if (fanned)
+    {
+        delivered = broadcast_lanes(info, ch, &res, frame_size, record_size, seq, sequence_size);
+    }
+
+    for (int i = 0; !fanned && i < ch->users->userCount; i++)
+    {
+        member = ch->users->members[i];
+
+        if (member->offline != NULL)
+        {
+            delivered += park_message(member, &res, seq) == 0;
+            continue;
+        }
+
+        // compressed at most once, and only if some member can read it
+        if (member->version >= CPT_VERSION_COMPRESSED && !packed)
+        {
+            packed_size = pack_message(info, ch, &res);
+            packed = 1;
+        }
+
+        if (member->version >= CPT_VERSION_SEQUENCED &&
+            queue_bytes(info, member, info->sequence_record, sequence_size) < 0)
+        {
+            continue;
+        }
+
+        if (member->version >= CPT_VERSION_COMPRESSED && packed_size > 0)
+        {
+            bytes = info->packed_record;
+            size = packed_size;
+        }
+        else if (member->version >= CPT_VERSION_BATCHED)
+        {
+            bytes = info->record;
+            size = record_size;
+        }
+        else
+        {
+            bytes = info->frame;
+            size = frame_size;
+        }
+
+        if (queue_bytes(info, member, bytes, size) == 0)
+        {
+            CPT_PROBE4(enqueue, member->user_fd, res.code, ch->channel_id, size);
+            delivered++;
+        }
+    }
+
+    if (msg_len >= CPT_COMPRESS_MIN)
+    {
+        train_dictionary(info, ch, msg, msg_len);
+    }
+
+    // under memory pressure the history is the first thing given up
+    if (info->history_capacity > 0 && !over_budget(info))
+    {
+        cpt_history_push(&ch->history, info->history_capacity, seq, user_id, msg, msg_len);
+    }
+
+    charge_channel(info, ch);
+    CPT_PROBE3(broadcast_done, ch->channel_id, seq, delivered);
+
+    return delivered;
+}
+
+/**
+ * Serialize the MESSAGE_SEQUENCE record of a broadcast into <info->sequence_record>.
+ *
+ * @return Record size.
+ */
+static size_t sequence_record(struct serverInfo *info, const channel *ch, uint32_t seq)
+{
+    struct CptResponse res;
+    uint8_t number[CPT_VARINT_MAX];
+
+    res.code = MESSAGE_SEQUENCE;
+    res.channel_id = ch->channel_id;
+    res.user_id = 0;
+    res.msg_len = (uint16_t) cpt_varint_put(seq, number);
+    res.data_size = res.msg_len;
+    res.msg = number;
+
+    return cpt_serialize_response_record(&res, info->sequence_record, CPT_SEQUENCE_RECORD_MAX);
+}
+
+/**
+ * Fan a serialized MESSAGE out over the channel's lanes in parallel.
+ *
+ * Every lane walks its part of the same member snapshot, so each member
+ * gets the message once. Large messages are compressed up front, a
+ * large channel almost always has a version 3 member.
+ *
+ * @return Number of members the message was queued for.
+ */
+static int broadcast_lanes(struct serverInfo *info, channel *ch, const struct CptResponse *res, size_t frame_size,
+                           size_t record_size, uint32_t seq, size_t sequence_size)
+{
+    struct lane_job job;
+    int delivered;
+
+    job.fanout = info->fanout;
+    job.snapshot = atomic_load_explicit(&ch->snapshot, memory_order_acquire);
+    job.res = res;
+    job.frame = info->frame;
+    job.frame_size = frame_size;
+    job.record = info->record;
+    job.record_size = record_size;
+    job.packed = info->packed_record;
+    job.packed_size = res->msg_len < CPT_COMPRESS_MIN ? 0 : pack_message(info, ch, res);
+    job.seq = seq;
+    job.sequence = info->sequence_record;
+    job.sequence_size = sequence_size;
+    cpt_fanout_run(info->fanout, deliver_lane, &job);
+    delivered = 0;
+
+    if (info->retired != NULL)
+    {
+        cpt_snapshot_reclaim(&info->retired, cpt_fanout_quiescent(info->fanout));
+    }
+
+    for (int lane = 0; lane < job.snapshot->lanes; lane++)
+    {
+        delivered += job.delivered[lane];
+
+        if (job.dirty[lane] != NULL)
+        {
+            job.dirty_tail[lane]->next = info->dirty;
+            info->dirty = job.dirty[lane];
+        }
+    }
+
+    return delivered;
+}
+
+static void deliver_lane(void *arg, int lane)
+{
+    struct lane_job *job;
+    const uint8_t *bytes;
+    size_t size;
+    user *member;
+
+    job = arg;
+    job->dirty[lane] = NULL;
+    job->dirty_tail[lane] = NULL;
+    job->delivered[lane] = 0;
+    CPT_PROBE3(lane_start, job->res->channel_id, lane, job->snapshot->starts[lane + 1] - job->snapshot->starts[lane]);
+
+    // a plain walk over immutable memory, no lock and no atomic update per member
+    for (size_t i = job->snapshot->starts[lane]; i < job->snapshot->starts[lane + 1]; i++)
+    {
+        member = job->snapshot->members[i];
+
+        // a parked member's queue is its own, so lanes never share one
+        if (member->offline != NULL)
+        {
+            job->delivered[lane] += park_message(member, job->res, job->seq) == 0;
+            continue;
+        }
+
+        if (member->version >= CPT_VERSION_SEQUENCED &&
+            append_bytes(member, job->sequence, job->sequence_size) < 0)
+        {
+            continue;
+        }
+
+        if (member->version >= CPT_VERSION_COMPRESSED && job->packed_size > 0)
+        {
+            bytes = job->packed;
+            size = job->packed_size;
+        }
+        else if (member->version >= CPT_VERSION_BATCHED)
+        {
+            bytes = job->record;
+            size = job->record_size;
+        }
+        else
+        {
+            bytes = job->frame;
+            size = job->frame_size;
+        }
+
+        if (append_bytes(member, bytes, size) < 0)
+        {
+            continue;
+        }
+
+        CPT_PROBE4(enqueue, member->user_fd, job->res->code, job->res->channel_id, size);
+        job->delivered[lane]++;
+
+        if (!member->dirty)
+        {
+            member->dirty = 1;
+            member->next = job->dirty[lane];
+            job->dirty[lane] = member;
+
+            if (job->dirty_tail[lane] == NULL)
+            {
+                job->dirty_tail[lane] = member;
+            }
+        }
+    }
+
+    // an atomic because the admin thread reads it at any time, lanes included
+    atomic_fetch_add_explicit(&job->fanout->delivered[lane], (uint64_t) job->delivered[lane], memory_order_relaxed);
+    CPT_PROBE3(lane_done, job->res->channel_id, lane, job->delivered[lane]);
+}
+
+/**
+ * Compress a MESSAGE into a MESSAGE_COMPRESSED record in <info->packed_record>.
+ *
+ * The record's MSG is varint dictionary id (0 for none), varint original
+ * length and the compressed block.
+ *
+ * @return Record size, 0 if compressing would not make the message smaller.
+ */
+static size_t pack_message(struct serverInfo *info, const channel *ch, const struct CptResponse *res)
+{
+    struct CptResponse packed;
+    const struct cpt_dictionary *dict;
+    size_t header_size;
+    size_t size;
+
+    dict = ch->dict != NULL && ch->dict->data != NULL ? ch->dict : NULL;
+    header_size = cpt_varint_put(dict == NULL ? 0 : dict->id, info->packed);
+    header_size += cpt_varint_put(res->msg_len, info->packed + header_size);
+
+    // the block must leave the MSG strictly shorter than the original
+    if (dict == NULL)
+    {
+        size = cpt_compress(&info->codec, NULL, 0, res->msg, res->msg_len, info->packed + header_size,
+                            res->msg_len - header_size - 1);
+    }
+    else
+    {
+        size = cpt_compress_dictionary(&info->codec, dict, res->msg, res->msg_len, info->packed + header_size,
+                                       res->msg_len - header_size - 1);
+    }
+
+    if (size == 0)
+    {
+        return 0;
+    }
+
+    packed = *res;
+    packed.code = MESSAGE_COMPRESSED;
+    packed.data_size = (uint16_t) (header_size + size);
+    packed.msg_len = packed.data_size;
+    packed.msg = info->packed;
+
+    return cpt_serialize_response_record(&packed, info->packed_record, CPT_RESPONSE_RECORD_MAX);
+}
+
+/**
+ * Feed a large message to the channel's dictionary and hand a retrained
+ * dictionary to every version 3 member.
+ */
+static void train_dictionary(struct serverInfo *info, channel *ch, uint8_t *msg, uint16_t msg_len)
+{
+    if (ch->dict == NULL && (ch->dict = cpt_dictionary_create()) == NULL)
+    {
+        return;
+    }
+
+    if (!cpt_dictionary_sample(ch->dict, msg, msg_len))
+    {
+        return;
+    }
+
+    for (int i = 0; i < ch->users->userCount; i++)
+    {
+        send_dictionary(info, ch->users->members[i], ch);
+    }
+}
+
+/**
+ * Queue the channel's current dictionary for a version 3 client.
+ *
+ * MSG is the varint dictionary id followed by the dictionary.
+ */
+static void send_dictionary(struct serverInfo *info, user *client, const channel *ch)
+{
+    size_t size;
+
+    if (client->version < CPT_VERSION_COMPRESSED || ch->dict == NULL || ch->dict->data == NULL)
+    {
+        return;
+    }
+
+    size = cpt_varint_put(ch->dict->id, info->packed);
+    memcpy(info->packed + size, ch->dict->data, ch->dict->size);
+    cpt_queue_response(info, client, CHANNEL_DICTIONARY, ch->channel_id, 0, info->packed,
+                       bounded_length(size + ch->dict->size));
+}
+
+ssize_t cpt_server_read(struct serverInfo *info, user *client)
+{
+    struct iovec iov[2];
+    ssize_t nread;
+    int iovcnt;
+
+    if (client->shm != NULL)
+    {
+        return read_rings(info, client);
+    }
+
+    iovcnt = cpt_ring_free_iov(&client->in, iov);
+    nread = readv(client->user_fd, iov, iovcnt);
+
+    if (nread <= 0)
+    {
+        return nread;
+    }
+
+    cpt_ring_produce(&client->in, (size_t) nread);
+    handle_input(info, client);
+
+    // requests sent behind MAP_RINGS did not wait for the rings and are dropped
+    if (client->shm != NULL)
+    {
+        cpt_ring_consume(&client->in, cpt_ring_length(&client->in));
+    }
+
+    return nread;
+}
+
+/**
+ * Whether requests in the input should be handled, which stops between
+ * a MAP_RINGS and the client's first doorbell.
+ */
+static int accepting_input(const user *client)
+{
+    return !client->closing && (client->shm == NULL || client->shm_active);
+}
+
+/**
+ * Handle every complete request in the input.
+ */
+static void handle_input(struct serverInfo *info, user *client)
+{
+    // a version 2 LOGIN switches the framing of everything after it, so re-check per frame
+    while (accepting_input(client))
+    {
+        if (client->version >= CPT_VERSION_BATCHED ? read_envelopes(info, client) : read_frames(info, client))
+        {
+            break;
+        }
+    }
+
+    charge_user(info, client);
+}
+
+/**
+ * Drain the doorbells on the socket, then the requests in the client's ring.
+ *
+ * @return Doorbell bytes read, 0 when the peer closed, -1 on error.
+ */
+static ssize_t read_rings(struct serverInfo *info, user *client)
+{
+    uint8_t bells[64];
+    ssize_t nread;
+
+    nread = recv(client->user_fd, bells, sizeof(bells), 0);
+
+    if (nread <= 0)
+    {
+        return nread;
+    }
+
+    // the first doorbell says the client has mapped the rings
+    client->shm_active = 1;
+    drain_rings(info, client);
+
+    return nread;
+}
+
+/**
+ * Handle the requests in the client's ring until it is empty.
+ */
+static void drain_rings(struct serverInfo *info, user *client)
+{
+    struct iovec iov[2];
+    size_t moved;
+    size_t n;
+    int iovcnt;
+    int wake;
+    int rc;
+
+    wake = 0;
+
+    // read until the ring is empty, the client only rings again after it saw that
+    do
+    {
+        moved = 0;
+        iovcnt = cpt_ring_free_iov(&client->in, iov);
+
+        for (int i = 0; i < iovcnt; i++)
+        {
+            rc = cpt_shm_read(client->shm, CPT_SHM_TO_SERVER, iov[i].iov_base, iov[i].iov_len, &n);
+
+            if (rc < 0)
+            {
+                client->closing = 1;
+                return;
+            }
+
+            wake |= rc;
+            moved += n;
+
+            if (n < iov[i].iov_len)
+            {
+                break;
+            }
+        }
+
+        cpt_ring_produce(&client->in, moved);
+        handle_input(info, client);
+    } while (moved > 0 && !client->closing);
+
+    if (wake)
+    {
+        cpt_shm_doorbell(client->user_fd);
+    }
+
+    // a doorbell may also mean the client made room in its own ring
+    mark_dirty(info, client);
+}
+
+void cpt_server_resume(struct serverInfo *info, user *client)
+{
+    // doorbells the previous process consumed are not rung again, so look at the ring regardless
+    if (client->shm != NULL && client->shm_active)
+    {
+        drain_rings(info, client);
+    }
+    else
+    {
+        handle_input(info, client);
+    }
+
+    mark_dirty(info, client);
+}
+
+/**
+ * Handle version 1 frames until the input runs out or the client switches to envelopes.
+ *
+ * @return Non-zero when more input is needed.
+ */
+static int read_frames(struct serverInfo *info, user *client)
+{
+    struct CptRequest req;
+    uint8_t header[CPT_REQUEST_HEADER_SIZE];
+    uint8_t *frame;
+    size_t available;
+    size_t frame_size;
+
+    while (accepting_input(client) && client->version < CPT_VERSION_BATCHED)
+    {
+        available = cpt_ring_length(&client->in);
+
+        if (available < CPT_REQUEST_HEADER_SIZE)
+        {
+            return 1;
+        }
+
+        cpt_ring_peek(&client->in, 0, header, sizeof(header));
+        frame_size = CPT_REQUEST_HEADER_SIZE + (size_t) ((header[4] << 8) | header[5]);
+
+        if (available < frame_size)
+        {
+            return 1;
+        }
+
+        // requests are parsed in place unless they straddle the end of the ring
+        frame = cpt_ring_contiguous(&client->in, 0, frame_size);
+
+        if (frame == NULL)
+        {
+            cpt_ring_peek(&client->in, 0, info->request, frame_size);
+            frame = info->request;
+        }
+
+        CPT_PROBE4(frame, client->user_fd, client->version, frame_size, info->now);
+        capture_frame(info, client, frame, frame_size);
+        cpt_parse_request_into(&req, frame, frame_size);
+        cpt_handle_request(info, client, &req);
+        cpt_ring_consume(&client->in, frame_size);
+    }
+
+    return 0;
+}
+
+/**
+ * Handle every complete envelope in the input.
+ *
+ * @return Non-zero when more input is needed.
+ */
+static int read_envelopes(struct serverInfo *info, user *client)
+{
+    struct CptRequest req;
+    uint8_t header[CPT_VARINT_MAX];
+    uint8_t *envelope;
+    size_t available;
+    size_t header_size;
+    size_t body_size;
+    size_t offset;
+    int used;
+
+    while (accepting_input(client))
+    {
+        available = cpt_ring_length(&client->in);
+        cpt_ring_peek(&client->in, 0, header, available < sizeof(header) ? available : sizeof(header));
+        used = cpt_envelope_parse_header(header, available < sizeof(header) ? available : sizeof(header),
+                                         &header_size, &body_size);
+
+        if (used < 0)
+        {
+            client->closing = 1;
+            break;
+        }
+
+        if (used == 0 || available < header_size + body_size)
+        {
+            return 1;
+        }
+
+        envelope = cpt_ring_contiguous(&client->in, 0, header_size + body_size);
+
+        if (envelope == NULL)
+        {
+            cpt_ring_peek(&client->in, 0, info->request, header_size + body_size);
+            envelope = info->request;
+        }
+
+        CPT_PROBE4(frame, client->user_fd, client->version, header_size + body_size, info->now);
+        capture_frame(info, client, envelope, header_size + body_size);
+
+        for (offset = header_size; accepting_input(client) && offset < header_size + body_size;
+             offset += (size_t) used)
+        {
+            used = cpt_parse_request_record(&req, envelope + offset, header_size + body_size - offset);
+
+            if (used < 0)
+            {
+                client->closing = 1;
+                break;
+            }
+
+            cpt_handle_request(info, client, &req);
+        }
+
+        cpt_ring_consume(&client->in, header_size + body_size);
+    }
+
+    return 1;
+}
+
+/**
+ * Record a frame or envelope as received, before it is handled.
+ */
+static void capture_frame(struct serverInfo *info, user *client, const uint8_t *frame, size_t size)
+{
+    if (info->capture == NULL)
+    {
+        return;
+    }
+
+    if (client->capture_id == 0)
+    {
+        client->capture_id = cpt_capture_connection(info->capture);
+    }
+
+    cpt_capture_frame(info->capture, client->capture_id, info->now, frame, size);
+}
+
+int cpt_server_flush(struct serverInfo *info, user *client)
+{
+    int rc;
+
+    CPT_PROBE4(flush_start, client->user_fd, cpt_buffer_length(&client->out), cpt_buffer_length(&client->urgent),
+               info->now);
+    rc = flush_output(info, client);
+    charge_user(info, client);
+
+    if (info->published != NULL && client->user_id != 0)
+    {
+        atomic_store_explicit(&info->published->users[client->user_id].queued, cpt_buffer_length(&client->out),
+                              memory_order_relaxed);
+        atomic_store_explicit(&info->published->users[client->user_id].urgent, cpt_buffer_length(&client->urgent),
+                              memory_order_relaxed);
+    }
+
+    CPT_PROBE5(flush_done, client->user_fd, cpt_buffer_length(&client->out), cpt_buffer_length(&client->urgent), rc,
+               info->now);
+
+    return rc;
+}
+
+/**
+ * Seal the open envelopes and send what the socket or the rings take.
+ */
+static int flush_output(struct serverInfo *info, user *client)
+{
+    cpt_envelope_seal(&client->envelope, &client->out);
+    cpt_envelope_seal(&client->urgent_envelope, &client->urgent);
+
+    if (client->shm == NULL)
+    {
+        return send_queues(info, client, cpt_buffer_length(&client->out));
+    }
+
+    if (send_queues(info, client, client->socket_left) < 0)
+    {
+        return -1;
+    }
+
+    // the rings take over once everything meant for the socket is out
+    if (client->socket_left > 0 || cpt_buffer_length(&client->urgent) > 0 || !client->shm_active)
+    {
+        return 0;
+    }
+
+    return flush_rings(client);
+}
+
+int cpt_server_merge_output(user *client)
+{
+    struct cpt_buffer merged;
+    size_t urgent_len;
+    size_t first;
+    uint8_t *dst;
+
+    cpt_envelope_seal(&client->envelope, &client->out);
+    cpt_envelope_seal(&client->urgent_envelope, &client->urgent);
+    urgent_len = cpt_buffer_length(&client->urgent);
+
+    if (urgent_len == 0)
+    {
+        return 0;
+    }
+
+    // a bulk unit cut short and frames from before an upgrade go out before anything urgent
+    first = client->unit_left > 0 && !client->unit_urgent ? client->unit_left : 0;
+    first = client->legacy > first ? client->legacy : first;
+    cpt_buffer_init(&merged, client->out.limit + client->urgent.limit);
+    // still empty, so this only keeps the merged output where the fan-out lane placed it
+    cpt_buffer_move(&merged, client->out.pool);
+    dst = cpt_buffer_reserve(&merged, cpt_buffer_length(&client->out) + urgent_len);
+
+    if (dst == NULL)
+    {
+        return -1;
+    }
+
+    memcpy(dst, client->out.data + client->out.head, first);
+    memcpy(dst + first, client->urgent.data + client->urgent.head, urgent_len);
+    memcpy(dst + first + urgent_len, client->out.data + client->out.head + first,
+           cpt_buffer_length(&client->out) - first);
+    cpt_buffer_commit(&merged, cpt_buffer_length(&client->out) + urgent_len);
+
+    // urgent output always leaves on the socket, before the MAP_RINGS reply
+    if (client->pass_pending)
+    {
+        client->pass_at += urgent_len;
+    }
+
+    if (client->shm != NULL)
+    {
+        client->socket_left += urgent_len;
+    }
+
+    cpt_buffer_destroy(&client->out);
+    client->out = merged;
+    cpt_buffer_consume(&client->urgent, urgent_len);
+    // should the upgrade fail, the merged output still leaves as one block
+    client->unit_left = client->shm != NULL ? client->socket_left : cpt_buffer_length(&client->out);
+    client->unit_urgent = 0;
+    client->legacy = 0;
+
+    return 0;
+}
+
+int cpt_server_wants_write(const user *client)
+{
+    if (client->held_since != 0)
+    {
+        return 0;
+    }
+
+    if (cpt_buffer_length(&client->urgent) > 0)
+    {
+        return 1;
+    }
+
+    if (client->shm != NULL)
+    {
+        return client->socket_left > 0;
+    }
+
+    return cpt_buffer_length(&client->out) > 0;
+}
+
+/**
+ * Send both output queues, switching between them only between envelopes.
+ *
+ * An envelope cut short by a full socket is finished first. Then urgent output
+ * goes, unless it already had <urgent_weight> turns while MESSAGEs
+ * waited, in which case one bulk envelope is let through. Nothing
+ * urgent passes the version 1 frames from before an upgrade, and all
+ * of it goes ahead of a MAP_RINGS reply, the last thing on the socket.
+ *
+ * @param bulk_size Bytes of <out> meant for the socket.
+ * @return 0 on success (even if output remains), -1 on error.
+ */
+static int send_queues(const struct serverInfo *info, user *client, size_t bulk_size)
+{
+    struct cpt_buffer *queue;
+    size_t before;
+    size_t size;
+    size_t sent;
+    int waiting;
+    int urgent;
+
+    for (;;)
+    {
+        waiting = cpt_buffer_length(&client->urgent) > 0;
+
+        if (client->unit_left > 0)
+        {
+            urgent = client->unit_urgent;
+            size = client->unit_left;
+        }
+        else if (!waiting && bulk_size == 0)
+        {
+            return 0;
+        }
+        else
+        {
+            urgent = waiting && client->legacy == 0 &&
+                     (bulk_size == 0 || client->urgent_run < info->urgent_weight ||
+                      (client->pass_pending && client->pass_at == 0));
+            size = urgent ? cpt_buffer_length(&client->urgent) : bulk_size;
+
+            if (!urgent && waiting)
+            {
+                size = client->legacy > 0 ? client->legacy
+                                          : envelope_size(client->out.data + client->out.head, bulk_size);
+            }
+
+            client->urgent_run = urgent ? client->urgent_run + (bulk_size > 0) : 0;
+        }
+
+        queue = urgent ? &client->urgent : &client->out;
+        before = cpt_buffer_length(queue);
+
+        if ((urgent ? send_urgent(client, size) : send_output(client, size)) < 0)
+        {
+            return -1;
+        }
+
+        sent = before - cpt_buffer_length(queue);
+
+        if (client->unit_left > 0)
+        {
+            client->unit_left -= sent;
+        }
+        else if (sent < size && client->version >= CPT_VERSION_BATCHED && (urgent || sent >= client->legacy))
+        {
+            client->unit_left = unit_rest(client, urgent, sent);
+            client->unit_urgent = urgent;
+        }
+
+        if (!urgent)
+        {
+            bulk_size -= sent;
+            client->legacy -= sent < client->legacy ? sent : client->legacy;
+        }
+
+        if (sent < size)
+        {
+            return 0;
+        }
+    }
+}
+
+/**
+ * Size of the sealed envelope at <data>, length prefix included.
+ *
+ * @param size      Bytes available at <data>.
+ */
+static size_t envelope_size(const uint8_t *data, size_t size)
+{
+    size_t header_size;
+    size_t body_size;
+
+    cpt_envelope_parse_header(data, size, &header_size, &body_size);
+
+    return header_size + body_size;
+}
+
+/**
+ * How much of the envelope a short send stopped in is still unsent.
+ *
+ * The sent bytes are still in the buffer just before its head. Bulk
+ * envelopes start where the version 1 frames from before an upgrade
+ * end, and the send stopped past them.
+ */
+static size_t unit_rest(const user *client, int urgent, size_t sent)
+{
+    const struct cpt_buffer *queue;
+    const uint8_t *data;
+    size_t length;
+    size_t offset;
+
+    queue = urgent ? &client->urgent : &client->out;
+    data = queue->data + queue->head - sent;
+    length = cpt_buffer_length(queue) + sent;
+    offset = urgent ? 0 : client->legacy;
+
+    while (offset < sent)
+    {
+        offset += envelope_size(data + offset, length - offset);
+    }
+
+    return offset - sent;
+}
+
+/**
+ * Send <data> with <pass_fd> attached as SCM_RIGHTS.
+ */
+static ssize_t send_descriptor(int fd, uint8_t *data, size_t size, int pass_fd)
+{
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    iov.iov_base = data;
+    iov.iov_len = size;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+
+    return sendmsg(fd, &msg, MSG_NOSIGNAL);
+}
+
+/**
+ * Send up to <size> bytes of output on the socket, attaching the ring
+ * descriptor to the first byte of the MAP_RINGS reply.
+ *
+ * @return 0 on success (even if output remains), -1 on error.
+ */
+static int send_output(user *client, size_t size)
+{
+    ssize_t nwritten;
+    int passing;
+
+    while (size > 0)
+    {
+        passing = client->pass_pending && client->pass_at == 0;
+
+        if (passing)
+        {
+            nwritten = send_descriptor(client->user_fd, client->out.data + client->out.head, size, client->shm->fd);
+        }
+        else
+        {
+            nwritten = send(client->user_fd, client->out.data + client->out.head,
+                            client->pass_pending ? client->pass_at : size, MSG_NOSIGNAL);
+        }
+
+        if (nwritten < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            if (errno == EWOULDBLOCK || errno == EAGAIN)
+            {
+                return 0;
+            }
+
+            return -1;
+        }
+
+        if (passing)
+        {
+            client->pass_pending = 0;
+        }
+        else if (client->pass_pending)
+        {
+            client->pass_at -= (size_t) nwritten;
+        }
+
+        if (client->shm != NULL)
+        {
+            client->socket_left -= (size_t) nwritten;
+        }
+
+        cpt_buffer_consume(&client->out, (size_t) nwritten);
+        size -= (size_t) nwritten;
+    }
+
+    return 0;
+}
+
+/**
+ * Send up to <size> bytes of urgent output on the socket.
+ *
+ * @return 0 on success (even if output remains), -1 on error.
+ */
+static int send_urgent(user *client, size_t size)
+{
+    ssize_t nwritten;
+
+    while (size > 0)
+    {
+        nwritten = send(client->user_fd, client->urgent.data + client->urgent.head, size, MSG_NOSIGNAL);
+
+        if (nwritten < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            if (errno == EWOULDBLOCK || errno == EAGAIN)
+            {
+                return 0;
+            }
+
+            return -1;
+        }
+
+        cpt_buffer_consume(&client->urgent, (size_t) nwritten);
+        size -= (size_t) nwritten;
+    }
+
+    return 0;
+}
+
+/**
+ * Copy as much output as fits into the client's ring.
+ *
+ * What does not fit waits for the doorbell the client rings once it
+ * has made room.
+ *
+ * @return 0 on success, -1 if the client corrupted the ring.
+ */
+static int flush_rings(user *client)
+{
+    size_t written;
+    int rc;
+
+    rc = cpt_shm_write(client->shm, CPT_SHM_TO_CLIENT, client->out.data + client->out.head,
+                       cpt_buffer_length(&client->out), &written);
+
+    if (rc < 0)
+    {
+        return -1;
+    }
+
+    cpt_buffer_consume(&client->out, written);
+
+    if (rc > 0)
+    {
+        cpt_shm_doorbell(client->user_fd);
+    }
+
+    return 0;
+}
+
+void cpt_server_flush_dirty(struct serverInfo *info)
+{
+    user *client;
+    user *held;
+
+    held = NULL;
+    info->coalesce_due = 0;
+
+    while (info->dirty != NULL)
+    {
+        client = info->dirty;
+        info->dirty = client->next;
+
+        if (hold_output(info, client))
+        {
+            client->next = held;
+            held = client;
+
+            if (info->coalesce_due == 0 || client->held_since + info->coalesce_cap < info->coalesce_due)
+            {
+                info->coalesce_due = client->held_since + info->coalesce_cap;
+            }
+
+            continue;
+        }
+
+        client->next = NULL;
+        client->dirty = 0;
+        client->held_since = 0;
+        client->flushed_at = info->now;
+
+        if (cpt_server_flush(info, client) < 0)
+        {
+            client->closing = 1;
+        }
+    }
+
+    info->dirty = held;
+}
+
+int cpt_server_coalesce_timeout(const struct serverInfo *info)
+{
+    if (info->dirty == NULL || info->coalesce_due == 0)
+    {
+        return -1;
+    }
+
+    if (info->now >= info->coalesce_due)
+    {
+        return 0;
+    }
+
+    return (int) ((info->coalesce_due - info->now + 999) / 1000);
+}
+
+/**
+ * Whether a dirty client's output should wait for the next round.
+ *
+ * Only a client that was flushed less than a cap ago waits, so output
+ * after a quiet spell is not delayed at all. Clients on rings have
+ * their own doorbell.
+ */
+static int hold_output(const struct serverInfo *info, user *client)
+{
+    if (info->coalesce_cap == 0 || client->shm != NULL || client->closing ||
+        cpt_buffer_length(&client->urgent) > 0 || cpt_buffer_length(&client->out) >= CPT_COALESCE_BYTES)
+    {
+        return 0;
+    }
+
+    if (client->held_since == 0)
+    {
+        if (info->now - client->flushed_at >= info->coalesce_cap)
+        {
+            return 0;
+        }
+
+        client->held_since = info->now;
+    }
+
+    return info->now - client->held_since < info->coalesce_cap;
+}
+
+int cpt_handle_request(struct serverInfo *info, user *client, struct CptRequest *req)
+{
+    uint64_t started;
+    uint64_t elapsed;
+    int status;
+
+    started = cpt_stats_clock();
+    CPT_PROBE5(dispatch, client->user_fd, req->command, req->channel_id, req->msg_len, started);
+    status = dispatch(info, client, req);
+    elapsed = cpt_stats_clock() - started;
+    cpt_latency_record(&info->latency[req->command < CPT_COMMAND_COUNT ? req->command : 0], elapsed);
+    CPT_PROBE4(handled, client->user_fd, req->command, status, elapsed);
+
+    return status;
+}
+
+static int dispatch(struct serverInfo *info, user *client, struct CptRequest *req)
+{
+    const struct command *entry;
+    int negotiating;
+    int status;
+
+    negotiating = req->command == LOGIN && req->version >= CPT_VERSION_BATCHED && req->version <= CPT_VERSION_SEQUENCED;
+
+    // versions 2 to 4 are only accepted on a LOGIN that negotiates them, records then carry version 2
+    if (req->version != CPT_SERVER_VERSION && !negotiating &&
+        !(req->version == CPT_VERSION_BATCHED && client->version >= CPT_VERSION_BATCHED))
+    {
+        status = BAD_VERSION;
+        cpt_queue_response(info, client, (uint8_t) status, req->channel_id, (uint16_t) client->user_id, NULL, 0);
+        return status;
+    }
+
+    if (client->user_id == 0 && req->command != LOGIN)
+    {
+        status = UNAUTH_ACCESS;
+        cpt_queue_response(info, client, (uint8_t) status, req->channel_id, 0, NULL, 0);
+        return status;
+    }
+
+    entry = &commands[req->command < CPT_COMMAND_COUNT ? req->command : 0];
+
+    if (entry->handler == NULL)
+    {
+        // the same bytes for everyone, nothing about the request is echoed
+        if (urgent_allowed(info, client))
+        {
+            queue_urgent_bytes(info, client, info->unknown_record, info->unknown_record_size);
+        }
+        else if (client->version >= CPT_VERSION_BATCHED)
+        {
+            queue_bytes(info, client, info->unknown_record, info->unknown_record_size);
+        }
+        else
+        {
+            queue_bytes(info, client, info->unknown_frame, CPT_RESPONSE_HEADER_SIZE);
+        }
+
+        CPT_PROBE4(enqueue, client->user_fd, UNKNOWN_CMD, 0,
+                   client->version >= CPT_VERSION_BATCHED ? info->unknown_record_size : CPT_RESPONSE_HEADER_SIZE);
+
+        return UNKNOWN_CMD;
+    }
+
+    if (req->msg_len < entry->min_len)
+    {
+        cpt_queue_response(info, client, entry->too_short, req->channel_id, (uint16_t) client->user_id, NULL, 0);
+        return entry->too_short;
+    }
+
+    return entry->handler(info, client, req);
+}
+
+void cpt_server_latency_report(const struct cpt_latency *latency, FILE *out)
+{
+    uint64_t count;
+
+    fprintf(out, "%-16s %10s %10s %10s %10s %10s\n", "command", "count", "mean_ns", "p50_ns", "p99_ns", "max_ns");
+
+    for (int i = 0; i < CPT_COMMAND_COUNT; i++)
+    {
+        count = atomic_load_explicit(&latency[i].count, memory_order_relaxed);
+
+        if (count == 0)
+        {
+            continue;
+        }
+
+        fprintf(out, "%-16s %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n",
+                commands[i].name, count, atomic_load_explicit(&latency[i].total_ns, memory_order_relaxed) / count,
+                cpt_latency_percentile(&latency[i], 50), cpt_latency_percentile(&latency[i], 99),
+                atomic_load_explicit(&latency[i].max_ns, memory_order_relaxed));
+    }
+}
+
+void cpt_server_report(const struct serverInfo *info, FILE *out)
+{
+    cpt_server_latency_report(info->latency, out);
+
+    if (info->arena != NULL)
+    {
+        fprintf(out, "input arena: %zu regions of %d MB, %zu on explicit huge pages, %zu slots in use\n",
+                info->arena->region_count, CPT_ARENA_REGION / (1024 * 1024), info->arena->explicit_regions,
+                info->arena->in_use);
+    }
+    fprintf(out, "memory: %zu KB in use, %zu KB peak, budget %zu KB\n", info->memory_used / 1024,
+            info->memory_peak / 1024, info->memory_budget / 1024);
+
+    if (info->shed_bytes > 0 || info->shed_clients > 0)
+    {
+        fprintf(out, "shed: %" PRIu64 " KB of cached frames and spare output, %" PRIu64 " clients disconnected\n",
+                info->shed_bytes / 1024, info->shed_clients);
+    }
+}
+
+int cpt_login_response(struct serverInfo *info, user *client, struct CptRequest *req)
+{
+    struct replay_job job;
+    size_t name_len;
+    user *parked;
+    int id;
+
+    if (client->user_id != 0)
+    {
+        cpt_queue_response(info, client, SUCCESS, GLOBAL_CHANNEL, (uint16_t) client->user_id, NULL, 0);
+        if (client->version < CPT_VERSION_BATCHED && req->version >= CPT_VERSION_BATCHED)
+        {
+            upgrade_version(client, req->version);
+            send_dictionary(info, client, &info->global);
+        }
+        publish_user(info, client, CPT_ADMIN_LOGGED_IN);
+        return SUCCESS;
+    }
+
+    // an empty name never gets here, see commands[]
+    name_len = req->msg_len > CPT_NAME_MAX ? CPT_NAME_MAX : req->msg_len;
+    memcpy(client->name, req->msg, name_len);
+    client->name[name_len] = '\0';
+    parked = find_parked(info, client->name);
+
+    // the parked user's id is still counted, so a full server lets it back in
+    if (parked != NULL)
+    {
+        unlink_parked(info, parked);
+        adopt_parked(info, client, parked);
+        cpt_queue_response(info, client, SUCCESS, GLOBAL_CHANNEL, (uint16_t) client->user_id, NULL, 0);
+
+        if (req->version >= CPT_VERSION_BATCHED)
+        {
+            upgrade_version(client, req->version);
+
+            for (int i = 0; i < client->channel_count; i++)
+            {
+                send_dictionary(info, client, info->channels[client->channels[i]]);
+            }
+        }
+
+        // the whole queue goes out with the reply in the next flush
+        job.info = info;
+        job.client = client;
+        job.channel_id = GLOBAL_CHANNEL;
+        cpt_offline_replay(parked->offline, replay_message, &job);
+        charge(info, &parked->charged, 0);
+        free_parked(parked);
+        publish_user(info, client, CPT_ADMIN_LOGGED_IN);
+
+        return SUCCESS;
+    }
+
+    if (info->user_count > info->last_user_id - info->first_user_id)
+    {
+        cpt_queue_response(info, client, SERVER_FULL, GLOBAL_CHANNEL, 0, NULL, 0);
+        return SERVER_FULL;
+    }
+
+    // ids are handed out round robin so a reconnecting client rarely gets a recycled id
+    id = info->next_user_id;
+    while (info->users[id] != NULL)
+    {
+        id = id == info->last_user_id ? info->first_user_id : id + 1;
+    }
+    info->next_user_id = id == info->last_user_id ? info->first_user_id : id + 1;
+
+    client->user_id = id;
+    info->users[id] = client;
+    info->user_count++;
+
+    if (channel_add_user(info, &info->global, client) < 0)
+    {
+        cpt_server_disconnect(info, client);
+        cpt_queue_response(info, client, LOGIN_FAIL, GLOBAL_CHANNEL, 0, NULL, 0);
+        return LOGIN_FAIL;
+    }
+
+    cpt_queue_response(info, client, SUCCESS, GLOBAL_CHANNEL, (uint16_t) id, NULL, 0);
+
+    // the SUCCESS above is the last version 1 frame this client gets
+    if (req->version >= CPT_VERSION_BATCHED)
+    {
+        upgrade_version(client, req->version);
+        send_dictionary(info, client, &info->global);
+    }
+
+    publish_user(info, client, CPT_ADMIN_LOGGED_IN);
+
+    return SUCCESS;
+}
+
+int cpt_logout_response(struct serverInfo *info, user *client, struct CptRequest *req)
+{
+    uint16_t id;
+
+    (void) req;
+
+    id = (uint16_t) client->user_id;
+    cpt_server_disconnect(info, client);
+    cpt_queue_response(info, client, SUCCESS, GLOBAL_CHANNEL, id, NULL, 0);
+
+    return SUCCESS;
+}
+
+int cpt_get_users_response(struct serverInfo *info, user *client, struct CptRequest *req)
+{
+    channel *ch;
+    size_t length;
+    int written;
+
+    ch = info->channels[req->channel_id];
+
+    if (ch == NULL)
+    {
+        cpt_queue_response(info, client, UNKNOWN_CHANNEL, req->channel_id, (uint16_t) client->user_id, NULL, 0);
+        return UNKNOWN_CHANNEL;
+    }
+
+    length = 0;
+
+    for (int i = 0; i < ch->users->userCount; i++)
+    {
+        written = snprintf(info->text + length, (size_t) UINT16_MAX + 1 - length, "%d %s\n",
+                           ch->users->members[i]->user_id, ch->users->members[i]->name);
+
+        if (written < 0 || length + (size_t) written > UINT16_MAX)
+        {
+            break;
+        }
+
+        length += (size_t) written;
+    }
+
+    cpt_queue_response(info, client, USER_LIST, req->channel_id, (uint16_t) client->user_id, (uint8_t *) info->text,
+                       bounded_length(length));
+
+    return USER_LIST;
+}
+
+int cpt_join_channel_response(struct serverInfo *info, user *client, struct CptRequest *req)
+{
+    channel *ch;
+
+    ch = info->channels[req->channel_id];
+
+    // a channel with members on other nodes gets a local member list on first join
+    if (ch == NULL && info->mesh != NULL && cpt_mesh_has_remote(info->mesh, req->channel_id))
+    {
+        ch = create_channel(NULL, req->channel_id);
+        info->channels[req->channel_id] = ch;
+    }
+
+    if (ch == NULL)
+    {
+        cpt_queue_response(info, client, UNKNOWN_CHANNEL, req->channel_id, (uint16_t) client->user_id, NULL, 0);
+        return UNKNOWN_CHANNEL;
+    }
+
+    if (channel_add_user(info, ch, client) < 0)
+    {
+        if (ch->users->userCount == 0)
+        {
+            info->channels[req->channel_id] = NULL;
+            destroy_channel(ch);
+        }
+        cpt_queue_response(info, client, SERVER_FULL, req->channel_id, (uint16_t) client->user_id, NULL, 0);
+        return SERVER_FULL;
+    }
+
+    cpt_queue_response(info, client, SUCCESS, req->channel_id, (uint16_t) client->user_id, NULL, 0);
+    send_dictionary(info, client, ch);
+
+    return SUCCESS;
+}
+
+int cpt_create_channel_response(struct serverInfo *info, user *client, struct CptRequest *req)
+{
+    channel *ch;
+    char *cursor;
+    char *end;
+    unsigned long id;
+    uint16_t channel_id;
+
+    // in a mesh only ids this node owns are taken, so two nodes never create the same channel
+    channel_id = 1;
+    while (info->channels[channel_id] != NULL ||
+           (info->mesh != NULL && !cpt_mesh_can_create(info->mesh, channel_id)))
+    {
+        if (channel_id == UINT16_MAX)
+        {
+            cpt_queue_response(info, client, CHAN_ID_OVERFLOW, 0, (uint16_t) client->user_id, NULL, 0);
+            return CHAN_ID_OVERFLOW;
+        }
+        channel_id++;
+    }
+
+    ch = create_channel(NULL, channel_id);
+
+    if (ch == NULL || channel_add_user(info, ch, client) < 0)
+    {
+        if (ch != NULL)
+        {
+            destroy_channel(ch);
+        }
+        cpt_queue_response(info, client, CHANNEL_CREATION_ERROR, 0, (uint16_t) client->user_id, NULL, 0);
+        return CHANNEL_CREATION_ERROR;
+    }
+
+    info->channels[channel_id] = ch;
+
+    memcpy(info->text, req->msg, req->msg_len);
+    info->text[req->msg_len] = '\0';
+    cursor = info->text;
+
+    // unknown ids in the list are skipped rather than failing the whole request
+    for (;;)
+    {
+        id = strtoul(cursor, &end, 10);
+
+        if (end == cursor)
+        {
+            break;
+        }
+
+        if (id > 0 && id <= UINT16_MAX && info->users[id] != NULL)
+        {
+            channel_add_user(info, ch, info->users[id]);
+        }
+
+        cursor = end;
+    }
+
+    cpt_queue_response(info, client, CHANNEL_CREATED, channel_id, (uint16_t) client->user_id, NULL, 0);
+
+    return CHANNEL_CREATED;
+}
+
+int cpt_leave_channel_response(struct serverInfo *info, user *client, struct CptRequest *req)
+{
+    channel *ch;
+
+    ch = info->channels[req->channel_id];
+
+    if (ch == NULL)
+    {
+        cpt_queue_response(info, client, UNKNOWN_CHANNEL, req->channel_id, (uint16_t) client->user_id, NULL, 0);
+        return UNKNOWN_CHANNEL;
+    }
+
+    if (req->channel_id == GLOBAL_CHANNEL || !channel_remove_user(info, ch, client))
+    {
+        cpt_queue_response(info, client, INVALID_ID, req->channel_id, (uint16_t) client->user_id, NULL, 0);
+        return INVALID_ID;
+    }
+
+    cpt_queue_response(info, client, SUCCESS, req->channel_id, (uint16_t) client->user_id, NULL, 0);
+
+    return SUCCESS;
+}
+
+int cpt_send_response(struct serverInfo *info, user *client, struct CptRequest *req)
+{
+    channel *ch;
+
+    ch = info->channels[req->channel_id];
+
+    if (ch == NULL)
+    {
+        cpt_queue_response(info, client, UNKNOWN_CHANNEL, req->channel_id, (uint16_t) client->user_id, NULL, 0);
+        return UNKNOWN_CHANNEL;
+    }
+
+    if (!channel_has_user(ch, client))
+    {
+        cpt_queue_response(info, client, UNAUTH_ACCESS, req->channel_id, (uint16_t) client->user_id, NULL, 0);
+        return UNAUTH_ACCESS;
+    }
+
+    // rejected before any fan-out work, and without using up the other bucket
+    if (!cpt_bucket_ready(&info->user_rate, &client->sends, info->now) ||
+        !cpt_bucket_ready(&info->channel_rate, &ch->sends, info->now))
+    {
+        cpt_queue_response(info, client, MSG_OVERFLOW, req->channel_id, (uint16_t) client->user_id, NULL, 0);
+        return MSG_OVERFLOW;
+    }
+
+    cpt_bucket_spend(&info->user_rate, &client->sends, info->now);
+    cpt_bucket_spend(&info->channel_rate, &ch->sends, info->now);
+    cpt_queue_response(info, client, SUCCESS, req->channel_id, (uint16_t) client->user_id, NULL, 0);
+    cpt_broadcast(info, ch, (uint16_t) client->user_id, (uint8_t *) req->msg, req->msg_len);
+    client->sent++;
+    client->sent_bytes += req->msg_len;
+
+    if (info->published != NULL)
+    {
+        atomic_store_explicit(&info->published->users[client->user_id].sent, client->sent, memory_order_relaxed);
+        atomic_store_explicit(&info->published->users[client->user_id].sent_bytes, client->sent_bytes,
+                              memory_order_relaxed);
+    }
+
+    if (info->mesh != NULL)
+    {
+        cpt_mesh_forward(info->mesh, req->channel_id, (uint16_t) client->user_id, (uint8_t *) req->msg, req->msg_len);
+    }
+
+    return SUCCESS;
+}
+
+int cpt_resume_response(struct serverInfo *info, user *client, struct CptRequest *req)
+{
+    struct replay_job job;
+    uint8_t missing[CPT_VARINT_MAX];
+    uint32_t after;
+    uint32_t replayed;
+    channel *ch;
+
+    ch = info->channels[req->channel_id];
+
+    if (ch == NULL)
+    {
+        cpt_queue_response(info, client, UNKNOWN_CHANNEL, req->channel_id, (uint16_t) client->user_id, NULL, 0);
+        return UNKNOWN_CHANNEL;
+    }
+
+    if (client->version < CPT_VERSION_SEQUENCED)
+    {
+        cpt_queue_response(info, client, BAD_VERSION, req->channel_id, (uint16_t) client->user_id, NULL, 0);
+        return BAD_VERSION;
+    }
+
+    if (!channel_has_user(ch, client))
+    {
+        cpt_queue_response(info, client, UNAUTH_ACCESS, req->channel_id, (uint16_t) client->user_id, NULL, 0);
+        return UNAUTH_ACCESS;
+    }
+
+    // a number the channel never reached belongs to an earlier channel or server
+    if (cpt_varint_get((uint8_t *) req->msg, req->msg_len, &after) <= 0 || after > ch->seq)
+    {
+        cpt_queue_response(info, client, INVALID_ID, req->channel_id, (uint16_t) client->user_id, NULL, 0);
+        return INVALID_ID;
+    }
+
+    // everything is queued in this round, so it leaves in one flush with the reply last, behind the resends
+    job.info = info;
+    job.client = client;
+    job.channel_id = req->channel_id;
+    replayed = cpt_history_replay(&ch->history, after, info->packed, resend_message, &job);
+    queue_response(info, client, SUCCESS, req->channel_id, (uint16_t) client->user_id, missing,
+                   (uint16_t) cpt_varint_put(ch->seq - after - replayed, missing), 0);
+
+    return SUCCESS;
+}
+
+int cpt_map_rings_response(struct serverInfo *info, user *client, struct CptRequest *req)
+{
+    struct cpt_shm *shm;
+
+    if (!client->local)
+    {
+        cpt_queue_response(info, client, UNAUTH_ACCESS, req->channel_id, (uint16_t) client->user_id, NULL, 0);
+        return UNAUTH_ACCESS;
+    }
+
+    if (client->shm != NULL)
+    {
+        cpt_queue_response(info, client, INVALID_ID, req->channel_id, (uint16_t) client->user_id, NULL, 0);
+        return INVALID_ID;
+    }
+
+    shm = malloc(sizeof(struct cpt_shm));
+
+    if (shm == NULL || cpt_shm_create(shm, CPT_SHM_RING_CAPACITY) < 0)
+    {
+        free(shm);
+        cpt_queue_response(info, client, SERVER_FULL, req->channel_id, (uint16_t) client->user_id, NULL, 0);
+        return SERVER_FULL;
+    }
+
+    // the descriptor rides on the reply's first byte and the reply is the last thing sent on the socket
+    cpt_envelope_seal(&client->envelope, &client->out);
+    client->pass_at = cpt_buffer_length(&client->out);
+
+    if (queue_response(info, client, SUCCESS, req->channel_id, (uint16_t) client->user_id, NULL, 0, 0) < 0)
+    {
+        cpt_shm_destroy(shm);
+        free(shm);
+        return SERVER_FULL;
+    }
+
+    cpt_envelope_seal(&client->envelope, &client->out);
+    client->shm = shm;
+    client->pass_pending = 1;
+    publish_user(info, client, CPT_ADMIN_LOGGED_IN);
+    client->socket_left = cpt_buffer_length(&client->out);
+
+    return SUCCESS;
+}
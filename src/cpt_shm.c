@@ -0,0 +1,257 @@
+// memfd_create() and file sealing are Linux extensions
+#define _GNU_SOURCE
+
+#include "cpt_shm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void map_rings(struct cpt_shm *shm, void *base, size_t capacity);
+static void copy_in(uint8_t *ring, size_t capacity, uint64_t position, const uint8_t *src, size_t size);
+static void copy_out(const uint8_t *ring, size_t capacity, uint64_t position, uint8_t *dst, size_t size);
+
+static void map_rings(struct cpt_shm *shm, void *base, size_t capacity)
+{
+    shm->header = base;
+    shm->capacity = capacity;
+    shm->data[CPT_SHM_TO_SERVER] = (uint8_t *) base + sizeof(struct cpt_shm_header);
+    shm->data[CPT_SHM_TO_CLIENT] = shm->data[CPT_SHM_TO_SERVER] + capacity;
+    shm->own[CPT_SHM_TO_SERVER] = 0;
+    shm->own[CPT_SHM_TO_CLIENT] = 0;
+}
+
+int cpt_shm_create(struct cpt_shm * shm, size_t capacity)
+{
+    void *base;
+
+    shm->header = NULL;
+    shm->size = sizeof(struct cpt_shm_header) + 2 * capacity;
+
+#ifdef __linux__
+    shm->fd = memfd_create("cpt-rings", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+    shm->fd = -1;
+    errno = ENOSYS;
+#endif
+
+    if (shm->fd < 0)
+    {
+        return -1;
+    }
+
+    if (ftruncate(shm->fd, (off_t) shm->size) < 0)
+    {
+        cpt_shm_destroy(shm);
+        return -1;
+    }
+
+#ifdef __linux__
+    // a client that could shrink the file would fault the server on its next access
+    if (fcntl(shm->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0)
+    {
+        cpt_shm_destroy(shm);
+        return -1;
+    }
+#endif
+
+    base = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0);
+
+    if (base == MAP_FAILED)
+    {
+        cpt_shm_destroy(shm);
+        return -1;
+    }
+
+    map_rings(shm, base, capacity);
+    shm->header->magic = CPT_SHM_MAGIC;
+    shm->header->capacity = (uint32_t) capacity;
+
+    for (int i = 0; i < 2; i++)
+    {
+        atomic_init(&shm->header->rings[i].tail, 0);
+        atomic_init(&shm->header->rings[i].head, 0);
+        atomic_init(&shm->header->rings[i].blocked, 0);
+    }
+
+    return 0;
+}
+
+int cpt_shm_attach(struct cpt_shm * shm, int fd)
+{
+    struct stat st;
+    void *base;
+    size_t capacity;
+
+    shm->fd = -1;
+    shm->header = NULL;
+
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(struct cpt_shm_header))
+    {
+        close(fd);
+        return -1;
+    }
+
+    shm->size = (size_t) st.st_size;
+    base = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (base == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    shm->header = base;
+    capacity = shm->header->capacity;
+
+    if (shm->header->magic != CPT_SHM_MAGIC || capacity == 0 || (capacity & (capacity - 1)) != 0 ||
+        sizeof(struct cpt_shm_header) + 2 * capacity != shm->size)
+    {
+        cpt_shm_destroy(shm);
+        return -1;
+    }
+
+    map_rings(shm, base, capacity);
+
+    return 0;
+}
+
+void cpt_shm_destroy(struct cpt_shm * shm)
+{
+    if (shm->header != NULL)
+    {
+        munmap(shm->header, shm->size);
+        shm->header = NULL;
+    }
+
+    if (shm->fd >= 0)
+    {
+        close(shm->fd);
+        shm->fd = -1;
+    }
+}
+
+static void copy_in(uint8_t *ring, size_t capacity, uint64_t position, const uint8_t *src, size_t size)
+{
+    size_t offset;
+    size_t first;
+
+    offset = (size_t) (position & (capacity - 1));
+    first = capacity - offset < size ? capacity - offset : size;
+    memcpy(ring + offset, src, first);
+    memcpy(ring, src + first, size - first);
+}
+
+static void copy_out(const uint8_t *ring, size_t capacity, uint64_t position, uint8_t *dst, size_t size)
+{
+    size_t offset;
+    size_t first;
+
+    offset = (size_t) (position & (capacity - 1));
+    first = capacity - offset < size ? capacity - offset : size;
+    memcpy(dst, ring + offset, first);
+    memcpy(dst + first, ring, size - first);
+}
+
+int cpt_shm_write(struct cpt_shm * shm, int ring, const uint8_t * data, size_t size, size_t * written)
+{
+    struct cpt_shm_ring *r;
+    uint64_t tail;
+    uint64_t head;
+    size_t n;
+
+    r = &shm->header->rings[ring];
+    tail = shm->own[ring];
+    head = atomic_load_explicit(&r->head, memory_order_acquire);
+    *written = 0;
+
+    if (tail - head > shm->capacity)
+    {
+        return -1;
+    }
+
+    n = shm->capacity - (size_t) (tail - head);
+
+    if (n < size)
+    {
+        // announce the wait, then look again: either the consumer sees the flag or this sees its progress
+        atomic_store_explicit(&r->blocked, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+        if (tail - head > shm->capacity)
+        {
+            return -1;
+        }
+
+        n = shm->capacity - (size_t) (tail - head);
+    }
+
+    n = n < size ? n : size;
+
+    if (n == 0)
+    {
+        return 0;
+    }
+
+    copy_in(shm->data[ring], shm->capacity, tail, data, n);
+    atomic_store_explicit(&r->tail, tail + n, memory_order_release);
+    shm->own[ring] = tail + n;
+    *written = n;
+
+    // the consumer only waits once it has caught up with everything published before
+    atomic_thread_fence(memory_order_seq_cst);
+
+    return atomic_load_explicit(&r->head, memory_order_relaxed) == tail;
+}
+
+int cpt_shm_read(struct cpt_shm * shm, int ring, uint8_t * dst, size_t size, size_t * nread)
+{
+    struct cpt_shm_ring *r;
+    uint64_t head;
+    uint64_t tail;
+    size_t n;
+
+    r = &shm->header->rings[ring];
+    head = shm->own[ring];
+    tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    *nread = 0;
+
+    if (tail - head > shm->capacity)
+    {
+        return -1;
+    }
+
+    n = (size_t) (tail - head) < size ? (size_t) (tail - head) : size;
+
+    if (n == 0)
+    {
+        return 0;
+    }
+
+    copy_out(shm->data[ring], shm->capacity, head, dst, n);
+    atomic_store_explicit(&r->head, head + n, memory_order_release);
+    shm->own[ring] = head + n;
+    *nread = n;
+
+    // pairs with the fence in cpt_shm_write(), one of the two sides sees the other
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (atomic_load_explicit(&r->blocked, memory_order_relaxed) == 0)
+    {
+        return 0;
+    }
+
+    return atomic_exchange_explicit(&r->blocked, 0, memory_order_relaxed) != 0;
+}
+
+void cpt_shm_doorbell(int fd)
+{
+    uint8_t bell;
+
+    bell = 0;
+    (void) send(fd, &bell, 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
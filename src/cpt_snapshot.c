@@ -0,0 +1,62 @@
+#include "cpt_snapshot.h"
+#include <stdlib.h>
+
+struct cpt_snapshot *cpt_snapshot_create(uint64_t version, int lanes, size_t count)
+{
+    struct cpt_snapshot *snapshot;
+
+    snapshot = malloc(sizeof(struct cpt_snapshot) + count * sizeof(struct user *));
+
+    if (snapshot == NULL)
+    {
+        return NULL;
+    }
+
+    snapshot->version = version;
+    snapshot->retired_at = 0;
+    snapshot->retired_next = NULL;
+    snapshot->lanes = lanes;
+    snapshot->count = count;
+
+    return snapshot;
+}
+
+void cpt_snapshot_retire(struct cpt_snapshot **retired, struct cpt_snapshot *snapshot, uint64_t epoch)
+{
+    if (snapshot == NULL)
+    {
+        return;
+    }
+
+    snapshot->retired_at = epoch;
+    snapshot->retired_next = *retired;
+    *retired = snapshot;
+}
+
+size_t cpt_snapshot_reclaim(struct cpt_snapshot **retired, uint64_t quiescent)
+{
+    struct cpt_snapshot **link;
+    struct cpt_snapshot *snapshot;
+    size_t freed;
+
+    link = retired;
+    freed = 0;
+
+    while (*link != NULL)
+    {
+        snapshot = *link;
+
+        // a lane still in generation retired_at may have loaded it before the swap
+        if (snapshot->retired_at > quiescent)
+        {
+            link = &snapshot->retired_next;
+            continue;
+        }
+
+        *link = snapshot->retired_next;
+        free(snapshot);
+        freed++;
+    }
+
+    return freed;
+}
@@ -0,0 +1,82 @@
+#include "cpt_stats.h"
+#include <time.h>
+
+static int bucket_of(uint64_t ns);
+
+uint64_t cpt_stats_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000U + (uint64_t) ts.tv_nsec;
+}
+
+void cpt_latency_record(struct cpt_latency *latency, uint64_t ns)
+{
+    _Atomic uint64_t *bucket;
+
+    // a single writer, so no read-modify-write is needed
+    bucket = &latency->buckets[bucket_of(ns)];
+    atomic_store_explicit(&latency->count, atomic_load_explicit(&latency->count, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    atomic_store_explicit(&latency->total_ns, atomic_load_explicit(&latency->total_ns, memory_order_relaxed) + ns,
+                          memory_order_relaxed);
+    atomic_store_explicit(bucket, atomic_load_explicit(bucket, memory_order_relaxed) + 1, memory_order_relaxed);
+
+    if (ns > atomic_load_explicit(&latency->max_ns, memory_order_relaxed))
+    {
+        atomic_store_explicit(&latency->max_ns, ns, memory_order_relaxed);
+    }
+}
+
+uint64_t cpt_latency_percentile(const struct cpt_latency *latency, double percent)
+{
+    double exact;
+    uint64_t count;
+    uint64_t max_ns;
+    uint64_t rank;
+    uint64_t seen;
+    uint64_t bound;
+
+    count = atomic_load_explicit(&latency->count, memory_order_relaxed);
+    max_ns = atomic_load_explicit(&latency->max_ns, memory_order_relaxed);
+
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    exact = (double) count * percent / 100.0;
+    rank = (uint64_t) exact;
+    rank += (double) rank < exact || rank == 0 ? 1U : 0U;
+    seen = 0;
+
+    for (int i = 0; i < CPT_LATENCY_BUCKETS - 1; i++)
+    {
+        seen += atomic_load_explicit(&latency->buckets[i], memory_order_relaxed);
+
+        if (seen >= rank)
+        {
+            bound = (uint64_t) 1 << (i + 1);
+            return bound < max_ns ? bound : max_ns;
+        }
+    }
+
+    return max_ns;
+}
+
+static int bucket_of(uint64_t ns)
+{
+    int bucket;
+
+    bucket = 0;
+
+    while (ns > 1 && bucket < CPT_LATENCY_BUCKETS - 1)
+    {
+        ns >>= 1;
+        bucket++;
+    }
+
+    return bucket;
+}
@@ -6,23 +6,72 @@
 #include <dc_posix/dc_stdlib.h>
 #include <dc_posix/dc_string.h>
 #include <dc_posix/sys/dc_socket.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/ioctl.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/poll.h>
+#include <sys/un.h>
+#include "cpt_admin.h"
+#include "cpt_arena.h"
+#include "cpt_capture.h"
+#include "cpt_cpu.h"
+#include "cpt_handoff.h"
+#include "cpt_fanout.h"
+#include "cpt_mesh.h"
 #include "cpt_server.h"
 #include "common.h"
 
-#define BUFFER 1024
+#define POLL_INITIAL_CAPACITY 64
+// pollfd[0] is the TCP listener, pollfd[1] the AF_UNIX one (-1 when disabled)
+#define LISTENERS 2
+// then the mesh listener and one slot per node, all -1 when not in a mesh
+#define MESH_SLOTS (CPT_MESH_MAX_NODES + 1)
+#define FIRST_CLIENT (LISTENERS + MESH_SLOTS)
+#define MESH_PATHS_MAX CPT_MESH_MAX_NODES
+// how long a live upgrade waits for the new process to confirm
+#define HANDOFF_TIMEOUT_MS 10000
 
 
+static volatile sig_atomic_t stop_server = 0;
+static volatile sig_atomic_t upgrade_server = 0;
+static char **server_argv;
+
 struct application_settings
 {
     struct dc_opt_settings opts;
     struct dc_setting_uint16 *port;
+    struct dc_setting_string *unix_path;
+    struct dc_setting_string *inherit;
+    struct dc_setting_string *mesh;
+    struct dc_setting_uint16 *node;
+    struct dc_setting_uint16 *fanout_threads;
+    struct dc_setting_uint16 *fanout_threshold;
+    struct dc_setting_uint16 *user_rate;
+    struct dc_setting_uint16 *user_burst;
+    struct dc_setting_uint16 *channel_rate;
+    struct dc_setting_uint16 *channel_burst;
+    struct dc_setting_uint16 *presence_ms;
+    struct dc_setting_uint16 *offline_ttl;
+    struct dc_setting_string *offline_dir;
+    struct dc_setting_uint16 *coalesce_us;
+    struct dc_setting_string *cpus;
+    struct dc_setting_uint16 *busy_poll_us;
+    struct dc_setting_uint16 *huge_pages;
+    struct dc_setting_string *capture;
+    struct dc_setting_string *admin;
+    struct dc_setting_uint16 *history_kb;
+    struct dc_setting_uint16 *urgent_weight;
+    struct dc_setting_uint16 *memory_mb;
 };
 
 
@@ -32,6 +81,19 @@ static int destroy_settings(const struct dc_posix_env *env,
                             struct dc_error *err,
                             struct dc_application_settings **psettings);
 static int run(const struct dc_posix_env *env, struct dc_error *err, struct dc_application_settings *settings);
+static void handle_stop(int signo);
+static void handle_upgrade(int signo);
+static int sooner(int timeout, int other);
+static int grow_poll_set(struct pollfd **pollfd, user ***clients, size_t *capacity);
+static int open_tcp_listener(uint16_t port);
+static int open_unix_listener(const char *path);
+static int inherit_server(int fd, struct serverInfo *info, struct pollfd **pollfd, user ***clients, size_t *nfds,
+                          size_t *capacity);
+static int hand_off(struct serverInfo *info, struct pollfd *pollfd, user **clients, size_t nfds);
+static char **upgrade_argv(char *fd_arg);
+static int split_paths(char *list, const char **paths);
+static void accept_clients(struct serverInfo *info, int listen_fd, int local, struct pollfd **pollfd,
+                           user ***clients, size_t *nfds, size_t *capacity);
 static void error_reporter(const struct dc_error *err);
 static void trace_reporter(const struct dc_posix_env *env,
                            const char *file_name,
@@ -52,6 +114,7 @@ int main(int argc, char *argv[])
     tracer = NULL;
     dc_error_init(&err, reporter);
     dc_posix_env_init(&env, tracer);
+    server_argv = argv;
     info = dc_application_info_create(&env, &err, "Chat Application");
     ret_val = dc_application_run(&env, &err, info, create_settings, destroy_settings, run, dc_default_create_lifecycle, dc_default_destroy_lifecycle, NULL, argc, argv);
     dc_application_info_destroy(&env, &info);
@@ -63,6 +126,18 @@ int main(int argc, char *argv[])
 static struct dc_application_settings *create_settings(const struct dc_posix_env *env, struct dc_error *err)
 {
     static const uint16_t defaultport = 8080;
+    static const uint16_t defaultnode = 0;
+    static const uint16_t defaultfanoutthreads = 0;
+    static const uint16_t defaultfanoutthreshold = CPT_FANOUT_THRESHOLD;
+    static const uint16_t defaultrate = 0;
+    static const uint16_t defaultpresencems = CPT_PRESENCE_WINDOW_MS;
+    static const uint16_t defaultofflinettl = CPT_OFFLINE_TTL;
+    static const uint16_t defaultcoalesceus = 0;
+    static const uint16_t defaultbusypollus = 0;
+    static const uint16_t defaulthugepages = CPT_ARENA_SMALL_PAGES;
+    static const uint16_t defaulthistorykb = CPT_HISTORY_MEMORY / 1024;
+    static const uint16_t defaulturgentweight = CPT_URGENT_WEIGHT;
+    static const uint16_t defaultmemorymb = CPT_MEMORY_BUDGET / (1024 * 1024);
     struct application_settings *settings;
 
     DC_TRACE(env);
@@ -75,6 +150,28 @@ static struct dc_application_settings *create_settings(const struct dc_posix_env
 
     settings->opts.parent.config_path = dc_setting_path_create(env, err);
     settings->port = dc_setting_uint16_create(env, err);
+    settings->unix_path = dc_setting_string_create(env, err);
+    settings->inherit = dc_setting_string_create(env, err);
+    settings->mesh = dc_setting_string_create(env, err);
+    settings->node = dc_setting_uint16_create(env, err);
+    settings->fanout_threads = dc_setting_uint16_create(env, err);
+    settings->fanout_threshold = dc_setting_uint16_create(env, err);
+    settings->user_rate = dc_setting_uint16_create(env, err);
+    settings->user_burst = dc_setting_uint16_create(env, err);
+    settings->channel_rate = dc_setting_uint16_create(env, err);
+    settings->channel_burst = dc_setting_uint16_create(env, err);
+    settings->presence_ms = dc_setting_uint16_create(env, err);
+    settings->offline_ttl = dc_setting_uint16_create(env, err);
+    settings->offline_dir = dc_setting_string_create(env, err);
+    settings->coalesce_us = dc_setting_uint16_create(env, err);
+    settings->cpus = dc_setting_string_create(env, err);
+    settings->busy_poll_us = dc_setting_uint16_create(env, err);
+    settings->huge_pages = dc_setting_uint16_create(env, err);
+    settings->capture = dc_setting_string_create(env, err);
+    settings->admin = dc_setting_string_create(env, err);
+    settings->history_kb = dc_setting_uint16_create(env, err);
+    settings->urgent_weight = dc_setting_uint16_create(env, err);
+    settings->memory_mb = dc_setting_uint16_create(env, err);
 
     struct options opts[] = {
             {(struct dc_setting *)settings->opts.parent.config_path,
@@ -97,6 +194,226 @@ static struct dc_application_settings *create_settings(const struct dc_posix_env
                     "port",
                     dc_string_from_config,
                     &defaultport},
+            {(struct dc_setting *)settings->unix_path,
+                    dc_options_set_string,
+                    "unix",
+                    required_argument,
+                    'u',
+                    "UNIX",
+                    dc_string_from_string,
+                    "unix",
+                    dc_string_from_config,
+                    NULL},
+            {(struct dc_setting *)settings->inherit,
+                    dc_options_set_string,
+                    "inherit",
+                    required_argument,
+                    'i',
+                    "INHERIT",
+                    dc_string_from_string,
+                    NULL,
+                    dc_string_from_config,
+                    NULL},
+            {(struct dc_setting *)settings->mesh,
+                    dc_options_set_string,
+                    "mesh",
+                    required_argument,
+                    'm',
+                    "MESH",
+                    dc_string_from_string,
+                    "mesh",
+                    dc_string_from_config,
+                    NULL},
+            {(struct dc_setting *)settings->node,
+                    dc_options_set_uint16,
+                    "node",
+                    required_argument,
+                    'n',
+                    "NODE",
+                    dc_string_from_string,
+                    "node",
+                    dc_string_from_config,
+                    &defaultnode},
+            {(struct dc_setting *)settings->fanout_threads,
+                    dc_options_set_uint16,
+                    "fanout-threads",
+                    required_argument,
+                    't',
+                    "FANOUT_THREADS",
+                    dc_string_from_string,
+                    "fanout-threads",
+                    dc_string_from_config,
+                    &defaultfanoutthreads},
+            {(struct dc_setting *)settings->fanout_threshold,
+                    dc_options_set_uint16,
+                    "fanout-threshold",
+                    required_argument,
+                    'f',
+                    "FANOUT_THRESHOLD",
+                    dc_string_from_string,
+                    "fanout-threshold",
+                    dc_string_from_config,
+                    &defaultfanoutthreshold},
+            {(struct dc_setting *)settings->user_rate,
+                    dc_options_set_uint16,
+                    "user-rate",
+                    required_argument,
+                    'r',
+                    "USER_RATE",
+                    dc_string_from_string,
+                    "user-rate",
+                    dc_string_from_config,
+                    &defaultrate},
+            {(struct dc_setting *)settings->user_burst,
+                    dc_options_set_uint16,
+                    "user-burst",
+                    required_argument,
+                    'b',
+                    "USER_BURST",
+                    dc_string_from_string,
+                    "user-burst",
+                    dc_string_from_config,
+                    &defaultrate},
+            {(struct dc_setting *)settings->channel_rate,
+                    dc_options_set_uint16,
+                    "channel-rate",
+                    required_argument,
+                    'R',
+                    "CHANNEL_RATE",
+                    dc_string_from_string,
+                    "channel-rate",
+                    dc_string_from_config,
+                    &defaultrate},
+            {(struct dc_setting *)settings->channel_burst,
+                    dc_options_set_uint16,
+                    "channel-burst",
+                    required_argument,
+                    'B',
+                    "CHANNEL_BURST",
+                    dc_string_from_string,
+                    "channel-burst",
+                    dc_string_from_config,
+                    &defaultrate},
+            {(struct dc_setting *)settings->presence_ms,
+                    dc_options_set_uint16,
+                    "presence-ms",
+                    required_argument,
+                    'w',
+                    "PRESENCE_MS",
+                    dc_string_from_string,
+                    "presence-ms",
+                    dc_string_from_config,
+                    &defaultpresencems},
+            {(struct dc_setting *)settings->offline_ttl,
+                    dc_options_set_uint16,
+                    "offline-ttl",
+                    required_argument,
+                    'o',
+                    "OFFLINE_TTL",
+                    dc_string_from_string,
+                    "offline-ttl",
+                    dc_string_from_config,
+                    &defaultofflinettl},
+            {(struct dc_setting *)settings->offline_dir,
+                    dc_options_set_string,
+                    "offline-dir",
+                    required_argument,
+                    'd',
+                    "OFFLINE_DIR",
+                    dc_string_from_string,
+                    "offline-dir",
+                    dc_string_from_config,
+                    NULL},
+            {(struct dc_setting *)settings->coalesce_us,
+                    dc_options_set_uint16,
+                    "coalesce-us",
+                    required_argument,
+                    'C',
+                    "COALESCE_US",
+                    dc_string_from_string,
+                    "coalesce-us",
+                    dc_string_from_config,
+                    &defaultcoalesceus},
+            {(struct dc_setting *)settings->cpus,
+                    dc_options_set_string,
+                    "cpus",
+                    required_argument,
+                    'P',
+                    "CPUS",
+                    dc_string_from_string,
+                    "cpus",
+                    dc_string_from_config,
+                    NULL},
+            {(struct dc_setting *)settings->busy_poll_us,
+                    dc_options_set_uint16,
+                    "busy-poll-us",
+                    required_argument,
+                    'y',
+                    "BUSY_POLL_US",
+                    dc_string_from_string,
+                    "busy-poll-us",
+                    dc_string_from_config,
+                    &defaultbusypollus},
+            {(struct dc_setting *)settings->huge_pages,
+                    dc_options_set_uint16,
+                    "huge-pages",
+                    required_argument,
+                    'H',
+                    "HUGE_PAGES",
+                    dc_string_from_string,
+                    "huge-pages",
+                    dc_string_from_config,
+                    &defaulthugepages},
+            {(struct dc_setting *)settings->capture,
+                    dc_options_set_string,
+                    "capture",
+                    required_argument,
+                    'a',
+                    "CAPTURE",
+                    dc_string_from_string,
+                    "capture",
+                    dc_string_from_config,
+                    NULL},
+            {(struct dc_setting *)settings->admin,
+                    dc_options_set_string,
+                    "admin",
+                    required_argument,
+                    'A',
+                    "ADMIN",
+                    dc_string_from_string,
+                    "admin",
+                    dc_string_from_config,
+                    NULL},
+            {(struct dc_setting *)settings->history_kb,
+                    dc_options_set_uint16,
+                    "history-kb",
+                    required_argument,
+                    'k',
+                    "HISTORY_KB",
+                    dc_string_from_string,
+                    "history-kb",
+                    dc_string_from_config,
+                    &defaulthistorykb},
+            {(struct dc_setting *)settings->urgent_weight,
+                    dc_options_set_uint16,
+                    "urgent-weight",
+                    required_argument,
+                    'W',
+                    "URGENT_WEIGHT",
+                    dc_string_from_string,
+                    "urgent-weight",
+                    dc_string_from_config,
+                    &defaulturgentweight},
+            {(struct dc_setting *)settings->memory_mb,
+                    dc_options_set_uint16,
+                    "memory-mb",
+                    required_argument,
+                    'M',
+                    "MEMORY_MB",
+                    dc_string_from_string,
+                    "memory-mb",
+                    dc_string_from_config,
+                    &defaultmemorymb},
     };
 
     // note the trick here - we use calloc and add 1 to ensure the last line is all 0/NULL
@@ -104,7 +421,7 @@ static struct dc_application_settings *create_settings(const struct dc_posix_env
     settings->opts.opts_size = sizeof(struct options);
     settings->opts.opts = dc_calloc(env, err, settings->opts.opts_count, settings->opts.opts_size);
     dc_memcpy(env, settings->opts.opts, opts, sizeof(opts));
-    settings->opts.flags = "c:p";
+    settings->opts.flags = "c:p:u:i:m:n:t:f:r:b:R:B:w:o:d:C:P:y:H:a:k:W:M:A:";
     settings->opts.env_prefix = "DC_CHAT_";
 
     return (struct dc_application_settings *)settings;
@@ -119,6 +436,28 @@ static int destroy_settings(const struct dc_posix_env *env,
     DC_TRACE(env);
     app_settings = (struct application_settings *)*psettings;
     dc_setting_uint16_destroy(env, &app_settings->port);
+    dc_setting_string_destroy(env, &app_settings->unix_path);
+    dc_setting_string_destroy(env, &app_settings->inherit);
+    dc_setting_string_destroy(env, &app_settings->mesh);
+    dc_setting_uint16_destroy(env, &app_settings->node);
+    dc_setting_uint16_destroy(env, &app_settings->fanout_threads);
+    dc_setting_uint16_destroy(env, &app_settings->fanout_threshold);
+    dc_setting_uint16_destroy(env, &app_settings->user_rate);
+    dc_setting_uint16_destroy(env, &app_settings->user_burst);
+    dc_setting_uint16_destroy(env, &app_settings->channel_rate);
+    dc_setting_uint16_destroy(env, &app_settings->channel_burst);
+    dc_setting_uint16_destroy(env, &app_settings->presence_ms);
+    dc_setting_uint16_destroy(env, &app_settings->offline_ttl);
+    dc_setting_string_destroy(env, &app_settings->offline_dir);
+    dc_setting_uint16_destroy(env, &app_settings->coalesce_us);
+    dc_setting_string_destroy(env, &app_settings->cpus);
+    dc_setting_uint16_destroy(env, &app_settings->busy_poll_us);
+    dc_setting_uint16_destroy(env, &app_settings->huge_pages);
+    dc_setting_string_destroy(env, &app_settings->capture);
+    dc_setting_string_destroy(env, &app_settings->admin);
+    dc_setting_uint16_destroy(env, &app_settings->history_kb);
+    dc_setting_uint16_destroy(env, &app_settings->urgent_weight);
+    dc_setting_uint16_destroy(env, &app_settings->memory_mb);
     dc_free(env, app_settings->opts.opts, app_settings->opts.opts_count);
     dc_free(env, *psettings, sizeof(struct application_settings));
 
@@ -130,30 +469,501 @@ static int destroy_settings(const struct dc_posix_env *env,
     return 0;
 }
 
-static int run(const struct dc_posix_env *env, struct dc_error *err, struct dc_application_settings *settings)
+static int run(const struct dc_posix_env *env, __attribute__((unused)) struct dc_error *err,
+               struct dc_application_settings *settings)
 {
-    int TRUE = 1, FALSE = 0;
-    int socket_fd = 0, reusable, on = 1, timeout = 180000, current_size=0, nfds = 1, len;
-    struct sockaddr_in6 sockaddrIn;
-    struct pollfd pollfd[35];
-    int end_server = 0, compress = 0, new_sd = -1, close_conn, compress_array;
-    char buffer[BUFFER];
+    struct application_settings *app_settings;
+    struct serverInfo *info;
+    struct sigaction sa;
+    struct pollfd *pollfd;
+    struct cpt_mesh *mesh;
+    struct cpt_admin *admin;
+    struct cpt_fanout *fanout;
+    const char *mesh_paths[MESH_PATHS_MAX];
+    int cpus[CPT_CPU_MAX];
+    user **clients;
+    size_t nfds, capacity;
+    int socket_fd, unix_fd, compress_array, upgraded, mesh_count, timeout, cpu_count;
+    const char *unix_path;
+    const char *cpu_list;
+    const char *capture_path;
+    const char *admin_path;
+    const char *offline_dir;
+    const char *inherit;
+    const char *mesh_spec;
+    char *mesh_list;
+    char capture_file[PATH_MAX];
     uint16_t port;
+    uint16_t node;
+    uint16_t fanout_threads;
+    uint16_t busy_poll_us;
+    uint16_t huge_pages;
+    uint16_t history_kb;
     ssize_t rc;
-    in_port_t converted_port;
 
     DC_TRACE(env);
 
-    struct application_settings *app_settings = (struct application_settings *) settings;
-
+    app_settings = (struct application_settings *) settings;
     port = dc_setting_uint16_get(env, app_settings->port);
-    converted_port = htons(port);
+    unix_path = dc_setting_string_get(env, app_settings->unix_path);
+    inherit = dc_setting_string_get(env, app_settings->inherit);
+    mesh_spec = dc_setting_string_get(env, app_settings->mesh);
+    node = dc_setting_uint16_get(env, app_settings->node);
+    fanout_threads = dc_setting_uint16_get(env, app_settings->fanout_threads);
+    cpu_list = dc_setting_string_get(env, app_settings->cpus);
+    busy_poll_us = dc_setting_uint16_get(env, app_settings->busy_poll_us);
+    huge_pages = dc_setting_uint16_get(env, app_settings->huge_pages);
+    capture_path = dc_setting_string_get(env, app_settings->capture);
+    admin_path = dc_setting_string_get(env, app_settings->admin);
+    cpu_count = cpu_list == NULL ? 0 : cpt_cpu_parse(cpu_list, cpus, CPT_CPU_MAX);
+
+    if (cpu_count < 0)
+    {
+        fprintf(stderr, "cpus: cannot parse %s\n", cpu_list);
+        return EXIT_FAILURE;
+    }
+
+    if (huge_pages > CPT_ARENA_EXPLICIT)
+    {
+        fprintf(stderr, "huge-pages: %u is not 0 (4 KB), 1 (transparent) or 2 (explicit)\n", (unsigned) huge_pages);
+        return EXIT_FAILURE;
+    }
+
+    // the event loop is lane 0 and takes the first CPU, before the registry is allocated on its node
+    if (cpu_count > 0 && cpt_cpu_pin(cpus[0]) < 0)
+    {
+        fprintf(stderr, "cpus: cannot pin the event loop to CPU %d\n", cpus[0]);
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = handle_upgrade;
+    sigaction(SIGUSR2, &sa, NULL);
+
+    info = cpt_server_create();
+    capacity = POLL_INITIAL_CAPACITY;
+    pollfd = calloc(capacity, sizeof(struct pollfd));
+    clients = calloc(capacity, sizeof(user *));
+
+    if (info == NULL || pollfd == NULL || clients == NULL)
+    {
+        perror("malloc() failed");
+        cpt_server_destroy(info);
+        free(pollfd);
+        free(clients);
+        return EXIT_FAILURE;
+    }
+
+    // input rings of every connection, the event loop's CPU pin above places the regions on its node
+    info->arena = cpt_arena_create(CPT_INPUT_CAPACITY, huge_pages);
+
+    // SENDs per second, 0 leaves them unlimited
+    cpt_rate_init(&info->user_rate, dc_setting_uint16_get(env, app_settings->user_rate),
+                  dc_setting_uint16_get(env, app_settings->user_burst));
+    cpt_rate_init(&info->channel_rate, dc_setting_uint16_get(env, app_settings->channel_rate),
+                  dc_setting_uint16_get(env, app_settings->channel_burst));
+    info->presence_window = (uint64_t) dc_setting_uint16_get(env, app_settings->presence_ms) * 1000;
+    // seconds a dropped user's channels and messages wait for it, 0 disconnects at once
+    info->offline_ttl = (uint64_t) dc_setting_uint16_get(env, app_settings->offline_ttl) * 1000000;
+    offline_dir = dc_setting_string_get(env, app_settings->offline_dir);
+
+    if (offline_dir != NULL)
+    {
+        info->offline_dir = offline_dir;
+    }
+
+    // recent messages each channel keeps for RESUME, 0 turns RESUME into a count of what was missed
+    history_kb = dc_setting_uint16_get(env, app_settings->history_kb);
+    info->history_capacity = 0;
+
+    if (history_kb > 0)
+    {
+        // the ring wants a power of two
+        for (info->history_capacity = 1024; info->history_capacity < (size_t) history_kb * 1024;)
+        {
+            info->history_capacity <<= 1;
+        }
+    }
+
+    // urgent turns a flush takes before a bulk envelope may go, 0 keeps replies behind MESSAGEs
+    info->urgent_weight = dc_setting_uint16_get(env, app_settings->urgent_weight);
+
+    // what buffers, queues and cached frames may take before load is shed, 0 for no limit
+    info->memory_budget = (size_t) dc_setting_uint16_get(env, app_settings->memory_mb) * 1024 * 1024;
+
+    // how long a busy client's small output may wait for more, 0 sends it every round
+    info->coalesce_cap = dc_setting_uint16_get(env, app_settings->coalesce_us);
+
+    mesh = NULL;
+    mesh_list = NULL;
+
+    if (mesh_spec != NULL)
+    {
+        mesh_list = strdup(mesh_spec);
+        mesh_count = mesh_list == NULL ? -1 : split_paths(mesh_list, mesh_paths);
+        mesh = mesh_count < 0 ? NULL : cpt_mesh_create(info, node, mesh_paths, mesh_count);
+
+        if (mesh == NULL)
+        {
+            fprintf(stderr, "mesh: cannot join as node %u of %s\n", (unsigned) node, mesh_spec);
+            cpt_server_destroy(info);
+            free(mesh_list);
+            free(pollfd);
+            free(clients);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // the first FIRST_CLIENT slots are listening sockets and mesh links, clients[i] belongs to pollfd[i]
+    for (size_t i = 0; i < FIRST_CLIENT; i++)
+    {
+        pollfd[i].fd = -1;
+    }
+
+    nfds = FIRST_CLIENT;
+
+    if (inherit != NULL)
+    {
+        // started by a live upgrade, the previous process hands over the listeners and every client
+        if (inherit_server(atoi(inherit), info, &pollfd, &clients, &nfds, &capacity) < 0)
+        {
+            fprintf(stderr, "live upgrade: handoff from the previous process failed\n");
+            cpt_mesh_destroy(mesh);
+            cpt_server_destroy(info);
+            free(mesh_list);
+            free(pollfd);
+            free(clients);
+            return EXIT_FAILURE;
+        }
+
+        socket_fd = pollfd[0].fd;
+        unix_fd = pollfd[1].fd;
+    }
+    else
+    {
+        socket_fd = open_tcp_listener(port);
+        unix_fd = -1;
+
+        if (socket_fd < 0 || (unix_path != NULL && (unix_fd = open_unix_listener(unix_path)) < 0))
+        {
+            if (socket_fd >= 0)
+            {
+                close(socket_fd);
+            }
+            cpt_mesh_destroy(mesh);
+            cpt_server_destroy(info);
+            free(mesh_list);
+            free(pollfd);
+            free(clients);
+            exit(-1);
+        }
+    }
+
+#ifdef SO_BUSY_POLL
+    // accepted sockets inherit it, their receive path then polls the device instead of waiting for an interrupt
+    if (busy_poll_us > 0)
+    {
+        int busy_poll = busy_poll_us;
+
+        setsockopt(socket_fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll));
+    }
+#endif
+
+    pollfd[0].fd = socket_fd;
+    pollfd[0].events = POLLIN;
+    pollfd[1].fd = unix_fd;
+    pollfd[1].events = POLLIN;
+    compress_array = 0;
+    upgraded = 0;
+
+    // the event loop is one of the lanes, a single lane is the plain loop
+    if (fanout_threads > 1)
+    {
+        info->fanout = cpt_fanout_create(fanout_threads,
+                                         dc_setting_uint16_get(env, app_settings->fanout_threshold), cpus,
+                                         cpu_count);
+
+        if (info->fanout == NULL)
+        {
+            fprintf(stderr, "fan-out: cannot start %u lanes, broadcasting from one thread\n",
+                    (unsigned) fanout_threads);
+        }
+    }
+
+    if (capture_path != NULL)
+    {
+        snprintf(capture_file, sizeof(capture_file), "%s", capture_path);
+
+        // after a live upgrade the previous process may still be writing the original file
+        if (inherit != NULL)
+        {
+            snprintf(capture_file, sizeof(capture_file), "%s.%ld", capture_path, (long) getpid());
+        }
+
+        info->capture = cpt_capture_open(capture_file);
+
+        if (info->capture == NULL)
+        {
+            fprintf(stderr, "capture: cannot record to %s\n", capture_file);
+        }
+    }
+
+    // operators' queries, answered by the admin thread from what the loop publishes
+    admin = NULL;
+
+    if (admin_path != NULL)
+    {
+        admin = cpt_admin_open(admin_path, info);
+
+        if (admin == NULL)
+        {
+            fprintf(stderr, "admin: cannot listen on %s\n", admin_path);
+        }
+    }
+
+    while (!stop_server)
+    {
+        if (upgrade_server)
+        {
+            upgrade_server = 0;
+
+            if (hand_off(info, pollfd, clients, nfds) == 0)
+            {
+                upgraded = 1;
+                break;
+            }
+
+            fprintf(stderr, "live upgrade failed, still serving\n");
+        }
+
+        for (size_t i = FIRST_CLIENT; i < nfds; i++)
+        {
+            pollfd[i].events = (short) (cpt_server_wants_write(clients[i]) ? POLLIN | POLLOUT : POLLIN);
+        }
+
+        timeout = mesh != NULL ? cpt_mesh_poll_set(mesh, pollfd + LISTENERS) : -1;
+        timeout = sooner(timeout, cpt_server_presence_timeout(info));
+        timeout = sooner(timeout, cpt_server_offline_timeout(info));
+        timeout = sooner(timeout, cpt_server_coalesce_timeout(info));
+
+        rc = cpt_cpu_poll(pollfd, (nfds_t) nfds, timeout, busy_poll_us);
+
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            perror("poll() failed");
+            break;
+        }
+
+        // one clock read serves every request handled this round
+        cpt_server_tick(info);
+        cpt_server_expire_offline(info);
+
+        if (pollfd[0].revents & POLLIN)
+        {
+            accept_clients(info, socket_fd, 0, &pollfd, &clients, &nfds, &capacity);
+        }
+
+        if (pollfd[1].revents & POLLIN)
+        {
+            accept_clients(info, unix_fd, 1, &pollfd, &clients, &nfds, &capacity);
+        }
+
+        if (mesh != NULL)
+        {
+            cpt_mesh_handle(mesh, pollfd + LISTENERS);
+        }
+
+        for (size_t i = FIRST_CLIENT; i < nfds; i++)
+        {
+            user *client = clients[i];
+
+            if (pollfd[i].revents == 0 || client->closing)
+            {
+                continue;
+            }
+
+            if (pollfd[i].revents & (POLLIN | POLLHUP | POLLERR))
+            {
+                rc = cpt_server_read(info, client);
+
+                if (rc == 0 || (rc < 0 && errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR))
+                {
+                    client->closing = 1;
+                }
+            }
+
+            if ((pollfd[i].revents & POLLOUT) && cpt_server_flush(info, client) < 0)
+            {
+                client->closing = 1;
+            }
+        }
+
+        cpt_server_flush_dirty(info);
+        // the clients shed to get back under the memory budget close with the others below
+        cpt_server_shed(info);
+
+        for (size_t i = FIRST_CLIENT; i < nfds; i++)
+        {
+            if (clients[i]->closing)
+            {
+                if (info->capture != NULL && clients[i]->capture_id != 0)
+                {
+                    cpt_capture_close(info->capture, clients[i]->capture_id, info->now);
+                }
+
+                // a dropped user keeps its place for a while, LOGOUT already gave it up
+                if (cpt_server_park(info, clients[i]) < 0)
+                {
+                    cpt_server_disconnect(info, clients[i]);
+                    destroy_user(clients[i]);
+                }
+
+                close(pollfd[i].fd);
+                clients[i] = NULL;
+                pollfd[i].fd = -1;
+                compress_array = 1;
+            }
+        }
+
+        // presence events once their window closed, and whatever a disconnect left queued for the remaining members
+        cpt_server_flush_presence(info);
+        cpt_server_flush_dirty(info);
+
+        // one envelope per node carries this round's forwarded messages and gossip
+        if (mesh != NULL)
+        {
+            cpt_mesh_flush(mesh);
+        }
+
+        if (compress_array)
+        {
+            size_t kept = FIRST_CLIENT;
+
+            compress_array = 0;
+            for (size_t i = FIRST_CLIENT; i < nfds; i++)
+            {
+                if (pollfd[i].fd != -1)
+                {
+                    pollfd[kept] = pollfd[i];
+                    clients[kept] = clients[i];
+                    kept++;
+                }
+            }
+            nfds = kept;
+        }
+    }
+
+    // after an upgrade the new process owns the connections, only this process' copies are closed
+    for (size_t i = FIRST_CLIENT; i < nfds; i++)
+    {
+        if (!upgraded)
+        {
+            cpt_server_disconnect(info, clients[i]);
+        }
+        close(pollfd[i].fd);
+        destroy_user(clients[i]);
+    }
+
+    close(socket_fd);
+
+    if (unix_fd >= 0)
+    {
+        close(unix_fd);
+
+        if (!upgraded)
+        {
+            unlink(unix_path);
+        }
+    }
+
+    if (mesh != NULL && !upgraded)
+    {
+        unlink(mesh_paths[node]);
+    }
+
+    // the new process of an upgrade already listens on the admin path
+    if (admin != NULL)
+    {
+        cpt_admin_close(admin, info);
+
+        if (!upgraded)
+        {
+            unlink(admin_path);
+        }
+    }
+
+    // per-command request counts and latency of this process' lifetime
+    cpt_server_report(info, stderr);
+    cpt_mesh_destroy(mesh);
+
+    if (info->capture != NULL)
+    {
+        fprintf(stderr, "capture: %" PRIu64 " frames recorded, %" PRIu64 " dropped\n", info->capture->records,
+                info->capture->dropped);
+        cpt_capture_destroy(info->capture);
+    }
+
+    // the lanes' pools hold client output, so they go after the clients
+    fanout = info->fanout;
+    cpt_server_destroy(info);
+    cpt_fanout_destroy(fanout);
+    free(mesh_list);
+    free(pollfd);
+    free(clients);
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * The shorter of two poll timeouts, -1 meaning none.
+ */
+static int sooner(int timeout, int other)
+{
+    if (other >= 0 && (timeout < 0 || other < timeout))
+    {
+        return other;
+    }
+
+    return timeout;
+}
+
+static void handle_stop(int signo)
+{
+    (void) signo;
+    stop_server = 1;
+}
+
+static void handle_upgrade(int signo)
+{
+    (void) signo;
+    upgrade_server = 1;
+}
+
+/**
+ * Bind the non-blocking TCP listener on every address.
+ *
+ * @param port      Port to listen on.
+ * @return The listening socket, -1 on failure.
+ */
+static int open_tcp_listener(uint16_t port)
+{
+    struct sockaddr_in6 sockaddrIn;
+    int socket_fd, on = 1;
+    ssize_t rc;
 
     socket_fd = socket(AF_INET6, SOCK_STREAM, 0);
     if (socket_fd < 0)
     {
         perror("socket() failed");
-        exit(-1);
+        return -1;
     }
 
     rc = setsockopt(socket_fd, SOL_SOCKET,  SO_REUSEADDR,
@@ -162,7 +972,7 @@ static int run(const struct dc_posix_env *env, struct dc_error *err, struct dc_a
     {
         perror("setsockopt() failed");
         close(socket_fd);
-        exit(-1);
+        return -1;
     }
 
     rc = ioctl(socket_fd, FIONBIO, (char *)&on);
@@ -170,9 +980,12 @@ static int run(const struct dc_posix_env *env, struct dc_error *err, struct dc_a
     {
         perror("ioctl() failed");
         close(socket_fd);
-        exit(-1);
+        return -1;
     }
 
+    // listeners and clients are passed on explicitly at an upgrade, never inherited by exec
+    fcntl(socket_fd, F_SETFD, FD_CLOEXEC);
+
     memset(&sockaddrIn, 0, sizeof(sockaddrIn));
     sockaddrIn.sin6_family      = AF_INET6;
     memcpy(&sockaddrIn.sin6_addr, &in6addr_any, sizeof(in6addr_any));
@@ -183,309 +996,399 @@ static int run(const struct dc_posix_env *env, struct dc_error *err, struct dc_a
     {
         perror("bind() failed");
         close(socket_fd);
-        exit(-1);
+        return -1;
     }
 
-    rc = listen(socket_fd, 32);
+    rc = listen(socket_fd, SOMAXCONN);
     if (rc < 0)
     {
         perror("listen() failed");
         close(socket_fd);
-        exit(-1);
+        return -1;
     }
 
-    memset(pollfd, 0 , sizeof(pollfd));
-    pollfd[0].fd = socket_fd;
-    pollfd[0].events = POLLIN;
+    return socket_fd;
+}
+
+/**
+ * Bind a non-blocking AF_UNIX listener, replacing a stale socket file.
+ *
+ * @param path      Socket path.
+ * @return The listening socket, -1 on failure.
+ */
+static int open_unix_listener(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd, on = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
 
-    do
+    if (strlen(path) >= sizeof(addr.sun_path))
     {
-        printf("Waiting on poll()...\n");
-        rc = poll(pollfd, (nfds_t) nfds, timeout);
+        fprintf(stderr, "unix socket path too long: %s\n", path);
+        return -1;
+    }
 
-        if (rc < 0)
+    strcpy(addr.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0)
+    {
+        perror("socket() failed");
+        return -1;
+    }
+
+    // a previous run that was killed leaves the file behind
+    unlink(path);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    if (ioctl(fd, FIONBIO, (char *)&on) < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(fd, SOMAXCONN) < 0)
+    {
+        perror("unix listener failed");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * Accept every pending connection on a listener and add it to the poll set.
+ *
+ * @param info      The server registry, its arena holds the input rings.
+ * @param listen_fd Listening socket.
+ * @param local     Non-zero for the AF_UNIX listener, whose clients may map shared-memory rings.
+ * @param pollfd    Poll set.
+ * @param clients   Users, parallel to <pollfd>.
+ * @param nfds      Entries in use.
+ * @param capacity  Allocated entries.
+ */
+static void accept_clients(struct serverInfo *info, int listen_fd, int local, struct pollfd **pollfd,
+                           user ***clients, size_t *nfds, size_t *capacity)
+{
+    int new_sd, on = 1;
+
+    for (;;)
+    {
+        new_sd = accept(listen_fd, NULL, NULL);
+
+        if (new_sd < 0)
         {
-            perror("  poll() failed");
+            if (errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR)
+            {
+                perror("accept() failed");
+            }
             break;
         }
 
-        if (rc == 0)
+        if (*nfds == *capacity && grow_poll_set(pollfd, clients, capacity) < 0)
         {
-            printf("  poll() timed out.  End program.\n");
+            close(new_sd);
             break;
         }
 
-        current_size = nfds;
-        for (int i = 0; i < current_size; i++)
+        ioctl(new_sd, FIONBIO, (char *)&on);
+        fcntl(new_sd, F_SETFD, FD_CLOEXEC);
+
+        // output is already batched per poll round, Nagle would only stall small replies
+        if (!local)
         {
-            if(pollfd[i].revents == 0)
-                continue;
+            setsockopt(new_sd, IPPROTO_TCP, TCP_NODELAY, (char *)&on, sizeof(on));
+        }
 
-            if(pollfd[i].revents != POLLIN)
-            {
-                printf("  Error! revents = %d\n", pollfd[i].revents);
-                end_server = TRUE;
-                break;
+        (*clients)[*nfds] = create_user_in(info->arena, new_sd, 0);
 
-            }
-            if (pollfd[i].fd == socket_fd)
-            {
-                printf("  Listening socket is readable\n");
+        if ((*clients)[*nfds] == NULL)
+        {
+            close(new_sd);
+            break;
+        }
 
-                do
-                {
-                    new_sd = accept(socket_fd, NULL, NULL);
-                    if (new_sd < 0)
-                    {
-                        if (errno != EWOULDBLOCK)
-                        {
-                            perror("  accept() failed");
-                            end_server = TRUE;
-                        }
-                        break;
-                    }
-
-                    printf("  New incoming connection - %d\n", new_sd);
-                    pollfd[nfds].fd = new_sd;
-                    pollfd[nfds].events = POLLIN;
-                    nfds++;
-                } while (new_sd != -1);
-            }
+        (*clients)[*nfds]->local = local;
+        (*pollfd)[*nfds].fd = new_sd;
+        (*pollfd)[*nfds].events = POLLIN;
+        (*pollfd)[*nfds].revents = 0;
+        (*nfds)++;
+    }
+}
 
-            else
-            {
-                printf("  Descriptor %d is readable\n", pollfd[i].fd);
-                close_conn = FALSE;
-                do
-                {
-                    uint8_t *incoming = malloc(sizeof(uint8_t*));
-
-                    rc = recv(pollfd[i].fd, incoming, sizeof(buffer), 0);
-
-                    struct CptRequest *cptRequest;
-                    cptRequest = cpt_parse_request(incoming, (size_t) rc);
-
-                    if (rc < 0)
-                    {
-                        if (errno != EWOULDBLOCK)
-                        {
-                            perror("  recv() failed");
-                            close_conn = TRUE;
-                        }
-                        break;
-                    }
-
-                    if (rc == 0)
-                    {
-                        printf("  Connection closed\n");
-                        close_conn = TRUE;
-                        break;
-                    }
-
-                    len = rc;
-
-                    switch (cptRequest->command) {
-                        case SEND:
-
-//                            for (int j = 0; j < current_size; ++j) {
-//                                uint8_t *er = malloc(sizeof(uint8_t*));
-//                                struct CptRequest *ads;
-//                                ads = cpt_request_init();
-//                                ads->command = SEND;
-//                                ads->version = 1;
-//                                ads->channel_id = 0;
-//                                ads->msg = cptRequest->msg;
-//                                ads->msg_len = cptRequest->msg_len;
-//
-//                                size_t ad;
-//
-//                                ad = cpt_serialize_request(ads, er);
-//
-//                                rc = send(pollfd[j].fd, er, ad, 0);
-//
-//                                if (rc < 0)
-//                                {
-//                                    perror("  send() failed");
-//                                    close_conn = TRUE;
-//                                    break;
-//                                }
-//                            }
-
-
-                            printf("Send was called\n");
-                            break;
-                        case LOGOUT:
-                            printf("Logout was called\n");
-                            break;
-                        case GET_USERS:
-                            printf("Get users was called\n");
-                            break;
-                        case CREATE_CHANNEL:
-                            printf("Create Channel was called\n");
-                            break;
-                        case JOIN_CHANNEL:
-                            printf("Join Channel was called\n");
-                            break;
-                        case LEAVE_CHANNEL:
-                            printf("Leave channel was called\n");
-                            break;
-                        case LOGIN:
-                            printf("Login was called\n");
-                            break;
-                        default:
-                            printf("Wrong Command\n");
-                    }
-
-                    uint8_t *lop = malloc(sizeof(uint8_t*));
-
-                    struct CptResponse *cptResponse;
-                    cptResponse = cpt_response_init();
-                    cptResponse->code = SUCCESS;
-                    cptResponse->channel_id = 0;
-                    cptResponse->user_id = (uint16_t) pollfd[i].fd;
-                    cptResponse->msg = " Success";
-                    cptResponse->msg_len = 8;
-                    cptResponse->data_size = 7;
-
-                    size_t server;
-                    server = cpt_serialize_response(cptResponse, lop);
-
-                    rc = send(pollfd[i].fd, lop, server, 0);
-
-                } while(TRUE);
-
-                if (close_conn)
-                {
-                    close(pollfd[i].fd);
-                    pollfd[i].fd = -1;
-                    compress_array = TRUE;
-                }
+/**
+ * Take over from the process that started this one for a live upgrade.
+ *
+ * Restores the listeners into pollfd[0] and pollfd[1] and every client
+ * after them, confirms with one byte and then picks up the requests and
+ * output the previous process left buffered.
+ *
+ * @param fd        AF_UNIX socket to the previous process, closed on return.
+ * @param info      Empty server registry.
+ * @param pollfd    Poll set.
+ * @param clients   Users, parallel to <pollfd>.
+ * @param nfds      Entries in use.
+ * @param capacity  Allocated entries.
+ * @return 0 on success, -1 if the handoff failed.
+ */
+static int inherit_server(int fd, struct serverInfo *info, struct pollfd **pollfd, user ***clients, size_t *nfds,
+                          size_t *capacity)
+{
+    int listeners[LISTENERS];
+    user **restored;
+    size_t count;
+    uint8_t ack;
+    int status;
 
+    if (cpt_handoff_receive(fd, info, listeners, LISTENERS, &restored, &count) < 0)
+    {
+        close(fd);
+        return -1;
+    }
 
-            }  /* End of existing connection is readable             */
-        } /* End of loop through pollable descriptors              */
+    status = 0;
 
-        if (compress_array)
+    while (status == 0 && *capacity < FIRST_CLIENT + count)
+    {
+        status = grow_poll_set(pollfd, clients, capacity);
+    }
+
+    ack = 1;
+
+    // the previous process keeps serving until it has this byte, so nothing is written before it
+    if (status < 0 || send(fd, &ack, 1, MSG_NOSIGNAL) != 1)
+    {
+        for (size_t i = 0; i < count; i++)
         {
-            compress_array = FALSE;
-            for (int i = 0; i < nfds; i++)
+            close(restored[i]->user_fd);
+            destroy_user(restored[i]);
+        }
+
+        for (size_t i = 0; i < LISTENERS; i++)
+        {
+            if (listeners[i] >= 0)
             {
-                if (pollfd[i].fd == -1)
-                {
-                    for(int j = i; j < nfds-1; j++)
-                    {
-                        pollfd[j].fd = pollfd[j+1].fd;
-                    }
-                    i--;
-                    nfds--;
-                }
+                close(listeners[i]);
             }
         }
 
-    } while (end_server == FALSE); /* End of serving running.    */
+        free(restored);
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+    (*pollfd)[0].fd = listeners[0];
+    (*pollfd)[1].fd = listeners[1];
 
-    for (int i = 0; i < nfds; i++)
+    for (size_t i = 0; i < count; i++)
     {
-        if(pollfd[i].fd >= 0)
-            close(pollfd[i].fd);
+        (*clients)[FIRST_CLIENT + i] = restored[i];
+        (*pollfd)[FIRST_CLIENT + i].fd = restored[i]->user_fd;
+        (*pollfd)[FIRST_CLIENT + i].events = POLLIN;
+        (*pollfd)[FIRST_CLIENT + i].revents = 0;
+        cpt_server_resume(info, restored[i]);
     }
 
-    return EXIT_SUCCESS;
-}
+    *nfds = FIRST_CLIENT + count;
+    cpt_server_flush_dirty(info);
+    free(restored);
 
-static void error_reporter(const struct dc_error *err)
-{
-    fprintf(stderr, "ERROR: %s : %s : @ %zu : %d\n", err->file_name, err->function_name, err->line_number, 0);
-    fprintf(stderr, "ERROR: %s\n", err->message);
+    return 0;
 }
 
-static void trace_reporter(__attribute__((unused)) const struct dc_posix_env *env,
-                           const char *file_name,
-                           const char *function_name,
-                           size_t line_number)
+/**
+ * Start a new copy of the server and hand everything over to it.
+ *
+ * The new process is exec'd from this one's argv with --inherit added
+ * and receives the listeners, the clients and the registry over a
+ * socketpair. Until it confirms, this process still owns everything;
+ * if it fails or does not answer in time it is killed and serving
+ * carries on here.
+ *
+ * @param info      The server registry.
+ * @param pollfd    Poll set, listeners first.
+ * @param clients   Users, parallel to <pollfd>.
+ * @param nfds      Entries in use.
+ * @return 0 once the new process took over, -1 if this one keeps serving.
+ */
+static int hand_off(struct serverInfo *info, struct pollfd *pollfd, user **clients, size_t nfds)
 {
-    fprintf(stdout, "TRACE: %s : %s : @ %zu\n", file_name, function_name, line_number);
-}
+    struct pollfd wait;
+    char fd_arg[16];
+    char **argv;
+    int listeners[LISTENERS];
+    int sv[2];
+    uint8_t ack;
+    pid_t pid;
+    int status;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    {
+        perror("socketpair() failed");
+        return -1;
+    }
+
+    fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+    snprintf(fd_arg, sizeof(fd_arg), "%d", sv[1]);
+    argv = upgrade_argv(fd_arg);
+    pid = argv == NULL ? -1 : fork();
 
+    if (pid == 0)
+    {
+        execvp(argv[0], argv);
+        perror("execvp() failed");
+        _exit(127);
+    }
 
+    free(argv);
+    close(sv[1]);
 
-channel *createChannelList(){
-    channel *global = malloc(sizeof(channel));
-    if (global == NULL) {
-        printf("ERROR (malloc) : createChannelList()\n");
+    if (pid < 0)
+    {
+        perror("fork() failed");
+        close(sv[0]);
+        return -1;
     }
-    struct userList *list = malloc(sizeof(userList));
-    if (list == NULL) {
-        printf("ERROR (malloc) : createChannelList()\n");
+
+    // output that is already queued moves with the clients, it is simpler to send what the sockets take now
+    cpt_server_flush_dirty(info);
+    listeners[0] = pollfd[0].fd;
+    listeners[1] = pollfd[1].fd;
+    status = cpt_handoff_send(sv[0], info, listeners, LISTENERS, clients + FIRST_CLIENT, nfds - FIRST_CLIENT);
+    wait.fd = sv[0];
+    wait.events = POLLIN;
+
+    if (status == 0 && (poll(&wait, 1, HANDOFF_TIMEOUT_MS) != 1 || recv(sv[0], &ack, 1, 0) != 1))
+    {
+        status = -1;
     }
 
-    list->userCount = 0;
-    list->next = NULL;
+    close(sv[0]);
 
-    global->channel_id = 0;
-    global->users = list;
+    if (status < 0)
+    {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
 
-    return global;
+    return 0;
 }
 
-void add_Channel(channel *list, channel *input){
+/**
+ * This process' arguments with any previous --inherit replaced.
+ *
+ * @param fd_arg    Descriptor number for the new --inherit.
+ * @return NULL terminated argument vector to be freed by the caller, NULL if allocation failed.
+ */
+static char **upgrade_argv(char *fd_arg)
+{
+    static char inherit_opt[] = "--inherit";
+    char **argv;
+    size_t argc;
+    size_t n;
 
-}
+    for (argc = 0; server_argv[argc] != NULL; argc++)
+    {
+    }
 
-channel * create_channel(userList *list, uint16_t id){
-    channel *temp = malloc(sizeof(channel));
-    temp->channel_id = id;
-    temp->next = NULL;
-    temp->users = list;
+    argv = calloc(argc + 3, sizeof(char *));
 
-    return temp;
-}
+    if (argv == NULL)
+    {
+        return NULL;
+    }
 
-void destroy_channel(channel *ch){
-    ch->channel_id = 0;
-    ch->next = NULL;
-    ch->users = NULL;
-    free(ch);
-}
+    n = 0;
 
-void destroy_user(user *client){
-    client->user_fd = 0;
-    client->user_id = 0;
-    free(client);
-}
+    for (size_t i = 0; i < argc; i++)
+    {
+        if (strcmp(server_argv[i], "--inherit") == 0 || strcmp(server_argv[i], "-i") == 0)
+        {
+            i++;
+            continue;
+        }
 
-user * create_user(int fd, int id){
-    user *i  = malloc(sizeof(user));
+        if (strncmp(server_argv[i], "--inherit=", 10) == 0 || strncmp(server_argv[i], "-i", 2) == 0)
+        {
+            continue;
+        }
 
-    i->user_id = id;
-    i->user_fd = fd;
-    i->next = NULL;
+        argv[n++] = server_argv[i];
+    }
+
+    argv[n++] = inherit_opt;
+    argv[n] = fd_arg;
 
-    return i;
+    return argv;
 }
 
+/**
+ * Split the comma separated link socket paths of a mesh in place.
+ *
+ * @param list      The --mesh argument, modified.
+ * @param paths     Set to up to MESH_PATHS_MAX paths.
+ * @return Number of paths, -1 if there are too many.
+ */
+static int split_paths(char *list, const char **paths)
+{
+    char *saveptr;
+    char *path;
+    int count;
 
+    count = 0;
 
-int cpt_login_response(char * name){
-    int status = 0;
+    for (path = strtok_r(list, ",", &saveptr); path != NULL; path = strtok_r(NULL, ",", &saveptr))
+    {
+        if (count == MESH_PATHS_MAX)
+        {
+            return -1;
+        }
 
-    return status;
-}
-int cpt_logout_response(){
-    int status = 0;
+        paths[count++] = path;
+    }
 
-    return status;
+    return count;
 }
-int cpt_get_users_response(uint16_t channel_id){
-    int status = 0;
 
-    return status;
+static int grow_poll_set(struct pollfd **pollfd, user ***clients, size_t *capacity)
+{
+    struct pollfd *fds;
+    user **users;
+    size_t new_capacity;
+
+    new_capacity = *capacity * 2;
+    fds = realloc(*pollfd, new_capacity * sizeof(struct pollfd));
+
+    if (fds == NULL)
+    {
+        return -1;
+    }
+
+    *pollfd = fds;
+    users = realloc(*clients, new_capacity * sizeof(user *));
+
+    if (users == NULL)
+    {
+        return -1;
+    }
+
+    *clients = users;
+    *capacity = new_capacity;
+
+    return 0;
 }
-int cpt_join_channel_response(uint16_t channel_id) {
-    int status = 0;
+
+static void error_reporter(const struct dc_error *err)
+{
+    fprintf(stderr, "ERROR: %s : %s : @ %zu : %d\n", err->file_name, err->function_name, err->line_number, 0);
+    fprintf(stderr, "ERROR: %s\n", err->message);
 }
-int cpt_send_response(char * name){
-    int status = 0;
 
-    return status;
+static void trace_reporter(__attribute__((unused)) const struct dc_posix_env *env,
+                           const char *file_name,
+                           const char *function_name,
+                           size_t line_number)
+{
+    fprintf(stdout, "TRACE: %s : %s : @ %zu\n", file_name, function_name, line_number);
 }
+
@@ -0,0 +1,177 @@
+#include "common.h"
+#include "cpt_admin.h"
+#include "cpt_server.h"
+#include "tests.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define ADMIN_PATH "/tmp/cpt_admin_test.sock"
+#define SENDS 3
+#define BIG_MSG 60000
+
+static struct serverInfo *info;
+static struct cpt_admin *admin;
+static struct member talker;
+static struct member quiet;
+static char *reply;
+static size_t reply_len;
+
+static void send_as(const struct member *m, char *msg, uint16_t msg_len);
+static int query(const char *text);
+static int dial_admin(void);
+
+static void send_as(const struct member *m, char *msg, uint16_t msg_len)
+{
+    struct CptRequest req;
+
+    req.version = CPT_SERVER_VERSION;
+    req.command = SEND;
+    req.channel_id = GLOBAL_CHANNEL;
+    req.msg = msg;
+    req.msg_len = msg_len;
+    assert_that(cpt_handle_request(info, m->client, &req), is_equal_to(SUCCESS));
+}
+
+static int query(const char *text)
+{
+    FILE *out;
+    int rc;
+
+    free(reply);
+    reply = NULL;
+    out = open_memstream(&reply, &reply_len);
+    rc = cpt_admin_query(admin, text, out);
+    fclose(out);
+
+    return rc;
+}
+
+static int dial_admin(void)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, ADMIN_PATH);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert_that(connect(fd, (struct sockaddr *) &addr, sizeof(addr)), is_equal_to(0));
+
+    return fd;
+}
+
+Describe(admin);
+
+BeforeEach(admin)
+{
+    char msg[] = "hello";
+
+    info = cpt_server_create();
+    reply = NULL;
+    // opened first, so everything below reaches the published counters the way the loop's changes do
+    admin = cpt_admin_open(ADMIN_PATH, info);
+    assert_that(admin, is_not_null);
+    // nobody reads the peers, so a large message stays partly queued after a flush
+    connect_member(info, &talker, "talker", CPT_SERVER_VERSION);
+    throttle_member(&talker);
+    connect_member(info, &quiet, "quiet", CPT_SERVER_VERSION);
+    throttle_member(&quiet);
+
+    for (int i = 0; i < SENDS; i++)
+    {
+        send_as(&talker, msg, (uint16_t) strlen(msg));
+    }
+}
+
+AfterEach(admin)
+{
+    free(reply);
+    drop_member(info, &talker);
+    drop_member(info, &quiet);
+    cpt_admin_close(admin, info);
+    assert_that(info->published, is_null);
+    unlink(ADMIN_PATH);
+    cpt_server_destroy(info);
+}
+
+Ensure(admin, answers_queries_from_published_counters)
+{
+    static char big[BIG_MSG];
+
+    assert_that(query("connections"), is_equal_to(0));
+    assert_that(strstr(reply, "connections: 2 logged in, 0 parked"), is_not_null);
+    assert_that(strstr(reply, "versions: 1 2,"), is_not_null);
+
+    assert_that(query("channels"), is_equal_to(0));
+    assert_that(strstr(reply, "channels: 1\nchannel 0: 2 members, seq 3"), is_not_null);
+
+    // the quiet member never sent anything and is not a talker
+    assert_that(query("top"), is_equal_to(0));
+    assert_that(strstr(reply, "top talkers: 1\nuser 1: 3 messages, 15 bytes"), is_not_null);
+
+    // queues are published by the flush, and one this large does not fit into either socket
+    memset(big, 'b', sizeof(big));
+    send_as(&quiet, big, sizeof(big));
+    cpt_server_flush_dirty(info);
+    assert_that(query("queues"), is_equal_to(0));
+    assert_that(strstr(reply, "waiting for 2 clients"), is_not_null);
+    assert_that(strstr(reply, "user 1: "), is_not_null);
+    assert_that(strstr(reply, "user 2: "), is_not_null);
+
+    assert_that(query("lanes"), is_equal_to(0));
+    assert_that(strstr(reply, "no fan-out"), is_not_null);
+
+    // the memory figures are published once per round
+    cpt_server_tick(info);
+    assert_that(query("stats"), is_equal_to(0));
+    assert_that(strstr(reply, "SEND"), is_not_null);
+    assert_that(strstr(reply, "memory: 0 KB"), is_null);
+
+    // a member that leaves frees its id
+    drop_member(info, &quiet);
+    assert_that(query("connections"), is_equal_to(0));
+    assert_that(strstr(reply, "connections: 1 logged in"), is_not_null);
+    connect_member(info, &quiet, "quiet", CPT_SERVER_VERSION);
+    throttle_member(&quiet);
+
+    assert_that(query("uptime"), is_equal_to(-1));
+    assert_that(strstr(reply, "unknown query 'uptime'"), is_not_null);
+}
+
+Ensure(admin, serves_operators_from_its_own_thread)
+{
+    char buf[4096];
+    size_t got;
+    ssize_t nread;
+    int fd;
+
+    fd = dial_admin();
+    assert_that(write(fd, "connections\r\n", 13), is_equal_to(13));
+    got = 0;
+
+    // nothing on this side polls, the admin thread answers and closes the connection
+    while ((nread = read(fd, buf + got, sizeof(buf) - 1 - got)) > 0)
+    {
+        got += (size_t) nread;
+    }
+
+    buf[got] = '\0';
+    assert_that(atomic_load(&admin->queries), is_equal_to(1));
+    assert_that(strstr(buf, "connections: 2 logged in"), is_not_null);
+    close(fd);
+}
+
+TestSuite *admin_tests(void)
+{
+    TestSuite *suite;
+
+    suite = create_test_suite();
+    add_test_with_context(suite, admin, answers_queries_from_published_counters);
+    add_test_with_context(suite, admin, serves_operators_from_its_own_thread);
+
+    return suite;
+}
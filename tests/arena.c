@@ -0,0 +1,103 @@
+#include "cpt_arena.h"
+#include "cpt_server.h"
+#include "tests.h"
+#include <string.h>
+
+#define SLOTS_PER_REGION (CPT_ARENA_REGION / CPT_INPUT_CAPACITY)
+
+static struct cpt_arena *arena;
+
+Describe(arena);
+
+BeforeEach(arena)
+{
+}
+
+AfterEach(arena)
+{
+    cpt_arena_destroy(arena);
+    arena = NULL;
+}
+
+Ensure(arena, carves_slots_from_aligned_regions)
+{
+    uint8_t *slots[SLOTS_PER_REGION + 1];
+    uint8_t *again;
+
+    arena = cpt_arena_create(CPT_INPUT_CAPACITY, CPT_ARENA_TRANSPARENT);
+    assert_that(arena, is_not_null);
+
+    for (int i = 0; i < SLOTS_PER_REGION; i++)
+    {
+        slots[i] = cpt_arena_alloc(arena);
+        assert_that(slots[i], is_not_null);
+    }
+
+    // one region holds the first slots back to back
+    assert_that(arena->region_count, is_equal_to(1));
+    assert_that((uintptr_t) arena->regions[0] % CPT_ARENA_HUGE_PAGE, is_equal_to(0));
+    assert_that(slots[0] == arena->regions[0], is_equal_to(1));
+    assert_that(slots[SLOTS_PER_REGION - 1] - slots[0], is_equal_to((SLOTS_PER_REGION - 1) * CPT_INPUT_CAPACITY));
+
+    slots[SLOTS_PER_REGION] = cpt_arena_alloc(arena);
+    assert_that(arena->region_count, is_equal_to(2));
+    assert_that((uintptr_t) arena->regions[1] % CPT_ARENA_HUGE_PAGE, is_equal_to(0));
+    memset(slots[SLOTS_PER_REGION], 0xab, CPT_INPUT_CAPACITY);
+    assert_that(arena->in_use, is_equal_to(SLOTS_PER_REGION + 1));
+
+    // the last slot freed is the first taken
+    cpt_arena_free(arena, slots[3]);
+    cpt_arena_free(arena, slots[5]);
+    again = cpt_arena_alloc(arena);
+    assert_that(again == slots[5], is_equal_to(1));
+    again = cpt_arena_alloc(arena);
+    assert_that(again == slots[3], is_equal_to(1));
+    assert_that(arena->region_count, is_equal_to(2));
+}
+
+Ensure(arena, falls_back_without_a_huge_page_pool)
+{
+    uint8_t *slot;
+
+    arena = cpt_arena_create(CPT_INPUT_CAPACITY, CPT_ARENA_EXPLICIT);
+    slot = cpt_arena_alloc(arena);
+
+    // either the hugetlbfs pool or ordinary pages, usable both ways
+    assert_that(slot, is_not_null);
+    assert_that(arena->explicit_regions, is_less_than(2));
+    memset(slot, 0x5a, CPT_INPUT_CAPACITY);
+    assert_that(slot[CPT_INPUT_CAPACITY - 1], is_equal_to(0x5a));
+    assert_that(cpt_arena_create(CPT_ARENA_REGION + 1, CPT_ARENA_SMALL_PAGES), is_null);
+}
+
+Ensure(arena, gives_users_their_input_ring)
+{
+    user *client;
+    uint8_t *ring;
+
+    arena = cpt_arena_create(CPT_INPUT_CAPACITY, CPT_ARENA_SMALL_PAGES);
+    client = create_user_in(arena, -1, 0);
+    assert_that(client, is_not_null);
+    ring = client->in.data;
+    assert_that(ring == arena->regions[0], is_equal_to(1));
+    assert_that(client->in.capacity, is_equal_to(CPT_INPUT_CAPACITY));
+    destroy_user(client);
+    assert_that(arena->in_use, is_equal_to(0));
+
+    // a new connection gets the slot back with its pages still mapped
+    client = create_user_in(arena, -1, 0);
+    assert_that(client->in.data == ring, is_equal_to(1));
+    destroy_user(client);
+}
+
+TestSuite *arena_tests(void)
+{
+    TestSuite *suite;
+
+    suite = create_test_suite();
+    add_test_with_context(suite, arena, carves_slots_from_aligned_regions);
+    add_test_with_context(suite, arena, falls_back_without_a_huge_page_pool);
+    add_test_with_context(suite, arena, gives_users_their_input_ring);
+
+    return suite;
+}
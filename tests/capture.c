@@ -0,0 +1,115 @@
+#include "common.h"
+#include "cpt_capture.h"
+#include "tests.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static char path[] = "/tmp/cpt_capture_XXXXXX";
+static uint8_t file[256];
+static size_t file_size;
+
+Describe(capture);
+
+BeforeEach(capture)
+{
+    int fd;
+
+    memcpy(path + sizeof(path) - 7, "XXXXXX", 6);
+    fd = mkstemp(path);
+    close(fd);
+    file_size = 0;
+}
+
+AfterEach(capture)
+{
+    unlink(path);
+}
+
+static void read_back(void)
+{
+    FILE *in;
+
+    in = fopen(path, "rb");
+    file_size = fread(file, 1, sizeof(file), in);
+    fclose(in);
+}
+
+/**
+ * Decode the record at <pos> into <fields> (id, delta, length).
+ *
+ * @return Position of the record's bytes.
+ */
+static size_t next_record(size_t pos, uint32_t fields[3])
+{
+    for (int i = 0; i < 3; i++)
+    {
+        pos += (size_t) cpt_varint_get(file + pos, file_size - pos, &fields[i]);
+    }
+
+    return pos;
+}
+
+Ensure(capture, writes_frames_and_closes_in_order)
+{
+    struct cpt_capture *capture;
+    const uint8_t login[] = {1, LOGIN, 0, 0, 0, 0};
+    const uint8_t send[] = {1, SEND, 0, 1, 2, 'h', 'i'};
+    uint32_t first, second, fields[3];
+    size_t pos;
+
+    capture = cpt_capture_open(path);
+    assert_that(capture, is_not_null);
+
+    first = cpt_capture_connection(capture);
+    second = cpt_capture_connection(capture);
+    assert_that(first, is_equal_to(1));
+    assert_that(second, is_equal_to(2));
+
+    cpt_capture_frame(capture, first, 1000, login, sizeof(login));
+    cpt_capture_frame(capture, second, 1250, send, sizeof(send));
+    cpt_capture_close(capture, first, 301250);
+    assert_that(capture->records, is_equal_to(3));
+    assert_that(capture->dropped, is_equal_to(0));
+
+    // destroying it writes out whatever the thread had not got to yet
+    cpt_capture_destroy(capture);
+    read_back();
+    assert_that(memcmp(file, CPT_CAPTURE_MAGIC, CPT_CAPTURE_MAGIC_SIZE), is_equal_to(0));
+
+    pos = next_record(CPT_CAPTURE_MAGIC_SIZE, fields);
+    assert_that(fields[0], is_equal_to(first));
+    assert_that(fields[1], is_equal_to(0));
+    assert_that(fields[2], is_equal_to(sizeof(login)));
+    assert_that(memcmp(file + pos, login, sizeof(login)), is_equal_to(0));
+
+    pos = next_record(pos + sizeof(login), fields);
+    assert_that(fields[0], is_equal_to(second));
+    assert_that(fields[1], is_equal_to(250));
+    assert_that(fields[2], is_equal_to(sizeof(send)));
+    assert_that(memcmp(file + pos, send, sizeof(send)), is_equal_to(0));
+
+    // a close is a record without bytes
+    pos = next_record(pos + sizeof(send), fields);
+    assert_that(fields[0], is_equal_to(first));
+    assert_that(fields[1], is_equal_to(300000));
+    assert_that(fields[2], is_equal_to(0));
+    assert_that(pos, is_equal_to(file_size));
+}
+
+Ensure(capture, cannot_open_a_file_in_a_missing_directory)
+{
+    assert_that(cpt_capture_open("/nonexistent/cpt.cap"), is_null);
+}
+
+TestSuite *capture_tests(void)
+{
+    TestSuite *suite;
+
+    suite = create_test_suite();
+    add_test_with_context(suite, capture, writes_frames_and_closes_in_order);
+    add_test_with_context(suite, capture, cannot_open_a_file_in_a_missing_directory);
+
+    return suite;
+}
@@ -0,0 +1,714 @@
+#include "common.h"
+#include "cpt_client.h"
+#include "tests.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define PROPERTY_RUNS 2000
+#define MAX_RANDOM_MSG 2048
+#define CANARY 0xA5
+
+struct collected
+{
+    struct CptResponse responses[64];
+    uint8_t messages[64][MAX_RANDOM_MSG];
+    size_t count;
+};
+
+struct negotiation
+{
+    struct collected *out;
+    struct cpt_response_decoder *dec;
+};
+
+static uint32_t next_random(uint32_t *state);
+static void random_bytes(uint32_t *state, uint8_t *dst, size_t size);
+static void collect_response(void *arg, const struct CptResponse *res);
+static void collect_and_upgrade(void *arg, const struct CptResponse *res);
+static size_t log_lines(uint32_t *state, uint8_t *dst, size_t size);
+
+static uint32_t next_random(uint32_t *state)
+{
+    // xorshift32, fixed seeds keep every run reproducible
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+
+    return *state;
+}
+
+static void random_bytes(uint32_t *state, uint8_t *dst, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        dst[i] = (uint8_t) next_random(state);
+    }
+}
+
+static void collect_response(void *arg, const struct CptResponse *res)
+{
+    struct collected *out;
+
+    out = arg;
+    out->responses[out->count] = *res;
+    memcpy(out->messages[out->count], res->msg, res->msg_len);
+    out->count++;
+}
+
+static void collect_and_upgrade(void *arg, const struct CptResponse *res)
+{
+    struct negotiation *state;
+
+    state = arg;
+    collect_response(state->out, res);
+
+    // the reply to a version 2 LOGIN is the last version 1 frame
+    if (state->out->count == 1)
+    {
+        cpt_response_decoder_set_version(state->dec, CPT_VERSION_BATCHED);
+    }
+}
+
+static size_t log_lines(uint32_t *state, uint8_t *dst, size_t size)
+{
+    size_t length;
+    int written;
+
+    length = 0;
+
+    // the kind of pasted log output compression is meant for
+    for (;;)
+    {
+        written = snprintf((char *) dst + length, size - length,
+                           "2026-10-19T12:%02u:%02u INFO worker-%u request id=%u path=/api/v1/items took %u ms\n",
+                           next_random(state) % 60, next_random(state) % 60, next_random(state) % 8,
+                           next_random(state) % 100000, next_random(state) % 500);
+
+        if (written < 0 || length + (size_t) written >= size)
+        {
+            return length;
+        }
+
+        length += (size_t) written;
+    }
+}
+
+Describe(codec);
+
+BeforeEach(codec)
+{
+}
+
+AfterEach(codec)
+{
+}
+
+Ensure(codec, round_trips_u16_values)
+{
+    uint8_t buf[2];
+    int current;
+
+    for (uint32_t value = 0; value <= UINT16_MAX; value++)
+    {
+        pack_u16((uint16_t) value, buf);
+        current = 0;
+        assert_that(unpack_u16(buf, &current), is_equal_to(value));
+        assert_that(current, is_equal_to(2));
+    }
+}
+
+Ensure(codec, round_trips_random_requests)
+{
+    static uint8_t msg[MAX_RANDOM_MSG];
+    static uint8_t wire[CPT_REQUEST_HEADER_SIZE + MAX_RANDOM_MSG];
+    struct CptRequest req;
+    struct CptRequest *parsed;
+    uint32_t seed;
+    size_t size;
+
+    seed = 0x12345678;
+
+    for (int run = 0; run < PROPERTY_RUNS; run++)
+    {
+        req.version = (uint8_t) next_random(&seed);
+        req.command = (uint8_t) next_random(&seed);
+        req.channel_id = (uint16_t) next_random(&seed);
+        req.msg_len = (uint16_t) (next_random(&seed) % MAX_RANDOM_MSG);
+        random_bytes(&seed, msg, req.msg_len);
+        req.msg = (char *) msg;
+
+        size = cpt_serialize_request(&req, wire, sizeof(wire));
+        assert_that(size, is_equal_to(CPT_REQUEST_HEADER_SIZE + req.msg_len));
+
+        parsed = cpt_parse_request(wire, size);
+        assert_that(parsed, is_not_null);
+        assert_that(parsed->version, is_equal_to(req.version));
+        assert_that(parsed->command, is_equal_to(req.command));
+        assert_that(parsed->channel_id, is_equal_to(req.channel_id));
+        assert_that(parsed->msg_len, is_equal_to(req.msg_len));
+        assert_that(memcmp(parsed->msg, msg, req.msg_len), is_equal_to(0));
+        assert_that(parsed->msg[req.msg_len], is_equal_to('\0'));
+        cpt_request_destroy(parsed);
+    }
+}
+
+Ensure(codec, round_trips_random_responses)
+{
+    static uint8_t msg[MAX_RANDOM_MSG];
+    static uint8_t wire[CPT_RESPONSE_HEADER_SIZE + MAX_RANDOM_MSG];
+    struct CptResponse res;
+    struct CptResponse parsed;
+    uint32_t seed;
+    size_t size;
+
+    seed = 0x9E3779B9;
+
+    for (int run = 0; run < PROPERTY_RUNS; run++)
+    {
+        res.code = (uint8_t) next_random(&seed);
+        res.channel_id = (uint16_t) next_random(&seed);
+        res.user_id = (uint16_t) next_random(&seed);
+        res.msg_len = (uint16_t) (next_random(&seed) % MAX_RANDOM_MSG);
+        random_bytes(&seed, msg, res.msg_len);
+        res.msg = msg;
+
+        size = cpt_serialize_response(&res, wire, sizeof(wire));
+        assert_that(size, is_equal_to(CPT_RESPONSE_HEADER_SIZE + res.msg_len));
+
+        assert_that(cpt_parse_response_into(&parsed, wire, size), is_equal_to(0));
+        assert_that(parsed.code, is_equal_to(res.code));
+        assert_that(parsed.channel_id, is_equal_to(res.channel_id));
+        assert_that(parsed.user_id, is_equal_to(res.user_id));
+        assert_that(parsed.msg_len, is_equal_to(res.msg_len));
+        assert_that(memcmp(parsed.msg, msg, res.msg_len), is_equal_to(0));
+    }
+}
+
+Ensure(codec, rejects_every_truncated_request)
+{
+    uint8_t wire[CPT_REQUEST_HEADER_SIZE + 5];
+    char hello[] = "hello";
+    struct CptRequest req;
+    struct CptRequest view;
+    size_t size;
+
+    req.version = 1;
+    req.command = SEND;
+    req.channel_id = 3;
+    req.msg_len = 5;
+    req.msg = hello;
+    size = cpt_serialize_request(&req, wire, sizeof(wire));
+
+    for (size_t prefix = 0; prefix < size; prefix++)
+    {
+        assert_that(cpt_parse_request(wire, prefix), is_null);
+        assert_that(cpt_parse_request_into(&view, wire, prefix), is_equal_to(-1));
+    }
+
+    assert_that(cpt_parse_request_into(&view, wire, size), is_equal_to(0));
+    assert_that(view.channel_id, is_equal_to(3));
+    assert_that(view.msg_len, is_equal_to(5));
+    assert_that(view.msg == (char *) wire + CPT_REQUEST_HEADER_SIZE, is_true);
+}
+
+Ensure(codec, rejects_every_truncated_response)
+{
+    uint8_t wire[CPT_RESPONSE_HEADER_SIZE + 5];
+    uint8_t hello[] = "hello";
+    struct CptResponse res;
+    struct CptResponse parsed;
+    size_t size;
+
+    res.code = MESSAGE;
+    res.channel_id = 3;
+    res.user_id = 4;
+    res.msg_len = 5;
+    res.msg = hello;
+    size = cpt_serialize_response(&res, wire, sizeof(wire));
+
+    for (size_t prefix = 0; prefix < size; prefix++)
+    {
+        assert_that(cpt_parse_response_into(&parsed, wire, prefix), is_equal_to(-1));
+        assert_that(cpt_parse_response(wire, prefix), is_null);
+    }
+}
+
+Ensure(codec, serializers_never_write_past_the_buffer)
+{
+    uint8_t wire[CPT_RESPONSE_HEADER_SIZE + 5 + 1];
+    char hello[] = "hello";
+    struct CptRequest req;
+    struct CptResponse res;
+
+    req.version = 1;
+    req.command = SEND;
+    req.channel_id = 0;
+    req.msg_len = 5;
+    req.msg = hello;
+
+    res.code = MESSAGE;
+    res.channel_id = 0;
+    res.user_id = 0;
+    res.msg_len = 5;
+    res.msg = (uint8_t *) hello;
+
+    for (size_t size = 0; size < sizeof(wire); size++)
+    {
+        memset(wire, CANARY, sizeof(wire));
+
+        if (size < CPT_REQUEST_HEADER_SIZE + 5)
+        {
+            assert_that(cpt_serialize_request(&req, wire, size), is_equal_to(0));
+        }
+        if (size < CPT_RESPONSE_HEADER_SIZE + 5)
+        {
+            assert_that(cpt_serialize_response(&res, wire, size), is_equal_to(0));
+        }
+        assert_that(wire[sizeof(wire) - 1], is_equal_to(CANARY));
+    }
+}
+
+Ensure(codec, decodes_responses_across_any_segmentation)
+{
+    static uint8_t stream[64 * (CPT_RESPONSE_HEADER_SIZE + MAX_RANDOM_MSG)];
+    static uint8_t messages[64][MAX_RANDOM_MSG];
+    static struct collected out;
+    struct cpt_response_decoder dec;
+    struct CptResponse res[64];
+    uint32_t seed;
+    size_t length;
+    size_t offset;
+    size_t chunk;
+
+    seed = 0xC0FFEE;
+
+    for (int run = 0; run < 50; run++)
+    {
+        length = 0;
+
+        for (int i = 0; i < 64; i++)
+        {
+            res[i].code = (uint8_t) (1 + next_random(&seed) % SERVER_FULL);
+            res[i].channel_id = (uint16_t) next_random(&seed);
+            res[i].user_id = (uint16_t) next_random(&seed);
+            res[i].msg_len = (uint16_t) (next_random(&seed) % MAX_RANDOM_MSG);
+            random_bytes(&seed, messages[i], res[i].msg_len);
+            res[i].msg = messages[i];
+            length += cpt_serialize_response(&res[i], stream + length, sizeof(stream) - length);
+        }
+
+        // small ring so frames regularly straddle its end
+        assert_that(cpt_response_decoder_init(&dec, 8192), is_equal_to(0));
+        out.count = 0;
+        offset = 0;
+
+        while (offset < length)
+        {
+            chunk = 1 + next_random(&seed) % 3000;
+            if (chunk > length - offset)
+            {
+                chunk = length - offset;
+            }
+            chunk = cpt_response_decoder_feed(&dec, stream + offset, chunk);
+            offset += chunk;
+            cpt_response_decoder_drain(&dec, collect_response, &out);
+        }
+
+        assert_that(out.count, is_equal_to(64));
+        assert_that(dec.resyncs, is_equal_to(0));
+
+        for (int i = 0; i < 64; i++)
+        {
+            assert_that(out.responses[i].code, is_equal_to(res[i].code));
+            assert_that(out.responses[i].channel_id, is_equal_to(res[i].channel_id));
+            assert_that(out.responses[i].user_id, is_equal_to(res[i].user_id));
+            assert_that(out.responses[i].msg_len, is_equal_to(res[i].msg_len));
+            assert_that(memcmp(out.messages[i], messages[i], res[i].msg_len), is_equal_to(0));
+        }
+
+        cpt_response_decoder_destroy(&dec);
+    }
+}
+
+Ensure(codec, rejects_decoder_capacities_that_are_not_powers_of_two)
+{
+    struct cpt_response_decoder dec;
+
+    assert_that(cpt_response_decoder_init(&dec, 0), is_equal_to(-1));
+    assert_that(cpt_response_decoder_init(&dec, 3), is_equal_to(-1));
+    assert_that(cpt_response_decoder_init(&dec, 8192 + 4096), is_equal_to(-1));
+    assert_that(cpt_response_decoder_init(&dec, 8192), is_equal_to(0));
+    cpt_response_decoder_destroy(&dec);
+}
+
+Ensure(codec, round_trips_varints)
+{
+    uint8_t buf[CPT_VARINT_MAX];
+    uint8_t padded[] = {0x85, 0x80, 0x00};
+    uint8_t too_long[] = {0x80, 0x80, 0x80, 0x80, 0x80, 0x00};
+    uint8_t too_wide[] = {0x80, 0x80, 0x80, 0x80, 0x10};
+    uint8_t widest[] = {0x80, 0x80, 0x80, 0x80, 0x0F};
+    uint32_t values[] = {0, 1, 127, 128, 16383, 16384, UINT16_MAX, CPT_ENVELOPE_MAX, UINT32_MAX};
+    uint32_t value;
+    size_t size;
+
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+    {
+        size = cpt_varint_put(values[i], buf);
+        assert_that(size, is_equal_to(cpt_varint_size(values[i])));
+        assert_that(cpt_varint_get(buf, size - 1, &value), is_equal_to(0));
+        assert_that(cpt_varint_get(buf, size, &value), is_equal_to(size));
+        assert_that(value, is_equal_to(values[i]));
+    }
+
+    assert_that(cpt_varint_get(padded, sizeof(padded), &value), is_equal_to(3));
+    assert_that(value, is_equal_to(5));
+    assert_that(cpt_varint_get(too_long, sizeof(too_long), &value), is_equal_to(-1));
+    // a fifth byte above 0x0F would be truncated to 32 bits, 0x10 here to 0
+    assert_that(cpt_varint_get(too_wide, sizeof(too_wide), &value), is_equal_to(-1));
+    assert_that(cpt_varint_get(widest, sizeof(widest), &value), is_equal_to(5));
+    assert_that(value, is_equal_to(0xF0000000U));
+}
+
+Ensure(codec, switches_to_envelopes_after_negotiation)
+{
+    static uint8_t messages[64][MAX_RANDOM_MSG];
+    static struct collected out;
+    struct negotiation state;
+    struct cpt_response_decoder dec;
+    struct cpt_envelope env;
+    struct cpt_buffer stream;
+    struct CptResponse res[64];
+    uint8_t *dst;
+    uint32_t seed;
+    size_t size;
+    size_t offset;
+    size_t chunk;
+
+    seed = 0xBA7C4;
+    cpt_buffer_init(&stream, 1024 * 1024);
+    cpt_envelope_init(&env);
+
+    for (int i = 0; i < 64; i++)
+    {
+        res[i].code = (uint8_t) (1 + next_random(&seed) % SERVER_FULL);
+        res[i].channel_id = (uint16_t) next_random(&seed);
+        res[i].user_id = (uint16_t) next_random(&seed);
+        res[i].msg_len = (uint16_t) (next_random(&seed) % MAX_RANDOM_MSG);
+        random_bytes(&seed, messages[i], res[i].msg_len);
+        res[i].msg = messages[i];
+
+        if (i == 0)
+        {
+            size = cpt_response_size(&res[i]);
+            dst = cpt_buffer_reserve(&stream, size);
+            cpt_buffer_commit(&stream, cpt_serialize_response(&res[i], dst, size));
+        }
+        else
+        {
+            size = cpt_response_record_size(&res[i]);
+            dst = cpt_envelope_reserve(&env, &stream, size);
+            cpt_envelope_commit(&env, &stream, cpt_serialize_response_record(&res[i], dst, size));
+        }
+    }
+
+    cpt_envelope_seal(&env, &stream);
+    assert_that(cpt_response_decoder_init(&dec, 256 * 1024), is_equal_to(0));
+    state.out = &out;
+    state.dec = &dec;
+    out.count = 0;
+    offset = 0;
+
+    while (offset < cpt_buffer_length(&stream))
+    {
+        chunk = 1 + next_random(&seed) % 3000;
+        if (chunk > cpt_buffer_length(&stream) - offset)
+        {
+            chunk = cpt_buffer_length(&stream) - offset;
+        }
+        offset += cpt_response_decoder_feed(&dec, stream.data + stream.head + offset, chunk);
+        cpt_response_decoder_drain(&dec, collect_and_upgrade, &state);
+    }
+
+    assert_that(out.count, is_equal_to(64));
+    assert_that(dec.resyncs, is_equal_to(0));
+
+    for (int i = 0; i < 64; i++)
+    {
+        assert_that(out.responses[i].code, is_equal_to(res[i].code));
+        assert_that(out.responses[i].channel_id, is_equal_to(res[i].channel_id));
+        assert_that(out.responses[i].user_id, is_equal_to(res[i].user_id));
+        assert_that(out.responses[i].msg_len, is_equal_to(res[i].msg_len));
+        assert_that(memcmp(out.messages[i], messages[i], res[i].msg_len), is_equal_to(0));
+    }
+
+    cpt_response_decoder_destroy(&dec);
+    cpt_buffer_destroy(&stream);
+}
+
+Ensure(codec, round_trips_compressed_blocks)
+{
+    static uint8_t msg[MAX_RANDOM_MSG];
+    static uint8_t packed[2 * MAX_RANDOM_MSG];
+    struct cpt_compressor codec;
+    struct cpt_dictionary *dict;
+    const uint8_t *expanded;
+    uint32_t seed;
+    size_t msg_len;
+    size_t plain_size;
+    size_t size;
+
+    seed = 0xC0DEC;
+    assert_that(cpt_compressor_init(&codec), is_equal_to(0));
+    dict = cpt_dictionary_create();
+    assert_that(dict, is_not_null);
+
+    while (!cpt_dictionary_sample(dict, msg, log_lines(&seed, msg, sizeof(msg))))
+    {
+    }
+
+    assert_that(dict->id, is_equal_to(1));
+    assert_that(dict->size, is_equal_to(CPT_DICT_MAX));
+
+    for (int run = 0; run < 200; run++)
+    {
+        msg_len = run % 2 == 0 ? log_lines(&seed, msg, sizeof(msg)) : next_random(&seed) % MAX_RANDOM_MSG;
+
+        if (run % 2 != 0)
+        {
+            random_bytes(&seed, msg, msg_len);
+        }
+
+        plain_size = cpt_compress(&codec, NULL, 0, msg, msg_len, packed, sizeof(packed));
+        assert_that(plain_size, is_greater_than(0));
+        expanded = cpt_decompress(&codec, NULL, 0, packed, plain_size, msg_len);
+        assert_that(expanded, is_not_null);
+        assert_that(memcmp(expanded, msg, msg_len), is_equal_to(0));
+
+        size = cpt_compress(&codec, dict->data, dict->size, msg, msg_len, packed, sizeof(packed));
+        assert_that(size, is_greater_than(0));
+        assert_that(cpt_compress_dictionary(&codec, dict, msg, msg_len, packed + size, sizeof(packed) - size),
+                    is_equal_to(size));
+        assert_that(memcmp(packed, packed + size, size), is_equal_to(0));
+        expanded = cpt_decompress(&codec, dict->data, dict->size, packed, size, msg_len);
+        assert_that(expanded, is_not_null);
+        assert_that(memcmp(expanded, msg, msg_len), is_equal_to(0));
+
+        // a wrong length or a block cut short must be rejected, not over-read
+        assert_that(cpt_decompress(&codec, dict->data, dict->size, packed, size, msg_len + 1), is_null);
+        assert_that(cpt_compress(&codec, dict->data, dict->size, msg, msg_len, packed, size - 1), is_equal_to(0));
+
+        if (run % 2 == 0)
+        {
+            assert_that(size, is_less_than(plain_size));
+            assert_that(size * 3, is_less_than(msg_len));
+        }
+    }
+
+    cpt_dictionary_destroy(dict);
+    cpt_compressor_destroy(&codec);
+}
+
+Ensure(codec, expands_compressed_messages)
+{
+    static uint8_t messages[10][MAX_RANDOM_MSG];
+    static uint8_t packed[MAX_RANDOM_MSG + CPT_DICT_MAX + 2 * CPT_VARINT_MAX];
+    static struct collected out;
+    struct cpt_compressor codec;
+    struct cpt_dictionary *dict;
+    struct cpt_response_decoder dec;
+    struct cpt_envelope env;
+    struct cpt_buffer stream;
+    struct CptResponse res;
+    uint16_t msg_len[10];
+    uint8_t *dst;
+    uint32_t seed;
+    size_t header_size;
+    size_t size;
+
+    seed = 0xD1C7;
+    assert_that(cpt_compressor_init(&codec), is_equal_to(0));
+    dict = cpt_dictionary_create();
+    assert_that(dict, is_not_null);
+
+    while (!cpt_dictionary_sample(dict, messages[0], log_lines(&seed, messages[0], MAX_RANDOM_MSG)))
+    {
+    }
+
+    cpt_buffer_init(&stream, 1024 * 1024);
+    cpt_envelope_init(&env);
+    res.channel_id = 7;
+    res.user_id = 3;
+
+    // the dictionary, then messages against it, one against an unknown dictionary and one without any
+    for (int i = -1; i < 10; i++)
+    {
+        if (i < 0)
+        {
+            res.code = CHANNEL_DICTIONARY;
+            header_size = cpt_varint_put(dict->id, packed);
+            memcpy(packed + header_size, dict->data, dict->size);
+            res.msg_len = (uint16_t) (header_size + dict->size);
+        }
+        else
+        {
+            msg_len[i] = (uint16_t) log_lines(&seed, messages[i], MAX_RANDOM_MSG);
+            res.code = MESSAGE_COMPRESSED;
+            header_size = cpt_varint_put(i == 8 ? 0 : dict->id + (i == 9), packed);
+            header_size += cpt_varint_put(msg_len[i], packed + header_size);
+            size = cpt_compress(&codec, i == 8 ? NULL : dict->data, i == 8 ? 0 : dict->size, messages[i],
+                                msg_len[i], packed + header_size, sizeof(packed) - header_size);
+            res.msg_len = (uint16_t) (header_size + size);
+        }
+
+        res.msg = packed;
+        size = cpt_response_record_size(&res);
+        dst = cpt_envelope_reserve(&env, &stream, size);
+        cpt_envelope_commit(&env, &stream, cpt_serialize_response_record(&res, dst, size));
+    }
+
+    cpt_envelope_seal(&env, &stream);
+    assert_that(cpt_response_decoder_init(&dec, 256 * 1024), is_equal_to(0));
+    cpt_response_decoder_set_version(&dec, CPT_VERSION_COMPRESSED);
+    out.count = 0;
+    cpt_response_decoder_feed(&dec, stream.data + stream.head, cpt_buffer_length(&stream));
+    cpt_response_decoder_drain(&dec, collect_response, &out);
+
+    assert_that(out.count, is_equal_to(9));
+    assert_that(dec.resyncs, is_equal_to(1));
+
+    for (int i = 0; i < 9; i++)
+    {
+        assert_that(out.responses[i].code, is_equal_to(MESSAGE));
+        assert_that(out.responses[i].channel_id, is_equal_to(7));
+        assert_that(out.responses[i].msg_len, is_equal_to(msg_len[i]));
+        assert_that(memcmp(out.messages[i], messages[i], msg_len[i]), is_equal_to(0));
+    }
+
+    cpt_response_decoder_destroy(&dec);
+    cpt_buffer_destroy(&stream);
+    cpt_dictionary_destroy(dict);
+    cpt_compressor_destroy(&codec);
+}
+
+Ensure(codec, fills_sequence_gaps_and_drops_duplicates)
+{
+    // 3 and 4 are skipped, then resent along with 5, which the client already has
+    static const uint32_t seqs[] = {1, 2, 5, 3, 4, 5, 6};
+    static struct collected out;
+    struct cpt_response_decoder dec;
+    struct cpt_envelope env;
+    struct cpt_buffer stream;
+    struct CptResponse res;
+    uint8_t number[CPT_VARINT_MAX];
+    uint8_t *dst;
+    size_t size;
+
+    cpt_buffer_init(&stream, 4096);
+    cpt_envelope_init(&env);
+    assert_that(cpt_response_decoder_init(&dec, 4096), is_equal_to(0));
+    cpt_response_decoder_set_version(&dec, CPT_VERSION_SEQUENCED);
+    out.count = 0;
+    res.channel_id = 7;
+    res.user_id = 3;
+
+    for (size_t i = 0; i < sizeof(seqs) / sizeof(seqs[0]); i++)
+    {
+        res.code = MESSAGE_SEQUENCE;
+        res.msg = number;
+        res.msg_len = (uint16_t) cpt_varint_put(seqs[i], number);
+        size = cpt_response_record_size(&res);
+        dst = cpt_envelope_reserve(&env, &stream, size);
+        cpt_envelope_commit(&env, &stream, cpt_serialize_response_record(&res, dst, size));
+
+        res.code = MESSAGE;
+        res.msg = number;
+        size = cpt_response_record_size(&res);
+        dst = cpt_envelope_reserve(&env, &stream, size);
+        cpt_envelope_commit(&env, &stream, cpt_serialize_response_record(&res, dst, size));
+        cpt_envelope_seal(&env, &stream);
+
+        cpt_response_decoder_feed(&dec, stream.data + stream.head, cpt_buffer_length(&stream));
+        cpt_buffer_consume(&stream, cpt_buffer_length(&stream));
+        cpt_response_decoder_drain(&dec, collect_response, &out);
+
+        if (i == 2)
+        {
+            assert_that(dec.gaps, is_equal_to(2));
+            assert_that(cpt_response_decoder_resume_after(&dec, 7), is_equal_to(2));
+        }
+    }
+
+    assert_that(out.count, is_equal_to(6));
+    assert_that(dec.duplicates, is_equal_to(1));
+    assert_that(dec.resyncs, is_equal_to(0));
+    assert_that(dec.seq, is_equal_to(6));
+    assert_that(cpt_response_decoder_resume_after(&dec, 7), is_equal_to(6));
+    assert_that(cpt_response_decoder_resume_after(&dec, 8), is_equal_to(0));
+
+    for (size_t i = 0; i < out.count; i++)
+    {
+        assert_that(out.responses[i].code, is_equal_to(MESSAGE));
+    }
+
+    // a channel left and created again starts over
+    cpt_response_decoder_forget_channel(&dec, 7);
+    assert_that(cpt_response_decoder_resume_after(&dec, 7), is_equal_to(0));
+
+    cpt_response_decoder_destroy(&dec);
+    cpt_buffer_destroy(&stream);
+}
+
+Ensure(codec, resynchronizes_after_garbage)
+{
+    uint8_t stream[2 * (CPT_RESPONSE_HEADER_SIZE + 5) + 3];
+    uint8_t hello[] = "hello";
+    static struct collected out;
+    struct cpt_response_decoder dec;
+    struct CptResponse res;
+    size_t length;
+
+    res.code = MESSAGE;
+    res.channel_id = 1;
+    res.user_id = 2;
+    res.msg_len = 5;
+    res.msg = hello;
+
+    length = cpt_serialize_response(&res, stream, sizeof(stream));
+    stream[length++] = 0;
+    stream[length++] = 0xEE;
+    stream[length++] = 0xEE;
+    length += cpt_serialize_response(&res, stream + length, sizeof(stream) - length);
+
+    assert_that(cpt_response_decoder_init(&dec, 1024), is_equal_to(0));
+    out.count = 0;
+    cpt_response_decoder_feed(&dec, stream, length);
+    cpt_response_decoder_drain(&dec, collect_response, &out);
+
+    assert_that(out.count, is_equal_to(2));
+    assert_that(dec.resyncs, is_equal_to(3));
+    cpt_response_decoder_destroy(&dec);
+}
+
+TestSuite *codec_tests(void)
+{
+    TestSuite *suite;
+
+    suite = create_test_suite();
+    add_test_with_context(suite, codec, round_trips_u16_values);
+    add_test_with_context(suite, codec, round_trips_random_requests);
+    add_test_with_context(suite, codec, round_trips_random_responses);
+    add_test_with_context(suite, codec, rejects_every_truncated_request);
+    add_test_with_context(suite, codec, rejects_every_truncated_response);
+    add_test_with_context(suite, codec, serializers_never_write_past_the_buffer);
+    add_test_with_context(suite, codec, decodes_responses_across_any_segmentation);
+    add_test_with_context(suite, codec, rejects_decoder_capacities_that_are_not_powers_of_two);
+    add_test_with_context(suite, codec, resynchronizes_after_garbage);
+    add_test_with_context(suite, codec, round_trips_varints);
+    add_test_with_context(suite, codec, switches_to_envelopes_after_negotiation);
+    add_test_with_context(suite, codec, round_trips_compressed_blocks);
+    add_test_with_context(suite, codec, expands_compressed_messages);
+    add_test_with_context(suite, codec, fills_sequence_gaps_and_drops_duplicates);
+
+    return suite;
+}
@@ -0,0 +1,86 @@
+// sched_getaffinity() is a Linux extension
+#define _GNU_SOURCE
+
+#include "cpt_cpu.h"
+#include "tests.h"
+#include <sched.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+Describe(cpu);
+
+BeforeEach(cpu)
+{
+}
+
+AfterEach(cpu)
+{
+}
+
+Ensure(cpu, parses_lists_and_ranges)
+{
+    int cpus[8];
+
+    assert_that(cpt_cpu_parse("3", cpus, 8), is_equal_to(1));
+    assert_that(cpus[0], is_equal_to(3));
+    assert_that(cpt_cpu_parse("0,2-4,7", cpus, 8), is_equal_to(5));
+    assert_that(cpus[1], is_equal_to(2));
+    assert_that(cpus[3], is_equal_to(4));
+    assert_that(cpus[4], is_equal_to(7));
+    assert_that(cpt_cpu_parse("0-8", cpus, 8), is_equal_to(-1));
+    assert_that(cpt_cpu_parse("4-2", cpus, 8), is_equal_to(-1));
+    assert_that(cpt_cpu_parse("1,x", cpus, 8), is_equal_to(-1));
+}
+
+Ensure(cpu, pins_to_an_allowed_cpu)
+{
+    cpu_set_t allowed;
+    cpu_set_t pinned;
+    size_t cpu;
+
+    assert_that(sched_getaffinity(0, sizeof(allowed), &allowed), is_equal_to(0));
+
+    for (cpu = 0; !CPU_ISSET(cpu, &allowed); cpu++)
+    {
+    }
+
+    assert_that(cpt_cpu_pin((int) cpu), is_equal_to(0));
+    assert_that(sched_getaffinity(0, sizeof(pinned), &pinned), is_equal_to(0));
+    assert_that(CPU_COUNT(&pinned), is_equal_to(1));
+    assert_that(CPU_ISSET(cpu, &pinned), is_not_equal_to(0));
+
+    // the rest of the suite runs where it did before
+    sched_setaffinity(0, sizeof(allowed), &allowed);
+}
+
+Ensure(cpu, spins_before_it_sleeps)
+{
+    struct pollfd fds[1];
+    int sv[2];
+
+    assert_that(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), is_equal_to(0));
+    fds[0].fd = sv[0];
+    fds[0].events = POLLIN;
+
+    // nothing arrives, the spin and the sleep together keep to the timeout
+    assert_that(cpt_cpu_poll(fds, 1, 2, 500), is_equal_to(0));
+
+    assert_that(write(sv[1], "x", 1), is_equal_to(1));
+    assert_that(cpt_cpu_poll(fds, 1, -1, 500), is_equal_to(1));
+    assert_that(fds[0].revents & POLLIN, is_not_equal_to(0));
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+TestSuite *cpu_tests(void)
+{
+    TestSuite *suite;
+
+    suite = create_test_suite();
+    add_test_with_context(suite, cpu, parses_lists_and_ranges);
+    add_test_with_context(suite, cpu, pins_to_an_allowed_cpu);
+    add_test_with_context(suite, cpu, spins_before_it_sleeps);
+
+    return suite;
+}
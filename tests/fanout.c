@@ -0,0 +1,274 @@
+// sched_getaffinity() is a Linux extension
+#define _GNU_SOURCE
+
+#include "common.h"
+#include "cpt_client.h"
+#include "cpt_cpu.h"
+#include "cpt_fanout.h"
+#include "cpt_server.h"
+#include "cpt_snapshot.h"
+#include "tests.h"
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define LANES 4
+#define THRESHOLD 8
+#define MEMBERS 40
+#define RUNS 1000
+
+static struct serverInfo *info;
+static struct member members[MEMBERS];
+
+static void count_lane(void *arg, int lane);
+static void count_message(void *arg, const struct CptResponse *res);
+
+static void count_lane(void *arg, int lane)
+{
+    int *counts;
+
+    counts = arg;
+    counts[lane]++;
+}
+
+static void count_message(void *arg, const struct CptResponse *res)
+{
+    int *count;
+
+    count = arg;
+
+    if (res->code == MESSAGE)
+    {
+        (*count)++;
+    }
+}
+
+Describe(fanout);
+
+BeforeEach(fanout)
+{
+    char name[16];
+
+    info = cpt_server_create();
+    info->fanout = cpt_fanout_create(LANES, THRESHOLD, NULL, 0);
+
+    for (int i = 0; i < MEMBERS; i++)
+    {
+        snprintf(name, sizeof(name), "m%d", i);
+        connect_member(info, &members[i], name, CPT_SERVER_VERSION);
+    }
+
+    cpt_server_flush_dirty(info);
+}
+
+AfterEach(fanout)
+{
+    struct cpt_fanout *fanout;
+
+    for (int i = 0; i < MEMBERS; i++)
+    {
+        drop_member(info, &members[i]);
+    }
+
+    fanout = info->fanout;
+    cpt_server_destroy(info);
+    cpt_fanout_destroy(fanout);
+}
+
+Ensure(fanout, runs_every_lane_once_per_run)
+{
+    int counts[LANES];
+
+    memset(counts, 0, sizeof(counts));
+
+    for (int run = 0; run < RUNS; run++)
+    {
+        cpt_fanout_run(info->fanout, count_lane, counts);
+    }
+
+    for (int lane = 0; lane < LANES; lane++)
+    {
+        assert_that(counts[lane], is_equal_to(RUNS));
+    }
+}
+
+Ensure(fanout, delivers_one_copy_to_every_member)
+{
+    struct cpt_response_decoder dec;
+    uint8_t msg[] = "to everyone";
+    int dirty;
+    int got;
+
+    assert_that(info->global.snapshot, is_null);
+    assert_that(cpt_broadcast(info, &info->global, 1, msg, (uint16_t) strlen((char *) msg)), is_equal_to(MEMBERS));
+    assert_that(info->global.snapshot->lanes, is_equal_to(LANES));
+    assert_that(info->global.snapshot->count, is_equal_to(MEMBERS));
+    assert_that(info->global.snapshot->starts[LANES], is_equal_to(MEMBERS));
+
+    // every lane's dirty members are linked into the registry's list exactly once
+    dirty = 0;
+
+    for (user *client = info->dirty; client != NULL; client = client->next)
+    {
+        dirty++;
+    }
+
+    assert_that(dirty, is_equal_to(MEMBERS));
+    cpt_server_flush_dirty(info);
+
+    for (int i = 0; i < MEMBERS; i++)
+    {
+        cpt_response_decoder_init(&dec, CPT_RESPONSE_DECODER_CAPACITY);
+        got = 0;
+        cpt_response_decoder_read(&dec, members[i].peer_fd);
+        cpt_response_decoder_drain(&dec, count_message, &got);
+        assert_that(got, is_equal_to(1));
+        cpt_response_decoder_destroy(&dec);
+    }
+}
+
+Ensure(fanout, keeps_lanes_in_step_with_members)
+{
+    uint8_t msg[] = "split";
+    const struct cpt_snapshot *snapshot;
+    uint64_t version;
+
+    cpt_broadcast(info, &info->global, 1, msg, (uint16_t) strlen((char *) msg));
+    version = info->global.snapshot->version;
+
+    for (int i = 0; i < MEMBERS - THRESHOLD / 2; i++)
+    {
+        cpt_server_disconnect(info, members[i].client);
+        snapshot = info->global.snapshot;
+
+        // every leave publishes a new version and the old one is freed at once, no lane is running
+        assert_that(snapshot->version, is_equal_to(++version));
+        assert_that(snapshot->count, is_equal_to(info->global.users->userCount));
+        assert_that(info->retired, is_null);
+
+        for (int lane = 0; lane < LANES; lane++)
+        {
+            for (size_t m = snapshot->starts[lane]; m < snapshot->starts[lane + 1]; m++)
+            {
+                assert_that(cpt_fanout_lane(info->fanout, snapshot->members[m]->user_id), is_equal_to(lane));
+            }
+        }
+    }
+
+    // below the threshold but not yet half of it, still delivered by the lanes
+    assert_that(cpt_broadcast(info, &info->global, 1, msg, (uint16_t) strlen((char *) msg)),
+                is_equal_to(THRESHOLD / 2));
+
+    // shrank below half the threshold, back to one list
+    cpt_server_disconnect(info, members[MEMBERS - THRESHOLD / 2].client);
+    assert_that(info->global.snapshot, is_null);
+    assert_that(cpt_broadcast(info, &info->global, 1, msg, (uint16_t) strlen((char *) msg)),
+                is_equal_to(THRESHOLD / 2 - 1));
+}
+
+Ensure(fanout, frees_a_retired_snapshot_once_every_lane_moved_on)
+{
+    struct cpt_snapshot *retired;
+    int counts[LANES];
+
+    retired = NULL;
+    cpt_snapshot_retire(&retired, cpt_snapshot_create(1, LANES, MEMBERS), 5);
+    cpt_snapshot_retire(&retired, cpt_snapshot_create(2, LANES, MEMBERS), 7);
+
+    // a lane may still be in generation 5 or 7
+    assert_that(cpt_snapshot_reclaim(&retired, 4), is_equal_to(0));
+    assert_that(cpt_snapshot_reclaim(&retired, 6), is_equal_to(1));
+    assert_that(retired->version, is_equal_to(2));
+    assert_that(cpt_snapshot_reclaim(&retired, 7), is_equal_to(1));
+    assert_that(retired, is_null);
+
+    memset(counts, 0, sizeof(counts));
+
+    for (int run = 0; run < RUNS; run++)
+    {
+        cpt_fanout_run(info->fanout, count_lane, counts);
+    }
+
+    assert_that(cpt_fanout_quiescent(info->fanout), is_equal_to(RUNS));
+}
+
+Ensure(fanout, moves_output_to_the_pool_of_its_lane)
+{
+    struct cpt_response_decoder dec;
+    struct cpt_pool *pool;
+    unsigned long mask[CPT_CPU_MAX_NODES / (sizeof(unsigned long) * 8)];
+    cpu_set_t allowed;
+    uint8_t msg[1000];
+    int cpu;
+    int mode;
+    int got;
+
+    assert_that(sched_getaffinity(0, sizeof(allowed), &allowed), is_equal_to(0));
+
+    for (cpu = 0; !CPU_ISSET((size_t) cpu, &allowed); cpu++)
+    {
+    }
+
+    // the unpinned fan-out has no pools and nothing in it to move
+    assert_that(info->fanout->pools[0], is_null);
+    cpt_fanout_destroy(info->fanout);
+    assert_that(cpt_cpu_pin(cpu), is_equal_to(0));
+    info->fanout = cpt_fanout_create(LANES, THRESHOLD, &cpu, 1);
+
+    for (int lane = 0; lane < LANES; lane++)
+    {
+        assert_that(info->fanout->pools[lane], is_not_null);
+        assert_that(info->fanout->pools[lane]->node, is_equal_to(cpt_cpu_node()));
+    }
+
+    memset(msg, 'p', sizeof(msg));
+
+    // the first one moves the members' output, the next two grow it from the pool
+    for (int sent = 0; sent < 3; sent++)
+    {
+        assert_that(cpt_broadcast(info, &info->global, 1, msg, sizeof(msg)), is_equal_to(MEMBERS));
+    }
+
+    for (int i = 0; i < MEMBERS; i++)
+    {
+        pool = info->fanout->pools[cpt_fanout_lane(info->fanout, members[i].client->user_id)];
+        assert_that(members[i].client->out.pool, is_equal_to(&pool->buffers));
+
+        // the page under the output was bound to the node before anything touched it
+        assert_that(syscall(SYS_get_mempolicy, &mode, mask, (unsigned long) CPT_CPU_MAX_NODES + 1,
+                            members[i].client->out.data, MPOL_F_ADDR), is_equal_to(0));
+        assert_that(mode, is_equal_to(MPOL_PREFERRED));
+    }
+
+    cpt_server_flush_dirty(info);
+
+    for (int i = 0; i < MEMBERS; i++)
+    {
+        cpt_response_decoder_init(&dec, CPT_RESPONSE_DECODER_CAPACITY);
+        got = 0;
+        cpt_response_decoder_read(&dec, members[i].peer_fd);
+        cpt_response_decoder_drain(&dec, count_message, &got);
+        assert_that(got, is_equal_to(3));
+        cpt_response_decoder_destroy(&dec);
+    }
+
+    // the rest of the suite runs where it did before
+    sched_setaffinity(0, sizeof(allowed), &allowed);
+}
+
+TestSuite *fanout_tests(void)
+{
+    TestSuite *suite;
+
+    suite = create_test_suite();
+    add_test_with_context(suite, fanout, runs_every_lane_once_per_run);
+    add_test_with_context(suite, fanout, delivers_one_copy_to_every_member);
+    add_test_with_context(suite, fanout, keeps_lanes_in_step_with_members);
+    add_test_with_context(suite, fanout, frees_a_retired_snapshot_once_every_lane_moved_on);
+    add_test_with_context(suite, fanout, moves_output_to_the_pool_of_its_lane);
+
+    return suite;
+}
@@ -0,0 +1,44 @@
+#include "common.h"
+#include "cpt_server.h"
+#include "tests.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+void connect_member(struct serverInfo *info, struct member *m, const char *name, uint8_t version)
+{
+    struct CptRequest req;
+    char login[CPT_NAME_MAX + 1];
+    int sv[2];
+
+    assert_that(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), is_equal_to(0));
+    m->client = create_user(sv[0], 0);
+    m->peer_fd = sv[1];
+    snprintf(login, sizeof(login), "%s", name);
+    req.version = version;
+    req.command = LOGIN;
+    req.channel_id = GLOBAL_CHANNEL;
+    req.msg = login;
+    req.msg_len = (uint16_t) strlen(login);
+    assert_that(cpt_handle_request(info, m->client, &req), is_equal_to(SUCCESS));
+}
+
+void throttle_member(struct member *m)
+{
+    int sndbuf;
+
+    sndbuf = 8192;
+    setsockopt(m->client->user_fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    fcntl(m->client->user_fd, F_SETFL, O_NONBLOCK);
+    fcntl(m->peer_fd, F_SETFL, O_NONBLOCK);
+}
+
+void drop_member(struct serverInfo *info, struct member *m)
+{
+    cpt_server_disconnect(info, m->client);
+    close(m->client->user_fd);
+    close(m->peer_fd);
+    destroy_user(m->client);
+}
@@ -0,0 +1,223 @@
+#include "common.h"
+#include "cpt_client.h"
+#include "cpt_history.h"
+#include "cpt_server.h"
+#include "tests.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CAPACITY 256
+#define MESSAGES 5
+
+struct kept
+{
+    uint32_t seqs[64];
+    size_t count;
+};
+
+struct received
+{
+    struct cpt_response_decoder *dec;
+    uint32_t seqs[16];
+    int messages;
+    int code;
+    uint32_t missing;
+};
+
+static struct serverInfo *info;
+static struct member sequenced;
+static struct member plain;
+static uint8_t scratch[UINT16_MAX];
+
+static void keep_seq(void *arg, uint32_t seq, uint16_t user_id, uint8_t *msg, uint16_t msg_len);
+static void receive(void *arg, const struct CptResponse *res);
+static int resume(struct member *m, uint32_t after);
+static void read_responses(struct member *m, struct received *got);
+
+static void keep_seq(void *arg, uint32_t seq, uint16_t user_id, uint8_t *msg, uint16_t msg_len)
+{
+    struct kept *kept;
+
+    kept = arg;
+    assert_that(user_id, is_equal_to(3));
+    assert_that(msg_len, is_equal_to(16 + seq % 16));
+    assert_that(msg[0], is_equal_to((uint8_t) seq));
+    kept->seqs[kept->count++] = seq;
+}
+
+static void receive(void *arg, const struct CptResponse *res)
+{
+    struct received *got;
+
+    got = arg;
+
+    if (res->code == MESSAGE)
+    {
+        got->seqs[got->messages++] = got->dec->seq;
+        return;
+    }
+
+    got->code = res->code;
+
+    if (res->msg_len > 0)
+    {
+        cpt_varint_get(res->msg, res->msg_len, &got->missing);
+    }
+}
+
+static int resume(struct member *m, uint32_t after)
+{
+    struct CptRequest req;
+    uint8_t number[CPT_VARINT_MAX];
+
+    // after the negotiating LOGIN every request arrives as a version 2 record
+    req.version = m->client->version >= CPT_VERSION_BATCHED ? CPT_VERSION_BATCHED : CPT_SERVER_VERSION;
+    req.command = RESUME;
+    req.channel_id = GLOBAL_CHANNEL;
+    req.msg = (char *) number;
+    req.msg_len = (uint16_t) cpt_varint_put(after, number);
+
+    return cpt_handle_request(info, m->client, &req);
+}
+
+static void read_responses(struct member *m, struct received *got)
+{
+    cpt_server_flush_dirty(info);
+    got->messages = 0;
+    got->code = -1;
+    got->missing = UINT32_MAX;
+    cpt_response_decoder_read(got->dec, m->peer_fd);
+    cpt_response_decoder_drain(got->dec, receive, got);
+}
+
+Describe(history);
+
+BeforeEach(history)
+{
+    info = cpt_server_create();
+    connect_member(info, &sequenced, "seq", CPT_VERSION_SEQUENCED);
+    connect_member(info, &plain, "plain", CPT_SERVER_VERSION);
+    cpt_server_flush_dirty(info);
+}
+
+AfterEach(history)
+{
+    drop_member(info, &sequenced);
+    drop_member(info, &plain);
+    cpt_server_destroy(info);
+}
+
+Ensure(history, keeps_the_newest_messages)
+{
+    struct cpt_history history;
+    struct kept kept;
+    uint8_t msg[32];
+
+    memset(&history, 0, sizeof(history));
+
+    for (uint32_t seq = 1; seq <= 40; seq++)
+    {
+        memset(msg, (uint8_t) seq, sizeof(msg));
+        assert_that(cpt_history_push(&history, CAPACITY, seq, 3, msg, (uint16_t) (16 + seq % 16)), is_equal_to(0));
+    }
+
+    // only the tail fits, without holes and ending with the newest
+    kept.count = 0;
+    cpt_history_replay(&history, 0, scratch, keep_seq, &kept);
+    assert_that(kept.count, is_greater_than(3));
+    assert_that(kept.count, is_less_than(CAPACITY / 24));
+
+    for (size_t i = 0; i < kept.count; i++)
+    {
+        assert_that(kept.seqs[i], is_equal_to(40 - kept.count + 1 + i));
+    }
+
+    kept.count = 0;
+    assert_that(cpt_history_replay(&history, 38, scratch, keep_seq, &kept), is_equal_to(2));
+    assert_that(kept.seqs[0], is_equal_to(39));
+    assert_that(kept.seqs[1], is_equal_to(40));
+
+    // a message larger than the whole ring empties it
+    assert_that(cpt_history_push(&history, CAPACITY, 41, 3, scratch, CAPACITY), is_equal_to(-1));
+    assert_that(cpt_history_replay(&history, 0, scratch, keep_seq, &kept), is_equal_to(0));
+    cpt_history_destroy(&history);
+}
+
+Ensure(history, numbers_messages_and_resends_them_on_resume)
+{
+    struct cpt_response_decoder dec;
+    struct received got;
+    uint8_t msg[] = "numbered";
+
+    cpt_response_decoder_init(&dec, CPT_RESPONSE_DECODER_CAPACITY);
+    cpt_response_decoder_set_version(&dec, CPT_VERSION_SEQUENCED);
+    got.dec = &dec;
+    // the LOGIN reply
+    read_responses(&sequenced, &got);
+
+    for (int i = 0; i < MESSAGES; i++)
+    {
+        cpt_broadcast(info, &info->global, 3, msg, (uint16_t) strlen((char *) msg));
+    }
+
+    read_responses(&sequenced, &got);
+    assert_that(got.messages, is_equal_to(MESSAGES));
+
+    for (int i = 0; i < MESSAGES; i++)
+    {
+        assert_that(got.seqs[i], is_equal_to(i + 1));
+    }
+
+    assert_that(cpt_response_decoder_resume_after(&dec, GLOBAL_CHANNEL), is_equal_to(MESSAGES));
+    assert_that(dec.gaps, is_equal_to(0));
+
+    // everything after 2 comes again, the decoder knows it has it already
+    assert_that(resume(&sequenced, 2), is_equal_to(SUCCESS));
+    read_responses(&sequenced, &got);
+    assert_that(got.messages, is_equal_to(0));
+    assert_that(dec.duplicates, is_equal_to(MESSAGES - 2));
+    assert_that(got.code, is_equal_to(SUCCESS));
+    assert_that(got.missing, is_equal_to(0));
+
+    // without history the reply only counts what is gone
+    cpt_history_destroy(&info->global.history);
+    assert_that(resume(&sequenced, 1), is_equal_to(SUCCESS));
+    read_responses(&sequenced, &got);
+    assert_that(got.messages, is_equal_to(0));
+    assert_that(got.missing, is_equal_to(MESSAGES - 1));
+
+    // a number the channel never handed out
+    assert_that(resume(&sequenced, MESSAGES + 1), is_equal_to(INVALID_ID));
+    cpt_response_decoder_destroy(&dec);
+}
+
+Ensure(history, only_resumes_for_version_4)
+{
+    uint8_t msg[] = "plain";
+    struct cpt_response_decoder dec;
+    struct received got;
+
+    cpt_broadcast(info, &info->global, 3, msg, (uint16_t) strlen((char *) msg));
+    assert_that(resume(&plain, 0), is_equal_to(BAD_VERSION));
+
+    // version 1 members see the same MESSAGE without a number in front
+    cpt_response_decoder_init(&dec, CPT_RESPONSE_DECODER_CAPACITY);
+    got.dec = &dec;
+    read_responses(&plain, &got);
+    assert_that(got.messages, is_equal_to(1));
+    assert_that(dec.seq_count, is_equal_to(0));
+    cpt_response_decoder_destroy(&dec);
+}
+
+TestSuite *history_tests(void)
+{
+    TestSuite *suite;
+
+    suite = create_test_suite();
+    add_test_with_context(suite, history, keeps_the_newest_messages);
+    add_test_with_context(suite, history, numbers_messages_and_resends_them_on_resume);
+    add_test_with_context(suite, history, only_resumes_for_version_4);
+
+    return suite;
+}
@@ -0,0 +1,146 @@
+#include "common.h"
+#include "cpt_limit.h"
+#include "cpt_server.h"
+#include "tests.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// a fixed clock far from zero, in microseconds
+#define START ((uint64_t) 1000000 * 1000000)
+
+static struct serverInfo *info;
+
+static int send_to(struct member *m, uint16_t channel_id);
+
+static int send_to(struct member *m, uint16_t channel_id)
+{
+    struct CptRequest req;
+    char msg[] = "hello";
+
+    req.version = CPT_SERVER_VERSION;
+    req.command = SEND;
+    req.channel_id = channel_id;
+    req.msg = msg;
+    req.msg_len = (uint16_t) strlen(msg);
+
+    return cpt_handle_request(info, m->client, &req);
+}
+
+Describe(limit);
+
+BeforeEach(limit)
+{
+    info = cpt_server_create();
+    info->now = START;
+}
+
+AfterEach(limit)
+{
+    cpt_server_destroy(info);
+}
+
+Ensure(limit, refills_at_the_configured_rate)
+{
+    struct cpt_rate rate;
+    struct cpt_bucket bucket;
+    uint64_t now;
+
+    cpt_rate_init(&rate, 10, 3);
+    memset(&bucket, 0, sizeof(bucket));
+    now = START;
+
+    // a fresh bucket is full
+    for (int i = 0; i < 3; i++)
+    {
+        assert_that(cpt_bucket_ready(&rate, &bucket, now), is_equal_to(1));
+        cpt_bucket_spend(&rate, &bucket, now);
+    }
+
+    assert_that(cpt_bucket_ready(&rate, &bucket, now), is_equal_to(0));
+    assert_that(cpt_bucket_ready(&rate, &bucket, now + 99999), is_equal_to(0));
+    assert_that(cpt_bucket_ready(&rate, &bucket, now + 100000), is_equal_to(1));
+
+    // refilling never goes past the burst
+    now += (uint64_t) 10 * 1000000;
+
+    for (int i = 0; i < 3; i++)
+    {
+        cpt_bucket_spend(&rate, &bucket, now);
+    }
+
+    assert_that(cpt_bucket_ready(&rate, &bucket, now), is_equal_to(0));
+}
+
+Ensure(limit, leaves_an_unset_rate_unlimited)
+{
+    struct cpt_rate rate;
+    struct cpt_bucket bucket;
+
+    cpt_rate_init(&rate, 0, 0);
+    memset(&bucket, 0, sizeof(bucket));
+
+    for (int i = 0; i < 1000; i++)
+    {
+        cpt_bucket_spend(&rate, &bucket, START);
+    }
+
+    assert_that(cpt_bucket_ready(&rate, &bucket, START), is_equal_to(1));
+}
+
+Ensure(limit, rejects_sends_over_the_user_limit)
+{
+    struct member a;
+    struct member b;
+
+    cpt_rate_init(&info->user_rate, 2, 2);
+    connect_member(info, &a, "a", CPT_SERVER_VERSION);
+    connect_member(info, &b, "b", CPT_SERVER_VERSION);
+
+    assert_that(send_to(&a, GLOBAL_CHANNEL), is_equal_to(SUCCESS));
+    assert_that(send_to(&a, GLOBAL_CHANNEL), is_equal_to(SUCCESS));
+    assert_that(send_to(&a, GLOBAL_CHANNEL), is_equal_to(MSG_OVERFLOW));
+
+    // the other user has a bucket of their own
+    assert_that(send_to(&b, GLOBAL_CHANNEL), is_equal_to(SUCCESS));
+
+    info->now += 500000;
+    assert_that(send_to(&a, GLOBAL_CHANNEL), is_equal_to(SUCCESS));
+    assert_that(send_to(&a, GLOBAL_CHANNEL), is_equal_to(MSG_OVERFLOW));
+
+    drop_member(info, &a);
+    drop_member(info, &b);
+}
+
+Ensure(limit, rejects_sends_over_the_channel_limit)
+{
+    struct member a;
+    struct member b;
+
+    cpt_rate_init(&info->user_rate, 1, 1);
+    cpt_rate_init(&info->channel_rate, 2, 1);
+    connect_member(info, &a, "a", CPT_SERVER_VERSION);
+    connect_member(info, &b, "b", CPT_SERVER_VERSION);
+
+    assert_that(send_to(&a, GLOBAL_CHANNEL), is_equal_to(SUCCESS));
+    assert_that(send_to(&b, GLOBAL_CHANNEL), is_equal_to(MSG_OVERFLOW));
+
+    // the channel refills first, and the rejected SEND did not use up b's own token
+    info->now += 500000;
+    assert_that(send_to(&b, GLOBAL_CHANNEL), is_equal_to(SUCCESS));
+
+    drop_member(info, &a);
+    drop_member(info, &b);
+}
+
+TestSuite *limit_tests(void)
+{
+    TestSuite *suite;
+
+    suite = create_test_suite();
+    add_test_with_context(suite, limit, refills_at_the_configured_rate);
+    add_test_with_context(suite, limit, leaves_an_unset_rate_unlimited);
+    add_test_with_context(suite, limit, rejects_sends_over_the_user_limit);
+    add_test_with_context(suite, limit, rejects_sends_over_the_channel_limit);
+
+    return suite;
+}
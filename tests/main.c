@@ -9,6 +9,21 @@ int main(int argc, char **argv)
 
     suite    = create_test_suite();
     reporter = create_text_reporter();
+    add_suite(suite, codec_tests());
+    add_suite(suite, transport_tests());
+    add_suite(suite, mesh_tests());
+    add_suite(suite, fanout_tests());
+    add_suite(suite, limit_tests());
+    add_suite(suite, presence_tests());
+    add_suite(suite, offline_tests());
+    add_suite(suite, stats_tests());
+    add_suite(suite, cpu_tests());
+    add_suite(suite, arena_tests());
+    add_suite(suite, capture_tests());
+    add_suite(suite, history_tests());
+    add_suite(suite, priority_tests());
+    add_suite(suite, memory_tests());
+    add_suite(suite, admin_tests());
 
     if(argc > 1)
     {
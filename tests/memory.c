@@ -0,0 +1,123 @@
+#include "common.h"
+#include "cpt_server.h"
+#include "tests.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MESSAGES 100
+#define MSG_SIZE 1000
+
+static struct serverInfo *info;
+static struct member slow;
+static struct member fast;
+
+static void drain_peer(const struct member *m);
+static void flood(void);
+
+static void drain_peer(const struct member *m)
+{
+    uint8_t buf[4096];
+
+    while (read(m->peer_fd, buf, sizeof(buf)) > 0)
+    {
+    }
+}
+
+static void flood(void)
+{
+    static uint8_t msg[MSG_SIZE];
+
+    memset(msg, 'm', sizeof(msg));
+
+    for (int i = 0; i < MESSAGES; i++)
+    {
+        cpt_broadcast(info, &info->global, 1, msg, sizeof(msg));
+        cpt_server_flush_dirty(info);
+        drain_peer(&fast);
+    }
+}
+
+Describe(memory);
+
+BeforeEach(memory)
+{
+    info = cpt_server_create();
+    // the slow member's output piles up behind a small socket buffer it never reads
+    connect_member(info, &slow, "slow", CPT_SERVER_VERSION);
+    throttle_member(&slow);
+    connect_member(info, &fast, "fast", CPT_SERVER_VERSION);
+    throttle_member(&fast);
+    cpt_server_flush_dirty(info);
+    drain_peer(&slow);
+    drain_peer(&fast);
+}
+
+AfterEach(memory)
+{
+    drop_member(info, &slow);
+    drop_member(info, &fast);
+    cpt_server_destroy(info);
+}
+
+Ensure(memory, charges_every_buffer_to_its_owner)
+{
+    assert_that(fast.client->charged, is_greater_than(CPT_INPUT_CAPACITY));
+    flood();
+
+    assert_that(slow.client->charged, is_greater_than(slow.client->out.capacity + CPT_INPUT_CAPACITY - 1));
+    assert_that(slow.client->charged, is_greater_than(fast.client->charged));
+    assert_that(info->global.charged, is_greater_than(info->history_capacity - 1));
+    assert_that(info->memory_used,
+                is_equal_to(slow.client->charged + fast.client->charged + info->global.charged));
+    assert_that(info->memory_peak, is_equal_to(info->memory_used));
+
+    // a disconnect gives the whole share back
+    cpt_server_disconnect(info, slow.client);
+    assert_that(slow.client->charged, is_equal_to(0));
+    assert_that(info->memory_used, is_equal_to(fast.client->charged + info->global.charged));
+}
+
+Ensure(memory, drops_cached_frames_before_clients)
+{
+    flood();
+    info->memory_budget = info->memory_used - 1;
+    cpt_server_shed(info);
+
+    assert_that(info->global.history.ring.data, is_null);
+    assert_that(info->shed_bytes, is_greater_than(info->history_capacity - 1));
+    assert_that(info->memory_used, is_less_than(info->memory_budget + 1));
+    assert_that(info->shed_clients, is_equal_to(0));
+    assert_that(slow.client->closing, is_equal_to(0));
+    assert_that(fast.client->closing, is_equal_to(0));
+}
+
+Ensure(memory, disconnects_the_largest_consumer)
+{
+    flood();
+    // more than the history and the fast member's spare output can make up for
+    info->memory_budget = info->memory_used - slow.client->charged / 2;
+    cpt_server_shed(info);
+
+    assert_that(slow.client->closing, is_equal_to(1));
+    assert_that(fast.client->closing, is_equal_to(0));
+    assert_that(info->shed_clients, is_equal_to(1));
+
+    // until it is gone the server is still over budget, so it is not parked either
+    info->offline_ttl = 1000000;
+    assert_that(cpt_server_park(info, slow.client), is_equal_to(-1));
+    cpt_server_disconnect(info, slow.client);
+    assert_that(info->memory_used, is_less_than(info->memory_budget + 1));
+}
+
+TestSuite *memory_tests(void)
+{
+    TestSuite *suite;
+
+    suite = create_test_suite();
+    add_test_with_context(suite, memory, charges_every_buffer_to_its_owner);
+    add_test_with_context(suite, memory, drops_cached_frames_before_clients);
+    add_test_with_context(suite, memory, disconnects_the_largest_consumer);
+
+    return suite;
+}
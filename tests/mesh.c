@@ -0,0 +1,225 @@
+#include "common.h"
+#include "cpt_client.h"
+#include "cpt_mesh.h"
+#include "cpt_server.h"
+#include "tests.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define NODES 2
+#define PUMP_ROUNDS 4
+
+struct node
+{
+    struct serverInfo *info;
+    struct cpt_mesh *mesh;
+    struct pollfd fds[CPT_MESH_MAX_NODES + 1];
+};
+
+static char paths[NODES][64];
+static const char *path_list[NODES];
+static struct node nodes[NODES];
+
+static void pump(void);
+static int request(struct member *m, struct node *n, uint8_t command, uint16_t channel_id, char *msg);
+static void count_message(void *arg, const struct CptResponse *res);
+
+/**
+ * A few poll rounds on every node, enough for a record to cross a link.
+ */
+static void pump(void)
+{
+    for (int round = 0; round < PUMP_ROUNDS; round++)
+    {
+        for (int i = 0; i < NODES; i++)
+        {
+            cpt_mesh_poll_set(nodes[i].mesh, nodes[i].fds);
+            poll(nodes[i].fds, CPT_MESH_MAX_NODES + 1, 10);
+            cpt_mesh_handle(nodes[i].mesh, nodes[i].fds);
+            cpt_server_flush_dirty(nodes[i].info);
+            cpt_mesh_flush(nodes[i].mesh);
+        }
+    }
+}
+
+static int request(struct member *m, struct node *n, uint8_t command, uint16_t channel_id, char *msg)
+{
+    struct CptRequest req;
+    static char empty[1];
+
+    req.version = CPT_SERVER_VERSION;
+    req.command = command;
+    req.channel_id = channel_id;
+    // the parser always hands over a buffer, even for an empty body
+    req.msg = msg == NULL ? empty : msg;
+    req.msg_len = (uint16_t) strlen(req.msg);
+
+    return cpt_handle_request(n->info, m->client, &req);
+}
+
+static void count_message(void *arg, const struct CptResponse *res)
+{
+    int *count;
+
+    count = arg;
+
+    if (res->code == MESSAGE)
+    {
+        count[0]++;
+        count[1] = res->user_id;
+    }
+}
+
+Describe(mesh);
+
+BeforeEach(mesh)
+{
+    for (int i = 0; i < NODES; i++)
+    {
+        snprintf(paths[i], sizeof(paths[i]), "/tmp/cpt_mesh_test.%d.%d.sock", (int) getpid(), i);
+        path_list[i] = paths[i];
+    }
+
+    for (int i = 0; i < NODES; i++)
+    {
+        nodes[i].info = cpt_server_create();
+        nodes[i].mesh = cpt_mesh_create(nodes[i].info, i, path_list, NODES);
+    }
+}
+
+AfterEach(mesh)
+{
+    for (int i = 0; i < NODES; i++)
+    {
+        cpt_mesh_destroy(nodes[i].mesh);
+        cpt_server_destroy(nodes[i].info);
+        unlink(paths[i]);
+    }
+}
+
+Ensure(mesh, splits_channels_between_nodes)
+{
+    int owned[NODES];
+    int disagree;
+    int owner;
+
+    memset(owned, 0, sizeof(owned));
+    disagree = 0;
+
+    for (int id = 0; id < CPT_MAX_CHANNELS; id++)
+    {
+        owner = cpt_mesh_owner(nodes[0].mesh, (uint16_t) id);
+        owned[owner]++;
+
+        // every node agrees without asking the others
+        disagree += owner != cpt_mesh_owner(nodes[1].mesh, (uint16_t) id);
+    }
+
+    assert_that(disagree, is_equal_to(0));
+    assert_that(owned[0], is_greater_than(CPT_MAX_CHANNELS / 3));
+    assert_that(owned[1], is_greater_than(CPT_MAX_CHANNELS / 3));
+}
+
+Ensure(mesh, hands_out_user_ids_per_node)
+{
+    struct member a;
+    struct member b;
+
+    connect_member(nodes[0].info, &a, "a", CPT_SERVER_VERSION);
+    connect_member(nodes[1].info, &b, "b", CPT_SERVER_VERSION);
+
+    assert_that(a.client->user_id, is_equal_to(1));
+    assert_that(b.client->user_id, is_equal_to(UINT16_MAX / NODES + 1));
+
+    drop_member(nodes[0].info, &a);
+    drop_member(nodes[1].info, &b);
+}
+
+Ensure(mesh, forwards_one_copy_per_node)
+{
+    struct cpt_response_decoder dec;
+    struct member a;
+    struct member b1;
+    struct member b2;
+    char msg[] = "across the link";
+    uint16_t channel_id;
+    int got[2];
+
+    connect_member(nodes[0].info, &a, "a", CPT_SERVER_VERSION);
+    connect_member(nodes[1].info, &b1, "b1", CPT_SERVER_VERSION);
+    connect_member(nodes[1].info, &b2, "b2", CPT_SERVER_VERSION);
+    pump();
+
+    assert_that(request(&a, &nodes[0], CREATE_CHANNEL, 0, NULL), is_equal_to(CHANNEL_CREATED));
+    channel_id = a.client->channels[a.client->channel_count - 1];
+    assert_that(cpt_mesh_owner(nodes[0].mesh, channel_id), is_equal_to(0));
+
+    // the channel only exists on node 0 until its members are gossiped
+    assert_that(request(&b1, &nodes[1], JOIN_CHANNEL, channel_id, NULL), is_equal_to(UNKNOWN_CHANNEL));
+    pump();
+    assert_that(request(&b1, &nodes[1], JOIN_CHANNEL, channel_id, NULL), is_equal_to(SUCCESS));
+    assert_that(request(&b2, &nodes[1], JOIN_CHANNEL, channel_id, NULL), is_equal_to(SUCCESS));
+    pump();
+    assert_that(nodes[0].mesh->peers[1].members[channel_id], is_equal_to(2));
+    assert_that(cpt_mesh_can_create(nodes[0].mesh, channel_id), is_equal_to(0));
+
+    assert_that(request(&a, &nodes[0], SEND, channel_id, msg), is_equal_to(SUCCESS));
+    assert_that(nodes[0].mesh->peers[1].envelope.open, is_equal_to(1));
+    assert_that(cpt_mesh_forward(nodes[0].mesh, channel_id, 1, (const uint8_t *) msg, 1), is_equal_to(1));
+    pump();
+
+    cpt_response_decoder_init(&dec, CPT_RESPONSE_DECODER_CAPACITY);
+    memset(got, 0, sizeof(got));
+    cpt_response_decoder_read(&dec, b2.peer_fd);
+    cpt_response_decoder_drain(&dec, count_message, got);
+    assert_that(got[0], is_equal_to(2));
+    assert_that(got[1], is_equal_to(a.client->user_id));
+
+    // once node 1's members leave, node 0 stops forwarding
+    request(&b1, &nodes[1], LEAVE_CHANNEL, channel_id, NULL);
+    request(&b2, &nodes[1], LEAVE_CHANNEL, channel_id, NULL);
+    pump();
+    assert_that(cpt_mesh_has_remote(nodes[0].mesh, channel_id), is_equal_to(0));
+    assert_that(cpt_mesh_forward(nodes[0].mesh, channel_id, 1, (const uint8_t *) msg, 1), is_equal_to(0));
+
+    cpt_response_decoder_destroy(&dec);
+    drop_member(nodes[0].info, &a);
+    drop_member(nodes[1].info, &b1);
+    drop_member(nodes[1].info, &b2);
+}
+
+Ensure(mesh, forgets_a_node_whose_link_dropped)
+{
+    struct member b;
+
+    connect_member(nodes[1].info, &b, "b", CPT_SERVER_VERSION);
+    pump();
+    assert_that(cpt_mesh_has_remote(nodes[0].mesh, GLOBAL_CHANNEL), is_equal_to(1));
+
+    cpt_mesh_destroy(nodes[1].mesh);
+    nodes[1].mesh = NULL;
+
+    for (int round = 0; round < PUMP_ROUNDS; round++)
+    {
+        cpt_mesh_poll_set(nodes[0].mesh, nodes[0].fds);
+        poll(nodes[0].fds, CPT_MESH_MAX_NODES + 1, 10);
+        cpt_mesh_handle(nodes[0].mesh, nodes[0].fds);
+    }
+
+    assert_that(cpt_mesh_has_remote(nodes[0].mesh, GLOBAL_CHANNEL), is_equal_to(0));
+    drop_member(nodes[1].info, &b);
+}
+
+TestSuite *mesh_tests(void)
+{
+    TestSuite *suite;
+
+    suite = create_test_suite();
+    add_test_with_context(suite, mesh, splits_channels_between_nodes);
+    add_test_with_context(suite, mesh, hands_out_user_ids_per_node);
+    add_test_with_context(suite, mesh, forwards_one_copy_per_node);
+    add_test_with_context(suite, mesh, forgets_a_node_whose_link_dropped);
+
+    return suite;
+}
@@ -0,0 +1,241 @@
+#include "common.h"
+#include "cpt_client.h"
+#include "cpt_offline.h"
+#include "cpt_server.h"
+#include "tests.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// a fixed clock far from zero, in microseconds
+#define START ((uint64_t) 1000000 * 1000000)
+#define TTL ((uint64_t) CPT_OFFLINE_TTL * 1000000)
+#define RECORD_SIZE 1000
+#define QUEUED 3
+
+/**
+ * MESSAGEs one member received.
+ */
+struct seen
+{
+    int logged_in;
+    int messages;
+    char last[16];
+};
+
+/**
+ * Replay order check for the queue alone.
+ */
+struct order
+{
+    int count;
+    int in_order;
+};
+
+static struct serverInfo *info;
+
+static int request(struct member *m, uint8_t command, uint16_t channel_id, const char *msg);
+static void park_member(struct member *m);
+static void receive(struct member *m, struct seen *seen);
+static void record_message(void *arg, const struct CptResponse *res);
+static void check_order(void *arg, uint16_t channel_id, uint16_t user_id, uint32_t seq, uint8_t *msg,
+                        uint16_t msg_len);
+
+static int request(struct member *m, uint8_t command, uint16_t channel_id, const char *msg)
+{
+    struct CptRequest req;
+    static char copy[CPT_NAME_MAX + 1];
+
+    strcpy(copy, msg);
+    req.version = CPT_SERVER_VERSION;
+    req.command = command;
+    req.channel_id = channel_id;
+    req.msg = copy;
+    req.msg_len = (uint16_t) strlen(copy);
+
+    return cpt_handle_request(info, m->client, &req);
+}
+
+/**
+ * What the event loop does when a logged-in client's socket drops.
+ */
+static void park_member(struct member *m)
+{
+    int fd;
+
+    fd = m->client->user_fd;
+    assert_that(cpt_server_park(info, m->client), is_equal_to(0));
+    close(fd);
+    close(m->peer_fd);
+}
+
+static void receive(struct member *m, struct seen *seen)
+{
+    struct cpt_response_decoder dec;
+
+    memset(seen, 0, sizeof(*seen));
+    cpt_server_flush_dirty(info);
+    cpt_response_decoder_init(&dec, CPT_RESPONSE_DECODER_CAPACITY);
+    cpt_response_decoder_read(&dec, m->peer_fd);
+    cpt_response_decoder_drain(&dec, record_message, seen);
+    cpt_response_decoder_destroy(&dec);
+}
+
+static void record_message(void *arg, const struct CptResponse *res)
+{
+    struct seen *seen;
+
+    seen = arg;
+
+    if (res->code == SUCCESS && seen->messages == 0)
+    {
+        seen->logged_in = 1;
+    }
+
+    if (res->code != MESSAGE || res->msg_len >= sizeof(seen->last))
+    {
+        return;
+    }
+
+    seen->messages++;
+    memcpy(seen->last, res->msg, res->msg_len);
+    seen->last[res->msg_len] = '\0';
+}
+
+static void check_order(void *arg, uint16_t channel_id, uint16_t user_id, uint32_t seq, uint8_t *msg,
+                        uint16_t msg_len)
+{
+    struct order *order;
+    int index;
+
+    order = arg;
+    memcpy(&index, msg, sizeof(index));
+    order->in_order &= index == order->count && channel_id == 7 && user_id == 9 && msg_len == RECORD_SIZE &&
+                       seq == (uint32_t) index + 1;
+    order->count++;
+}
+
+Describe(offline);
+
+BeforeEach(offline)
+{
+    info = cpt_server_create();
+    info->now = START;
+    info->offline_ttl = TTL;
+}
+
+AfterEach(offline)
+{
+    cpt_server_destroy(info);
+}
+
+Ensure(offline, spills_past_the_memory_budget_in_order)
+{
+    struct cpt_offline queue;
+    struct order order;
+    uint8_t msg[RECORD_SIZE];
+    int pushed;
+
+    cpt_offline_init(&queue, CPT_OFFLINE_DIR, 0);
+    memset(msg, 0, sizeof(msg));
+    pushed = 0;
+
+    // until the spill file is full as well
+    while (queue.dropped == 0)
+    {
+        memcpy(msg, &pushed, sizeof(pushed));
+        pushed += cpt_offline_push(&queue, 7, 9, (uint32_t) pushed + 1, msg, RECORD_SIZE) == 0;
+    }
+
+    assert_that(queue.segment, is_not_null);
+    assert_that(queue.length, is_less_than(CPT_OFFLINE_MEMORY + 1));
+    assert_that(pushed, is_greater_than(CPT_OFFLINE_SEGMENT / (RECORD_SIZE + 8)));
+
+    order.count = 0;
+    order.in_order = 1;
+    cpt_offline_replay(&queue, check_order, &order);
+    assert_that(order.count, is_equal_to(pushed));
+    assert_that(order.in_order, is_equal_to(1));
+
+    cpt_offline_destroy(&queue);
+}
+
+Ensure(offline, replays_the_queue_on_login)
+{
+    struct member a;
+    struct member b;
+    struct seen seen;
+    uint16_t channel_id;
+    int user_id;
+    char text[16];
+
+    connect_member(info, &a, "a", CPT_SERVER_VERSION);
+    connect_member(info, &b, "b", CPT_SERVER_VERSION);
+    assert_that(request(&a, CREATE_CHANNEL, 0, ""), is_equal_to(CHANNEL_CREATED));
+    channel_id = a.client->channels[a.client->channel_count - 1];
+    assert_that(request(&b, JOIN_CHANNEL, channel_id, ""), is_equal_to(SUCCESS));
+    receive(&b, &seen);
+    user_id = b.client->user_id;
+    park_member(&b);
+
+    for (int i = 0; i < QUEUED; i++)
+    {
+        sprintf(text, "message %d", i);
+        request(&a, SEND, channel_id, text);
+    }
+
+    // back under the same name: same id, same channel, and what was missed
+    connect_member(info, &b, "b", CPT_SERVER_VERSION);
+    assert_that(b.client->user_id, is_equal_to(user_id));
+    assert_that(info->users[user_id] == b.client, is_equal_to(1));
+    assert_that(info->offline, is_null);
+    receive(&b, &seen);
+    assert_that(seen.logged_in, is_equal_to(1));
+    assert_that(seen.messages, is_equal_to(QUEUED));
+    assert_that(strcmp(seen.last, "message 2"), is_equal_to(0));
+
+    request(&a, SEND, channel_id, "live");
+    receive(&b, &seen);
+    assert_that(seen.messages, is_equal_to(1));
+
+    drop_member(info, &a);
+    drop_member(info, &b);
+}
+
+Ensure(offline, disconnects_once_the_ttl_runs_out)
+{
+    struct member a;
+    struct member b;
+    int user_id;
+
+    connect_member(info, &a, "a", CPT_SERVER_VERSION);
+    connect_member(info, &b, "b", CPT_SERVER_VERSION);
+    user_id = b.client->user_id;
+    park_member(&b);
+
+    info->now += TTL - 1;
+    cpt_server_expire_offline(info);
+    assert_that(info->users[user_id], is_not_null);
+    assert_that(cpt_server_offline_timeout(info), is_equal_to(1));
+
+    info->now += 1;
+    cpt_server_expire_offline(info);
+    assert_that(info->users[user_id], is_null);
+    assert_that(info->offline, is_null);
+    assert_that(info->global.users->userCount, is_equal_to(1));
+    assert_that(cpt_server_offline_timeout(info), is_equal_to(-1));
+
+    drop_member(info, &a);
+}
+
+TestSuite *offline_tests(void)
+{
+    TestSuite *suite;
+
+    suite = create_test_suite();
+    add_test_with_context(suite, offline, spills_past_the_memory_budget_in_order);
+    add_test_with_context(suite, offline, replays_the_queue_on_login);
+    add_test_with_context(suite, offline, disconnects_once_the_ttl_runs_out);
+
+    return suite;
+}
@@ -0,0 +1,204 @@
+#include "common.h"
+#include "cpt_client.h"
+#include "cpt_presence.h"
+#include "cpt_server.h"
+#include "tests.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// a fixed clock far from zero, in microseconds
+#define START ((uint64_t) 1000000 * 1000000)
+#define WINDOW ((uint64_t) CPT_PRESENCE_WINDOW_MS * 1000)
+#define CHURN 50
+
+/**
+ * Presence events one member received, and the ids in the last one.
+ */
+struct seen
+{
+    int events[UINT8_MAX + 1];
+    uint32_t ids[8];
+    uint32_t id_count;
+    uint16_t msg_len;
+};
+
+static struct serverInfo *info;
+
+static int request(struct member *m, uint8_t command, uint16_t channel_id);
+static void receive(struct member *m, struct seen *seen);
+static void record_event(void *arg, const struct CptResponse *res);
+
+static int request(struct member *m, uint8_t command, uint16_t channel_id)
+{
+    struct CptRequest req;
+    static char empty[1];
+
+    req.version = CPT_SERVER_VERSION;
+    req.command = command;
+    req.channel_id = channel_id;
+    req.msg = empty;
+    req.msg_len = 0;
+
+    return cpt_handle_request(info, m->client, &req);
+}
+
+static void receive(struct member *m, struct seen *seen)
+{
+    struct cpt_response_decoder dec;
+
+    memset(seen, 0, sizeof(*seen));
+    cpt_server_flush_dirty(info);
+    cpt_response_decoder_init(&dec, CPT_RESPONSE_DECODER_CAPACITY);
+    cpt_response_decoder_read(&dec, m->peer_fd);
+    cpt_response_decoder_drain(&dec, record_event, seen);
+    cpt_response_decoder_destroy(&dec);
+}
+
+static void record_event(void *arg, const struct CptResponse *res)
+{
+    struct seen *seen;
+    uint32_t count;
+    size_t pos;
+    int used;
+
+    seen = arg;
+
+    if (res->code != USER_CONNECTED && res->code != USER_DISCONNECTED && res->code != USER_JOINED_CHANNEL &&
+        res->code != USER_LEFT_CHANNEL)
+    {
+        return;
+    }
+
+    seen->events[res->code]++;
+    seen->msg_len = res->msg_len;
+    seen->id_count = 0;
+    used = res->msg_len == 0 ? 0 : cpt_varint_get(res->msg, res->msg_len, &count);
+
+    if (used <= 0)
+    {
+        return;
+    }
+
+    pos = (size_t) used;
+
+    for (uint32_t i = 0; i < count && i < 8; i++)
+    {
+        pos += (size_t) cpt_varint_get(res->msg + pos, res->msg_len - pos, &seen->ids[i]);
+        seen->id_count++;
+    }
+}
+
+Describe(presence);
+
+BeforeEach(presence)
+{
+    info = cpt_server_create();
+    info->now = START;
+}
+
+AfterEach(presence)
+{
+    cpt_server_destroy(info);
+}
+
+Ensure(presence, nets_out_changes_within_a_window)
+{
+    struct cpt_presence presence;
+    size_t joins;
+
+    memset(&presence, 0, sizeof(presence));
+    cpt_presence_record(&presence, 1, 1);
+    cpt_presence_record(&presence, 2, 1);
+    cpt_presence_record(&presence, 1, 0);
+    cpt_presence_record(&presence, 3, 0);
+    cpt_presence_record(&presence, 3, 1);
+    cpt_presence_record(&presence, 4, 0);
+
+    // 1 came and went, 3 left and came back
+    joins = cpt_presence_settle(&presence);
+    assert_that(joins, is_equal_to(1));
+    assert_that(presence.count, is_equal_to(2));
+    assert_that(presence.deltas[0].user_id, is_equal_to(2));
+    assert_that(presence.deltas[1].user_id, is_equal_to(4));
+    assert_that(presence.deltas[1].joined, is_equal_to(0));
+
+    cpt_presence_destroy(&presence);
+}
+
+Ensure(presence, sends_one_event_per_window)
+{
+    struct member a;
+    struct member b;
+    struct seen seen;
+    uint16_t channel_id;
+
+    connect_member(info, &a, "a", CPT_SERVER_VERSION);
+    connect_member(info, &b, "b", CPT_SERVER_VERSION);
+
+    // nothing goes out until the window closes
+    cpt_server_flush_presence(info);
+    receive(&a, &seen);
+    assert_that(seen.events[USER_CONNECTED], is_equal_to(0));
+    assert_that(cpt_server_presence_timeout(info), is_equal_to(CPT_PRESENCE_WINDOW_MS));
+
+    info->now += WINDOW;
+    cpt_server_flush_presence(info);
+    receive(&a, &seen);
+    assert_that(seen.events[USER_CONNECTED], is_equal_to(1));
+    assert_that(seen.id_count, is_equal_to(2));
+    assert_that(cpt_server_presence_timeout(info), is_equal_to(-1));
+
+    assert_that(request(&a, CREATE_CHANNEL, 0), is_equal_to(CHANNEL_CREATED));
+    channel_id = a.client->channels[a.client->channel_count - 1];
+
+    // a reconnect storm in one window comes down to its net change
+    for (int i = 0; i < CHURN; i++)
+    {
+        request(&b, JOIN_CHANNEL, channel_id);
+        request(&b, LEAVE_CHANNEL, channel_id);
+    }
+
+    request(&b, JOIN_CHANNEL, channel_id);
+    info->now += WINDOW;
+    cpt_server_flush_presence(info);
+    receive(&b, &seen);
+    assert_that(seen.events[USER_JOINED_CHANNEL], is_equal_to(1));
+    assert_that(seen.events[USER_LEFT_CHANNEL], is_equal_to(0));
+    assert_that(seen.id_count, is_equal_to(2));
+
+    drop_member(info, &a);
+    drop_member(info, &b);
+}
+
+Ensure(presence, asks_for_a_refetch_after_too_many_changes)
+{
+    struct member a;
+    struct seen seen;
+
+    connect_member(info, &a, "a", CPT_SERVER_VERSION);
+
+    for (int i = 0; i <= CPT_PRESENCE_MAX; i++)
+    {
+        cpt_presence_record(&info->global.presence, (uint16_t) (i + 100), 1);
+    }
+
+    info->now += WINDOW;
+    cpt_server_flush_presence(info);
+    receive(&a, &seen);
+    assert_that(seen.events[USER_CONNECTED], is_equal_to(1));
+    assert_that(seen.msg_len, is_equal_to(0));
+
+    drop_member(info, &a);
+}
+
+TestSuite *presence_tests(void)
+{
+    TestSuite *suite;
+
+    suite = create_test_suite();
+    add_test_with_context(suite, presence, nets_out_changes_within_a_window);
+    add_test_with_context(suite, presence, sends_one_event_per_window);
+    add_test_with_context(suite, presence, asks_for_a_refetch_after_too_many_changes);
+
+    return suite;
+}
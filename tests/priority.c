@@ -0,0 +1,203 @@
+#include "common.h"
+#include "cpt_client.h"
+#include "cpt_server.h"
+#include "tests.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define MESSAGES 200
+#define MSG_SIZE 1000
+
+/**
+ * Where the control reply landed among the responses a client read.
+ */
+struct order
+{
+    struct cpt_response_decoder *dec;
+    int messages;
+    int reply_at;
+    int responses;
+};
+
+static struct serverInfo *info;
+static user *client;
+static int peer_fd;
+
+static int request(uint8_t version, uint8_t command, uint16_t channel_id, const char *msg);
+static void note_response(void *arg, const struct CptResponse *res);
+static void read_everything(struct order *order);
+
+static int request(uint8_t version, uint8_t command, uint16_t channel_id, const char *msg)
+{
+    static char copy[CPT_NAME_MAX + 1];
+    struct CptRequest req;
+
+    strcpy(copy, msg);
+    req.version = version;
+    req.command = command;
+    req.channel_id = channel_id;
+    req.msg = copy;
+    req.msg_len = (uint16_t) strlen(copy);
+
+    return cpt_handle_request(info, client, &req);
+}
+
+static void note_response(void *arg, const struct CptResponse *res)
+{
+    struct order *order;
+
+    order = arg;
+
+    // the LOGIN reply is the last version 1 frame
+    if (order->responses++ == 0)
+    {
+        cpt_response_decoder_set_version(order->dec, CPT_VERSION_BATCHED);
+        return;
+    }
+
+    if (res->code == MESSAGE)
+    {
+        order->messages++;
+    }
+    else if (res->code == UNKNOWN_CHANNEL)
+    {
+        order->reply_at = order->responses - 1;
+    }
+}
+
+/**
+ * Keep reading and flushing until the server has nothing left for the client.
+ */
+static void read_everything(struct order *order)
+{
+    ssize_t nread;
+
+    do
+    {
+        nread = cpt_response_decoder_read(order->dec, peer_fd);
+        cpt_response_decoder_drain(order->dec, note_response, order);
+        cpt_server_flush(info, client);
+    } while (nread > 0 || cpt_server_wants_write(client));
+}
+
+Describe(priority);
+
+BeforeEach(priority)
+{
+    int sndbuf;
+    int sv[2];
+
+    info = cpt_server_create();
+    assert_that(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), is_equal_to(0));
+    // a small socket buffer fills after a few envelopes, like a slow reader's would
+    sndbuf = 8192;
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    fcntl(sv[1], F_SETFL, O_NONBLOCK);
+    client = create_user(sv[0], 0);
+    peer_fd = sv[1];
+    assert_that(request(CPT_VERSION_BATCHED, LOGIN, GLOBAL_CHANNEL, "slow"), is_equal_to(SUCCESS));
+}
+
+AfterEach(priority)
+{
+    cpt_server_disconnect(info, client);
+    close(client->user_fd);
+    close(peer_fd);
+    destroy_user(client);
+    cpt_server_destroy(info);
+}
+
+static void flood_then_fail_a_join(struct order *order)
+{
+    static uint8_t msg[MSG_SIZE];
+
+    memset(msg, 'm', sizeof(msg));
+
+    // one envelope per round, most of them stuck behind the full socket
+    for (int i = 0; i < MESSAGES; i++)
+    {
+        cpt_broadcast(info, &info->global, 1, msg, sizeof(msg));
+        cpt_server_flush_dirty(info);
+    }
+
+    assert_that(cpt_buffer_length(&client->out), is_greater_than(MESSAGES * MSG_SIZE / 2));
+    assert_that(request(CPT_VERSION_BATCHED, JOIN_CHANNEL, 999, ""), is_equal_to(UNKNOWN_CHANNEL));
+    cpt_server_flush_dirty(info);
+    read_everything(order);
+}
+
+Ensure(priority, sends_replies_ahead_of_queued_messages)
+{
+    struct cpt_response_decoder dec;
+    struct order order;
+
+    cpt_response_decoder_init(&dec, CPT_RESPONSE_DECODER_CAPACITY);
+    memset(&order, 0, sizeof(order));
+    order.dec = &dec;
+    flood_then_fail_a_join(&order);
+
+    // every MESSAGE still arrives intact, the reply only overtook those not yet on the socket
+    assert_that(order.messages, is_equal_to(MESSAGES));
+    assert_that(dec.resyncs, is_equal_to(0));
+    assert_that(order.reply_at, is_greater_than(0));
+    assert_that(order.reply_at, is_less_than(MESSAGES / 4));
+    cpt_response_decoder_destroy(&dec);
+}
+
+Ensure(priority, keeps_one_queue_without_weight)
+{
+    struct cpt_response_decoder dec;
+    struct order order;
+
+    info->urgent_weight = 0;
+    cpt_response_decoder_init(&dec, CPT_RESPONSE_DECODER_CAPACITY);
+    memset(&order, 0, sizeof(order));
+    order.dec = &dec;
+    flood_then_fail_a_join(&order);
+
+    assert_that(order.messages, is_equal_to(MESSAGES));
+    assert_that(order.reply_at, is_equal_to(MESSAGES + 1));
+    cpt_response_decoder_destroy(&dec);
+}
+
+Ensure(priority, lets_messages_through_between_urgent_turns)
+{
+    static uint8_t msg[MSG_SIZE];
+    struct cpt_response_decoder dec;
+    struct order order;
+
+    memset(msg, 'm', sizeof(msg));
+    cpt_response_decoder_init(&dec, CPT_RESPONSE_DECODER_CAPACITY);
+    memset(&order, 0, sizeof(order));
+    order.dec = &dec;
+
+    // a client that keeps failing requests while MESSAGEs pile up still gets the MESSAGEs
+    for (int i = 0; i < MESSAGES; i++)
+    {
+        cpt_broadcast(info, &info->global, 1, msg, sizeof(msg));
+        request(CPT_VERSION_BATCHED, JOIN_CHANNEL, 999, "");
+        cpt_server_flush_dirty(info);
+    }
+
+    assert_that(client->urgent_run, is_less_than(CPT_URGENT_WEIGHT + 1));
+    read_everything(&order);
+    assert_that(order.messages, is_equal_to(MESSAGES));
+    assert_that(dec.resyncs, is_equal_to(0));
+    cpt_response_decoder_destroy(&dec);
+}
+
+TestSuite *priority_tests(void)
+{
+    TestSuite *suite;
+
+    suite = create_test_suite();
+    add_test_with_context(suite, priority, sends_replies_ahead_of_queued_messages);
+    add_test_with_context(suite, priority, keeps_one_queue_without_weight);
+    add_test_with_context(suite, priority, lets_messages_through_between_urgent_turns);
+
+    return suite;
+}
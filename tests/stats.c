@@ -0,0 +1,150 @@
+#include "common.h"
+#include "cpt_client.h"
+#include "cpt_server.h"
+#include "cpt_stats.h"
+#include "tests.h"
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/**
+ * The last response one client received.
+ */
+struct seen
+{
+    int responses;
+    struct CptResponse last;
+};
+
+static struct serverInfo *info;
+static user *client;
+static int peer_fd;
+
+static int request(uint8_t version, uint8_t command, uint16_t channel_id, const char *msg);
+static void receive(struct seen *seen);
+static void record_response(void *arg, const struct CptResponse *res);
+
+static int request(uint8_t version, uint8_t command, uint16_t channel_id, const char *msg)
+{
+    struct CptRequest req;
+    static char copy[CPT_NAME_MAX + 1];
+
+    strcpy(copy, msg);
+    req.version = version;
+    req.command = command;
+    req.channel_id = channel_id;
+    req.msg = copy;
+    req.msg_len = (uint16_t) strlen(copy);
+
+    return cpt_handle_request(info, client, &req);
+}
+
+static void receive(struct seen *seen)
+{
+    struct cpt_response_decoder dec;
+
+    memset(seen, 0, sizeof(*seen));
+    cpt_server_flush_dirty(info);
+    cpt_response_decoder_init(&dec, CPT_RESPONSE_DECODER_CAPACITY);
+    cpt_response_decoder_read(&dec, peer_fd);
+    cpt_response_decoder_drain(&dec, record_response, seen);
+    cpt_response_decoder_destroy(&dec);
+}
+
+static void record_response(void *arg, const struct CptResponse *res)
+{
+    struct seen *seen;
+
+    seen = arg;
+    seen->responses++;
+    seen->last = *res;
+    seen->last.msg = NULL;
+}
+
+Describe(stats);
+
+BeforeEach(stats)
+{
+    int sv[2];
+
+    info = cpt_server_create();
+    assert_that(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), is_equal_to(0));
+    client = create_user(sv[0], 0);
+    peer_fd = sv[1];
+}
+
+AfterEach(stats)
+{
+    cpt_server_disconnect(info, client);
+    close(client->user_fd);
+    close(peer_fd);
+    destroy_user(client);
+    cpt_server_destroy(info);
+}
+
+Ensure(stats, places_latencies_in_power_of_two_buckets)
+{
+    struct cpt_latency latency;
+
+    memset(&latency, 0, sizeof(latency));
+
+    for (int i = 0; i < 98; i++)
+    {
+        cpt_latency_record(&latency, 100);
+    }
+
+    cpt_latency_record(&latency, 5000);
+    cpt_latency_record(&latency, 70000);
+
+    assert_that(latency.count, is_equal_to(100));
+    assert_that(latency.max_ns, is_equal_to(70000));
+    assert_that(cpt_latency_percentile(&latency, 50), is_equal_to(128));
+    assert_that(cpt_latency_percentile(&latency, 99), is_equal_to(8192));
+    assert_that(cpt_latency_percentile(&latency, 100), is_equal_to(70000));
+}
+
+Ensure(stats, answers_unknown_commands_in_either_framing)
+{
+    struct seen seen;
+
+    assert_that(request(CPT_SERVER_VERSION, LOGIN, GLOBAL_CHANNEL, "a"), is_equal_to(SUCCESS));
+    receive(&seen);
+
+    assert_that(request(CPT_SERVER_VERSION, 0, 9, ""), is_equal_to(UNKNOWN_CMD));
+    receive(&seen);
+    assert_that(seen.responses, is_equal_to(1));
+    assert_that(seen.last.code, is_equal_to(UNKNOWN_CMD));
+    assert_that(seen.last.channel_id, is_equal_to(0));
+
+    // the reply to a negotiating LOGIN is the last frame, records follow
+    assert_that(request(CPT_VERSION_BATCHED, LOGIN, GLOBAL_CHANNEL, "a"), is_equal_to(SUCCESS));
+    receive(&seen);
+    assert_that(request(CPT_VERSION_BATCHED, 200, 9, ""), is_equal_to(UNKNOWN_CMD));
+    // an error for a batched client skips ahead of its MESSAGEs
+    assert_that(cpt_buffer_length(&client->urgent), is_greater_than(0));
+    assert_that(info->latency[0].count, is_equal_to(2));
+    assert_that(info->latency[LOGIN].count, is_equal_to(2));
+}
+
+Ensure(stats, rejects_a_login_without_a_name)
+{
+    struct seen seen;
+
+    assert_that(request(CPT_SERVER_VERSION, LOGIN, GLOBAL_CHANNEL, ""), is_equal_to(LOGIN_FAIL));
+    receive(&seen);
+    assert_that(seen.last.code, is_equal_to(LOGIN_FAIL));
+    assert_that(client->user_id, is_equal_to(0));
+    assert_that(info->latency[LOGIN].count, is_equal_to(1));
+}
+
+TestSuite *stats_tests(void)
+{
+    TestSuite *suite;
+
+    suite = create_test_suite();
+    add_test_with_context(suite, stats, places_latencies_in_power_of_two_buckets);
+    add_test_with_context(suite, stats, answers_unknown_commands_in_either_framing);
+    add_test_with_context(suite, stats, rejects_a_login_without_a_name);
+
+    return suite;
+}
@@ -2,7 +2,60 @@
 #define LIBDC_POSIX_TESTS_H
 
 
+#include "cpt_server.h"
 #include <cgreen/cgreen.h>
 
+/**
+ * A logged-in test client: the server's end of a socketpair is
+ * <client>'s socket, the test reads what it was sent from <peer_fd>.
+ */
+struct member
+{
+    user *client;
+    int peer_fd;
+};
+
+/**
+ * Connect <m> over a socketpair and log it in as <name>.
+ *
+ * @param info      The server registry.
+ * @param m         The member.
+ * @param name      Login name.
+ * @param version   Protocol version of the LOGIN.
+ */
+void connect_member(struct serverInfo *info, struct member *m, const char *name, uint8_t version);
+
+/**
+ * Give <m> an 8 KB socket buffer and make both ends nonblocking, so
+ * output the test does not read piles up on the server side.
+ *
+ * @param m         The member.
+ */
+void throttle_member(struct member *m);
+
+/**
+ * Disconnect <m> the way the event loop does and close both ends.
+ *
+ * @param info      The server registry.
+ * @param m         The member.
+ */
+void drop_member(struct serverInfo *info, struct member *m);
+
+TestSuite *codec_tests(void);
+TestSuite *transport_tests(void);
+TestSuite *mesh_tests(void);
+TestSuite *fanout_tests(void);
+TestSuite *limit_tests(void);
+TestSuite *presence_tests(void);
+TestSuite *offline_tests(void);
+TestSuite *stats_tests(void);
+TestSuite *cpu_tests(void);
+TestSuite *arena_tests(void);
+TestSuite *capture_tests(void);
+TestSuite *history_tests(void);
+TestSuite *priority_tests(void);
+TestSuite *memory_tests(void);
+TestSuite *admin_tests(void);
+
 
 #endif // LIBDC_POSIX_TESTS_H
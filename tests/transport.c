@@ -0,0 +1,406 @@
+#include "common.h"
+#include "cpt_client.h"
+#include "cpt_handoff.h"
+#include "cpt_server.h"
+#include "cpt_shm.h"
+#include "tests.h"
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define SMALL_RING 64
+
+struct collected
+{
+    uint8_t codes[16];
+    char text[16][32];
+    size_t count;
+};
+
+static void collect_response(void *arg, const struct CptResponse *res);
+static void open_pair(struct cpt_shm *server, struct cpt_shm *client, size_t capacity);
+
+static void collect_response(void *arg, const struct CptResponse *res)
+{
+    struct collected *out;
+    size_t length;
+
+    out = arg;
+    length = res->msg_len < sizeof(out->text[0]) - 1 ? res->msg_len : sizeof(out->text[0]) - 1;
+    out->codes[out->count] = res->code;
+    memcpy(out->text[out->count], res->msg, length);
+    out->text[out->count][length] = '\0';
+    out->count++;
+}
+
+static void open_pair(struct cpt_shm *server, struct cpt_shm *client, size_t capacity)
+{
+    // each side keeps its own indices, so a ring is always exercised through two views
+    assert_that(cpt_shm_create(server, capacity), is_equal_to(0));
+    assert_that(cpt_shm_attach(client, dup(server->fd)), is_equal_to(0));
+}
+
+Describe(transport);
+
+BeforeEach(transport)
+{
+}
+
+AfterEach(transport)
+{
+}
+
+Ensure(transport, wraps_around_the_ring)
+{
+    struct cpt_shm server;
+    struct cpt_shm client;
+    uint8_t data[SMALL_RING];
+    uint8_t copy[SMALL_RING];
+    size_t n;
+
+    open_pair(&server, &client, SMALL_RING);
+
+    for (size_t i = 0; i < sizeof(data); i++)
+    {
+        data[i] = (uint8_t) i;
+    }
+
+    // an empty ring means the consumer may be asleep, a second write finds it still busy
+    assert_that(cpt_shm_write(&server, CPT_SHM_TO_CLIENT, data, 40, &n), is_equal_to(1));
+    assert_that(n, is_equal_to(40));
+    assert_that(cpt_shm_write(&server, CPT_SHM_TO_CLIENT, data, 10, &n), is_equal_to(0));
+    assert_that(cpt_shm_read(&client, CPT_SHM_TO_CLIENT, copy, sizeof(copy), &n), is_equal_to(0));
+    assert_that(n, is_equal_to(50));
+
+    // the second block starts at offset 50 and wraps
+    assert_that(cpt_shm_write(&server, CPT_SHM_TO_CLIENT, data, 60, &n), is_equal_to(1));
+    assert_that(n, is_equal_to(60));
+    assert_that(cpt_shm_read(&client, CPT_SHM_TO_CLIENT, copy, sizeof(copy), &n), is_equal_to(0));
+    assert_that(n, is_equal_to(60));
+    assert_that(memcmp(copy, data, 60), is_equal_to(0));
+    assert_that(cpt_shm_read(&client, CPT_SHM_TO_CLIENT, copy, sizeof(copy), &n), is_equal_to(0));
+    assert_that(n, is_equal_to(0));
+
+    cpt_shm_destroy(&client);
+    cpt_shm_destroy(&server);
+}
+
+Ensure(transport, wakes_a_producer_waiting_for_space)
+{
+    struct cpt_shm server;
+    struct cpt_shm client;
+    uint8_t data[SMALL_RING];
+    size_t n;
+
+    memset(data, 'x', sizeof(data));
+    open_pair(&server, &client, SMALL_RING);
+
+    assert_that(cpt_shm_write(&client, CPT_SHM_TO_SERVER, data, 50, &n), is_equal_to(1));
+    assert_that(cpt_shm_write(&client, CPT_SHM_TO_SERVER, data, 50, &n), is_equal_to(0));
+    assert_that(n, is_equal_to(14));
+    assert_that(cpt_shm_write(&client, CPT_SHM_TO_SERVER, data, 1, &n), is_equal_to(0));
+    assert_that(n, is_equal_to(0));
+
+    // only the first read after the producer gave up reports it
+    assert_that(cpt_shm_read(&server, CPT_SHM_TO_SERVER, data, 10, &n), is_equal_to(1));
+    assert_that(cpt_shm_read(&server, CPT_SHM_TO_SERVER, data, 10, &n), is_equal_to(0));
+
+    cpt_shm_destroy(&client);
+    cpt_shm_destroy(&server);
+}
+
+Ensure(transport, rejects_corrupted_indices)
+{
+    struct cpt_shm shm;
+    uint8_t data[8];
+    size_t n;
+
+    memset(data, 0, sizeof(data));
+    assert_that(cpt_shm_create(&shm, SMALL_RING), is_equal_to(0));
+
+    atomic_store(&shm.header->rings[CPT_SHM_TO_CLIENT].head, 1000);
+    assert_that(cpt_shm_write(&shm, CPT_SHM_TO_CLIENT, data, sizeof(data), &n), is_equal_to(-1));
+    assert_that(n, is_equal_to(0));
+
+    atomic_store(&shm.header->rings[CPT_SHM_TO_SERVER].tail, SMALL_RING + 1);
+    assert_that(cpt_shm_read(&shm, CPT_SHM_TO_SERVER, data, sizeof(data), &n), is_equal_to(-1));
+
+    cpt_shm_destroy(&shm);
+}
+
+Ensure(transport, attaches_to_the_peers_rings)
+{
+    struct cpt_shm server;
+    struct cpt_shm client;
+    uint8_t copy[5];
+    size_t n;
+
+    open_pair(&server, &client, CPT_SHM_RING_CAPACITY);
+    assert_that(client.capacity, is_equal_to(CPT_SHM_RING_CAPACITY));
+
+    cpt_shm_write(&client, CPT_SHM_TO_SERVER, (const uint8_t *) "hello", 5, &n);
+    assert_that(cpt_shm_read(&server, CPT_SHM_TO_SERVER, copy, sizeof(copy), &n), is_equal_to(0));
+    assert_that(n, is_equal_to(5));
+    assert_that(memcmp(copy, "hello", 5), is_equal_to(0));
+
+    // anything that is not a ring pair is refused
+    cpt_shm_destroy(&client);
+    assert_that(cpt_shm_attach(&client, dup(STDIN_FILENO)), is_equal_to(-1));
+
+    cpt_shm_destroy(&server);
+}
+
+Ensure(transport, moves_a_local_client_onto_rings)
+{
+    struct serverInfo *info;
+    struct cpt_connection conn;
+    struct cpt_response_decoder dec;
+    struct collected got;
+    char name[] = "local";
+    char msg[] = "over the rings";
+    user *client;
+    int sv[2];
+    int passed;
+
+    assert_that(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), is_equal_to(0));
+    info = cpt_server_create();
+    client = create_user(sv[0], 0);
+    client->local = 1;
+    cpt_connection_init(&conn, sv[1], CPT_CONNECTION_OUTPUT_LIMIT);
+    cpt_response_decoder_init(&dec, CPT_RESPONSE_DECODER_CAPACITY);
+    memset(&got, 0, sizeof(got));
+    passed = -1;
+
+    cpt_batch_login(&conn, name);
+    cpt_batch_map_rings(&conn);
+    cpt_batch_flush(&conn);
+    cpt_server_read(info, client);
+    cpt_server_flush_dirty(info);
+
+    assert_that(cpt_response_decoder_read_fd(&dec, sv[1], &passed), is_greater_than(0));
+    cpt_response_decoder_drain(&dec, collect_response, &got);
+    assert_that(got.count, is_equal_to(2));
+    assert_that(got.codes[1], is_equal_to(SUCCESS));
+    assert_that(passed, is_greater_than(-1));
+
+    // the first doorbell switches the server over, requests and responses then bypass the socket
+    assert_that(cpt_connection_attach_rings(&conn, passed), is_equal_to(0));
+    cpt_batch_send(&conn, GLOBAL_CHANNEL, msg);
+    assert_that(cpt_batch_flush(&conn), is_greater_than(0));
+    assert_that(cpt_server_read(info, client), is_greater_than(0));
+    assert_that(client->shm_active, is_equal_to(1));
+    cpt_server_flush_dirty(info);
+
+    assert_that(cpt_response_decoder_read_rings(&dec, &conn), is_greater_than(0));
+    cpt_response_decoder_drain(&dec, collect_response, &got);
+    assert_that(got.count, is_equal_to(4));
+    assert_that(got.codes[2], is_equal_to(SUCCESS));
+    assert_that(got.codes[3], is_equal_to(MESSAGE));
+    assert_that(strcmp(got.text[3], msg), is_equal_to(0));
+    assert_that(cpt_response_decoder_read_rings(&dec, &conn), is_equal_to(-1));
+
+    cpt_server_disconnect(info, client);
+    destroy_user(client);
+    cpt_server_destroy(info);
+    cpt_connection_destroy(&conn);
+    cpt_response_decoder_destroy(&dec);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+Ensure(transport, refuses_rings_over_tcp)
+{
+    struct serverInfo *info;
+    struct CptRequest req;
+    user *client;
+
+    info = cpt_server_create();
+    client = create_user(-1, 0);
+    client->user_id = 1;
+    memset(&req, 0, sizeof(req));
+    req.version = CPT_SERVER_VERSION;
+    req.command = MAP_RINGS;
+
+    assert_that(cpt_handle_request(info, client, &req), is_equal_to(UNAUTH_ACCESS));
+    assert_that(client->shm, is_null);
+
+    destroy_user(client);
+    cpt_server_destroy(info);
+}
+
+Ensure(transport, coalesces_a_busy_clients_output)
+{
+    struct serverInfo *info;
+    user *client;
+    uint8_t large[CPT_COALESCE_BYTES];
+    int sv[2];
+
+    info = cpt_server_create();
+    info->coalesce_cap = 1000;
+    assert_that(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), is_equal_to(0));
+    client = create_user(sv[0], 1);
+    memset(large, 'x', sizeof(large));
+
+    // the first output after a quiet spell goes out at once
+    cpt_queue_response(info, client, SUCCESS, 0, 1, NULL, 0);
+    cpt_server_flush_dirty(info);
+    assert_that(cpt_buffer_length(&client->out), is_equal_to(0));
+
+    // then small output waits for more, up to the cap
+    cpt_queue_response(info, client, SUCCESS, 0, 1, NULL, 0);
+    cpt_server_flush_dirty(info);
+    cpt_queue_response(info, client, SUCCESS, 0, 1, NULL, 0);
+    cpt_server_flush_dirty(info);
+    assert_that(cpt_buffer_length(&client->out), is_equal_to(2 * CPT_RESPONSE_HEADER_SIZE));
+    assert_that(cpt_server_wants_write(client), is_equal_to(0));
+    assert_that(cpt_server_coalesce_timeout(info), is_equal_to(1));
+
+    info->now += 1000;
+    cpt_server_flush_dirty(info);
+    assert_that(cpt_buffer_length(&client->out), is_equal_to(0));
+    assert_that(cpt_server_coalesce_timeout(info), is_equal_to(-1));
+
+    // a segment's worth does not wait
+    cpt_queue_response(info, client, MESSAGE, 0, 1, large, sizeof(large));
+    cpt_server_flush_dirty(info);
+    assert_that(cpt_buffer_length(&client->out), is_equal_to(0));
+
+    close(sv[0]);
+    close(sv[1]);
+    destroy_user(client);
+    cpt_server_destroy(info);
+}
+
+Ensure(transport, hands_clients_to_a_new_registry)
+{
+    struct serverInfo *old_info;
+    struct serverInfo *new_info;
+    struct cpt_connection alice_conn;
+    struct cpt_connection bob_conn;
+    struct cpt_response_decoder dec;
+    struct collected got;
+    char alice_name[] = "alice";
+    char bob_name[] = "bob";
+    char members[] = "2";
+    char msg[] = "still here";
+    uint8_t partial[] = {CPT_SERVER_VERSION, SEND};
+    user *old_clients[2];
+    user **restored;
+    size_t count;
+    size_t pending[2];
+    int listeners[2];
+    int alice_sv[2];
+    int bob_sv[2];
+    int hs[2];
+
+    assert_that(socketpair(AF_UNIX, SOCK_STREAM, 0, alice_sv), is_equal_to(0));
+    assert_that(socketpair(AF_UNIX, SOCK_STREAM, 0, bob_sv), is_equal_to(0));
+    assert_that(socketpair(AF_UNIX, SOCK_STREAM, 0, hs), is_equal_to(0));
+    old_info = cpt_server_create();
+    new_info = cpt_server_create();
+    old_clients[0] = create_user(alice_sv[0], 0);
+    old_clients[1] = create_user(bob_sv[0], 0);
+    cpt_connection_init(&alice_conn, alice_sv[1], CPT_CONNECTION_OUTPUT_LIMIT);
+    cpt_connection_init(&bob_conn, bob_sv[1], CPT_CONNECTION_OUTPUT_LIMIT);
+    cpt_response_decoder_init(&dec, CPT_RESPONSE_DECODER_CAPACITY);
+    memset(&got, 0, sizeof(got));
+
+    cpt_batch_login_batched(&alice_conn, alice_name);
+    cpt_batch_flush(&alice_conn);
+    cpt_server_read(old_info, old_clients[0]);
+    cpt_connection_set_version(&alice_conn, CPT_VERSION_BATCHED);
+    cpt_batch_login(&bob_conn, bob_name);
+    cpt_batch_flush(&bob_conn);
+    cpt_server_read(old_info, old_clients[1]);
+    cpt_batch_create_channel(&alice_conn, members);
+    cpt_batch_flush(&alice_conn);
+    cpt_server_read(old_info, old_clients[0]);
+    cpt_server_flush_dirty(old_info);
+    assert_that(cpt_response_decoder_read(&dec, bob_sv[1]), is_greater_than(0));
+    cpt_response_decoder_drain(&dec, collect_response, &got);
+
+    // a broadcast still queued and half a request are in flight when the upgrade starts
+    cpt_batch_send(&alice_conn, 1, msg);
+    cpt_batch_flush(&alice_conn);
+    cpt_server_read(old_info, old_clients[0]);
+    assert_that(write(bob_sv[1], partial, sizeof(partial)), is_equal_to(sizeof(partial)));
+    cpt_server_read(old_info, old_clients[1]);
+
+    listeners[0] = -1;
+    listeners[1] = hs[0];
+    assert_that(cpt_handoff_send(hs[1], old_info, listeners, 2, old_clients, 2), is_equal_to(0));
+    pending[0] = cpt_buffer_length(&old_clients[0]->out);
+    pending[1] = cpt_buffer_length(&old_clients[1]->out);
+    assert_that(cpt_handoff_receive(hs[0], new_info, listeners, 2, &restored, &count), is_equal_to(0));
+
+    assert_that(count, is_equal_to(2));
+    assert_that(listeners[0], is_equal_to(-1));
+    assert_that(listeners[1], is_greater_than(-1));
+    assert_that(new_info->user_count, is_equal_to(2));
+    assert_that(new_info->next_user_id, is_equal_to(old_info->next_user_id));
+    assert_that(strcmp(new_info->users[1]->name, alice_name), is_equal_to(0));
+    assert_that(new_info->users[1]->version, is_equal_to(CPT_VERSION_BATCHED));
+    assert_that(strcmp(new_info->users[2]->name, bob_name), is_equal_to(0));
+    assert_that(new_info->channels[1]->users->userCount, is_equal_to(2));
+    assert_that(new_info->global.users->userCount, is_equal_to(2));
+    assert_that(restored[1]->channel_count, is_equal_to(2));
+    assert_that(cpt_buffer_length(&restored[0]->out), is_equal_to(pending[0]));
+    assert_that(cpt_buffer_length(&restored[1]->out), is_equal_to(pending[1]));
+    assert_that(cpt_ring_length(&restored[1]->in), is_equal_to(sizeof(partial)));
+
+    // the new process delivers what the old one had queued
+    for (size_t i = 0; i < count; i++)
+    {
+        cpt_server_resume(new_info, restored[i]);
+    }
+    cpt_server_flush_dirty(new_info);
+    memset(&got, 0, sizeof(got));
+    assert_that(cpt_response_decoder_read(&dec, bob_sv[1]), is_greater_than(0));
+    cpt_response_decoder_drain(&dec, collect_response, &got);
+    assert_that(got.count, is_equal_to(1));
+    assert_that(got.codes[0], is_equal_to(MESSAGE));
+    assert_that(strcmp(got.text[0], msg), is_equal_to(0));
+
+    for (size_t i = 0; i < count; i++)
+    {
+        cpt_server_disconnect(new_info, restored[i]);
+        close(restored[i]->user_fd);
+        destroy_user(restored[i]);
+    }
+
+    for (size_t i = 0; i < 2; i++)
+    {
+        destroy_user(old_clients[i]);
+    }
+
+    free(restored);
+    close(listeners[1]);
+    cpt_server_destroy(old_info);
+    cpt_server_destroy(new_info);
+    cpt_connection_destroy(&alice_conn);
+    cpt_connection_destroy(&bob_conn);
+    cpt_response_decoder_destroy(&dec);
+    close(alice_sv[0]);
+    close(alice_sv[1]);
+    close(bob_sv[0]);
+    close(bob_sv[1]);
+    close(hs[0]);
+    close(hs[1]);
+}
+
+TestSuite *transport_tests(void)
+{
+    TestSuite *suite;
+
+    suite = create_test_suite();
+    add_test_with_context(suite, transport, wraps_around_the_ring);
+    add_test_with_context(suite, transport, wakes_a_producer_waiting_for_space);
+    add_test_with_context(suite, transport, rejects_corrupted_indices);
+    add_test_with_context(suite, transport, attaches_to_the_peers_rings);
+    add_test_with_context(suite, transport, moves_a_local_client_onto_rings);
+    add_test_with_context(suite, transport, refuses_rings_over_tcp);
+    add_test_with_context(suite, transport, coalesces_a_busy_clients_output);
+    add_test_with_context(suite, transport, hands_clients_to_a_new_registry);
+
+    return suite;
+}